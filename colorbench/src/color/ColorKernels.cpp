@@ -0,0 +1 @@
+../../../core/src/color/ColorKernels.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../core/src/color/ColorKernels.h
\ No newline at end of file
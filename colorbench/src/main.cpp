@@ -0,0 +1,266 @@
+/**
+ * Main entrypoint for the Lichtenstein color kernel benchmark
+ *
+ * Times the component reordering done by the color kernels against the loop
+ * the test clients use to turn RGBW data into GRBW, at typical strip lengths.
+ * The kernels that extract white from RGB data are timed as well.
+ */
+#include "color/ColorKernels.h"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+/// strip lengths that are benchmarked, in pixels
+static const size_t kPixelCounts[] = {300, 500, 1000, 2000};
+
+/// GRB(W) order, as WS2812 and SK6812 strips expect it
+static const uint8_t kOrder[4] = {1, 0, 2, 3};
+/// factors that leave all components unchanged; only the order is applied
+static const uint8_t kIdentity[4] = {255, 255, 255, 255};
+
+/**
+ * A kernel that's benchmarked.
+ */
+struct Kernel {
+	const char *name;
+	ColorKernels::TransformFunction function;
+
+	// whether the CPU can run it; nullptr if it always can
+	bool (*isAvailable)(void);
+};
+
+/**
+ * Swaps red and green of each pixel, the way the test clients have always done
+ * it (see ledchain-test's ProtocolHandler); the RGB version is the same loop
+ * with a 3 byte stride.
+ */
+static void legacySwap(uint8_t *buf, size_t pixels, unsigned int bytesPerPixel, const uint8_t *, const uint8_t *) {
+	for(int i = 0; i < static_cast<int>(pixels); i++) {
+		int off = (i * bytesPerPixel);
+
+		uint8_t r = buf[off + 0];
+		uint8_t g = buf[off + 1];
+		uint8_t b = buf[off + 2];
+
+		buf[off + 0] = g;
+		buf[off + 1] = r;
+		buf[off + 2] = b;
+	}
+}
+
+/// the legacy loop, followed by all kernels
+static const Kernel kKernels[] = {
+	{"legacy", legacySwap, nullptr},
+	{"scalar", ColorKernels::transformScalar, nullptr},
+	{"ssse3", ColorKernels::transformSsse3, ColorKernels::ssse3Available},
+	{"neon", ColorKernels::transformNeon, ColorKernels::neonAvailable},
+};
+
+/**
+ * A white extraction kernel that's benchmarked.
+ */
+struct ExpandKernel {
+	const char *name;
+	ColorKernels::ExpandFunction function;
+
+	// whether the CPU can run it; nullptr if it always can
+	bool (*isAvailable)(void);
+};
+
+/// all white extraction kernels, with the scalar one (the baseline) first
+static const ExpandKernel kExpandKernels[] = {
+	{"scalar", ColorKernels::expandScalar, nullptr},
+	{"ssse3", ColorKernels::expandSsse3, ColorKernels::ssse3Available},
+	{"neon", ColorKernels::expandNeon, ColorKernels::neonAvailable},
+};
+
+/// color of warm white (3000K) LEDs
+static const uint8_t kWarmWhite[3] = {255, 178, 112};
+
+/**
+ * Fills a buffer with random pixel data.
+ */
+static vector<uint8_t> randomPixels(size_t pixels, unsigned int bytesPerPixel) {
+	vector<uint8_t> buffer(pixels * bytesPerPixel);
+
+	for(auto &byte : buffer) {
+		byte = static_cast<uint8_t>(rand());
+	}
+
+	return buffer;
+}
+
+/**
+ * Checks that the kernel reorders the pixels exactly like the legacy loop.
+ */
+static bool verify(const Kernel &kernel, size_t pixels, unsigned int bytesPerPixel) {
+	vector<uint8_t> expected = randomPixels(pixels, bytesPerPixel);
+	vector<uint8_t> actual = expected;
+
+	legacySwap(expected.data(), pixels, bytesPerPixel, kOrder, kIdentity);
+	kernel.function(actual.data(), pixels, bytesPerPixel, kOrder, kIdentity);
+
+	return (expected == actual);
+}
+
+/**
+ * Times the kernel, and returns the average time it takes for one frame, in
+ * nanoseconds.
+ */
+static double benchmark(const Kernel &kernel, size_t pixels, unsigned int bytesPerPixel, unsigned int iterations) {
+	vector<uint8_t> buffer = randomPixels(pixels, bytesPerPixel);
+
+	// warm up the caches
+	kernel.function(buffer.data(), pixels, bytesPerPixel, kOrder, kIdentity);
+
+	auto start = chrono::steady_clock::now();
+
+	for(unsigned int i = 0; i < iterations; i++) {
+		kernel.function(buffer.data(), pixels, bytesPerPixel, kOrder, kIdentity);
+
+		// don't let the compiler drop any of the passes
+		asm volatile("" : : "r"(buffer.data()) : "memory");
+	}
+
+	auto end = chrono::steady_clock::now();
+	auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+
+	return (static_cast<double>(ns) / iterations);
+}
+
+/**
+ * Checks that the white extraction kernel matches the scalar one.
+ */
+static bool verifyExpand(const ExpandKernel &kernel, size_t pixels, const ColorKernels::WhitePoint &white) {
+	vector<uint8_t> expected = randomPixels(pixels, 4);
+	vector<uint8_t> actual = expected;
+
+	ColorKernels::expandScalar(expected.data(), pixels, white);
+	kernel.function(actual.data(), pixels, white);
+
+	return (expected == actual);
+}
+
+/**
+ * Times the white extraction kernel, and returns the average time it takes
+ * for one frame, in nanoseconds.
+ */
+static double benchmarkExpand(const ExpandKernel &kernel, size_t pixels, const ColorKernels::WhitePoint &white, unsigned int iterations) {
+	vector<uint8_t> source = randomPixels(pixels, 3);
+	vector<uint8_t> buffer(pixels * 4);
+
+	auto start = chrono::steady_clock::now();
+
+	for(unsigned int i = 0; i < iterations; i++) {
+		// the kernel works in place, so start with fresh RGB data each time
+		memcpy(buffer.data(), source.data(), source.size());
+		kernel.function(buffer.data(), pixels, white);
+
+		asm volatile("" : : "r"(buffer.data()) : "memory");
+	}
+
+	auto end = chrono::steady_clock::now();
+	auto ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+
+	return (static_cast<double>(ns) / iterations);
+}
+
+/**
+ * Main function
+ */
+int main(int argc, const char *argv[]) {
+	// parse command-line options
+	cxxopts::Options options("lichtenstein_colorbench", "Lichtenstein Color Kernel Benchmark");
+
+	options.add_options()
+		("i,iterations", "Frames to time each kernel with", cxxopts::value<unsigned int>()->default_value("20000"))
+		("h,help", "Print usage")
+	;
+
+	auto cmdlineOptions = options.parse(argc, argv);
+
+	if(cmdlineOptions.count("help")) {
+		cout << options.help() << endl;
+		return 0;
+	}
+
+	const unsigned int iterations = cmdlineOptions["iterations"].as<unsigned int>();
+
+	int failures = 0;
+
+	for(unsigned int bytesPerPixel : {4U, 3U}) {
+		cout << ((bytesPerPixel == 4) ? "RGBW -> GRBW" : "RGB -> GRB") << endl;
+
+		for(size_t pixels : kPixelCounts) {
+			double legacy = 0;
+
+			for(const Kernel &kernel : kKernels) {
+				if(kernel.isAvailable && !kernel.isAvailable()) {
+					continue;
+				}
+
+				if(!verify(kernel, pixels, bytesPerPixel)) {
+					cout << "  " << kernel.name << " doesn't match the legacy loop at "
+						<< pixels << " pixels" << endl;
+					failures++;
+					continue;
+				}
+
+				const double ns = benchmark(kernel, pixels, bytesPerPixel, iterations);
+
+				if(kernel.function == legacySwap) {
+					legacy = ns;
+				}
+
+				cout << "  " << setw(5) << pixels << " pixels, " << setw(6) << kernel.name
+					<< ": " << fixed << setprecision(0) << setw(8) << ns << " ns/frame, "
+					<< setprecision(2) << (legacy / ns) << "x" << endl;
+			}
+		}
+	}
+
+	// white extraction
+	const ColorKernels::WhitePoint white = ColorKernels::makeWhitePoint(kWarmWhite);
+
+	cout << "RGB -> RGBW (3000K white)" << endl;
+
+	for(size_t pixels : kPixelCounts) {
+		double scalar = 0;
+
+		for(const ExpandKernel &kernel : kExpandKernels) {
+			if(kernel.isAvailable && !kernel.isAvailable()) {
+				continue;
+			}
+
+			if(!verifyExpand(kernel, pixels, white)) {
+				cout << "  " << kernel.name << " doesn't match the scalar kernel at "
+					<< pixels << " pixels" << endl;
+				failures++;
+				continue;
+			}
+
+			const double ns = benchmarkExpand(kernel, pixels, white, iterations);
+
+			if(kernel.function == ColorKernels::expandScalar) {
+				scalar = ns;
+			}
+
+			cout << "  " << setw(5) << pixels << " pixels, " << setw(6) << kernel.name
+				<< ": " << fixed << setprecision(0) << setw(8) << ns << " ns/frame, "
+				<< setprecision(2) << (scalar / ns) << "x" << endl;
+		}
+	}
+
+	return (failures ? 1 : 0);
+}
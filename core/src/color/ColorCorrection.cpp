@@ -0,0 +1,485 @@
+#include "ColorCorrection.h"
+
+#include "../config/Config.h"
+#include "../output/OutputFrame.h"
+#include "../util/EngineSelector.h"
+
+#include <glog/logging.h>
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <cctype>
+#include <cstring>
+
+/**
+ * All transform kernels that may be selected. The scalar kernel is the
+ * reference the others are checked against.
+ */
+const ColorCorrection::Candidate ColorCorrection::kCandidates[] = {
+	{"scalar", ColorKernels::transformScalar, ColorKernels::expandScalar, nullptr},
+	{"ssse3", ColorKernels::transformSsse3, ColorKernels::expandSsse3, ColorKernels::ssse3Available},
+	{"neon", ColorKernels::transformNeon, ColorKernels::expandNeon, ColorKernels::neonAvailable},
+};
+const size_t ColorCorrection::kNumCandidates = (sizeof(kCandidates) / sizeof(kCandidates[0]));
+
+/// pixel counts the kernels are checked against; around each block size
+static const size_t kCheckPixels[] = {
+	0, 1, 2, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 170
+};
+/// factors the kernels are checked with
+static const uint8_t kCheckFactors[][4] = {
+	{255, 255, 255, 255}, {0, 0, 0, 0}, {128, 64, 200, 17}, {254, 1, 127, 255}
+};
+/// orders the kernels are checked with
+static const uint8_t kCheckOrders[][4] = {
+	{0, 1, 2, 3}, {1, 0, 2, 3}, {2, 1, 0, 3}, {1, 2, 0, 3}
+};
+/// white LED colors the expand kernels are checked with
+static const uint8_t kCheckWhitePoints[][3] = {
+	{255, 255, 255}, {255, 167, 87}, {201, 218, 255}, {1, 2, 3}
+};
+/// largest misalignment the kernels are checked with
+static const size_t kCheckMaxOffset = 3;
+
+/// number of pixels used for benchmarking; a typical strip
+static const size_t kBenchmarkPixels = 512;
+/// order used for benchmarking; that of WS2812 strips
+static const uint8_t kBenchmarkOrder[4] = {1, 0, 2, 3};
+/// number of rounds, and calls per round; the fastest round counts
+static const size_t kBenchmarkRounds = 5;
+static const size_t kBenchmarkCalls = 64;
+
+/**
+ * Selects the kernels, and sets up every channel with the component order,
+ * gamma and brightness from the config.
+ */
+ColorCorrection::ColorCorrection(const Config *config) {
+	const Config::Output &output = config->getOutput();
+
+	this->selectKernel(output.colorEngine);
+	this->readOrders(output.colorOrder);
+	this->setWhiteTemperature(output.whiteTemperature);
+
+	// apply the defaults
+	Parameters params;
+	params.gamma = output.gamma;
+	params.brightness = static_cast<uint8_t>(output.brightness);
+
+	for(size_t i = 0; i < kMaxChannels; i++) {
+		this->setParameters(i, params);
+	}
+
+	LOG_IF(INFO, (params.gamma != 1 || params.brightness != 255)) << "Correcting output with gamma "
+		<< params.gamma << ", brightness " << output.brightness;
+}
+
+/**
+ * Releases all lookup tables.
+ */
+ColorCorrection::~ColorCorrection() {
+	for(size_t i = 0; i < kMaxChannels; i++) {
+		delete[] this->channels[i].tables;
+	}
+}
+
+
+
+/**
+ * Sets the component order of each channel from a comma separated list: the
+ * first entry is the order of channel 0, and so on. The last one also applies
+ * to all channels after it. Invalid entries are ignored.
+ *
+ * Channels whose order includes white are marked as driving RGBW strips.
+ */
+void ColorCorrection::readOrders(const std::string &orders) {
+	size_t channel = 0, start = 0;
+	uint8_t order[4] = {0, 1, 2, 3};
+	int components = 3;
+
+	while(start <= orders.size() && channel < kMaxChannels) {
+		size_t end = orders.find(',', start);
+
+		if(end == std::string::npos) {
+			end = orders.size();
+		}
+
+		const std::string entry = orders.substr(start, (end - start));
+
+		const int parsed = ColorCorrection::parseOrder(entry, order);
+
+		if(parsed < 0) {
+			LOG(WARNING) << "Invalid color order '" << entry << "' for channel " << channel;
+		} else {
+			components = parsed;
+		}
+
+		memcpy(this->channels[channel].order, order, sizeof(order));
+		this->channels[channel++].rgbw = (components == 4);
+
+		start = (end + 1);
+	}
+
+	// the last order applies to the remaining channels too
+	for(; channel < kMaxChannels; channel++) {
+		memcpy(this->channels[channel].order, order, sizeof(order));
+		this->channels[channel].rgbw = (components == 4);
+	}
+
+	LOG_IF(INFO, orders != "RGB") << "Component order of channels: " << orders;
+}
+
+/**
+ * Parses a component order, such as "GRB" or "GRBW": a permutation of R, G and
+ * B, optionally followed by W, which must always come last. Case and spaces
+ * around it are ignored.
+ *
+ * @param order Receives the index of the input component for each output
+ * component; it's left unchanged if the order is invalid.
+ *
+ * @return Number of components (3 or 4), or -1 if the order is invalid.
+ */
+int ColorCorrection::parseOrder(const std::string &string, uint8_t *order) {
+	static const char kComponents[] = "RGBW";
+
+	// trim the string
+	const size_t first = string.find_first_not_of(" \t");
+	const size_t last = string.find_last_not_of(" \t");
+
+	if(first == std::string::npos) {
+		return -1;
+	}
+
+	const std::string trimmed = string.substr(first, (last - first + 1));
+
+	if(trimmed.size() != 3 && trimmed.size() != 4) {
+		return -1;
+	}
+
+	// find each letter's component, and make sure each appears once
+	uint8_t parsed[4] = {0, 1, 2, 3};
+	bool seen[4] = {false, false, false, false};
+
+	for(size_t i = 0; i < trimmed.size(); i++) {
+		const char *component = strchr(kComponents, toupper(trimmed[i]));
+
+		if(!component || !*component) {
+			return -1;
+		}
+
+		const size_t index = (component - kComponents);
+
+		if(seen[index] || (index == 3 && i != 3) || (i == 3 && index != 3)) {
+			return -1;
+		}
+
+		seen[index] = true;
+		parsed[i] = index;
+	}
+
+	memcpy(order, parsed, sizeof(parsed));
+	return static_cast<int>(trimmed.size());
+}
+
+/**
+ * Sets the color of the white LEDs on RGBW strips from their color temperature,
+ * relative to daylight (6500K), which is taken to be neutral white. Warmer
+ * LEDs have less blue (and green) in them, so less of those is taken out of
+ * the other components when white is extracted.
+ *
+ * The color of each temperature is approximated with the curves fit to the
+ * blackbody data by Tanner Helland.
+ */
+void ColorCorrection::setWhiteTemperature(double kelvin) {
+	// gets the approximate color of the given temperature
+	auto colorOf = [](double kelvin, double *rgb) {
+		const double t = (kelvin / 100);
+
+		if(t <= 66) {
+			rgb[0] = 255;
+			rgb[1] = ((99.4708025861 * std::log(t)) - 161.1195681661);
+		} else {
+			rgb[0] = (329.698727446 * std::pow((t - 60), -0.1332047592));
+			rgb[1] = (288.1221695283 * std::pow((t - 60), -0.0755148492));
+		}
+
+		if(t >= 66) {
+			rgb[2] = 255;
+		} else if(t <= 19) {
+			rgb[2] = 0;
+		} else {
+			rgb[2] = ((138.5177312231 * std::log(t - 10)) - 305.0447927307);
+		}
+	};
+
+	double color[3], neutral[3];
+
+	colorOf(kelvin, color);
+	colorOf(6500, neutral);
+
+	// scale it so daylight is (255, 255, 255)
+	uint8_t white[3];
+
+	for(size_t c = 0; c < 3; c++) {
+		const double value = std::round((255 * color[c]) / neutral[c]);
+		white[c] = static_cast<uint8_t>(std::min(std::max(value, 1.0), 255.0));
+	}
+
+	this->white = ColorKernels::makeWhitePoint(white);
+
+	LOG_IF(INFO, kelvin != 6500) << "White LEDs are " << kelvin << "K: ("
+		<< static_cast<int>(white[0]) << ", " << static_cast<int>(white[1]) << ", "
+		<< static_cast<int>(white[2]) << ")";
+}
+
+
+
+/**
+ * Selects the transform kernel. If a specific one is requested, it's used as long
+ * as the CPU supports it and it passes the cross check; otherwise (or for
+ * "auto"), the fastest one that passes is used.
+ *
+ * @return 0 if the requested kernel is used, -1 if another one was picked.
+ */
+int ColorCorrection::selectKernel(const std::string &preferred) {
+	EngineSelector<Candidate> selector("color kernel",
+		("per " + std::to_string(kBenchmarkPixels) + " pixels"),
+		ColorCorrection::crossCheck, ColorCorrection::benchmark);
+
+	// the scalar kernel is the reference, so it always passes the check
+	const Candidate *best = selector.select(kCandidates, kNumCandidates, 0, preferred);
+	CHECK(best != nullptr) << "Scalar color kernel failed the cross check";
+
+	this->transformFunction = best->function;
+	this->expandFunction = best->expand;
+
+	return (selector.gotPreferred() ? 0 : -1);
+}
+
+/**
+ * Checks that the candidate gets the same result as the scalar kernel for all
+ * combinations of pixel sizes, counts, alignments, orders and factors.
+ *
+ * @return Whether the candidate passed.
+ */
+bool ColorCorrection::crossCheck(const Candidate &candidate) {
+	const size_t maxPixels = kCheckPixels[(sizeof(kCheckPixels) / sizeof(kCheckPixels[0])) - 1];
+
+	std::vector<uint8_t> input((maxPixels * 4) + kCheckMaxOffset);
+	EngineBenchmark::fillTestData(input);
+
+	std::vector<uint8_t> expected(input.size()), actual(input.size());
+
+	for(unsigned int bytesPerPixel = 3; bytesPerPixel <= 4; bytesPerPixel++) {
+		for(size_t pixels : kCheckPixels) {
+			for(size_t offset = 0; offset <= kCheckMaxOffset; offset++) {
+				for(const uint8_t *order : kCheckOrders) {
+					for(const uint8_t *factors : kCheckFactors) {
+						expected = input;
+						actual = input;
+
+						ColorKernels::transformScalar((expected.data() + offset), pixels, bytesPerPixel, order, factors);
+						candidate.function((actual.data() + offset), pixels, bytesPerPixel, order, factors);
+
+						if(expected != actual) {
+							LOG(ERROR) << "Color kernel " << candidate.name << " is broken: "
+								<< pixels << " pixels of " << bytesPerPixel << " bytes at offset "
+								<< offset << " don't match";
+							return false;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// check the expand kernel the same way
+	for(size_t pixels : kCheckPixels) {
+		for(size_t offset = 0; offset <= kCheckMaxOffset; offset++) {
+			for(const uint8_t *color : kCheckWhitePoints) {
+				const ColorKernels::WhitePoint white = ColorKernels::makeWhitePoint(color);
+
+				expected = input;
+				actual = input;
+
+				ColorKernels::expandScalar((expected.data() + offset), pixels, white);
+				candidate.expand((actual.data() + offset), pixels, white);
+
+				if(expected != actual) {
+					LOG(ERROR) << "Color kernel " << candidate.name << " is broken: "
+						<< pixels << " pixels expanded at offset " << offset << " don't match";
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Times how long the candidate takes to reorder and scale an RGB strip.
+ *
+ * @return The fastest round, in nanoseconds per call.
+ */
+uint64_t ColorCorrection::benchmark(const Candidate &candidate) {
+	std::vector<uint8_t> buffer(kBenchmarkPixels * 3);
+	EngineBenchmark::fillTestData(buffer);
+
+	static const uint8_t kFactors[4] = {200, 180, 160, 255};
+
+	return EngineBenchmark::timeFastestRound(kBenchmarkRounds, kBenchmarkCalls, [&]() {
+		candidate.function(buffer.data(), kBenchmarkPixels, 3, kBenchmarkOrder, kFactors);
+	});
+}
+
+
+
+/**
+ * Whether the parameters can be applied to the given channel.
+ */
+bool ColorCorrection::isValid(size_t index, const Parameters &params) {
+	return (index < kMaxChannels && params.gamma > 0 && std::isfinite(params.gamma));
+}
+
+/**
+ * Changes the color correction of a channel. This may be called from any
+ * thread; frames already corrected aren't affected.
+ *
+ * @return 0 on success, -1 if the channel or parameters are invalid.
+ */
+int ColorCorrection::setParameters(size_t index, const Parameters &params) {
+	if(!ColorCorrection::isValid(index, params)) {
+		return -1;
+	}
+
+	Channel &channel = this->channels[index];
+	const uint8_t *order = channel.order;
+
+	// combine brightness and white balance into one factor per component, in
+	// the order the strip expects them
+	uint8_t factors[4];
+
+	for(size_t c = 0; c < 4; c++) {
+		const uint8_t whiteBalance = params.whiteBalance[order[c]];
+		factors[c] = ((((params.brightness + 1U) * (whiteBalance + 1U)) - 1U) >> 8);
+	}
+
+	// figure out the cheapest way to apply them
+	Mode mode;
+	ColorKernels::Tables *tables = nullptr;
+
+	const bool linear = (std::fabs(params.gamma - 1) < 1e-6);
+	const bool reordered = (order[0] != 0 || order[1] != 1 || order[2] != 2 || order[3] != 3);
+
+	if(linear && !reordered && ColorKernels::isUnscaled(factors, 4)) {
+		mode = kModeIdentity;
+	} else if(linear) {
+		mode = kModeTransform;
+	} else {
+		// fold gamma and the factors into one table per component
+		mode = kModeLookup;
+		tables = new ColorKernels::Tables[1];
+
+		for(size_t v = 0; v < 256; v++) {
+			const double corrected = std::round(255 * std::pow((v / 255.), params.gamma));
+			const uint8_t value = static_cast<uint8_t>(std::min(255., std::max(0., corrected)));
+
+			for(size_t c = 0; c < 4; c++) {
+				(*tables)[c][v] = ColorKernels::scale(value, factors[c]);
+			}
+		}
+	}
+
+	// swap them in
+	{
+		std::lock_guard<std::mutex> lck(channel.lock);
+
+		channel.mode = mode;
+		memcpy(channel.factors, factors, sizeof(factors));
+		std::swap(channel.tables, tables);
+	}
+
+	delete[] tables;
+
+	VLOG(1) << "Channel " << index << ": gamma " << params.gamma << ", brightness "
+		<< static_cast<unsigned int>(params.brightness) << " (mode " << mode << ")";
+
+	return 0;
+}
+
+/**
+ * Changes the color correction of several channels at once. The parameters are
+ * checked against all of them first, so either every channel is changed, or
+ * none is.
+ *
+ * @return 0 on success, -1 if any channel or the parameters are invalid.
+ */
+int ColorCorrection::setParameters(const std::vector<size_t> &channels, const Parameters &params) {
+	for(size_t index : channels) {
+		if(!ColorCorrection::isValid(index, params)) {
+			return -1;
+		}
+	}
+
+	// this can't fail anymore
+	for(size_t index : channels) {
+		this->setParameters(index, params);
+	}
+
+	return 0;
+}
+
+/**
+ * Reorders the components of the frame's data and applies the color correction
+ * of its channel, in place. RGB frames for RGBW strips are expanded first.
+ *
+ * @return 0 on success, or -1 if the frame can't be output on its channel.
+ */
+int ColorCorrection::apply(OutputFrame *frame) {
+	const size_t index = frame->getChannel();
+
+	if(index >= kMaxChannels) {
+		return 0;
+	}
+
+	unsigned int bytesPerPixel = frame->getBytesPerPixel();
+	const size_t pixels = (frame->getDataLen() / bytesPerPixel);
+	uint8_t *data = static_cast<uint8_t *>(frame->getData());
+
+	Channel &channel = this->channels[index];
+
+	// add a white component to RGB data for RGBW strips; RGB data would shift
+	// every pixel on the strip, so the frame is rejected if there's no room
+	if(channel.rgbw && bytesPerPixel == 3) {
+		if(frame->getDataCapacity() < (pixels * 4)) {
+			LOG(WARNING) << "No room to extract white for " << pixels << " pixels on channel "
+				<< index << "; rejecting the frame";
+			return -1;
+		}
+
+		this->expandFunction(data, pixels, this->white);
+
+		bytesPerPixel = 4;
+		frame->setBytesPerPixel(4);
+		frame->setDataLen(pixels * 4);
+	}
+
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	switch(channel.mode) {
+		case kModeIdentity:
+			break;
+
+		case kModeTransform:
+			this->transformFunction(data, pixels, bytesPerPixel, channel.order, channel.factors);
+			break;
+
+		case kModeLookup:
+			ColorKernels::lookup(data, pixels, bytesPerPixel, channel.order, *channel.tables);
+			break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * Applies gamma, brightness and white balance to frames on their way to the
+ * output plugin, so the server doesn't have to do it for every node.
+ *
+ * Each channel has its own parameters. Rather than running the pixels through
+ * a chain of tables, the parameters are combined when they change: if gamma is
+ * linear, brightness and white balance reduce to one factor per component that
+ * the transform kernels apply with SIMD; otherwise, everything is folded into
+ * one lookup table per component.
+ *
+ * Each channel also has a component order (from the config), for strips that
+ * don't take RGB data. It's applied in the same pass as the correction, so a
+ * frame's data is only read and written once.
+ *
+ * Channels whose order includes white drive RGBW strips. The server may send
+ * them RGB data, which saves a quarter of the bytes on the wire; the white
+ * component is then extracted here, taking the color temperature of the white
+ * LEDs into account.
+ *
+ * A channel with the default parameters and order is left untouched, so nodes
+ * that don't use any of this pay nothing for it.
+ *
+ * The transform kernel is picked when the client starts, like the CRC
+ * algorithm: each one the CPU supports is checked against the scalar version,
+ * timed, and the fastest wins.
+ */
+#ifndef COLORCORRECTION_H
+#define COLORCORRECTION_H
+
+#include "ColorKernels.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+class Config;
+class OutputFrame;
+
+class ColorCorrection {
+	public:
+		/**
+		 * Color correction applied to a channel.
+		 */
+		struct Parameters {
+			// gamma exponent; 1 is linear
+			double gamma = 1;
+			// global brightness; 255 is full brightness
+			uint8_t brightness = 255;
+			// white balance of the red, green, blue and white components
+			uint8_t whiteBalance[4] = {255, 255, 255, 255};
+		};
+
+	public:
+		ColorCorrection(const Config *config);
+		~ColorCorrection();
+
+		int setParameters(size_t channel, const Parameters &params);
+		int setParameters(const std::vector<size_t> &channels, const Parameters &params);
+		int apply(OutputFrame *frame);
+
+		static int parseOrder(const std::string &string, uint8_t *order);
+
+	private:
+		struct Candidate {
+			const char *name;
+			ColorKernels::TransformFunction function;
+			ColorKernels::ExpandFunction expand;
+
+			// whether the CPU can run it; nullptr if it always can
+			bool (*isAvailable)(void);
+		};
+
+		static bool isValid(size_t channel, const Parameters &params);
+
+		int selectKernel(const std::string &preferred);
+		void readOrders(const std::string &orders);
+		void setWhiteTemperature(double kelvin);
+
+		static bool crossCheck(const Candidate &candidate);
+		static uint64_t benchmark(const Candidate &candidate);
+
+	private:
+		/**
+		 * How a channel's frames are corrected.
+		 */
+		enum Mode {
+			// not at all
+			kModeIdentity,
+			// by the transform kernel
+			kModeTransform,
+			// through the lookup tables
+			kModeLookup,
+		};
+
+		struct Channel {
+			// order of components the strip expects, and whether it has a
+			// white component; neither changes
+			uint8_t order[4] = {0, 1, 2, 3};
+			bool rgbw = false;
+
+			Mode mode = kModeIdentity;
+
+			// combined brightness and white balance of each component, in the
+			// order the strip expects them
+			uint8_t factors[4] = {255, 255, 255, 255};
+			// combined tables, in the same order; only allocated for kModeLookup
+			ColorKernels::Tables *tables = nullptr;
+
+			// protects all of the above, except the order and rgbw
+			std::mutex lock;
+		};
+
+		// number of channels that can be corrected; see kLichtensteinMaxChannels
+		static const size_t kMaxChannels = 128;
+
+		// all transform kernels, with the scalar one first
+		static const Candidate kCandidates[];
+		static const size_t kNumCandidates;
+
+	private:
+		// transform and expand kernels in use
+		ColorKernels::TransformFunction transformFunction = ColorKernels::transformScalar;
+		ColorKernels::ExpandFunction expandFunction = ColorKernels::expandScalar;
+
+		// color of the white LEDs on RGBW strips
+		ColorKernels::WhitePoint white;
+
+		Channel channels[kMaxChannels];
+};
+
+#endif
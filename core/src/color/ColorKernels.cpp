@@ -0,0 +1,576 @@
+#include "ColorKernels.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+	#define COLOR_HAS_SSSE3 1
+	#include <tmmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define COLOR_HAS_NEON 1
+	#include <arm_neon.h>
+#endif
+
+/**
+ * Reorders the components of each pixel and runs them through their tables.
+ * The number of components is a template parameter, so the inner loop is
+ * unrolled.
+ */
+template<unsigned int Components>
+static void lookupPixels(uint8_t *data, size_t pixels, const uint8_t *order, const ColorKernels::Tables &tables) {
+	for(size_t i = 0; i < pixels; i++) {
+		uint8_t in[Components];
+		memcpy(in, data, Components);
+
+		for(unsigned int c = 0; c < Components; c++) {
+			data[c] = tables[c][in[order[c]]];
+		}
+
+		data += Components;
+	}
+}
+
+/**
+ * Applies the order and lookup tables to the given pixels.
+ */
+void ColorKernels::lookup(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const Tables &tables) {
+	if(bytesPerPixel == 4) {
+		lookupPixels<4>(data, pixels, order, tables);
+	} else {
+		lookupPixels<3>(data, pixels, order, tables);
+	}
+}
+
+
+
+/**
+ * Position of a byte of an RGBW pixel in the word it's loaded as.
+ */
+static constexpr unsigned int byteShift(unsigned int index) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (8 * (3 - index));
+#else
+	return (8 * index);
+#endif
+}
+
+/**
+ * Gets the output component at the given index out of a pixel loaded as a word.
+ */
+template<bool Scaled, unsigned int Index, unsigned int From>
+static inline uint32_t moveComponent(uint32_t in, const uint8_t *factors) {
+	uint32_t value = ((in >> byteShift(From)) & 0xFF);
+
+	if(Scaled) {
+		value = ColorKernels::scale(value, factors[Index]);
+	}
+
+	return (value << byteShift(Index));
+}
+
+/**
+ * Transforms pixels without SIMD instructions, for one particular order of the
+ * red, green and blue components; white always stays last. Since the order is
+ * a template parameter, all shifts and offsets are constants.
+ *
+ * RGBW pixels are transformed a word at a time: each pixel is loaded as a
+ * single word, its components are moved into place with shifts and masks, and
+ * it's stored as a single word again. RGB pixels don't line up with words, so
+ * each component is loaded on its own.
+ */
+template<bool Scaled, unsigned int R, unsigned int G, unsigned int B>
+static void transformPixels(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *factors) {
+	if(bytesPerPixel == 4) {
+		for(size_t i = 0; i < pixels; i++) {
+			uint32_t in;
+			memcpy(&in, data, sizeof(in));
+
+			const uint32_t out = (moveComponent<Scaled, 0, R>(in, factors)
+				| moveComponent<Scaled, 1, G>(in, factors)
+				| moveComponent<Scaled, 2, B>(in, factors)
+				| moveComponent<Scaled, 3, 3>(in, factors));
+
+			memcpy(data, &out, sizeof(out));
+			data += 4;
+		}
+	} else {
+		for(size_t i = 0; i < pixels; i++) {
+			const uint8_t in[3] = {data[0], data[1], data[2]};
+
+			if(Scaled) {
+				data[0] = ColorKernels::scale(in[R], factors[0]);
+				data[1] = ColorKernels::scale(in[G], factors[1]);
+				data[2] = ColorKernels::scale(in[B], factors[2]);
+			} else {
+				data[0] = in[R];
+				data[1] = in[G];
+				data[2] = in[B];
+			}
+
+			data += 3;
+		}
+	}
+}
+
+/**
+ * Gets the specialization of transformPixels for the given order, which must
+ * be a permutation of the red, green and blue components.
+ */
+template<bool Scaled>
+static void (*pixelFunction(const uint8_t *order))(uint8_t *, size_t, unsigned int, const uint8_t *) {
+	switch((order[0] * 9) + (order[1] * 3) + order[2]) {
+		case ((0 * 9) + (2 * 3) + 1):
+			return transformPixels<Scaled, 0, 2, 1>;
+		case ((1 * 9) + (0 * 3) + 2):
+			return transformPixels<Scaled, 1, 0, 2>;
+		case ((1 * 9) + (2 * 3) + 0):
+			return transformPixels<Scaled, 1, 2, 0>;
+		case ((2 * 9) + (0 * 3) + 1):
+			return transformPixels<Scaled, 2, 0, 1>;
+		case ((2 * 9) + (1 * 3) + 0):
+			return transformPixels<Scaled, 2, 1, 0>;
+		default:
+			return transformPixels<Scaled, 0, 1, 2>;
+	}
+}
+
+/**
+ * Transforms the given pixels without any SIMD instructions.
+ */
+void ColorKernels::transformScalar(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors) {
+	if(ColorKernels::isUnscaled(factors, bytesPerPixel)) {
+		pixelFunction<false>(order)(data, pixels, bytesPerPixel, factors);
+	} else {
+		pixelFunction<true>(order)(data, pixels, bytesPerPixel, factors);
+	}
+}
+
+
+
+/**
+ * Turns the given RGB pixels into RGBW without any SIMD instructions, starting
+ * with the last pixel.
+ */
+void ColorKernels::expandScalar(uint8_t *data, size_t pixels, const WhitePoint &white) {
+	// a local copy can't alias the data, so it stays in registers
+	const WhitePoint local = white;
+
+	for(size_t i = pixels; i-- > 0;) {
+		ColorKernels::extractWhite((data + (i * 3)), (data + (i * 4)), local);
+	}
+}
+
+/**
+ * Sets up a white point for the given color of the white LED. Components that
+ * are 0 are treated as 1, so the inverse is always defined.
+ */
+ColorKernels::WhitePoint ColorKernels::makeWhitePoint(const uint8_t *color) {
+	WhitePoint white;
+
+	for(unsigned int c = 0; c < 3; c++) {
+		white.color[c] = (color[c] ? color[c] : 1);
+		white.inverse[c] = (65280 / white.color[c]);
+	}
+
+	return white;
+}
+
+
+
+#ifdef COLOR_HAS_SSSE3
+/**
+ * Scales the 16 components in a vector by their multipliers (factor + 1): they
+ * are widened to 16 bits, multiplied and narrowed again. The product is at
+ * most 65280, so it fits an unsigned 16-bit lane.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i scaleVector(__m128i value, __m128i low, __m128i high) {
+	const __m128i zero = _mm_setzero_si128();
+
+	const __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(value, zero), low);
+	const __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(value, zero), high);
+
+	return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+/**
+ * Transforms blocks of 48 bytes (16 RGB or 12 RGBW pixels) at a time. Each
+ * block is loaded as three vectors before any of them is stored, so a load
+ * never has to wait on a store that only partially overlaps it.
+ *
+ * Each output vector is put together by shuffling (pshufb) the input vectors
+ * its components come from, and combining the results: RGBW pixels never span
+ * two vectors, so that's one shuffle per vector, but RGB pixels do, which may
+ * take up to three.
+ */
+template<bool Scaled>
+__attribute__((target("ssse3")))
+static void transformSsse3Impl(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors) {
+	static const unsigned int kBlockBytes = 48;
+
+	// build a shuffle for each pair of output and input vector, and the
+	// multipliers for each output vector
+	uint8_t shuffles[3][3][16];
+	uint16_t multipliers[3][16];
+
+	memset(shuffles, 0x80, sizeof(shuffles));
+
+	for(unsigned int i = 0; i < kBlockBytes; i++) {
+		const unsigned int component = (i % bytesPerPixel);
+		const unsigned int from = ((i - component) + order[component]);
+
+		shuffles[i / 16][from / 16][i % 16] = (from % 16);
+		multipliers[i / 16][i % 16] = (factors[component] + 1U);
+	}
+
+	__m128i mask[3][3], low[3], high[3];
+
+	for(unsigned int v = 0; v < 3; v++) {
+		for(unsigned int w = 0; w < 3; w++) {
+			mask[v][w] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(shuffles[v][w]));
+		}
+
+		low[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&multipliers[v][0]));
+		high[v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&multipliers[v][8]));
+	}
+
+	// transform all whole blocks
+	const size_t pixelsPerBlock = (kBlockBytes / bytesPerPixel);
+	const size_t blocks = (pixels / pixelsPerBlock);
+
+	for(size_t b = 0; b < blocks; b++) {
+		__m128i *ptr = reinterpret_cast<__m128i *>(data);
+
+		const __m128i in0 = _mm_loadu_si128(ptr + 0);
+		const __m128i in1 = _mm_loadu_si128(ptr + 1);
+		const __m128i in2 = _mm_loadu_si128(ptr + 2);
+
+		__m128i out0, out1, out2;
+
+		if(bytesPerPixel == 4) {
+			out0 = _mm_shuffle_epi8(in0, mask[0][0]);
+			out1 = _mm_shuffle_epi8(in1, mask[1][1]);
+			out2 = _mm_shuffle_epi8(in2, mask[2][2]);
+		} else {
+			out0 = _mm_or_si128(_mm_shuffle_epi8(in0, mask[0][0]),
+				_mm_shuffle_epi8(in1, mask[0][1]));
+			out1 = _mm_or_si128(_mm_shuffle_epi8(in1, mask[1][1]),
+				_mm_or_si128(_mm_shuffle_epi8(in0, mask[1][0]),
+				_mm_shuffle_epi8(in2, mask[1][2])));
+			out2 = _mm_or_si128(_mm_shuffle_epi8(in2, mask[2][2]),
+				_mm_shuffle_epi8(in1, mask[2][1]));
+		}
+
+		if(Scaled) {
+			out0 = scaleVector(out0, low[0], high[0]);
+			out1 = scaleVector(out1, low[1], high[1]);
+			out2 = scaleVector(out2, low[2], high[2]);
+		}
+
+		_mm_storeu_si128(ptr + 0, out0);
+		_mm_storeu_si128(ptr + 1, out1);
+		_mm_storeu_si128(ptr + 2, out2);
+
+		data += kBlockBytes;
+	}
+
+	// pixels that don't fill a block
+	ColorKernels::transformScalar(data, (pixels % pixelsPerBlock), bytesPerPixel, order, factors);
+}
+
+/**
+ * Gets how much of the white LED's color each of 16 components could make up,
+ * as ((x * inverse) >> 8), capped at 255. Putting x in the high byte of each
+ * lane makes that the high half of the 16-bit product.
+ */
+__attribute__((target("ssse3")))
+static inline __m128i whiteAmount(__m128i value, __m128i inverse) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(255);
+
+	__m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, value), inverse);
+	__m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, value), inverse);
+
+	// cap at 255, as min(x, 255) = x - max(x - 255, 0); pack is signed
+	lo = _mm_sub_epi16(lo, _mm_subs_epu16(lo, max));
+	hi = _mm_sub_epi16(hi, _mm_subs_epu16(hi, max));
+
+	return _mm_packus_epi16(lo, hi);
+}
+
+/**
+ * Turns blocks of 16 RGB pixels (48 bytes) into RGBW (64 bytes), starting with
+ * the last one. Each block is loaded in full before it's stored, and the
+ * stores never reach the next (earlier) block, so working in place is safe.
+ *
+ * The pixels are split into a vector per component with shuffles, the white
+ * component is computed and taken out of them, and they're interleaved again
+ * with unpacks.
+ */
+__attribute__((target("ssse3")))
+static void expandSsse3Impl(uint8_t *data, size_t pixels, const ColorKernels::WhitePoint &white) {
+	// build a shuffle to gather each component out of each input vector
+	uint8_t shuffles[3][3][16];
+	memset(shuffles, 0x80, sizeof(shuffles));
+
+	for(unsigned int i = 0; i < 48; i++) {
+		shuffles[i % 3][i / 16][i / 3] = (i % 16);
+	}
+
+	__m128i mask[3][3], inverse[3], multiplier[3];
+
+	for(unsigned int c = 0; c < 3; c++) {
+		for(unsigned int v = 0; v < 3; v++) {
+			mask[c][v] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(shuffles[c][v]));
+		}
+
+		inverse[c] = _mm_set1_epi16(static_cast<short>(white.inverse[c]));
+		multiplier[c] = _mm_set1_epi16(white.color[c] + 1);
+	}
+
+	// pixels that don't fill a block are at the end, so they go first
+	const size_t blocks = (pixels / 16);
+	const size_t done = (blocks * 16);
+
+	for(size_t i = pixels; i-- > done;) {
+		ColorKernels::extractWhite((data + (i * 3)), (data + (i * 4)), white);
+	}
+
+	for(size_t b = blocks; b-- > 0;) {
+		const __m128i *in = reinterpret_cast<const __m128i *>(data + (b * 48));
+		__m128i *out = reinterpret_cast<__m128i *>(data + (b * 64));
+
+		const __m128i in0 = _mm_loadu_si128(in + 0);
+		const __m128i in1 = _mm_loadu_si128(in + 1);
+		const __m128i in2 = _mm_loadu_si128(in + 2);
+
+		// split into components, and find the white component
+		__m128i rgb[3];
+
+		for(unsigned int c = 0; c < 3; c++) {
+			rgb[c] = _mm_or_si128(_mm_shuffle_epi8(in0, mask[c][0]),
+				_mm_or_si128(_mm_shuffle_epi8(in1, mask[c][1]),
+				_mm_shuffle_epi8(in2, mask[c][2])));
+		}
+
+		const __m128i w = _mm_min_epu8(whiteAmount(rgb[0], inverse[0]),
+			_mm_min_epu8(whiteAmount(rgb[1], inverse[1]), whiteAmount(rgb[2], inverse[2])));
+
+		// take the white LED's share out of each component
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i wLo = _mm_unpacklo_epi8(w, zero);
+		const __m128i wHi = _mm_unpackhi_epi8(w, zero);
+
+		for(unsigned int c = 0; c < 3; c++) {
+			const __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(wLo, multiplier[c]), 8);
+			const __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(wHi, multiplier[c]), 8);
+
+			rgb[c] = _mm_subs_epu8(rgb[c], _mm_packus_epi16(lo, hi));
+		}
+
+		// interleave them again
+		const __m128i rgLo = _mm_unpacklo_epi8(rgb[0], rgb[1]);
+		const __m128i rgHi = _mm_unpackhi_epi8(rgb[0], rgb[1]);
+		const __m128i bwLo = _mm_unpacklo_epi8(rgb[2], w);
+		const __m128i bwHi = _mm_unpackhi_epi8(rgb[2], w);
+
+		_mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rgLo, bwLo));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rgLo, bwLo));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rgHi, bwHi));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rgHi, bwHi));
+	}
+}
+#endif
+
+/**
+ * Transforms the given pixels with SSSE3, if available, or without SIMD
+ * instructions otherwise.
+ */
+void ColorKernels::transformSsse3(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors) {
+#ifdef COLOR_HAS_SSSE3
+	if(ColorKernels::isUnscaled(factors, bytesPerPixel)) {
+		transformSsse3Impl<false>(data, pixels, bytesPerPixel, order, factors);
+	} else {
+		transformSsse3Impl<true>(data, pixels, bytesPerPixel, order, factors);
+	}
+#else
+	ColorKernels::transformScalar(data, pixels, bytesPerPixel, order, factors);
+#endif
+}
+
+/**
+ * Turns the given RGB pixels into RGBW with SSSE3, if available, or without
+ * SIMD instructions otherwise.
+ */
+void ColorKernels::expandSsse3(uint8_t *data, size_t pixels, const WhitePoint &white) {
+#ifdef COLOR_HAS_SSSE3
+	expandSsse3Impl(data, pixels, white);
+#else
+	ColorKernels::expandScalar(data, pixels, white);
+#endif
+}
+
+/**
+ * Whether the CPU supports SSSE3 (and with it, SSE2.)
+ */
+bool ColorKernels::ssse3Available(void) {
+#ifdef COLOR_HAS_SSSE3
+	return (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse2"));
+#else
+	return false;
+#endif
+}
+
+
+
+#ifdef COLOR_HAS_NEON
+/**
+ * Scales 16 values of the same component by (factor + 1), as (x * f) + x.
+ */
+static inline uint8x16_t scaleComponent(uint8x16_t value, uint8_t factor) {
+	const uint8x8_t f = vdup_n_u8(factor);
+
+	const uint16x8_t lo = vaddw_u8(vmull_u8(vget_low_u8(value), f), vget_low_u8(value));
+	const uint16x8_t hi = vaddw_u8(vmull_u8(vget_high_u8(value), f), vget_high_u8(value));
+
+	return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+}
+
+/**
+ * Transforms blocks of 16 pixels. The structured loads split them into one
+ * vector per component, so reordering them is just a matter of storing those
+ * vectors in a different order; no table lookups (vtbl) are needed.
+ */
+template<bool Scaled>
+static void transformNeonImpl(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors) {
+	const size_t blocks = (pixels / 16);
+
+	if(bytesPerPixel == 4) {
+		for(size_t b = 0; b < blocks; b++) {
+			const uint8x16x4_t in = vld4q_u8(data);
+			uint8x16x4_t out;
+
+			for(unsigned int c = 0; c < 4; c++) {
+				out.val[c] = in.val[order[c]];
+
+				if(Scaled) {
+					out.val[c] = scaleComponent(out.val[c], factors[c]);
+				}
+			}
+
+			vst4q_u8(data, out);
+			data += 64;
+		}
+	} else {
+		for(size_t b = 0; b < blocks; b++) {
+			const uint8x16x3_t in = vld3q_u8(data);
+			uint8x16x3_t out;
+
+			for(unsigned int c = 0; c < 3; c++) {
+				out.val[c] = in.val[order[c]];
+
+				if(Scaled) {
+					out.val[c] = scaleComponent(out.val[c], factors[c]);
+				}
+			}
+
+			vst3q_u8(data, out);
+			data += 48;
+		}
+	}
+
+	// pixels that don't fill a block
+	ColorKernels::transformScalar(data, (pixels % 16), bytesPerPixel, order, factors);
+}
+
+/**
+ * Gets how much of the white LED's color each of 16 components could make up,
+ * as ((x * inverse) >> 8), capped at 255 by the saturating narrows.
+ */
+static inline uint8x16_t whiteAmount(uint8x16_t value, uint16_t inverse) {
+	const uint16x4_t inv = vdup_n_u16(inverse);
+
+	const uint16x8_t lo = vmovl_u8(vget_low_u8(value));
+	const uint16x8_t hi = vmovl_u8(vget_high_u8(value));
+
+	const uint16x8_t amountLo = vcombine_u16(vqshrn_n_u32(vmull_u16(vget_low_u16(lo), inv), 8),
+		vqshrn_n_u32(vmull_u16(vget_high_u16(lo), inv), 8));
+	const uint16x8_t amountHi = vcombine_u16(vqshrn_n_u32(vmull_u16(vget_low_u16(hi), inv), 8),
+		vqshrn_n_u32(vmull_u16(vget_high_u16(hi), inv), 8));
+
+	return vcombine_u8(vqmovn_u16(amountLo), vqmovn_u16(amountHi));
+}
+
+/**
+ * Turns blocks of 16 RGB pixels into RGBW, starting with the last one. The
+ * structured loads and stores take care of splitting the pixels into their
+ * components, and interleaving them again.
+ */
+static void expandNeonImpl(uint8_t *data, size_t pixels, const ColorKernels::WhitePoint &white) {
+	// pixels that don't fill a block are at the end, so they go first
+	const size_t blocks = (pixels / 16);
+	const size_t done = (blocks * 16);
+
+	for(size_t i = pixels; i-- > done;) {
+		ColorKernels::extractWhite((data + (i * 3)), (data + (i * 4)), white);
+	}
+
+	for(size_t b = blocks; b-- > 0;) {
+		const uint8x16x3_t in = vld3q_u8(data + (b * 48));
+
+		const uint8x16_t w = vminq_u8(whiteAmount(in.val[0], white.inverse[0]),
+			vminq_u8(whiteAmount(in.val[1], white.inverse[1]), whiteAmount(in.val[2], white.inverse[2])));
+
+		uint8x16x4_t out;
+
+		for(unsigned int c = 0; c < 3; c++) {
+			out.val[c] = vqsubq_u8(in.val[c], scaleComponent(w, white.color[c]));
+		}
+
+		out.val[3] = w;
+
+		vst4q_u8((data + (b * 64)), out);
+	}
+}
+#endif
+
+/**
+ * Transforms the given pixels with NEON, if it was available at compile time,
+ * or without SIMD instructions otherwise.
+ */
+void ColorKernels::transformNeon(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors) {
+#ifdef COLOR_HAS_NEON
+	if(ColorKernels::isUnscaled(factors, bytesPerPixel)) {
+		transformNeonImpl<false>(data, pixels, bytesPerPixel, order, factors);
+	} else {
+		transformNeonImpl<true>(data, pixels, bytesPerPixel, order, factors);
+	}
+#else
+	ColorKernels::transformScalar(data, pixels, bytesPerPixel, order, factors);
+#endif
+}
+
+/**
+ * Turns the given RGB pixels into RGBW with NEON, if it was available at
+ * compile time, or without SIMD instructions otherwise.
+ */
+void ColorKernels::expandNeon(uint8_t *data, size_t pixels, const WhitePoint &white) {
+#ifdef COLOR_HAS_NEON
+	expandNeonImpl(data, pixels, white);
+#else
+	ColorKernels::expandScalar(data, pixels, white);
+#endif
+}
+
+/**
+ * Whether NEON can be used; there's no portable way to check at runtime, so
+ * this depends on whether the compiler was allowed to use it.
+ */
+bool ColorKernels::neonAvailable(void) {
+#ifdef COLOR_HAS_NEON
+	return true;
+#else
+	return false;
+#endif
+}
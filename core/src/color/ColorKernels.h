@@ -0,0 +1,122 @@
+/**
+ * Kernels that apply color correction to pixel data in place. Pixels are made
+ * up of 3 (RGB) or 4 (RGBW) bytes, one per component.
+ *
+ * Every kernel first puts the components of each pixel into the order the
+ * strip expects: output component c is input component order[c]. Strips that
+ * take GRB data, for example, use the order {1, 0, 2, 3}. The first three
+ * entries must be a permutation of red, green and blue; white stays last.
+ *
+ * The lookup kernel then runs each component through its own 256 entry table,
+ * and can apply any correction, including gamma. It's scalar everywhere: the
+ * SSSE3 byte shuffle only indexes 16 entries, and a table this size doesn't fit
+ * in a NEON register file.
+ *
+ * The transform kernels instead multiply each component by a factor, which is
+ * all that's needed for brightness and white balance when gamma is linear. A
+ * factor f maps x to ((x * (f + 1)) >> 8), so 255 leaves the component
+ * unchanged and 0 turns it off. There are SSSE3 (x86) and NEON (ARM) versions,
+ * and a scalar one for everything else, such as MIPS, which moves RGBW pixels
+ * a word at a time.
+ *
+ * The expand kernels turn RGB pixels into RGBW, for RGBW strips that are sent
+ * RGB data. The white component is the largest amount of the white LED's color
+ * (see WhitePoint) that's contained in all of red, green and blue, and it's
+ * taken out of them. This is done in place: the buffer must have room for the
+ * RGBW pixels, and is filled from the back so no pixel is overwritten before
+ * it's read.
+ */
+#ifndef COLORKERNELS_H
+#define COLORKERNELS_H
+
+#include <algorithm>
+
+#include <cstddef>
+#include <cstdint>
+
+class ColorKernels {
+	public:
+		/// a lookup table for each component of a pixel
+		typedef uint8_t Tables[4][256];
+
+		/// reorders the components of each pixel, then scales them (see above)
+		typedef void (*TransformFunction)(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors);
+
+		/**
+		 * Color of the white LED, at full brightness, in terms of red, green
+		 * and blue; (255, 255, 255) is a perfectly neutral white.
+		 */
+		struct WhitePoint {
+			// red, green and blue of the white LED; never 0
+			uint8_t color[3] = {255, 255, 255};
+			// 65280 / color: (x * inverse) >> 8 is how much of the white LED's
+			// color a component with value x can make up
+			uint16_t inverse[3] = {256, 256, 256};
+		};
+
+		/// turns RGB pixels into RGBW (see above)
+		typedef void (*ExpandFunction)(uint8_t *data, size_t pixels, const WhitePoint &white);
+
+	public:
+		static void lookup(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const Tables &tables);
+
+		static void transformScalar(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors);
+		static void expandScalar(uint8_t *data, size_t pixels, const WhitePoint &white);
+
+		static void transformSsse3(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors);
+		static void expandSsse3(uint8_t *data, size_t pixels, const WhitePoint &white);
+		static bool ssse3Available(void);
+
+		static void transformNeon(uint8_t *data, size_t pixels, unsigned int bytesPerPixel, const uint8_t *order, const uint8_t *factors);
+		static void expandNeon(uint8_t *data, size_t pixels, const WhitePoint &white);
+		static bool neonAvailable(void);
+
+		static WhitePoint makeWhitePoint(const uint8_t *color);
+
+		/**
+		 * Scales a single component; all kernels must match this exactly.
+		 */
+		static inline uint8_t scale(uint8_t value, uint8_t factor) {
+			return ((value * (factor + 1U)) >> 8);
+		}
+
+		/**
+		 * Turns a single RGB pixel into RGBW; all expand kernels must match
+		 * this exactly.
+		 */
+		static inline void extractWhite(const uint8_t *in, uint8_t *out, const WhitePoint &white) {
+			// read the pixel first, since out may overlap it
+			const unsigned int r = in[0], g = in[1], b = in[2];
+
+			// how much of the white LED's color each component could make up
+			unsigned int w = 255;
+			w = std::min(w, ((r * white.inverse[0]) >> 8));
+			w = std::min(w, ((g * white.inverse[1]) >> 8));
+			w = std::min(w, ((b * white.inverse[2]) >> 8));
+
+			// take that out of each component
+			const unsigned int takenR = scale(w, white.color[0]);
+			const unsigned int takenG = scale(w, white.color[1]);
+			const unsigned int takenB = scale(w, white.color[2]);
+
+			out[0] = (r > takenR) ? (r - takenR) : 0;
+			out[1] = (g > takenG) ? (g - takenG) : 0;
+			out[2] = (b > takenB) ? (b - takenB) : 0;
+			out[3] = w;
+		}
+
+		/**
+		 * Whether the factors leave all components unchanged.
+		 */
+		static inline bool isUnscaled(const uint8_t *factors, unsigned int bytesPerPixel) {
+			for(unsigned int c = 0; c < bytesPerPixel; c++) {
+				if(factors[c] != 255) {
+					return false;
+				}
+			}
+
+			return true;
+		}
+};
+
+#endif
@@ -0,0 +1,492 @@
+#include "Config.h"
+#include "../net/lichtenstein_proto.h"
+
+#include <glog/logging.h>
+#include <INIReader.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+
+/// maximum number of packets read with a single recvmmsg call
+static const long kMaxRxBatchSize = 64;
+/// maximum number of extra packet buffers to preallocate
+static const long kMaxRxBuffers = 1024;
+/// maximum number of receive shards
+static const long kMaxReceiveShards = 16;
+/// largest frame that may be reassembled, in bytes
+static const long kMaxFrameSize = (1024 * 1024);
+/// largest framebuffer memory that may be announced; this must fit in a long
+/// on 32-bit platforms, too
+static const long kMaxFramebufferSize = INT32_MAX;
+
+/// unknown keys at most this many edits away from a known key are misspelled
+static const size_t kMaxSuggestionDistance = 2;
+
+/**
+ * Parses the config file, then loads and validates all settings used by the
+ * client. Unknown keys are reported later, once plugins declared theirs.
+ */
+Config::Config(const std::string &path) {
+	this->parseError = ini_parse(path.c_str(), Config::iniHandler, this);
+
+	if(this->parseError != 0) {
+		return;
+	}
+
+	this->loadSettings();
+}
+
+/**
+ * Nothing to clean up.
+ */
+Config::~Config() {
+
+}
+
+/**
+ * Callback invoked by the INI parser for each key. Like INIReader, values for
+ * keys that occur multiple times are joined with newlines.
+ */
+int Config::iniHandler(void *ctx, const char *section, const char *name, const char *value) {
+	Config *config = static_cast<Config *>(ctx);
+
+	std::string &stored = config->values[Config::makeKey(section, name)];
+
+	if(!stored.empty()) {
+		stored += "\n";
+	}
+
+	stored += value;
+
+	return 1;
+}
+
+
+
+/**
+ * Reads all settings used by the client into their structs.
+ */
+void Config::loadSettings(void) {
+	// [client]
+	this->client.port = this->readInteger("client", "port", 7420, 1, 65535);
+
+	this->client.listen = this->readAddress("client", "listen", "0.0.0.0");
+	this->client.advertiseAddress = this->readAddress("client", "advertiseAddress", "0.0.0.0");
+	this->client.multicastGroup = this->readAddress("client", "multicastGroup", "239.42.0.69");
+
+	this->client.announcementIntervalInitial = this->readReal("client", "announcementIntervalInitial", 10, 0);
+	this->client.announcementInterval = this->readReal("client", "announcementInterval", 10, 0);
+
+	this->client.rxBatchSize = this->readInteger("client", "rxBatchSize", 16, 1, kMaxRxBatchSize);
+	this->client.rxBuffers = this->readInteger("client", "rxBuffers", 32, 0, kMaxRxBuffers);
+	this->client.receiveShards = this->readInteger("client", "receiveShards", 1, 1, kMaxReceiveShards);
+
+	this->client.separateControl = this->readBoolean("client", "separateControl", true);
+	this->client.dataThreadPriority = this->readInteger("client", "dataThreadPriority", 0, 0, 99);
+	this->client.controlThreadNice = this->readInteger("client", "controlThreadNice", 5, -20, 19);
+
+	this->client.pipeline = this->readBoolean("client", "pipeline", false);
+	this->client.pipelineDepth = this->readInteger("client", "pipelineDepth", 256, 2, 65536);
+	this->client.receiveCpus = this->readString("client", "receiveCpus", "");
+	this->client.decodeCpus = this->readString("client", "decodeCpus", "");
+	this->client.convertCpu = this->readInteger("client", "convertCpu", -1, -1, INT_MAX);
+
+	this->client.maxFrameSize = this->readInteger("client", "maxFrameSize", (1024 * 32), 1, kMaxFrameSize);
+	this->client.reassemblyTimeout = this->readInteger("client", "reassemblyTimeout", 50, 1, LONG_MAX);
+
+	this->client.cumulativeAck = this->readBoolean("client", "cumulativeAck", true);
+
+	this->client.clockSyncInterval = this->readReal("client", "clockSyncInterval", 2, 0);
+	this->client.clockSyncTestOffset = this->readInteger("client", "clockSyncTestOffset", 0, LONG_MIN, LONG_MAX);
+
+	this->client.crcEngine = this->readString("client", "crcEngine", "auto");
+
+	// [statusled]
+	this->statusLed.errorLed = this->readString("statusled", "errorled", "none");
+	this->statusLed.outputLed = this->readString("statusled", "outputled", "none");
+	this->statusLed.adoptionLed = this->readString("statusled", "adoptionled", "none");
+	this->statusLed.heartbeatLed = this->readString("statusled", "heartbeatled", "none");
+
+	// [discovery]
+	this->discovery.eepromBus = this->readInteger("discovery", "eeprom_bus", 0, 0, INT_MAX);
+	this->discovery.eepromAddresses = this->readString("discovery", "eeprom_addresses", "0x50,0x51,0x52,0x53");
+
+	this->discovery.autodetectOutput = this->readBoolean("discovery", "autodetect_output", true);
+	this->discovery.autodetectInput = this->readBoolean("discovery", "autodetect_input", false);
+
+	// [output]
+	this->output.outputWait = this->readInteger("output", "output_wait", 15, 0, LONG_MAX);
+
+	this->output.channels = this->readInteger("output", "channels", 1, 1, kLichtensteinMaxChannels);
+	this->output.fbSize = this->readInteger("output", "fbsize", 1048576, 0, kMaxFramebufferSize);
+
+	this->output.queueDepth = this->readInteger("output", "queue_depth", 2, 1, LONG_MAX);
+	this->output.admissionPolicy = this->readString("output", "admission_policy", "latest");
+
+	this->output.gamma = this->readReal("output", "gamma", 1, 0.1);
+	this->output.brightness = this->readInteger("output", "brightness", 255, 0, 255);
+	this->output.colorEngine = this->readString("output", "color_engine", "auto");
+	this->output.colorOrder = this->readString("output", "color_order", "RGB");
+	this->output.whiteTemperature = this->readReal("output", "white_temperature", 6500, 2000);
+
+	this->output.moduleDir = this->readString("output", "module_dir", "");
+	this->output.module = this->readString("output", "module", "");
+
+	// [input]
+	this->input.channels = this->readInteger("input", "channels", 0, 0, LONG_MAX);
+
+	this->input.moduleDir = this->readString("input", "module_dir", "");
+	this->input.module = this->readString("input", "module", "");
+
+	// [capture]
+	this->capture.file = this->readString("capture", "file", "");
+	this->capture.replayFile = this->readString("capture", "replayFile", "");
+	this->capture.replaySpeed = this->readReal("capture", "replaySpeed", 1, 0);
+
+	// [logging]
+	this->logging.file = this->readString("logging", "file", "");
+	this->logging.verbosity = this->readInteger("logging", "verbosity", 0, INT_MIN, INT_MAX);
+	this->logging.logToStderr = this->readBoolean("logging", "stderr", true);
+}
+
+/**
+ * Marks keys in the given section as known. Plugins read their settings by name
+ * long after the file was loaded, so they declare the keys when initialized.
+ */
+void Config::declareKeys(const std::string &section, const std::vector<std::string> &keys) const {
+	for(const std::string &key : keys) {
+		this->knownKeys.insert(Config::makeKey(section, key));
+	}
+}
+
+/**
+ * Logs a warning for each key in the file that isn't known. If the key is only
+ * a few typos away from a known key in the same section, that one is suggested.
+ *
+ * This should be called once all plugins have been initialized.
+ */
+void Config::reportUnknownKeys(void) const {
+	// sort the keys, so they're reported in a stable order
+	std::vector<std::string> keys;
+
+	for(auto it : this->values) {
+		if(this->knownKeys.count(it.first) == 0) {
+			keys.push_back(it.first);
+		}
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	for(const std::string &key : keys) {
+		const std::string section = key.substr(0, key.find('.'));
+
+		// find the closest known key in the same section
+		const std::string *suggestion = nullptr;
+		size_t bestDistance = (kMaxSuggestionDistance + 1);
+		bool sectionKnown = false;
+
+		for(const std::string &known : this->knownKeys) {
+			if(known.compare(0, (section.size() + 1), section + ".") != 0) {
+				continue;
+			}
+
+			sectionKnown = true;
+
+			const size_t distance = Config::editDistance(key, known);
+
+			if(distance < bestDistance) {
+				bestDistance = distance;
+				suggestion = &known;
+			}
+		}
+
+		if(suggestion) {
+			LOG(WARNING) << "Unknown config key " << key << "; did you mean "
+				<< *suggestion << "?";
+		} else if(sectionKnown) {
+			LOG(WARNING) << "Unknown config key " << key;
+		} else {
+			LOG(WARNING) << "Unknown config key " << key << " (section [" << section
+				<< "] isn't used by the client or any loaded plugin)";
+		}
+	}
+}
+
+
+
+/**
+ * Reads a string setting, and marks its key as known.
+ */
+std::string Config::readString(const char *section, const char *key, const char *fallback) {
+	this->knownKeys.insert(Config::makeKey(section, key));
+
+	return this->getString(section, key, fallback);
+}
+
+/**
+ * Reads an integer setting, and marks its key as known. If the value isn't an
+ * integer, or isn't in [min, max], a warning is logged and the fallback used.
+ */
+long Config::readInteger(const char *section, const char *key, long fallback, long min, long max) {
+	this->knownKeys.insert(Config::makeKey(section, key));
+
+	const std::string *value = this->find(section, key);
+	long out;
+
+	if(value == nullptr) {
+		return fallback;
+	}
+
+	if(!Config::parseInteger(*value, out)) {
+		LOG(WARNING) << "Config key " << section << "." << key << " must be an integer (got '"
+			<< *value << "'); using default " << fallback;
+		return fallback;
+	}
+
+	if(out < min || out > max) {
+		LOG(WARNING) << "Config key " << section << "." << key << " must be between " << min
+			<< " and " << max << " (got " << out << "); using default " << fallback;
+		return fallback;
+	}
+
+	return out;
+}
+
+/**
+ * Reads a real number setting, and marks its key as known. If the value isn't a
+ * number, or is less than min, a warning is logged and the fallback used.
+ */
+double Config::readReal(const char *section, const char *key, double fallback, double min) {
+	this->knownKeys.insert(Config::makeKey(section, key));
+
+	const std::string *value = this->find(section, key);
+	double out;
+
+	if(value == nullptr) {
+		return fallback;
+	}
+
+	if(!Config::parseReal(*value, out) || out < min) {
+		LOG(WARNING) << "Config key " << section << "." << key << " must be a number of at least "
+			<< min << " (got '" << *value << "'); using default " << fallback;
+		return fallback;
+	}
+
+	return out;
+}
+
+/**
+ * Reads a boolean setting, and marks its key as known. If the value isn't a
+ * boolean, a warning is logged and the fallback used.
+ */
+bool Config::readBoolean(const char *section, const char *key, bool fallback) {
+	this->knownKeys.insert(Config::makeKey(section, key));
+
+	const std::string *value = this->find(section, key);
+	bool out;
+
+	if(value == nullptr) {
+		return fallback;
+	}
+
+	if(!Config::parseBoolean(*value, out)) {
+		LOG(WARNING) << "Config key " << section << "." << key << " must be true or false (got '"
+			<< *value << "'); using default " << (fallback ? "true" : "false");
+		return fallback;
+	}
+
+	return out;
+}
+
+/**
+ * Reads an IPv4 address setting, and marks its key as known. An invalid address
+ * is fatal, since we can't guess at which address was meant.
+ */
+struct in_addr Config::readAddress(const char *section, const char *key, const char *fallback) {
+	int err;
+	struct in_addr addr;
+
+	std::string value = this->readString(section, key, fallback);
+
+	err = inet_pton(AF_INET, value.c_str(), &addr);
+	LOG_IF(FATAL, err != 1) << "Config key " << section << "." << key
+		<< " isn't a valid IPv4 address: '" << value << "'";
+
+	return addr;
+}
+
+
+
+/**
+ * Checks whether the given key is in the config file.
+ */
+bool Config::hasKey(const std::string &section, const std::string &key) const {
+	return (this->find(section, key) != nullptr);
+}
+
+/**
+ * Gets the value of a key as a string; if it isn't in the file, the fallback is
+ * returned.
+ */
+std::string Config::getString(const std::string &section, const std::string &key, const std::string &fallback) const {
+	const std::string *value = this->find(section, key);
+	return value ? *value : fallback;
+}
+
+/**
+ * Gets the value of a key as an integer (which may be specified in decimal, hex
+ * or octal.) If it isn't in the file, or isn't an integer, the fallback is
+ * returned.
+ */
+long Config::getInteger(const std::string &section, const std::string &key, long fallback) const {
+	const std::string *value = this->find(section, key);
+	long out;
+
+	if(value && Config::parseInteger(*value, out)) {
+		return out;
+	}
+
+	return fallback;
+}
+
+/**
+ * Gets the value of a key as a real number. If it isn't in the file, or isn't a
+ * number, the fallback is returned.
+ */
+double Config::getReal(const std::string &section, const std::string &key, double fallback) const {
+	const std::string *value = this->find(section, key);
+	double out;
+
+	if(value && Config::parseReal(*value, out)) {
+		return out;
+	}
+
+	return fallback;
+}
+
+/**
+ * Gets the value of a key as a boolean: true, yes, on and 1 are true; false, no,
+ * off and 0 are false. If it isn't in the file, or is anything else, the
+ * fallback is returned.
+ */
+bool Config::getBoolean(const std::string &section, const std::string &key, bool fallback) const {
+	const std::string *value = this->find(section, key);
+	bool out;
+
+	if(value && Config::parseBoolean(*value, out)) {
+		return out;
+	}
+
+	return fallback;
+}
+
+
+
+/**
+ * Finds the value of a key, or returns nullptr if it isn't in the file.
+ */
+const std::string *Config::find(const std::string &section, const std::string &key) const {
+	auto it = this->values.find(Config::makeKey(section, key));
+
+	if(it == this->values.end()) {
+		return nullptr;
+	}
+
+	return &it->second;
+}
+
+/**
+ * Builds the key under which a value is stored: the lowercase section and key
+ * names, separated by a period.
+ */
+std::string Config::makeKey(const std::string &section, const std::string &key) {
+	std::string out = section + "." + key;
+
+	std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c) {
+		return std::tolower(c);
+	});
+
+	return out;
+}
+
+/**
+ * Parses an integer in decimal, hex (0x prefix) or octal (0 prefix.)
+ */
+bool Config::parseInteger(const std::string &value, long &out) {
+	char *end;
+
+	errno = 0;
+	out = strtol(value.c_str(), &end, 0);
+
+	return (!value.empty() && *end == '\0' && errno == 0);
+}
+
+/**
+ * Parses a real number.
+ */
+bool Config::parseReal(const std::string &value, double &out) {
+	char *end;
+
+	errno = 0;
+	out = strtod(value.c_str(), &end);
+
+	return (!value.empty() && *end == '\0' && errno == 0);
+}
+
+/**
+ * Parses a boolean, in the same way INIReader does.
+ */
+bool Config::parseBoolean(const std::string &value, bool &out) {
+	std::string lower = value;
+
+	std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) {
+		return std::tolower(c);
+	});
+
+	if(lower == "true" || lower == "yes" || lower == "on" || lower == "1") {
+		out = true;
+		return true;
+	} else if(lower == "false" || lower == "no" || lower == "off" || lower == "0") {
+		out = false;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Calculates the Levenshtein distance between two strings, i.e. the number of
+ * single character insertions, deletions and substitutions to turn one into the
+ * other.
+ */
+size_t Config::editDistance(const std::string &a, const std::string &b) {
+	std::vector<size_t> row(b.size() + 1);
+
+	for(size_t j = 0; j <= b.size(); j++) {
+		row[j] = j;
+	}
+
+	for(size_t i = 1; i <= a.size(); i++) {
+		size_t diagonal = row[0];
+		row[0] = i;
+
+		for(size_t j = 1; j <= b.size(); j++) {
+			const size_t above = row[j];
+			const size_t cost = (a[i - 1] == b[j - 1]) ? 0 : 1;
+
+			row[j] = std::min({(above + 1), (row[j - 1] + 1), (diagonal + cost)});
+			diagonal = above;
+		}
+	}
+
+	return row[b.size()];
+}
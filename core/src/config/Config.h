@@ -0,0 +1,236 @@
+/**
+ * Typed, immutable snapshot of the client's configuration.
+ *
+ * The config file is read once at startup: all settings used by the client
+ * itself are validated and converted into the structs below, so reading them
+ * is a plain member access. Plugins declare the keys they read when they're
+ * initialized; once they have been, keys that neither the client nor any of
+ * the plugins know about are reported, since they're most likely misspelled.
+ *
+ * Plugins read the settings in their own sections with the getters that take a
+ * section and key name. These look up and convert the value on every call, so
+ * they should only be used while initializing. As with the INI reader used
+ * before, section and key names aren't case sensitive.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <cstddef>
+
+// for struct in_addr
+#include <netinet/in.h>
+
+class Config {
+	public:
+		Config(const std::string &path);
+		virtual ~Config();
+
+		/**
+		 * Returns 0 if the file was parsed successfully, -1 if it couldn't be
+		 * opened, or the first line on which a syntax error occurred.
+		 */
+		int getParseError(void) const {
+			return this->parseError;
+		}
+
+	// settings used by the client (defaults are applied when loading)
+	public:
+		// [client]
+		struct Client {
+			int port;
+
+			struct in_addr listen;
+			struct in_addr advertiseAddress;
+			struct in_addr multicastGroup;
+
+			// seconds
+			double announcementIntervalInitial;
+			double announcementInterval;
+
+			long rxBatchSize;
+			long rxBuffers;
+			long receiveShards;
+
+			// whether control packets get a socket and thread of their own
+			bool separateControl;
+			// SCHED_FIFO priority of the data shards' threads; 0 to leave as is
+			long dataThreadPriority;
+			// nice value of the control shard's thread, if it's separate
+			long controlThreadNice;
+
+			// whether packets pass through separate receive, decode and convert threads
+			bool pipeline;
+			// number of items each ring between the pipeline's stages holds
+			long pipelineDepth;
+			// CPUs to pin the receive and decode threads of each shard to
+			std::string receiveCpus;
+			std::string decodeCpus;
+			// CPU to pin the convert thread to; negative to leave it unpinned
+			long convertCpu;
+
+			long maxFrameSize;
+			// milliseconds
+			long reassemblyTimeout;
+
+			bool cumulativeAck;
+
+			// seconds; 0 disables clock synchronization
+			double clockSyncInterval;
+			// microseconds added to our clock, for testing only
+			long clockSyncTestOffset;
+
+			// CRC32 algorithm to use, or "auto" to pick the fastest
+			std::string crcEngine;
+		};
+
+		// [statusled]
+		struct StatusLed {
+			// paths to the LEDs' brightness files, or "none"
+			std::string errorLed;
+			std::string outputLed;
+			std::string adoptionLed;
+			std::string heartbeatLed;
+		};
+
+		// [discovery]
+		struct Discovery {
+			int eepromBus;
+			std::string eepromAddresses;
+
+			bool autodetectOutput;
+			bool autodetectInput;
+		};
+
+		// [output]
+		struct Output {
+			// milliseconds
+			long outputWait;
+
+			long channels;
+			long fbSize;
+
+			// frames per channel waiting for the plugin, and what to do beyond that
+			long queueDepth;
+			std::string admissionPolicy;
+
+			// color correction applied to all channels until the server changes it
+			double gamma;
+			long brightness;
+			// transform kernel used for color correction
+			std::string colorEngine;
+			// component order of each channel's strip
+			std::string colorOrder;
+			// color temperature of the white LEDs on RGBW strips, in kelvin
+			double whiteTemperature;
+
+			std::string moduleDir;
+			std::string module;
+		};
+
+		// [input]
+		struct Input {
+			long channels;
+
+			std::string moduleDir;
+			std::string module;
+		};
+
+		// [capture]
+		struct Capture {
+			// file to capture received packets to; empty disables capturing
+			std::string file;
+
+			// file to replay instead of receiving packets; empty to receive
+			std::string replayFile;
+			// multiple of the original timing; 0 replays as fast as possible
+			double replaySpeed;
+		};
+
+		// [logging]
+		struct Logging {
+			std::string file;
+			int verbosity;
+			bool logToStderr;
+		};
+
+		const Client &getClient(void) const {
+			return this->client;
+		}
+		const StatusLed &getStatusLed(void) const {
+			return this->statusLed;
+		}
+		const Discovery &getDiscovery(void) const {
+			return this->discovery;
+		}
+		const Output &getOutput(void) const {
+			return this->output;
+		}
+		const Input &getInput(void) const {
+			return this->input;
+		}
+		const Capture &getCapture(void) const {
+			return this->capture;
+		}
+		const Logging &getLogging(void) const {
+			return this->logging;
+		}
+
+	// settings by name (for plugins)
+	public:
+		virtual bool hasKey(const std::string &section, const std::string &key) const;
+
+		virtual std::string getString(const std::string &section, const std::string &key, const std::string &fallback) const;
+		virtual long getInteger(const std::string &section, const std::string &key, long fallback) const;
+		virtual double getReal(const std::string &section, const std::string &key, double fallback) const;
+		virtual bool getBoolean(const std::string &section, const std::string &key, bool fallback) const;
+
+	// checking for unknown keys (used by the client only)
+	public:
+		void declareKeys(const std::string &section, const std::vector<std::string> &keys) const;
+		void reportUnknownKeys(void) const;
+
+	private:
+		static int iniHandler(void *, const char *, const char *, const char *);
+
+		void loadSettings(void);
+
+		std::string readString(const char *, const char *, const char *);
+		long readInteger(const char *, const char *, long, long, long);
+		double readReal(const char *, const char *, double, double);
+		bool readBoolean(const char *, const char *, bool);
+		struct in_addr readAddress(const char *, const char *, const char *);
+
+		const std::string *find(const std::string &, const std::string &) const;
+
+		static std::string makeKey(const std::string &, const std::string &);
+
+		static bool parseInteger(const std::string &, long &);
+		static bool parseReal(const std::string &, double &);
+		static bool parseBoolean(const std::string &, bool &);
+
+		static size_t editDistance(const std::string &, const std::string &);
+
+	private:
+		// result of parsing the file
+		int parseError = 0;
+
+		// all values in the file, keyed by lowercase "section.key"
+		std::unordered_map<std::string, std::string> values;
+		// keys read while loading the settings above, or declared by plugins
+		mutable std::unordered_set<std::string> knownKeys;
+
+		Client client;
+		StatusLed statusLed;
+		Discovery discovery;
+		Output output;
+		Input input;
+		Capture capture;
+		Logging logging;
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "Crc32Engine.h"
+
+#include "../util/EngineSelector.h"
+
+#include <glog/logging.h>
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * All algorithms that may be selected, in order of increasing table size. The
+ * bitwise algorithm is the reference, and only used if explicitly requested.
+ */
+const Crc32Engine::Candidate Crc32Engine::kCandidates[] = {
+	{"bitwise", crc32_bitwise, 0, nullptr},
+	{"1byte", crc32_1byte, (1 * 256 * sizeof(uint32_t)), nullptr},
+	// tables are only used for the remainder that doesn't fill a block
+	{"clmul", crc32_clmul, (4 * 256 * sizeof(uint32_t)), crc32_clmul_available},
+	{"4bytes", crc32_4bytes, (4 * 256 * sizeof(uint32_t)), nullptr},
+	{"8bytes", crc32_8bytes, (8 * 256 * sizeof(uint32_t)), nullptr},
+	{"16bytes", crc32_16bytes, (16 * 256 * sizeof(uint32_t)), nullptr},
+};
+const size_t Crc32Engine::kNumCandidates = (sizeof(kCandidates) / sizeof(kCandidates[0]));
+
+const char *Crc32Engine::selectedName = "1byte";
+
+/// lengths the candidates are checked against; around each block size
+static const size_t kCheckLengths[] = {
+	0, 1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128,
+	129, 255, 256, 1023, 1472, 4099
+};
+/// values of the previous CRC the candidates are checked with
+static const uint32_t kCheckPrevious[] = {
+	0, 0xFFFFFFFF, 0x12345678
+};
+/// largest misalignment the candidates are checked with
+static const size_t kCheckMaxOffset = 7;
+
+/// size of the buffer used for benchmarking; about a full datagram
+static const size_t kBenchmarkLength = 1472;
+/// offset into that buffer, same as the checksummed part of a packet
+static const size_t kBenchmarkOffset = 12;
+/// number of rounds, and calls per round; the fastest round counts
+static const size_t kBenchmarkRounds = 5;
+static const size_t kBenchmarkCalls = 64;
+
+/**
+ * Selects the algorithm used by crc32_fast. If a specific algorithm is
+ * requested, it's used as long as the CPU supports it and it passes the cross
+ * check; otherwise (or for "auto"), the fastest one that passes is used.
+ *
+ * This must be called before any other threads that compute CRCs start.
+ *
+ * @param preferred Name of the algorithm to use, or "auto"
+ *
+ * @return 0 if the requested algorithm is used, -1 if another one was picked.
+ */
+int Crc32Engine::select(const std::string &preferred) {
+	EngineSelector<Candidate> selector("CRC32 algorithm",
+		("per " + std::to_string(kBenchmarkLength) + " bytes"),
+		Crc32Engine::crossCheck, Crc32Engine::benchmark);
+
+	// larger tables need to be clearly faster, and smaller ones needn't be
+	selector.setComparator(Crc32Engine::isBetter);
+
+	// the reference (first) is far too slow to ever win
+	const Candidate *best = selector.select(kCandidates, kNumCandidates, 1, preferred);
+
+	// the bitwise algorithm is the reference, so it can't fail the check
+	if(!best) {
+		LOG(ERROR) << "No CRC32 algorithm passed the cross check; using bitwise";
+
+		crc32_select(crc32_bitwise);
+		Crc32Engine::selectedName = "bitwise";
+
+		return -1;
+	}
+
+	crc32_select(best->function);
+	Crc32Engine::selectedName = best->name;
+
+	return (selector.gotPreferred() ? 0 : -1);
+}
+
+/**
+ * Decides whether a candidate is better than the best one so far. Between two
+ * with tables of different sizes, the one with larger tables must be faster by
+ * at least kTableSizePenalty percent.
+ */
+bool Crc32Engine::isBetter(const Candidate &candidate, uint64_t time, const Candidate &best, uint64_t bestTime) {
+	if(candidate.tableSize > best.tableSize) {
+		return ((time * (100 + kTableSizePenalty)) < (bestTime * 100));
+	} else if(candidate.tableSize < best.tableSize) {
+		return ((time * 100) < (bestTime * (100 + kTableSizePenalty)));
+	}
+
+	return (time < bestTime);
+}
+
+/**
+ * Checks that the candidate gets the same result as the bitwise algorithm for
+ * all combinations of the check lengths, alignments and previous CRCs, and
+ * that a CRC computed in two parts matches one computed over the whole buffer.
+ *
+ * @return Whether the candidate passed.
+ */
+bool Crc32Engine::crossCheck(const Candidate &candidate) {
+	std::vector<uint8_t> buffer(kCheckLengths[(sizeof(kCheckLengths) / sizeof(kCheckLengths[0])) - 1] + kCheckMaxOffset);
+	EngineBenchmark::fillTestData(buffer);
+
+	for(size_t length : kCheckLengths) {
+		for(size_t offset = 0; offset <= kCheckMaxOffset; offset++) {
+			const uint8_t *data = (buffer.data() + offset);
+
+			for(uint32_t previous : kCheckPrevious) {
+				const uint32_t expected = crc32_bitwise(data, length, previous);
+				const uint32_t actual = candidate.function(data, length, previous);
+
+				if(actual != expected) {
+					LOG(ERROR) << "CRC32 algorithm " << candidate.name << " is broken: got "
+						<< std::hex << actual << ", expected " << expected << std::dec
+						<< " for " << length << " bytes at offset " << offset;
+					return false;
+				}
+			}
+
+			// continuing from a previous CRC must give the same result
+			const size_t split = (length / 3);
+
+			const uint32_t whole = candidate.function(data, length, 0);
+			const uint32_t first = candidate.function(data, split, 0);
+			const uint32_t parts = candidate.function((data + split), (length - split), first);
+
+			if(whole != parts) {
+				LOG(ERROR) << "CRC32 algorithm " << candidate.name << " is broken: got "
+					<< std::hex << parts << " in two parts, but " << whole << std::dec
+					<< " for all " << length << " bytes at offset " << offset;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Times the candidate on a buffer the size of a full datagram.
+ *
+ * @return Nanoseconds per call, in the fastest round.
+ */
+uint64_t Crc32Engine::benchmark(const Candidate &candidate) {
+	std::vector<uint8_t> buffer(kBenchmarkOffset + kBenchmarkLength);
+	EngineBenchmark::fillTestData(buffer);
+
+	const uint8_t *data = (buffer.data() + kBenchmarkOffset);
+
+	// chain the results, so the calls can't be optimized away
+	volatile uint32_t sink;
+	uint32_t crc = candidate.function(data, kBenchmarkLength, 0);
+
+	const uint64_t time = EngineBenchmark::timeFastestRound(kBenchmarkRounds, kBenchmarkCalls, [&]() {
+		crc = candidate.function(data, kBenchmarkLength, crc);
+	});
+
+	sink = crc;
+	(void) sink;
+
+	return time;
+}
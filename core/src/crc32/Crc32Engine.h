@@ -0,0 +1,62 @@
+/**
+ * Picks the CRC32 algorithm used by crc32_fast when the client starts.
+ *
+ * The candidates are the table based slicing-by-1/4/8/16 variants, which need
+ * 1 to 16 KiB of lookup tables, and folding with carry-less multiplication if
+ * the CPU supports it. Each is first checked bit for bit against the bitwise
+ * implementation, over buffers of varying lengths and alignments, then timed
+ * on packet sized buffers; the fastest wins.
+ *
+ * A benchmark with the tables hot in the cache flatters the larger ones, which
+ * on nodes with a small data cache compete with the packets being checksummed.
+ * So a candidate only beats one with smaller tables if it's clearly faster,
+ * and the choice can be overridden in the config.
+ */
+#ifndef CRC32ENGINE_H
+#define CRC32ENGINE_H
+
+#include "crc32.h"
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+class Crc32Engine {
+	public:
+		static int select(const std::string &preferred);
+
+		static const char *getSelectedName(void) {
+			return Crc32Engine::selectedName;
+		}
+
+	private:
+		struct Candidate {
+			const char *name;
+			crc32_function_t function;
+
+			// bytes of lookup tables the algorithm uses
+			size_t tableSize;
+
+			// whether the CPU can run it; nullptr if it always can
+			bool (*isAvailable)(void);
+		};
+
+		static bool crossCheck(const Candidate &candidate);
+		static uint64_t benchmark(const Candidate &candidate);
+
+		static bool isBetter(const Candidate &candidate, uint64_t time, const Candidate &best, uint64_t bestTime);
+
+	private:
+		// candidates, in order of increasing table size
+		static const Candidate kCandidates[];
+		static const size_t kNumCandidates;
+
+		// a candidate must be this much faster (in percent) to beat a smaller one
+		static const unsigned int kTableSizePenalty = 10;
+
+		// name of the algorithm currently in use
+		static const char *selectedName;
+};
+
+#endif
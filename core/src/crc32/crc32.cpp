@@ -7,11 +7,15 @@
 //
 
 // this code has been modified from the original by removing all CRC routines
-// besides crc32_16bytes.
+// besides crc32_16bytes, then adding back slicing-by-4 and -8 (with unaligned
+// loads), a copying variant, and one using carry-less multiplication.
 
 
 #include "crc32.h"
 
+// memcpy
+#include <string.h>
+
 // define endianess and some integer data types
 #if defined(_MSC_VER) || defined(__MINGW32__)
   #define __LITTLE_ENDIAN 1234
@@ -82,6 +86,90 @@ uint32_t crc32_bitwise(const void* data, size_t length, uint32_t previousCrc32)
   return ~crc; // same as crc ^ 0xFFFFFFFF
 }
 
+/// compute CRC32 (Slicing-by-4 algorithm)
+uint32_t crc32_4bytes(const void* data, size_t length, uint32_t previousCrc32)
+{
+  uint32_t crc = ~previousCrc32; // same as previousCrc32 ^ 0xFFFFFFFF
+  const uint8_t* current = (const uint8_t*) data;
+
+  // process four bytes at once; memcpy compiles to a plain (or, where the CPU
+  // can't do unaligned loads, a split) load, as the data may be unaligned
+  while (length >= 4)
+  {
+    uint32_t one;
+    memcpy(&one, current, 4);
+    current += 4;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    one ^= swap(crc);
+    crc  = Crc32Lookup[0][ one        & 0xFF] ^
+           Crc32Lookup[1][(one >>  8) & 0xFF] ^
+           Crc32Lookup[2][(one >> 16) & 0xFF] ^
+           Crc32Lookup[3][(one >> 24) & 0xFF];
+#else
+    one ^= crc;
+    crc  = Crc32Lookup[0][(one >> 24) & 0xFF] ^
+           Crc32Lookup[1][(one >> 16) & 0xFF] ^
+           Crc32Lookup[2][(one >>  8) & 0xFF] ^
+           Crc32Lookup[3][ one        & 0xFF];
+#endif
+
+    length -= 4;
+  }
+
+  // remaining 1 to 3 bytes (standard algorithm)
+  while (length-- != 0)
+    crc = (crc >> 8) ^ Crc32Lookup[0][(crc & 0xFF) ^ *current++];
+
+  return ~crc; // same as crc ^ 0xFFFFFFFF
+}
+
+/// compute CRC32 (Slicing-by-8 algorithm)
+uint32_t crc32_8bytes(const void* data, size_t length, uint32_t previousCrc32)
+{
+  uint32_t crc = ~previousCrc32; // same as previousCrc32 ^ 0xFFFFFFFF
+  const uint8_t* current = (const uint8_t*) data;
+
+  // process eight bytes at once
+  while (length >= 8)
+  {
+    uint32_t one, two;
+    memcpy(&one, current, 4);
+    memcpy(&two, current + 4, 4);
+    current += 8;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    one ^= swap(crc);
+    crc  = Crc32Lookup[0][ two        & 0xFF] ^
+           Crc32Lookup[1][(two >>  8) & 0xFF] ^
+           Crc32Lookup[2][(two >> 16) & 0xFF] ^
+           Crc32Lookup[3][(two >> 24) & 0xFF] ^
+           Crc32Lookup[4][ one        & 0xFF] ^
+           Crc32Lookup[5][(one >>  8) & 0xFF] ^
+           Crc32Lookup[6][(one >> 16) & 0xFF] ^
+           Crc32Lookup[7][(one >> 24) & 0xFF];
+#else
+    one ^= crc;
+    crc  = Crc32Lookup[0][(two >> 24) & 0xFF] ^
+           Crc32Lookup[1][(two >> 16) & 0xFF] ^
+           Crc32Lookup[2][(two >>  8) & 0xFF] ^
+           Crc32Lookup[3][ two        & 0xFF] ^
+           Crc32Lookup[4][(one >> 24) & 0xFF] ^
+           Crc32Lookup[5][(one >> 16) & 0xFF] ^
+           Crc32Lookup[6][(one >>  8) & 0xFF] ^
+           Crc32Lookup[7][ one        & 0xFF];
+#endif
+
+    length -= 8;
+  }
+
+  // remaining 1 to 7 bytes (standard algorithm)
+  while (length-- != 0)
+    crc = (crc >> 8) ^ Crc32Lookup[0][(crc & 0xFF) ^ *current++];
+
+  return ~crc; // same as crc ^ 0xFFFFFFFF
+}
+
 /// compute CRC32 (Slicing-by-16 algorithm)
 uint32_t crc32_16bytes(const void* data, size_t length, uint32_t previousCrc32)
 {
@@ -241,11 +329,204 @@ uint32_t crc32_1byte(const void* data, size_t length, uint32_t previousCrc32)
 }
 
 
+/// copy data while computing its CRC32 (Slicing-by-4 algorithm)
+uint32_t crc32_copy(void* dest, const void* data, size_t length, uint32_t previousCrc32)
+{
+  // only the first four tables are used, so the working set stays at 4 KB; each
+  // word is loaded once, then both stored and folded into the CRC. memcpy is
+  // used for the loads and stores, since neither pointer needs to be aligned.
+  uint32_t crc = ~previousCrc32; // same as previousCrc32 ^ 0xFFFFFFFF
+  const uint8_t* current = (const uint8_t*) data;
+  uint8_t* output = (uint8_t*) dest;
+
+  while (length >= 4)
+  {
+    uint32_t one;
+    memcpy(&one, current, 4);
+    memcpy(output, &one, 4);
+
+    current += 4;
+    output  += 4;
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+    one ^= swap(crc);
+    crc  = Crc32Lookup[0][ one        & 0xFF] ^
+           Crc32Lookup[1][(one >>  8) & 0xFF] ^
+           Crc32Lookup[2][(one >> 16) & 0xFF] ^
+           Crc32Lookup[3][(one >> 24) & 0xFF];
+#else
+    one ^= crc;
+    crc  = Crc32Lookup[0][(one >> 24) & 0xFF] ^
+           Crc32Lookup[1][(one >> 16) & 0xFF] ^
+           Crc32Lookup[2][(one >>  8) & 0xFF] ^
+           Crc32Lookup[3][ one        & 0xFF];
+#endif
+
+    length -= 4;
+  }
+
+  // remaining 1 to 3 bytes (standard algorithm)
+  while (length-- != 0)
+  {
+    *output++ = *current;
+    crc = (crc >> 8) ^ Crc32Lookup[0][(crc & 0xFF) ^ *current++];
+  }
+
+  return ~crc; // same as crc ^ 0xFFFFFFFF
+}
+
+
+// //////////////////////////////////////////////////////////
+// carry-less multiplication (x86 PCLMULQDQ)
+//
+// The data is folded 64 (then 16) bytes at a time: multiplying a 128 bit block
+// by x^n mod P moves it n bits further along the message without changing its
+// remainder, so the block can be XORed into the data that follows. Whatever is
+// left over is run through the lookup tables. The constants are computed at
+// runtime, since the polynomial isn't the one most implementations use.
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  #define CRC32_HAS_CLMUL 1
+  #include <immintrin.h>
+#endif
+
+#ifdef CRC32_HAS_CLMUL
+/// x^n mod P, with P in its unreflected form
+static uint32_t xPowerModP(size_t n)
+{
+  // the polynomial's unreflected form is its reflected form, bit reversed
+  uint32_t poly = 0;
+  for (int i = 0; i < 32; i++)
+    if (Polynomial & (1u << i))
+      poly |= 1u << (31 - i);
+
+  uint32_t result = 1; // x^0
+  while (n-- != 0)
+    result = (result << 1) ^ ((result & 0x80000000) ? poly : 0);
+
+  return result;
+}
+
+/// folding constant for moving a 64 bit half-block n bits along
+static uint64_t foldConstant(size_t n)
+{
+  uint32_t value = xPowerModP(n);
+
+  uint32_t reflected = 0;
+  for (int i = 0; i < 32; i++)
+    if (value & (1u << i))
+      reflected |= 1u << (31 - i);
+
+  return ((uint64_t) reflected) << 1;
+}
+
+static uint64_t Fold512Low, Fold512High, Fold128Low, Fold128High;
+
+/// multiply both halves of the block by their constants, and combine them
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i block, __m128i constants)
+{
+  return _mm_xor_si128(_mm_clmulepi64_si128(block, constants, 0x00),
+                       _mm_clmulepi64_si128(block, constants, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_clmul_impl(const void* data, size_t length, uint32_t previousCrc32)
+{
+  const uint8_t* current = (const uint8_t*) data;
+
+  // folding only pays off for a few blocks
+  if (length < 64)
+    return crc32_4bytes(data, length, previousCrc32);
+
+  const __m128i fold512 = _mm_set_epi64x((long long) Fold512High, (long long) Fold512Low);
+  const __m128i fold128 = _mm_set_epi64x((long long) Fold128High, (long long) Fold128Low);
+
+  // the previous CRC is XORed into the first four bytes, as in the table version
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) current), _mm_cvtsi32_si128((int) ~previousCrc32));
+  __m128i x1 = _mm_loadu_si128((const __m128i*) (current + 16));
+  __m128i x2 = _mm_loadu_si128((const __m128i*) (current + 32));
+  __m128i x3 = _mm_loadu_si128((const __m128i*) (current + 48));
+
+  current += 64;
+  length  -= 64;
+
+  // fold four independent blocks at once, to hide the multiplier's latency
+  while (length >= 64)
+  {
+    x0 = _mm_xor_si128(fold(x0, fold512), _mm_loadu_si128((const __m128i*) current));
+    x1 = _mm_xor_si128(fold(x1, fold512), _mm_loadu_si128((const __m128i*) (current + 16)));
+    x2 = _mm_xor_si128(fold(x2, fold512), _mm_loadu_si128((const __m128i*) (current + 32)));
+    x3 = _mm_xor_si128(fold(x3, fold512), _mm_loadu_si128((const __m128i*) (current + 48)));
+
+    current += 64;
+    length  -= 64;
+  }
+
+  // then down to a single block
+  x0 = _mm_xor_si128(fold(x0, fold128), x1);
+  x0 = _mm_xor_si128(fold(x0, fold128), x2);
+  x0 = _mm_xor_si128(fold(x0, fold128), x3);
+
+  while (length >= 16)
+  {
+    x0 = _mm_xor_si128(fold(x0, fold128), _mm_loadu_si128((const __m128i*) current));
+
+    current += 16;
+    length  -= 16;
+  }
+
+  // the remainder of the folded block is the CRC so far (without the initial inversion)
+  uint8_t folded[16];
+  _mm_storeu_si128((__m128i*) folded, x0);
+
+  uint32_t crc = crc32_4bytes(folded, sizeof(folded), 0xFFFFFFFF);
+  return crc32_4bytes(current, length, crc);
+}
+#endif
+
+/// compute CRC32 (folding with carry-less multiplication)
+uint32_t crc32_clmul(const void* data, size_t length, uint32_t previousCrc32)
+{
+#ifdef CRC32_HAS_CLMUL
+  return crc32_clmul_impl(data, length, previousCrc32);
+#else
+  return crc32_4bytes(data, length, previousCrc32);
+#endif
+}
+
+/// whether the CPU supports carry-less multiplication; also sets up the constants
+bool crc32_clmul_available()
+{
+#ifdef CRC32_HAS_CLMUL
+  if (!__builtin_cpu_supports("pclmul") || !__builtin_cpu_supports("sse2"))
+    return false;
+
+  // the low half of a block comes first, so it has to move 64 bits further
+  Fold512Low  = foldConstant(4 * 128 + 32);
+  Fold512High = foldConstant(4 * 128 - 32);
+  Fold128Low  = foldConstant(128 + 32);
+  Fold128High = foldConstant(128 - 32);
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+/// algorithm used by crc32_fast
+static crc32_function_t fastFunction = crc32_1byte;
+
+/// select the algorithm used by crc32_fast
+void crc32_select(crc32_function_t function)
+{
+  fastFunction = function;
+}
+
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32) {
-	// return crc32_16bytes(data, length, previousCrc32);
-	// return crc32_16bytes_prefetch(data, length, previousCrc32);
-	return crc32_1byte(data, length, previousCrc32);
+	return fastFunction(data, length, previousCrc32);
 }
 
 
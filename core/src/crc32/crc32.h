@@ -11,9 +11,14 @@
 // size_t
 #include <stddef.h>
 
-// crc32_fast selects the fastest algorithm depending on flags (CRC32_USE_LOOKUP_...)
+/// signature shared by all CRC32 algorithms
+typedef uint32_t (*crc32_function_t)(const void* data, size_t length, uint32_t previousCrc32);
+
+// crc32_fast calls whichever algorithm was selected with crc32_select (see Crc32Engine)
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// select the algorithm used by crc32_fast; crc32_1byte until this is called
+void crc32_select(crc32_function_t function);
 
 /// compute CRC32 (bitwise algorithm)
 uint32_t crc32_bitwise (const void* data, size_t length, uint32_t previousCrc32 = 0);
@@ -21,7 +26,19 @@ uint32_t crc32_bitwise (const void* data, size_t length, uint32_t previousCrc32
 // single byte algorithm
 uint32_t crc32_1byte(const void* data, size_t length, uint32_t previousCrc32);
 
+/// compute CRC32 (Slicing-by-4 algorithm)
+uint32_t crc32_4bytes (const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// compute CRC32 (Slicing-by-8 algorithm)
+uint32_t crc32_8bytes (const void* data, size_t length, uint32_t previousCrc32 = 0);
 /// compute CRC32 (Slicing-by-16 algorithm)
 uint32_t crc32_16bytes (const void* data, size_t length, uint32_t previousCrc32 = 0);
 /// compute CRC32 (Slicing-by-16 algorithm, prefetch upcoming data blocks)
 uint32_t crc32_16bytes_prefetch(const void* data, size_t length, uint32_t previousCrc32 = 0, size_t prefetchAhead = 256);
+
+/// compute CRC32 (folding with carry-less multiplication; only if crc32_clmul_available)
+uint32_t crc32_clmul(const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// whether the CPU supports carry-less multiplication
+bool crc32_clmul_available();
+
+/// copy data while computing its CRC32 (Slicing-by-4 algorithm), so it's only read once
+uint32_t crc32_copy(void* dest, const void* data, size_t length, uint32_t previousCrc32 = 0);
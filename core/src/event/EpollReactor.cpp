@@ -0,0 +1,284 @@
+// epoll and eventfd are linux only; SelectReactor is used everywhere else
+#ifdef __linux__
+
+#include "EpollReactor.h"
+
+#include <glog/logging.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+ * Creates the epoll instance, as well as the eventfd used to post commands,
+ * and registers the latter with the former.
+ */
+EpollReactor::EpollReactor() {
+	int err;
+
+	this->pendingCommands = 0;
+
+	// create the epoll instance
+	this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	PCHECK(this->epollFd != -1) << "Couldn't create epoll instance";
+
+	// create the eventfd for commands
+	this->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	PCHECK(this->eventFd != -1) << "Couldn't create eventfd";
+
+	// add it; a null pointer in the event data identifies it
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+
+	err = epoll_ctl(this->epollFd, EPOLL_CTL_ADD, this->eventFd, &event);
+	PCHECK(err == 0) << "Couldn't add eventfd to epoll";
+}
+
+/**
+ * Closes the epoll instance and eventfd, and releases all descriptor info.
+ */
+EpollReactor::~EpollReactor() {
+	int err;
+
+	// release descriptor info
+	for(auto it : this->descriptors) {
+		delete it.second;
+	}
+
+	for(Descriptor *desc : this->removedDescriptors) {
+		delete desc;
+	}
+
+	// close descriptors
+	err = close(this->eventFd);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close eventfd";
+
+	err = close(this->epollFd);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close epoll instance";
+}
+
+
+
+/**
+ * Registers a descriptor.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int EpollReactor::addDescriptor(int fd, uint32_t events, descriptor_handler_t handler) {
+	int err;
+
+	// make sure it's not already registered
+	if(this->descriptors.count(fd) != 0) {
+		LOG(ERROR) << "Descriptor " << fd << " is already registered";
+		return EEXIST;
+	}
+
+	// allocate the info struct
+	Descriptor *desc = new Descriptor;
+
+	desc->fd = fd;
+	desc->handler = handler;
+	desc->removed = false;
+
+	// add it to epoll
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+
+	event.events = EpollReactor::toEpollEvents(events);
+	event.data.ptr = desc;
+
+	err = epoll_ctl(this->epollFd, EPOLL_CTL_ADD, fd, &event);
+
+	if(err != 0) {
+		err = errno;
+		PLOG(ERROR) << "Couldn't add descriptor " << fd;
+
+		delete desc;
+		return err;
+	}
+
+	this->descriptors[fd] = desc;
+	return 0;
+}
+
+/**
+ * Removes a descriptor. Its info is only released once any dispatch that is in
+ * progress completes, since an event for it may still be pending.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int EpollReactor::removeDescriptor(int fd) {
+	int err;
+
+	// find the descriptor
+	auto it = this->descriptors.find(fd);
+
+	if(it == this->descriptors.end()) {
+		LOG(ERROR) << "Descriptor " << fd << " isn't registered";
+		return ENOENT;
+	}
+
+	Descriptor *desc = it->second;
+	this->descriptors.erase(it);
+
+	// remove from epoll
+	err = epoll_ctl(this->epollFd, EPOLL_CTL_DEL, fd, nullptr);
+
+	if(err != 0) {
+		err = errno;
+		PLOG(ERROR) << "Couldn't remove descriptor " << fd;
+	}
+
+	desc->removed = true;
+	this->removedDescriptors.push_back(desc);
+
+	return err;
+}
+
+
+
+/**
+ * Posts a command. This sets the command's bit in the pending mask; only if no
+ * commands were pending before (meaning the worker either already handled all
+ * of them or is about to) is the eventfd written to wake up the worker.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int EpollReactor::postCommand(unsigned int command) {
+	int err;
+
+	CHECK(command < Reactor::kMaxCommands) << "Invalid command " << command;
+
+	// set the bit for the command
+	const uint32_t bit = (1U << command);
+	uint32_t previous = this->pendingCommands.fetch_or(bit);
+
+	// if other commands were pending, the worker will be woken up anyways
+	if(previous != 0) {
+		return 0;
+	}
+
+	// otherwise, write the eventfd
+	uint64_t value = 1;
+	err = write(this->eventFd, &value, sizeof(value));
+
+	if(err == -1) {
+		err = errno;
+		PLOG(ERROR) << "Couldn't write eventfd";
+
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Handles all pending commands in ascending order.
+ */
+void EpollReactor::dispatchCommands(void) {
+	int err;
+
+	// reset the eventfd counter
+	uint64_t value;
+	err = read(this->eventFd, &value, sizeof(value));
+
+	if(err == -1 && errno != EAGAIN) {
+		PLOG(WARNING) << "Couldn't read eventfd";
+	}
+
+	// grab all pending commands
+	uint32_t commands = this->pendingCommands.exchange(0);
+
+	// invoke the handler for each of them
+	while(commands != 0) {
+		unsigned int command = __builtin_ctz(commands);
+		commands &= ~(1U << command);
+
+		if(this->commandHandler) {
+			this->commandHandler(command);
+		} else {
+			LOG(WARNING) << "Received command " << command << " without handler";
+		}
+	}
+}
+
+
+
+/**
+ * Waits for events, then dispatches them.
+ */
+int EpollReactor::runOnce(int timeoutMs) {
+	struct epoll_event events[kMaxEvents];
+	int num;
+
+	// wait for events
+	num = epoll_wait(this->epollFd, events, kMaxEvents, timeoutMs);
+
+	if(num == -1) {
+		int err = errno;
+		PLOG_IF(WARNING, err != EINTR) << "epoll_wait failed";
+
+		return -err;
+	}
+
+	// dispatch each event
+	for(int i = 0; i < num; i++) {
+		Descriptor *desc = static_cast<Descriptor *>(events[i].data.ptr);
+
+		// commands?
+		if(desc == nullptr) {
+			this->dispatchCommands();
+		}
+		// otherwise, invoke the descriptor's handler (unless it went away)
+		else if(!desc->removed) {
+			desc->handler(EpollReactor::fromEpollEvents(events[i].events));
+		}
+	}
+
+	// release info for descriptors removed in the meantime
+	for(Descriptor *desc : this->removedDescriptors) {
+		delete desc;
+	}
+
+	this->removedDescriptors.clear();
+
+	return num;
+}
+
+
+
+/**
+ * Converts reactor events to epoll events.
+ */
+uint32_t EpollReactor::toEpollEvents(uint32_t events) {
+	uint32_t out = 0;
+
+	if(events & kEventReadable) out |= EPOLLIN;
+	if(events & kEventWritable) out |= EPOLLOUT;
+	if(events & kEventPriority) out |= EPOLLPRI;
+	if(events & kEventError) out |= EPOLLERR;
+
+	return out;
+}
+
+/**
+ * Converts epoll events to reactor events.
+ */
+uint32_t EpollReactor::fromEpollEvents(uint32_t events) {
+	uint32_t out = 0;
+
+	if(events & EPOLLIN) out |= kEventReadable;
+	if(events & EPOLLOUT) out |= kEventWritable;
+	if(events & EPOLLPRI) out |= kEventPriority;
+	if(events & (EPOLLERR | EPOLLHUP)) out |= kEventError;
+
+	return out;
+}
+
+#endif
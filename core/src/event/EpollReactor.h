@@ -0,0 +1,68 @@
+/**
+ * Implements the reactor interface on top of epoll, with commands delivered
+ * through an eventfd. This is only available on Linux.
+ */
+#ifndef EPOLLREACTOR_H
+#define EPOLLREACTOR_H
+
+#ifdef __linux__
+
+#include <Reactor.h>
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <cstdint>
+
+class EpollReactor : public Reactor {
+	public:
+		EpollReactor();
+		virtual ~EpollReactor();
+
+	public:
+		virtual int addDescriptor(int fd, uint32_t events, descriptor_handler_t handler);
+		virtual int removeDescriptor(int fd);
+
+		virtual void setCommandHandler(command_handler_t handler) {
+			this->commandHandler = handler;
+		}
+		virtual int postCommand(unsigned int command);
+
+		virtual int runOnce(int timeoutMs = -1);
+
+	private:
+		struct Descriptor {
+			int fd;
+			descriptor_handler_t handler;
+			bool removed;
+		};
+
+	private:
+		void dispatchCommands(void);
+
+		static uint32_t toEpollEvents(uint32_t events);
+		static uint32_t fromEpollEvents(uint32_t events);
+
+	private:
+		// maximum number of events handled per call to epoll_wait
+		static const int kMaxEvents = 16;
+
+	private:
+		// epoll instance and eventfd used to wake it for commands
+		int epollFd = -1;
+		int eventFd = -1;
+
+		// bitmask of commands posted, but not yet handled
+		std::atomic<uint32_t> pendingCommands;
+		command_handler_t commandHandler;
+
+		// registered descriptors, keyed by descriptor
+		std::map<int, Descriptor *> descriptors;
+		// descriptors removed while dispatching; freed after dispatch finishes
+		std::vector<Descriptor *> removedDescriptors;
+};
+
+#endif
+
+#endif
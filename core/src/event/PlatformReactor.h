@@ -0,0 +1,18 @@
+/**
+ * Picks the reactor implementation for the platform the client is built for:
+ * epoll on Linux, and select() everywhere else.
+ */
+#ifndef PLATFORMREACTOR_H
+#define PLATFORMREACTOR_H
+
+#ifdef __linux__
+	#include "EpollReactor.h"
+
+	typedef EpollReactor PlatformReactor;
+#else
+	#include "SelectReactor.h"
+
+	typedef SelectReactor PlatformReactor;
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+#include "SelectReactor.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+/**
+ * Creates the pipe used to post commands. Both ends are non-blocking, so
+ * posting never blocks, and the worker can drain it without knowing how many
+ * bytes are waiting.
+ */
+SelectReactor::SelectReactor() {
+	int err;
+	int fds[2];
+
+	this->pendingCommands = 0;
+
+	// create the pipe
+	err = pipe(fds);
+	PCHECK(err == 0) << "Couldn't create command pipe";
+
+	for(int fd : fds) {
+		err = fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL) | O_NONBLOCK));
+		PCHECK(err != -1) << "Couldn't make command pipe non-blocking";
+
+		err = fcntl(fd, F_SETFD, FD_CLOEXEC);
+		PCHECK(err != -1) << "Couldn't set close-on-exec on command pipe";
+	}
+
+	this->pipeRead = fds[0];
+	this->pipeWrite = fds[1];
+
+	CHECK(this->pipeRead < FD_SETSIZE) << "Command pipe descriptor too large for select";
+}
+
+/**
+ * Closes the pipe, and releases all descriptor info.
+ */
+SelectReactor::~SelectReactor() {
+	int err;
+
+	// release descriptor info
+	for(auto it : this->descriptors) {
+		delete it.second;
+	}
+
+	for(Descriptor *desc : this->removedDescriptors) {
+		delete desc;
+	}
+
+	// close descriptors
+	err = close(this->pipeRead);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close command pipe";
+
+	err = close(this->pipeWrite);
+	PLOG_IF(ERROR, err != 0) << "Couldn't close command pipe";
+}
+
+
+
+/**
+ * Registers a descriptor. select() doesn't report errors separately; they show
+ * up as the descriptor becoming readable or writable.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int SelectReactor::addDescriptor(int fd, uint32_t events, descriptor_handler_t handler) {
+	// make sure it's not already registered, and fits into an fd_set
+	if(this->descriptors.count(fd) != 0) {
+		LOG(ERROR) << "Descriptor " << fd << " is already registered";
+		return EEXIST;
+	}
+
+	if(fd < 0 || fd >= FD_SETSIZE) {
+		LOG(ERROR) << "Descriptor " << fd << " can't be used with select";
+		return EINVAL;
+	}
+
+	// allocate the info struct
+	Descriptor *desc = new Descriptor;
+
+	desc->fd = fd;
+	desc->events = events;
+	desc->handler = handler;
+	desc->removed = false;
+
+	this->descriptors[fd] = desc;
+	return 0;
+}
+
+/**
+ * Removes a descriptor. Its info is only released once any dispatch that is in
+ * progress completes, since an event for it may still be pending.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int SelectReactor::removeDescriptor(int fd) {
+	// find the descriptor
+	auto it = this->descriptors.find(fd);
+
+	if(it == this->descriptors.end()) {
+		LOG(ERROR) << "Descriptor " << fd << " isn't registered";
+		return ENOENT;
+	}
+
+	Descriptor *desc = it->second;
+	this->descriptors.erase(it);
+
+	desc->removed = true;
+	this->removedDescriptors.push_back(desc);
+
+	return 0;
+}
+
+
+
+/**
+ * Posts a command. This sets the command's bit in the pending mask; only if no
+ * commands were pending before (meaning the worker either already handled all
+ * of them or is about to) is a byte written to the pipe to wake up the worker.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int SelectReactor::postCommand(unsigned int command) {
+	int err;
+
+	CHECK(command < Reactor::kMaxCommands) << "Invalid command " << command;
+
+	// set the bit for the command
+	const uint32_t bit = (1U << command);
+	uint32_t previous = this->pendingCommands.fetch_or(bit);
+
+	// if other commands were pending, the worker will be woken up anyways
+	if(previous != 0) {
+		return 0;
+	}
+
+	// otherwise, write the pipe; if it's full, the worker is awake already
+	uint8_t value = 1;
+	err = write(this->pipeWrite, &value, sizeof(value));
+
+	if(err == -1 && errno != EAGAIN) {
+		err = errno;
+		PLOG(ERROR) << "Couldn't write command pipe";
+
+		return err;
+	}
+
+	return 0;
+}
+
+/**
+ * Handles all pending commands in ascending order.
+ */
+void SelectReactor::dispatchCommands(void) {
+	int err;
+
+	// drain the pipe
+	uint8_t buffer[64];
+
+	do {
+		err = read(this->pipeRead, buffer, sizeof(buffer));
+	} while(err > 0);
+
+	if(err == -1 && errno != EAGAIN) {
+		PLOG(WARNING) << "Couldn't read command pipe";
+	}
+
+	// grab all pending commands
+	uint32_t commands = this->pendingCommands.exchange(0);
+
+	// invoke the handler for each of them
+	while(commands != 0) {
+		unsigned int command = __builtin_ctz(commands);
+		commands &= ~(1U << command);
+
+		if(this->commandHandler) {
+			this->commandHandler(command);
+		} else {
+			LOG(WARNING) << "Received command " << command << " without handler";
+		}
+	}
+}
+
+
+
+/**
+ * Waits for events, then dispatches them.
+ */
+int SelectReactor::runOnce(int timeoutMs) {
+	int num;
+	fd_set readFds, writeFds, exceptFds;
+
+	// build the descriptor sets; the pipe is always waited on
+	FD_ZERO(&readFds);
+	FD_ZERO(&writeFds);
+	FD_ZERO(&exceptFds);
+
+	FD_SET(this->pipeRead, &readFds);
+	int maxFd = this->pipeRead;
+
+	for(auto it : this->descriptors) {
+		const Descriptor *desc = it.second;
+
+		if(desc->events & kEventReadable) FD_SET(desc->fd, &readFds);
+		if(desc->events & kEventWritable) FD_SET(desc->fd, &writeFds);
+		if(desc->events & kEventPriority) FD_SET(desc->fd, &exceptFds);
+
+		maxFd = std::max(maxFd, desc->fd);
+	}
+
+	// wait for events
+	struct timeval timeout;
+	timeout.tv_sec = (timeoutMs / 1000);
+	timeout.tv_usec = ((timeoutMs % 1000) * 1000);
+
+	num = select((maxFd + 1), &readFds, &writeFds, &exceptFds,
+				 (timeoutMs < 0) ? nullptr : &timeout);
+
+	if(num == -1) {
+		int err = errno;
+		PLOG_IF(WARNING, err != EINTR) << "select failed";
+
+		return -err;
+	}
+
+	// collect the descriptors that are ready before invoking any handlers, as
+	// they may add or remove descriptors
+	std::vector<std::pair<Descriptor *, uint32_t>> ready;
+
+	for(auto it : this->descriptors) {
+		Descriptor *desc = it.second;
+		uint32_t events = 0;
+
+		if(FD_ISSET(desc->fd, &readFds)) events |= kEventReadable;
+		if(FD_ISSET(desc->fd, &writeFds)) events |= kEventWritable;
+		if(FD_ISSET(desc->fd, &exceptFds)) events |= kEventPriority;
+
+		if(events) {
+			ready.push_back(std::make_pair(desc, events));
+		}
+	}
+
+	// commands?
+	if(FD_ISSET(this->pipeRead, &readFds)) {
+		this->dispatchCommands();
+	}
+
+	// then, invoke the handlers of the ready descriptors (unless they went away)
+	for(auto &event : ready) {
+		if(!event.first->removed) {
+			event.first->handler(event.second);
+		}
+	}
+
+	// release info for descriptors removed in the meantime
+	for(Descriptor *desc : this->removedDescriptors) {
+		delete desc;
+	}
+
+	this->removedDescriptors.clear();
+
+	return num;
+}
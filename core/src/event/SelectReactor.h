@@ -0,0 +1,59 @@
+/**
+ * Implements the reactor interface on top of select(), with commands delivered
+ * through a pipe. This works on any POSIX system; on Linux, EpollReactor is
+ * used instead.
+ */
+#ifndef SELECTREACTOR_H
+#define SELECTREACTOR_H
+
+#include <Reactor.h>
+
+#include <atomic>
+#include <map>
+#include <vector>
+
+#include <cstdint>
+
+class SelectReactor : public Reactor {
+	public:
+		SelectReactor();
+		virtual ~SelectReactor();
+
+	public:
+		virtual int addDescriptor(int fd, uint32_t events, descriptor_handler_t handler);
+		virtual int removeDescriptor(int fd);
+
+		virtual void setCommandHandler(command_handler_t handler) {
+			this->commandHandler = handler;
+		}
+		virtual int postCommand(unsigned int command);
+
+		virtual int runOnce(int timeoutMs = -1);
+
+	private:
+		struct Descriptor {
+			int fd;
+			uint32_t events;
+			descriptor_handler_t handler;
+			bool removed;
+		};
+
+	private:
+		void dispatchCommands(void);
+
+	private:
+		// read and write end of the pipe used to wake select for commands
+		int pipeRead = -1;
+		int pipeWrite = -1;
+
+		// bitmask of commands posted, but not yet handled
+		std::atomic<uint32_t> pendingCommands;
+		command_handler_t commandHandler;
+
+		// registered descriptors, keyed by descriptor
+		std::map<int, Descriptor *> descriptors;
+		// descriptors removed while dispatching; freed after dispatch finishes
+		std::vector<Descriptor *> removedDescriptors;
+};
+
+#endif
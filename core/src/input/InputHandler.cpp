@@ -3,13 +3,13 @@
 #include "../plugin/LichtensteinPluginHandler.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include "../config/Config.h"
 
 /**
  * Attempts to load the input plugin specified in the configuration file, then
  * sets up the input event handler.
  */
-InputHandler::InputHandler(INIReader *_config, LichtensteinPluginHandler *_pluginHandler) :
+InputHandler::InputHandler(const Config *_config, LichtensteinPluginHandler *_pluginHandler) :
  	config(_config), pluginHandler(_pluginHandler) {
 	this->loadPlugin();
 }
@@ -28,7 +28,7 @@ InputHandler::~InputHandler() {
  */
 void InputHandler::loadPlugin(void) {
 	// get the factory function
-	std::string uuid = this->config->Get("input", "module", "");
+	std::string uuid = this->config->getInput().module;
 
 	try {
 		this->plugin = this->pluginHandler->initInputPluginByUUID(uuid);
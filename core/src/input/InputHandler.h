@@ -1,20 +1,20 @@
 #ifndef INPUTHANDLER_H
 #define INPUTHANDLER_H
 
-class INIReader;
+class Config;
 class InputPlugin;
 class LichtensteinPluginHandler;
 
 class InputHandler {
 	public:
-		InputHandler(INIReader *config, LichtensteinPluginHandler *pluginHandler);
+		InputHandler(const Config *config, LichtensteinPluginHandler *pluginHandler);
 		~InputHandler();
 
 	private:
 		void loadPlugin(void);
 
 	private:
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
 
 		LichtensteinPluginHandler *pluginHandler = nullptr;
 		InputPlugin *plugin = nullptr;
@@ -2,14 +2,17 @@
  * Main entrypoint for Lichtenstein client
  */
 #include "status/StatusHandler.h"
+#include "metrics/MetricsRegistry.h"
 #include "plugin/LichtensteinPluginHandler.h"
 #include "net/ProtocolHandler.h"
+#include "crc32/Crc32Engine.h"
 #include "input/InputHandler.h"
 #include "output/OutputHandler.h"
+#include "color/ColorCorrection.h"
 
 #include <glog/logging.h>
 #include <cxxopts.hpp>
-#include "INIReader.h"
+#include "config/Config.h"
 
 #include <iostream>
 #include <atomic>
@@ -32,9 +35,13 @@ OutputHandler *output = nullptr;
 
 // when set to false, the client terminates
 atomic_bool keepRunning;
+// when set, the metrics are logged (then it's cleared)
+atomic_bool logMetrics;
+// thread that waits for signals
+pthread_t mainThread;
 
 // parsing of the config file
-INIReader *configReader = nullptr;
+Config *config = nullptr;
 void parseConfigFile(string path);
 
 /**
@@ -48,6 +55,14 @@ void signalHandler(int sig) {
 	keepRunning = false;
 }
 
+/**
+ * Handler for SIGUSR1: requests that the main thread logs all metrics,
+ * including the latency histograms.
+ */
+void metricsSignalHandler(int) {
+	logMetrics = true;
+}
+
 /**
  * Main function
  */
@@ -83,6 +98,7 @@ int main(int argc, const char *argv[]) {
 
 	// set up a signal handler for termination so we can close down cleanly
 	keepRunning = true;
+	mainThread = pthread_self();
 
 	struct sigaction sigIntHandler;
 
@@ -92,35 +108,72 @@ int main(int argc, const char *argv[]) {
 
 	sigaction(SIGINT, &sigIntHandler, nullptr);
 
-	// set up the status handler
-	StatusHandler::initSingleton(configReader);
+	// dump metrics on SIGUSR1
+	logMetrics = false;
+
+	struct sigaction sigUsr1Handler;
+
+	sigUsr1Handler.sa_handler = metricsSignalHandler;
+	sigemptyset(&sigUsr1Handler.sa_mask);
+	sigUsr1Handler.sa_flags = 0;
+
+	sigaction(SIGUSR1, &sigUsr1Handler, nullptr);
+
+	// pick the CRC algorithm before anything can receive packets
+	Crc32Engine::select(config->getClient().crcEngine);
+
+	// set up the metrics registry, then the status handler
+	MetricsRegistry::initSingleton();
+	StatusHandler::initSingleton(config);
 
 	// set up the various components
-	plugin = new LichtensteinPluginHandler(configReader);
-	proto = new ProtocolHandler(configReader);
+	plugin = new LichtensteinPluginHandler(config);
+	// plugins have declared the keys they read now
+	config->reportUnknownKeys();
+
+	proto = new ProtocolHandler(config);
 
 	// set up the input and output handlers
-	input = new InputHandler(configReader, plugin);
-	output = new OutputHandler(configReader, plugin);
+	input = new InputHandler(config, plugin);
+	output = new OutputHandler(config, plugin);
 
 
 
 	// set up plugin handler
 	plugin->protocolHandler = proto;
+	plugin->outputHandler = output;
 
 	// set up frame received callback: queue into plugin handler
 	proto->frameReceiveCallback = [](OutputFrame *frame) {
 		return output->queueOutputFrame(frame);
 	};
+	// set up color correction callback: change the output handler's correction
+	proto->colorCorrectionCallback = [](const std::vector<size_t> &channels, const ColorCorrection::Parameters &params) {
+		return output->getColorCorrection()->setParameters(channels, params);
+	};
 	// set up channel output callback: call into plugin handler
 	proto->channelOutputCallback = [](std::bitset<32> &channels) {
 		return output->outputChannels(channels);
 	};
+	// once a replay is done, log the metrics and exit
+	proto->replayDoneCallback = []() {
+		logMetrics = true;
+		keepRunning = false;
+
+		pthread_kill(mainThread, SIGUSR1);
+	};
+
+	// start replaying packets, if configured
+	proto->startReplay();
 
 
 	// wait for a signal
 	while(keepRunning) {
 		pause();
+
+		if(logMetrics.exchange(false)) {
+			MetricsRegistry::sharedInstance()->logMetrics();
+		}
 	}
 
 	// before anything, stop accepting protocol requests
@@ -135,12 +188,16 @@ int main(int argc, const char *argv[]) {
 	// lastly, clean up plugins
 	delete plugin;
 
-	// clean up status handler
+	// clean up status handler and metrics
 	StatusHandler::deallocSingleton();
+	MetricsRegistry::deallocSingleton();
+
+	delete config;
 }
 
 /**
- * Opens the config file for reading and parses it.
+ * Opens the config file for reading and parses it. Any problems with the values
+ * in it are logged while it's loaded.
  */
 void parseConfigFile(string path) {
 	int err;
@@ -148,9 +205,9 @@ void parseConfigFile(string path) {
 	LOG(INFO) << "Reading configuration from " << path;
 
 	// attempt to open the config file
-	configReader = new INIReader(path);
+	config = new Config(path);
 
-	err = configReader->ParseError();
+	err = config->getParseError();
 
 	if(err == -1) {
 		LOG(FATAL) << "Couldn't open config file at " << path;
@@ -159,7 +216,7 @@ void parseConfigFile(string path) {
 	}
 
 	// set up the logging parameters
-	int verbosity = configReader->GetInteger("logging", "verbosity", 0);
+	int verbosity = config->getLogging().verbosity;
 
 	if(verbosity < 0) {
 		FLAGS_v = abs(verbosity);
@@ -174,5 +231,5 @@ void parseConfigFile(string path) {
 		FLAGS_minloglevel = min(verbosity, 2);
 	}
 
-	FLAGS_logtostderr = configReader->GetBoolean("logging", "stderr", true);
+	FLAGS_logtostderr = config->getLogging().logToStderr;
 }
@@ -0,0 +1,426 @@
+#include "MetricsRegistry.h"
+
+#include <glog/logging.h>
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <unistd.h>
+
+#ifdef __linux__
+	#include <sys/sysinfo.h>
+	#include <linux/ethtool.h>
+	#include <linux/sockios.h>
+#endif
+
+// static instance (singleton)
+static MetricsRegistry *sharedRegistry = nullptr;
+
+
+
+/**
+ * Registers the system-wide metrics, and takes an initial snapshot so that the
+ * CPU usage reported by the next one covers a known interval.
+ */
+MetricsRegistry::MetricsRegistry() {
+	this->totalMemory = this->registerGauge("system.memTotal");
+	this->freeMemory = this->registerGauge("system.memFree");
+	this->cpuUsage = this->registerGauge("process.cpuPercent");
+	this->linkSpeed = this->registerGauge("link.speed");
+	this->linkDuplex = this->registerGauge("link.duplex");
+
+#ifdef __linux__
+	this->ethtoolSocket = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_IP);
+	PLOG_IF(ERROR, this->ethtoolSocket < 0) << "Couldn't create ethtool socket";
+#endif
+
+	this->takeSnapshot();
+}
+
+/**
+ * Deletes all metrics. Nobody may hold on to them beyond this point.
+ */
+MetricsRegistry::~MetricsRegistry() {
+	for(auto &pair : this->counters) {
+		delete pair.second;
+	}
+	for(auto &pair : this->gauges) {
+		delete pair.second;
+	}
+	for(auto &pair : this->histograms) {
+		delete pair.second;
+	}
+
+	if(this->ethtoolSocket >= 0) {
+		int err = close(this->ethtoolSocket);
+		PLOG_IF(ERROR, err != 0) << "Couldn't close ethtool socket";
+	}
+}
+
+
+
+/**
+ * Allocates the registry. This should be called from the main routine before
+ * any of the components that register metrics are created.
+ */
+void MetricsRegistry::initSingleton(void) {
+	sharedRegistry = new MetricsRegistry();
+}
+
+/**
+ * Deallocates the registry.
+ */
+void MetricsRegistry::deallocSingleton(void) {
+	CHECK(sharedRegistry != nullptr) << "Call to deallocSingleton but singleton is null";
+
+	delete sharedRegistry;
+	sharedRegistry = nullptr;
+}
+
+/**
+ * Returns the previously allocated registry.
+ */
+MetricsRegistry *MetricsRegistry::sharedInstance(void) {
+	return sharedRegistry;
+}
+
+
+
+/**
+ * Returns the counter with the given name, creating it if it doesn't exist
+ * yet. The counter lives as long as the registry.
+ */
+MetricsCounter *MetricsRegistry::registerCounter(const std::string &name) {
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	auto it = this->counters.find(name);
+
+	if(it != this->counters.end()) {
+		return it->second;
+	}
+
+	LOG_IF(WARNING, this->gauges.count(name) != 0) << "Counter " << name
+		<< " has the same name as a gauge";
+
+	MetricsCounter *counter = new MetricsCounter();
+	this->counters[name] = counter;
+
+	return counter;
+}
+
+/**
+ * Returns the gauge with the given name, creating it if it doesn't exist yet.
+ * The gauge lives as long as the registry.
+ */
+MetricsGauge *MetricsRegistry::registerGauge(const std::string &name) {
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	auto it = this->gauges.find(name);
+
+	if(it != this->gauges.end()) {
+		return it->second;
+	}
+
+	LOG_IF(WARNING, this->counters.count(name) != 0) << "Gauge " << name
+		<< " has the same name as a counter";
+
+	MetricsGauge *gauge = new MetricsGauge();
+	this->gauges[name] = gauge;
+
+	return gauge;
+}
+
+/**
+ * Returns the histogram with the given name, creating it if it doesn't exist
+ * yet. The histogram lives as long as the registry.
+ */
+MetricsHistogram *MetricsRegistry::registerHistogram(const std::string &name) {
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	auto it = this->histograms.find(name);
+
+	if(it != this->histograms.end()) {
+		return it->second;
+	}
+
+	MetricsHistogram *histogram = new MetricsHistogram();
+	this->histograms[name] = histogram;
+
+	return histogram;
+}
+
+
+
+/**
+ * Updates the system-wide metrics, then copies the current value of every
+ * metric into its snapshot.
+ */
+void MetricsRegistry::takeSnapshot(void) {
+	this->updateSystemMetrics();
+
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	for(auto &pair : this->counters) {
+		pair.second->snapshot.store(pair.second->read(), std::memory_order_relaxed);
+	}
+	for(auto &pair : this->gauges) {
+		pair.second->snapshot.store(pair.second->read(), std::memory_order_relaxed);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &this->snapshotTime);
+}
+
+/**
+ * Invokes the callback with the name and snapshot value of each metric, in
+ * order of name.
+ *
+ * @note The registry is locked while the callback runs, so it may not register
+ * any metrics.
+ */
+void MetricsRegistry::forEachSnapshot(std::function<void(const std::string &, int64_t)> callback) {
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	for(auto &pair : this->counters) {
+		callback(pair.first, static_cast<int64_t>(pair.second->getSnapshot()));
+	}
+	for(auto &pair : this->gauges) {
+		callback(pair.first, pair.second->getSnapshot());
+	}
+}
+
+/**
+ * Logs the last snapshot of all counters and gauges, and a summary of each
+ * histogram as it is right now.
+ */
+void MetricsRegistry::logMetrics(void) {
+	this->forEachSnapshot([](const std::string &name, int64_t value) {
+		LOG(INFO) << name << " = " << value;
+	});
+
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	for(auto &pair : this->histograms) {
+		MetricsHistogram::Summary summary;
+		pair.second->summarize(summary);
+
+		LOG(INFO) << pair.first << ": " << summary.count << " samples, p50 <= "
+			<< summary.p50 << " ns, p90 <= " << summary.p90 << " ns, p99 <= "
+			<< summary.p99 << " ns, p99.9 <= " << summary.p999 << " ns, max <= "
+			<< summary.max << " ns";
+	}
+}
+
+
+
+/**
+ * Reads the system-wide figures: memory, CPU usage and link settings.
+ */
+void MetricsRegistry::updateSystemMetrics(void) {
+	// get total and free memory (this only works on linux)
+#ifdef __linux__
+	struct sysinfo info;
+
+	if(sysinfo(&info) == 0) {
+		const uint64_t unitSz = info.mem_unit;
+
+		this->totalMemory->set(info.totalram * unitSz);
+		this->freeMemory->set(info.freeram * unitSz);
+	} else {
+		PLOG(ERROR) << "sysinfo failed";
+	}
+#endif
+
+	this->updateCpuUsage();
+	this->updateLinkSettings();
+}
+
+/**
+ * Calculates the CPU time (user and system) used by the process since the last
+ * snapshot, as a percentage of the wall time that passed. Like top, this is
+ * relative to a single core, so it may exceed 100 on multicore systems.
+ */
+void MetricsRegistry::updateCpuUsage(void) {
+	int err;
+
+	struct rusage usage;
+	err = getrusage(RUSAGE_SELF, &usage);
+
+	if(err != 0) {
+		PLOG(ERROR) << "getrusage failed";
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	const uint64_t cpuUs = (static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL) +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+	const uint64_t wallUs = (static_cast<uint64_t>(now.tv_sec) * 1000000ULL) + (now.tv_nsec / 1000);
+
+	// the first call only establishes the baseline
+	if(this->lastWallTimeUs != 0 && wallUs > this->lastWallTimeUs) {
+		const uint64_t percent = ((cpuUs - this->lastCpuTimeUs) * 100) / (wallUs - this->lastWallTimeUs);
+		this->cpuUsage->set(percent);
+	}
+
+	this->lastCpuTimeUs = cpuUs;
+	this->lastWallTimeUs = wallUs;
+}
+
+/**
+ * Queries the speed (in Mbps) and duplex mode of the primary interface, which
+ * is the first non-loopback interface with an IPv4 address, with the ethtool
+ * ioctl. Interfaces that don't support it, such as wireless ones, report a
+ * speed of zero.
+ */
+void MetricsRegistry::updateLinkSettings(void) {
+#ifdef __linux__
+	int err;
+
+	if(this->ethtoolSocket < 0) {
+		return;
+	}
+
+	// find the interface
+	struct ifaddrs *interfaces;
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+
+	err = getifaddrs(&interfaces);
+
+	if(err != 0) {
+		PLOG(ERROR) << "Couldn't get address info";
+		return;
+	}
+
+	for(struct ifaddrs *it = interfaces; it != nullptr; it = it->ifa_next) {
+		if((it->ifa_flags & IFF_LOOPBACK) || it->ifa_addr == nullptr) {
+			continue;
+		} else if(it->ifa_addr->sa_family != AF_INET) {
+			continue;
+		}
+
+		strncpy(ifr.ifr_name, it->ifa_name, (IFNAMSIZ - 1));
+		break;
+	}
+
+	freeifaddrs(interfaces);
+
+	if(ifr.ifr_name[0] == '\0') {
+		this->linkSpeed->set(0);
+		return;
+	}
+
+	// get its settings
+	struct ethtool_cmd cmd;
+	memset(&cmd, 0, sizeof(cmd));
+
+	cmd.cmd = ETHTOOL_GSET;
+	ifr.ifr_data = reinterpret_cast<char *>(&cmd);
+
+	err = ioctl(this->ethtoolSocket, SIOCETHTOOL, &ifr);
+
+	if(err != 0) {
+		VLOG_IF(1, errno != EOPNOTSUPP) << "ethtool request for " << ifr.ifr_name
+			<< " failed: " << strerror(errno);
+
+		this->linkSpeed->set(0);
+		return;
+	}
+
+	const uint32_t speed = ethtool_cmd_speed(&cmd);
+
+	this->linkSpeed->set((speed == static_cast<uint32_t>(SPEED_UNKNOWN)) ? 0 : speed);
+	this->linkDuplex->set((cmd.duplex == DUPLEX_FULL) ? 1 : 0);
+#endif
+}
+
+
+
+/**
+ * Clears all buckets.
+ */
+MetricsHistogram::MetricsHistogram() {
+	this->reset();
+}
+
+/**
+ * Clears all buckets. Values recorded concurrently may or may not be lost.
+ */
+void MetricsHistogram::reset(void) {
+	for(size_t i = 0; i < kNumBuckets; i++) {
+		this->buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Returns the largest value that falls into the given bucket.
+ */
+uint64_t MetricsHistogram::getBucketUpperBound(size_t bucket) {
+	if(bucket < (2 * kSubBuckets)) {
+		return bucket;
+	}
+
+	const unsigned int shift = ((bucket / kSubBuckets) - 1);
+	const uint64_t mantissa = ((bucket % kSubBuckets) + kSubBuckets);
+
+	return (((mantissa + 1) << shift) - 1);
+}
+
+/**
+ * Calculates the number of samples and the percentiles of the histogram. As
+ * the buckets are read one by one, samples recorded in the meantime may or may
+ * not be included.
+ */
+void MetricsHistogram::summarize(Summary &out) const {
+	uint32_t counts[kNumBuckets];
+	uint64_t total = 0;
+
+	memset(&out, 0, sizeof(out));
+
+	for(size_t i = 0; i < kNumBuckets; i++) {
+		counts[i] = this->buckets[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+
+	out.count = total;
+
+	if(total == 0) {
+		return;
+	}
+
+	// walk the buckets until each percentile's rank is reached
+	const uint64_t ranks[4] = {
+		((total * 50) + 99) / 100,
+		((total * 90) + 99) / 100,
+		((total * 99) + 99) / 100,
+		((total * 999) + 999) / 1000
+	};
+	uint64_t *values[4] = {&out.p50, &out.p90, &out.p99, &out.p999};
+
+	uint64_t seen = 0;
+	size_t next = 0;
+
+	for(size_t i = 0; i < kNumBuckets; i++) {
+		if(counts[i] == 0) {
+			continue;
+		}
+
+		seen += counts[i];
+
+		while(next < 4 && seen >= ranks[next]) {
+			*values[next++] = getBucketUpperBound(i);
+		}
+
+		out.max = getBucketUpperBound(i);
+	}
+}
@@ -0,0 +1,282 @@
+/**
+ * Central registry of the client's counters, gauges and histograms.
+ *
+ * Counters are bumped on hot paths (every received packet, for example) by any
+ * number of threads, so each one is split into cache line sized cells: every
+ * thread adds to its own cell with a relaxed atomic, and nothing is shared
+ * until the cells are summed. Should there be more threads than cells, some of
+ * them share a cell; that costs some contention, but no counts.
+ *
+ * Readers don't look at the live values: the registry periodically takes a
+ * snapshot of all metrics, along with a few system-wide figures (memory, CPU
+ * usage of the process and the link's speed) which would otherwise need
+ * syscalls whenever they're requested.
+ *
+ * Latency histograms are log-linear: below 16 every value has its own bucket,
+ * and above that, each power of two is split into 8 buckets, so any recorded
+ * value is within 12.5% of its bucket's bounds. They cover up to about a
+ * minute (in nanoseconds) in a fixed 272 32-bit counters (1088 bytes), and
+ * recording a value is a count leading zeros, a shift and a relaxed increment;
+ * they can thus stay enabled on the slowest of nodes.
+ *
+ * Plugins register their metrics through the plugin handler; incrementing
+ * them is inline, and thus doesn't need to call into the client.
+ */
+#ifndef METRICSREGISTRY_H
+#define METRICSREGISTRY_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <map>
+#include <functional>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+class MetricsRegistry;
+
+/**
+ * A monotonically increasing counter.
+ */
+class MetricsCounter {
+	friend class MetricsRegistry;
+
+	public:
+		void add(uint64_t value) {
+			this->cells[getCellIndex()].value.fetch_add(value, std::memory_order_relaxed);
+		}
+		void increment(void) {
+			this->add(1);
+		}
+
+		/**
+		 * Sums up the current value of all cells.
+		 */
+		uint64_t read(void) const {
+			uint64_t total = 0;
+
+			for(size_t i = 0; i < kNumCells; i++) {
+				total += this->cells[i].value.load(std::memory_order_relaxed);
+			}
+
+			return total;
+		}
+
+		/**
+		 * Returns the value at the time of the last snapshot.
+		 */
+		uint64_t getSnapshot(void) const {
+			return this->snapshot.load(std::memory_order_relaxed);
+		}
+
+	private:
+		MetricsCounter() = default;
+
+		/**
+		 * Returns the index of the calling thread's cell. Indices are handed
+		 * out round robin the first time a thread touches any counter.
+		 */
+		static size_t getCellIndex(void) {
+			static std::atomic_size_t nextIndex(0);
+			static thread_local size_t index = (nextIndex.fetch_add(1, std::memory_order_relaxed) % kNumCells);
+
+			return index;
+		}
+
+	private:
+		static const size_t kNumCells = 16;
+
+		struct alignas(64) Cell {
+			std::atomic<uint64_t> value{0};
+		};
+
+		Cell cells[kNumCells];
+
+		std::atomic<uint64_t> snapshot{0};
+};
+
+/**
+ * A value that's set rather than accumulated, such as a state.
+ */
+class MetricsGauge {
+	friend class MetricsRegistry;
+
+	public:
+		void set(int64_t value) {
+			this->value.store(value, std::memory_order_relaxed);
+		}
+		void add(int64_t delta) {
+			this->value.fetch_add(delta, std::memory_order_relaxed);
+		}
+
+		int64_t read(void) const {
+			return this->value.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Returns the value at the time of the last snapshot.
+		 */
+		int64_t getSnapshot(void) const {
+			return this->snapshot.load(std::memory_order_relaxed);
+		}
+
+	private:
+		MetricsGauge() = default;
+
+	private:
+		alignas(64) std::atomic<int64_t> value{0};
+
+		std::atomic<int64_t> snapshot{0};
+};
+
+/**
+ * A histogram of durations, in nanoseconds.
+ */
+class MetricsHistogram {
+	friend class MetricsRegistry;
+
+	public:
+		void record(uint64_t ns) {
+			this->buckets[getBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/**
+		 * Records the time between the two timestamps, which must be from the
+		 * same clock. Intervals that are negative (because the clock was
+		 * stepped) are ignored.
+		 */
+		void recordInterval(const struct timespec &start, const struct timespec &end) {
+			const int64_t ns = ((static_cast<int64_t>(end.tv_sec) - start.tv_sec) * 1000000000LL) +
+				(static_cast<int64_t>(end.tv_nsec) - start.tv_nsec);
+
+			if(ns >= 0) {
+				this->record(static_cast<uint64_t>(ns));
+			}
+		}
+
+	public:
+		struct Summary {
+			uint64_t count;
+
+			// upper bounds of the buckets the percentiles fall into
+			uint64_t p50;
+			uint64_t p90;
+			uint64_t p99;
+			uint64_t p999;
+			uint64_t max;
+		};
+
+		void summarize(Summary &out) const;
+		void reset(void);
+
+	private:
+		MetricsHistogram();
+
+		/**
+		 * Returns the bucket a value falls into.
+		 */
+		static size_t getBucket(uint64_t value) {
+			if(value < (2 * kSubBuckets)) {
+				return static_cast<size_t>(value);
+			}
+
+			const unsigned int msb = (63 - __builtin_clzll(value));
+			const unsigned int shift = (msb - kSubBucketBits);
+
+			const size_t bucket = ((shift + 1) * kSubBuckets) + ((value >> shift) - kSubBuckets);
+			return (bucket < kNumBuckets) ? bucket : (kNumBuckets - 1);
+		}
+
+		static uint64_t getBucketUpperBound(size_t bucket);
+
+	private:
+		// number of linear sub-buckets per power of two (as bits)
+		static const unsigned int kSubBucketBits = 3;
+		static const size_t kSubBuckets = (1 << kSubBucketBits);
+
+		// values of 2^kMaxBits and above end up in the last bucket
+		static const unsigned int kMaxBits = 36;
+		static const size_t kNumBuckets = ((kMaxBits - kSubBucketBits + 1) * kSubBuckets);
+
+		std::atomic<uint32_t> buckets[kNumBuckets];
+};
+
+class MetricsRegistry {
+	friend int main(int, const char *[]);
+
+	public:
+		static MetricsRegistry *sharedInstance(void);
+
+		virtual MetricsCounter *registerCounter(const std::string &name);
+		virtual MetricsGauge *registerGauge(const std::string &name);
+		virtual MetricsHistogram *registerHistogram(const std::string &name);
+
+		void takeSnapshot(void);
+		void forEachSnapshot(std::function<void(const std::string &, int64_t)> callback);
+
+		void logMetrics(void);
+
+		/**
+		 * Returns the time at which the last snapshot was taken.
+		 */
+		struct timespec getSnapshotTime(void) const {
+			std::lock_guard<std::mutex> lck(this->lock);
+			return this->snapshotTime;
+		}
+
+	// well known metrics (filled in when taking a snapshot)
+	public:
+		MetricsGauge *getTotalMemory(void) const {
+			return this->totalMemory;
+		}
+		MetricsGauge *getFreeMemory(void) const {
+			return this->freeMemory;
+		}
+		MetricsGauge *getCpuUsage(void) const {
+			return this->cpuUsage;
+		}
+		MetricsGauge *getLinkSpeed(void) const {
+			return this->linkSpeed;
+		}
+		MetricsGauge *getLinkDuplex(void) const {
+			return this->linkDuplex;
+		}
+
+	private:
+		MetricsRegistry();
+		virtual ~MetricsRegistry();
+
+		static void initSingleton(void);
+		static void deallocSingleton(void);
+
+		void updateSystemMetrics(void);
+		void updateCpuUsage(void);
+		void updateLinkSettings(void);
+
+	private:
+		// protects the maps and snapshot time
+		mutable std::mutex lock;
+
+		std::map<std::string, MetricsCounter *> counters;
+		std::map<std::string, MetricsGauge *> gauges;
+		std::map<std::string, MetricsHistogram *> histograms;
+
+		struct timespec snapshotTime = {0, 0};
+
+		// CPU time used by the process, and when, as of the last snapshot
+		uint64_t lastCpuTimeUs = 0;
+		uint64_t lastWallTimeUs = 0;
+
+		// socket for ethtool requests
+		int ethtoolSocket = -1;
+
+		MetricsGauge *totalMemory = nullptr;
+		MetricsGauge *freeMemory = nullptr;
+		MetricsGauge *cpuUsage = nullptr;
+		MetricsGauge *linkSpeed = nullptr;
+		MetricsGauge *linkDuplex = nullptr;
+};
+
+#endif
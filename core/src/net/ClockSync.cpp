@@ -0,0 +1,145 @@
+#include "ClockSync.h"
+
+#include <glog/logging.h>
+
+/**
+ * Sets up the clock sync state, without any samples.
+ *
+ * @param testOffsetNs Amount of time added to the system clock; only useful to
+ * test synchronization.
+ */
+ClockSync::ClockSync(int64_t testOffsetNs) : testOffset(testOffsetNs) {
+	LOG_IF(WARNING, this->testOffset != 0) << "Offsetting local clock by "
+		<< this->testOffset << " ns for testing";
+}
+
+/**
+ * Returns the current time according to our clock.
+ */
+uint64_t ClockSync::getLocalTime(void) const {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return this->getLocalTime(now);
+}
+
+/**
+ * Converts a time from CLOCK_REALTIME (such as a kernel receive timestamp) to
+ * our clock.
+ */
+uint64_t ClockSync::getLocalTime(const struct timespec &realtime) const {
+	const int64_t ns = (static_cast<int64_t>(realtime.tv_sec) * 1000000000LL) + realtime.tv_nsec;
+	return static_cast<uint64_t>(ns + this->testOffset);
+}
+
+/**
+ * Discards all samples, e.g. when adopted by a different server.
+ */
+void ClockSync::reset(void) {
+	this->pendingOriginate = 0;
+
+	this->nextSample = 0;
+	this->numSamples = 0;
+
+	this->offset = 0;
+	this->delay = 0;
+}
+
+
+
+/**
+ * Notes the start of a new exchange.
+ *
+ * @return The originate time to put in the request.
+ */
+uint64_t ClockSync::startRequest(void) {
+	this->pendingOriginate = this->getLocalTime();
+	return this->pendingOriginate;
+}
+
+/**
+ * Adds the sample obtained from a response, and updates the offset estimate.
+ * Responses that don't belong to the outstanding request (duplicated or late
+ * ones) are ignored, as are those with impossible timestamps.
+ *
+ * @return Whether the sample was used.
+ */
+bool ClockSync::addSample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+	// only accept a response to the outstanding request, and only once
+	if(this->pendingOriginate == 0 || t1 != this->pendingOriginate) {
+		VLOG(1) << "Ignoring time sync response for originate time " << t1;
+		return false;
+	}
+
+	this->pendingOriginate = 0;
+
+	// time can't go backwards on either end
+	if(t4 < t1 || t3 < t2) {
+		LOG(WARNING) << "Ignoring time sync response with invalid timestamps";
+		return false;
+	}
+
+	const int64_t sampleDelay = static_cast<int64_t>(t4 - t1) - static_cast<int64_t>(t3 - t2);
+
+	if(sampleDelay < 0) {
+		LOG(WARNING) << "Ignoring time sync response with negative delay " << sampleDelay;
+		return false;
+	}
+
+	// get the offset; the halves are taken separately to avoid overflow
+	const int64_t a = static_cast<int64_t>(t2 - t1);
+	const int64_t b = static_cast<int64_t>(t3 - t4);
+
+	Sample &sample = this->samples[this->nextSample];
+
+	sample.offset = (a / 2) + (b / 2);
+	sample.delay = sampleDelay;
+
+	this->nextSample = (this->nextSample + 1) % kNumSamples;
+
+	if(this->numSamples < kNumSamples) {
+		this->numSamples++;
+	}
+
+	// use the sample with the lowest delay
+	const Sample *best = &this->samples[0];
+
+	for(size_t i = 1; i < this->numSamples; i++) {
+		if(this->samples[i].delay < best->delay) {
+			best = &this->samples[i];
+		}
+	}
+
+	this->offset = best->offset;
+	this->delay = best->delay;
+
+	VLOG(2) << "Clock sync sample: offset " << sample.offset << " ns, delay "
+		<< sample.delay << " ns; using offset " << this->offset << " ns (delay "
+		<< this->delay << " ns)";
+
+	return true;
+}
+
+
+
+/**
+ * Converts a time according to the server's clock to CLOCK_REALTIME.
+ *
+ * @return Whether the time could be converted, i.e. whether we're synchronized.
+ */
+bool ClockSync::toRealtime(uint64_t serverTime, struct timespec &out) const {
+	if(!this->isSynchronized()) {
+		return false;
+	}
+
+	const int64_t realtime = static_cast<int64_t>(serverTime) - this->offset - this->testOffset;
+
+	if(realtime < 0) {
+		return false;
+	}
+
+	out.tv_sec = (realtime / 1000000000LL);
+	out.tv_nsec = (realtime % 1000000000LL);
+
+	return true;
+}
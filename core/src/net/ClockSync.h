@@ -0,0 +1,82 @@
+/**
+ * Estimates the offset between the server's clock and ours with the exchange
+ * of four timestamps used by NTP: we note when we send a request (t1), the
+ * server when it receives it (t2) and sends its response (t3), and we note when
+ * we receive that response (t4). Assuming the network delay is the same in both
+ * directions:
+ *
+ *   offset = ((t2 - t1) + (t3 - t4)) / 2
+ *   delay  = (t4 - t1) - (t3 - t2)
+ *
+ * A sample that got held up somewhere has a large delay, and its offset may be
+ * off by up to half of that; so, like NTP's clock filter, we use the offset of
+ * the sample with the lowest delay out of the last few.
+ *
+ * All times are in nanoseconds since the epoch. Our clock is CLOCK_REALTIME,
+ * plus an (optional) artificial offset, which allows testing synchronization
+ * against a server running on the same machine.
+ *
+ * @note This class is not thread safe; it's only used by the sync shard.
+ */
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+class ClockSync {
+	public:
+		ClockSync(int64_t testOffsetNs = 0);
+
+		uint64_t getLocalTime(void) const;
+		uint64_t getLocalTime(const struct timespec &realtime) const;
+
+		void reset(void);
+
+		uint64_t startRequest(void);
+		bool addSample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4);
+
+		bool toRealtime(uint64_t serverTime, struct timespec &out) const;
+
+	public:
+		bool isSynchronized(void) const {
+			return (this->numSamples != 0);
+		}
+
+		/// offset of the server's clock relative to ours
+		int64_t getOffset(void) const {
+			return this->offset;
+		}
+		/// round trip delay of the sample the offset was taken from
+		int64_t getDelay(void) const {
+			return this->delay;
+		}
+
+	private:
+		// number of samples to pick the best one from
+		static const size_t kNumSamples = 8;
+
+		struct Sample {
+			int64_t offset;
+			int64_t delay;
+		};
+
+	private:
+		// artificial offset added to CLOCK_REALTIME
+		int64_t testOffset = 0;
+
+		// originate time of the outstanding request, if any
+		uint64_t pendingOriginate = 0;
+
+		// the last few samples (a ring buffer)
+		Sample samples[kNumSamples];
+		size_t nextSample = 0;
+		size_t numSamples = 0;
+
+		// current estimate
+		int64_t offset = 0;
+		int64_t delay = 0;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#include "FrameReassembler.h"
+
+#include "ProtocolHandler.h"
+
+#include "../output/OutputFrame.h"
+#include "../util/BufferPool.h"
+
+#include <glog/logging.h>
+#include "../config/Config.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+/**
+ * Allocates an assembly slot for each output channel, as well as the buffers
+ * into which frames are assembled: two per channel, so that a completed frame
+ * can wait for output while the next one is being assembled.
+ *
+ * When receiving is sharded, each shard only sees the channels steered to it,
+ * so buffers are only preallocated for its share of the channels.
+ */
+FrameReassembler::FrameReassembler(const Config *config, ProtocolHandler *_handler, size_t numShards) : handler(_handler) {
+	// get the number of channels
+	const long channels = config->getOutput().channels;
+
+	this->slots.resize(channels);
+
+	// get the maximum frame size
+	const long maxFrameSize = config->getClient().maxFrameSize;
+
+	const size_t channelsPerShard = ((channels + numShards - 1) / numShards);
+	this->pool = new BufferPool(maxFrameSize, (channelsPerShard * 2));
+
+	// get the timeout
+	this->timeoutMs = static_cast<unsigned int>(config->getClient().reassemblyTimeout);
+
+	LOG(INFO) << "Reassembling frames of up to " << maxFrameSize << " bytes for "
+		<< channels << " channels (timeout " << this->timeoutMs << " ms)";
+}
+
+/**
+ * Abandons any frames still being assembled and releases the buffer pool.
+ */
+FrameReassembler::~FrameReassembler() {
+	for(Slot &slot : this->slots) {
+		this->resetSlot(slot);
+	}
+
+	this->pool->destroy();
+
+	VLOG(1) << "Reassembly: " << this->fragmentsReceived << " fragments, "
+		<< this->fragmentsDiscarded << " discarded; " << this->framesAssembled
+		<< " frames assembled, " << this->framesSuperseded << " superseded, "
+		<< this->framesTimedOut << " timed out";
+}
+
+
+
+/**
+ * Handles a received fragment (already in host byte order.) If it completes a
+ * frame, an output frame is allocated and returned; otherwise, nullptr is
+ * returned. The frame's receive timestamp is that of its first fragment.
+ *
+ * If the fragment's checksum was deferred, it's verified while the payload is
+ * copied into the frame; a fragment that fails it abandons the frame, since
+ * the buffer now holds garbage.
+ */
+OutputFrame *FrameReassembler::addFragment(lichtenstein_framebuffer_fragment_t *packet, size_t length, struct in_addr *source, const struct timespec *rxTimestamp, LichtensteinUtils::PartialChecksum *checksum) {
+	const size_t channel = packet->destChannel;
+
+	const uint32_t txn = packet->header.txn;
+	const uint16_t index = packet->header.sequenceIndex;
+	const uint16_t numFragments = packet->header.sequenceNumPackets;
+
+	if(length < sizeof(lichtenstein_framebuffer_fragment_t)) {
+		LOG(WARNING) << "Fragment packet too small (" << length << " bytes)";
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	// validate the channel and fragment index
+	if(channel >= this->slots.size()) {
+		LOG(WARNING) << "Fragment for invalid channel " << channel;
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	if(numFragments == 0 || numFragments > kLichtensteinMaxFragments || index >= numFragments) {
+		LOG(WARNING) << "Invalid fragment " << index << " of " << numFragments
+			<< " (txn " << txn << ")";
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	Slot &slot = this->slots[channel];
+
+	// is this a retransmission for the frame completed last?
+	if(!slot.active && slot.hasLastTxn && slot.lastTxn == txn) {
+		VLOG(2) << "Ignoring fragment " << index << " of completed txn " << txn;
+		return nullptr;
+	}
+
+	// a fragment of a different frame abandons the one being assembled
+	if(slot.active && slot.txn != txn) {
+		// but only if its header (and thus the txn) can be trusted
+		const size_t payloadLength = (length - sizeof(lichtenstein_framebuffer_fragment_t));
+
+		if(LichtensteinUtils::verifyPayload(checksum, packet->data, payloadLength) != LichtensteinUtils::kNoError) {
+			LOG(WARNING) << "Fragment " << index << " for channel " << channel
+				<< " has an invalid checksum";
+
+			this->fragmentsDiscarded++;
+			return nullptr;
+		}
+
+		VLOG(1) << "Frame " << slot.txn << " for channel " << channel
+			<< " superseded by " << txn << " (" << slot.fragmentsReceived
+			<< " of " << slot.numFragments << " fragments received)";
+
+		this->framesSuperseded++;
+		this->resetSlot(slot);
+	}
+
+	// start assembling the frame if needed
+	if(!slot.active) {
+		if(!this->startFrame(slot, packet, source, rxTimestamp)) {
+			this->fragmentsDiscarded++;
+			return nullptr;
+		}
+	}
+
+	// the fragment must agree with the frame on its shape
+	if(packet->dataFormat != slot.dataFormat || packet->totalElements != slot.totalElements ||
+	   numFragments != slot.numFragments) {
+		LOG(WARNING) << "Fragment " << index << " doesn't match frame (txn " << txn << ")";
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	// and its data must be within the frame, and actually be in the packet
+	if(packet->elementOffset > slot.totalElements ||
+	   packet->dataElements > (slot.totalElements - packet->elementOffset)) {
+		LOG(WARNING) << "Fragment " << index << " exceeds frame (offset "
+			<< packet->elementOffset << ", " << packet->dataElements << " elements)";
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	const size_t numBytes = (packet->dataElements * slot.bytesPerElement);
+
+	if(numBytes > (length - sizeof(lichtenstein_framebuffer_fragment_t))) {
+		LOG(WARNING) << "Fragment " << index << " is truncated (" << length << " bytes)";
+
+		this->fragmentsDiscarded++;
+		return nullptr;
+	}
+
+	// ignore duplicates
+	if(slot.received[index]) {
+		VLOG(2) << "Duplicate fragment " << index << " (txn " << txn << ")";
+		return nullptr;
+	}
+
+	// copy the data into place, verifying the checksum as we go
+	char *dest = static_cast<char *>(slot.buffer->getData());
+	const size_t payloadLength = (length - sizeof(lichtenstein_framebuffer_fragment_t));
+
+	if(LichtensteinUtils::copyPayload(checksum, dest + (packet->elementOffset * slot.bytesPerElement),
+									  packet->data, numBytes, payloadLength) != LichtensteinUtils::kNoError) {
+		LOG(WARNING) << "Fragment " << index << " for channel " << channel
+			<< " has an invalid checksum; abandoning frame (txn " << txn << ")";
+
+		this->fragmentsDiscarded++;
+		this->resetSlot(slot);
+		return nullptr;
+	}
+
+	slot.received[index] = true;
+	slot.fragmentsReceived++;
+
+	this->fragmentsReceived++;
+
+	// is the frame complete?
+	if(slot.fragmentsReceived != slot.numFragments) {
+		return nullptr;
+	}
+
+	const size_t frameBytes = (slot.totalElements * slot.bytesPerElement);
+
+	OutputFrame *frame = new OutputFrame(channel, slot.buffer, frameBytes,
+		kOpcodeFramebufferFragment, txn, this->handler, &slot.source);
+	frame->setRxTimestamp(slot.rxTimestamp);
+	frame->setBytesPerPixel(slot.bytesPerElement);
+
+	VLOG(3) << "Assembled " << frameBytes << " bytes from " << slot.numFragments
+		<< " fragments for channel " << channel;
+
+	this->framesAssembled++;
+
+	// the frame holds on to the buffer; the slot can be reused
+	this->resetSlot(slot);
+
+	slot.hasLastTxn = true;
+	slot.lastTxn = txn;
+
+	return frame;
+}
+
+/**
+ * Sets up a slot to assemble the frame the given fragment belongs to.
+ *
+ * @return Whether the frame can be assembled.
+ */
+bool FrameReassembler::startFrame(Slot &slot, lichtenstein_framebuffer_fragment_t *packet, struct in_addr *source, const struct timespec *rxTimestamp) {
+	// figure out the size of each element
+	size_t bytesPerElement;
+
+	switch(packet->dataFormat) {
+		// 3 bytes per element
+		case kDataFormatRGB:
+			bytesPerElement = 3;
+			break;
+
+		// 4 bytes per element
+		case kDataFormatRGBW:
+			bytesPerElement = 4;
+			break;
+
+		// shouldn't happen
+		default:
+			LOG(ERROR) << "Unknown data format " << packet->dataFormat;
+			return false;
+	}
+
+	// ensure the frame fits into a buffer
+	if(packet->totalElements > (this->pool->getBufferSize() / bytesPerElement)) {
+		LOG(WARNING) << "Frame of " << packet->totalElements << " elements is larger "
+			<< "than maxFrameSize (" << this->pool->getBufferSize() << " bytes)";
+		return false;
+	}
+
+	// set up the slot
+	slot.active = true;
+
+	slot.txn = packet->header.txn;
+	slot.dataFormat = packet->dataFormat;
+	slot.totalElements = packet->totalElements;
+	slot.bytesPerElement = bytesPerElement;
+
+	slot.numFragments = packet->header.sequenceNumPackets;
+	slot.fragmentsReceived = 0;
+	slot.received.reset();
+
+	slot.buffer = this->pool->acquire();
+	slot.source = *source;
+	slot.rxTimestamp = *rxTimestamp;
+
+	slot.deadline = clock_t::now() + std::chrono::milliseconds(this->timeoutMs);
+	slot.nacksSent = 0;
+
+	return true;
+}
+
+/**
+ * Abandons the frame being assembled in the slot, if any.
+ */
+void FrameReassembler::resetSlot(Slot &slot) {
+	if(slot.buffer) {
+		slot.buffer->release();
+		slot.buffer = nullptr;
+	}
+
+	slot.active = false;
+}
+
+
+
+/**
+ * Checks all slots for frames that weren't completed in time. Each of them is
+ * NACKed, asking for the missing fragments, until the NACK limit is reached, at
+ * which point the frame is discarded.
+ */
+void FrameReassembler::expireSlots(void) {
+	const clock_t::time_point now = clock_t::now();
+
+	for(size_t i = 0; i < this->slots.size(); i++) {
+		Slot &slot = this->slots[i];
+
+		if(!slot.active || now < slot.deadline) {
+			continue;
+		}
+
+		// request retransmission of the missing fragments
+		if(slot.nacksSent < kMaxNacks) {
+			this->sendNack(i, slot);
+
+			slot.nacksSent++;
+			slot.deadline = now + std::chrono::milliseconds(this->timeoutMs);
+		}
+		// give up on the frame
+		else {
+			LOG(WARNING) << "Discarding frame " << slot.txn << " for channel " << i
+				<< ": only " << slot.fragmentsReceived << " of " << slot.numFragments
+				<< " fragments received";
+
+			this->framesTimedOut++;
+			this->resetSlot(slot);
+		}
+	}
+}
+
+/**
+ * Sends a NACK for the frame in the given slot, listing the fragments that have
+ * yet to be received.
+ */
+void FrameReassembler::sendNack(size_t channel, Slot &slot) {
+	uint16_t missing[kLichtensteinMaxFragments];
+	size_t numMissing = 0;
+
+	for(uint16_t i = 0; i < slot.numFragments; i++) {
+		if(!slot.received[i]) {
+			missing[numMissing++] = i;
+		}
+	}
+
+	VLOG(1) << "Requesting " << numMissing << " missing fragments of frame "
+		<< slot.txn << " for channel " << channel;
+
+	this->handler->sendFragmentNack(slot.txn, channel, missing, numMissing, &slot.source);
+}
@@ -0,0 +1,118 @@
+/**
+ * Reassembles framebuffer data that was split across several datagrams.
+ *
+ * Each output channel has one assembly slot, allocated up front, which holds
+ * the frame (identified by its transaction number) currently being assembled
+ * for that channel. Fragments are copied into a buffer taken from a pool; once
+ * all of them have arrived, an output frame referencing that buffer is handed
+ * back to the protocol handler.
+ *
+ * If a frame isn't complete within the configured timeout, a NACK listing only
+ * the missing fragments is sent to the server. After a few NACKs without
+ * success, the frame is discarded.
+ */
+#ifndef FRAMEREASSEMBLER_H
+#define FRAMEREASSEMBLER_H
+
+#include "lichtenstein_proto.h"
+#include "LichtensteinUtils.h"
+
+#include <bitset>
+#include <chrono>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// for struct in_addr
+#include <netinet/in.h>
+
+class Config;
+class ProtocolHandler;
+class OutputFrame;
+class BufferPool;
+class PacketBuffer;
+
+class FrameReassembler {
+	public:
+		FrameReassembler(const Config *config, ProtocolHandler *handler, size_t numShards = 1);
+		~FrameReassembler();
+
+		OutputFrame *addFragment(lichtenstein_framebuffer_fragment_t *packet, size_t length, struct in_addr *source, const struct timespec *rxTimestamp, LichtensteinUtils::PartialChecksum *checksum = nullptr);
+
+		void expireSlots(void);
+
+		unsigned int getTimeoutMs(void) const {
+			return this->timeoutMs;
+		}
+
+	private:
+		typedef std::chrono::steady_clock clock_t;
+
+		struct Slot {
+			// whether a frame is being assembled in this slot
+			bool active = false;
+
+			// transaction, format and size of the frame
+			uint32_t txn = 0;
+			uint32_t dataFormat = 0;
+			uint32_t totalElements = 0;
+			size_t bytesPerElement = 0;
+
+			// which of the frame's fragments have been received
+			uint16_t numFragments = 0;
+			uint16_t fragmentsReceived = 0;
+			std::bitset<kLichtensteinMaxFragments> received;
+
+			// buffer into which the frame is assembled
+			PacketBuffer *buffer = nullptr;
+
+			// where to send the (n)ack to
+			struct in_addr source;
+			// when the first fragment was received
+			struct timespec rxTimestamp;
+
+			// when the frame times out, and how many NACKs were sent for it
+			clock_t::time_point deadline;
+			unsigned int nacksSent = 0;
+
+			// transaction of the last frame completed in this slot
+			bool hasLastTxn = false;
+			uint32_t lastTxn = 0;
+		};
+
+	private:
+		bool startFrame(Slot &, lichtenstein_framebuffer_fragment_t *, struct in_addr *, const struct timespec *);
+		void resetSlot(Slot &);
+
+		void sendNack(size_t, Slot &);
+
+	private:
+		// maximum number of NACKs sent for a frame before giving up on it
+		static const unsigned int kMaxNacks = 3;
+
+	private:
+		ProtocolHandler *handler = nullptr;
+
+		// one slot per output channel
+		std::vector<Slot> slots;
+		// buffers frames are assembled into
+		BufferPool *pool = nullptr;
+
+		// how long to wait for missing fragments
+		unsigned int timeoutMs = 0;
+
+	// counters
+	private:
+		size_t fragmentsReceived = 0;
+		size_t fragmentsDiscarded = 0;
+
+		size_t framesAssembled = 0;
+		// frames abandoned because a newer frame for the channel arrived
+		size_t framesSuperseded = 0;
+		// frames abandoned because fragments never arrived
+		size_t framesTimedOut = 0;
+};
+
+#endif
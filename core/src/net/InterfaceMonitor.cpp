@@ -0,0 +1,182 @@
+#include "InterfaceMonitor.h"
+
+#include <glog/logging.h>
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <net/if.h>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+/**
+ * Opens the rtnetlink socket and subscribes to link and IPv4 address changes.
+ */
+InterfaceMonitor::InterfaceMonitor() {
+#ifdef __linux__
+	int err;
+
+	this->socket = ::socket(AF_NETLINK, (SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC), NETLINK_ROUTE);
+
+	if(this->socket < 0) {
+		PLOG(ERROR) << "Couldn't create rtnetlink socket";
+		return;
+	}
+
+	// subscribe to the multicast groups
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(addr));
+
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = (RTMGRP_LINK | RTMGRP_IPV4_IFADDR);
+
+	err = bind(this->socket, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+
+	if(err != 0) {
+		PLOG(ERROR) << "Couldn't subscribe to interface changes";
+
+		close(this->socket);
+		this->socket = -1;
+
+		return;
+	}
+
+	this->buffer = new char[kBufferSize];
+
+	VLOG(1) << "Monitoring network interfaces for changes";
+#else
+	LOG(WARNING) << "Interface monitoring isn't supported on this platform";
+#endif
+}
+
+/**
+ * Closes the socket.
+ */
+InterfaceMonitor::~InterfaceMonitor() {
+	if(this->socket >= 0) {
+		int err = close(this->socket);
+		PLOG_IF(ERROR, err != 0) << "Couldn't close rtnetlink socket";
+	}
+
+	delete[] this->buffer;
+}
+
+
+
+/**
+ * Reads all notifications the kernel has queued on the socket.
+ *
+ * If the socket's buffer overran, notifications were lost; in that case, we
+ * report that everything changed.
+ *
+ * @return Mask of kChange values describing what changed.
+ */
+uint32_t InterfaceMonitor::readChanges(void) {
+	uint32_t changes = 0;
+
+#ifdef __linux__
+	if(this->socket < 0) {
+		return (kChangeLink | kChangeAddress);
+	}
+
+	while(true) {
+		struct sockaddr_nl addr;
+		socklen_t addrLen = sizeof(addr);
+
+		ssize_t received = recvfrom(this->socket, this->buffer, kBufferSize, 0,
+			reinterpret_cast<struct sockaddr *>(&addr), &addrLen);
+
+		if(received < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if(errno == EINTR) {
+				continue;
+			} else if(errno == ENOBUFS) {
+				LOG(WARNING) << "Lost interface change notifications";
+
+				changes |= (kChangeLink | kChangeAddress);
+				continue;
+			}
+
+			PLOG(ERROR) << "Couldn't read from rtnetlink socket";
+			break;
+		}
+
+		// only the kernel may tell us about interfaces
+		if(addr.nl_pid != 0) {
+			continue;
+		}
+
+		changes |= this->parseMessages(this->buffer, received);
+	}
+#endif
+
+	return changes;
+}
+
+/**
+ * Walks the netlink messages in the buffer and determines what changed.
+ */
+uint32_t InterfaceMonitor::parseMessages(const void *buffer, size_t length) {
+	uint32_t changes = 0;
+
+#ifdef __linux__
+	const struct nlmsghdr *msg = static_cast<const struct nlmsghdr *>(buffer);
+	// NLMSG_NEXT modifies the length
+	unsigned int remaining = length;
+
+	for(; NLMSG_OK(msg, remaining); msg = NLMSG_NEXT(msg, remaining)) {
+		switch(msg->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK: {
+				const struct ifinfomsg *info = static_cast<const struct ifinfomsg *>(NLMSG_DATA(msg));
+
+				if(msg->nlmsg_len < NLMSG_LENGTH(sizeof(*info))) {
+					break;
+				}
+
+				if(!(info->ifi_flags & IFF_LOOPBACK)) {
+					VLOG(2) << "Link " << info->ifi_index << " changed (flags "
+						<< std::hex << info->ifi_flags << std::dec << ")";
+
+					changes |= kChangeLink;
+				}
+				break;
+			}
+
+			case RTM_NEWADDR:
+			case RTM_DELADDR: {
+				const struct ifaddrmsg *info = static_cast<const struct ifaddrmsg *>(NLMSG_DATA(msg));
+
+				if(msg->nlmsg_len < NLMSG_LENGTH(sizeof(*info))) {
+					break;
+				}
+
+				if(info->ifa_family == AF_INET && info->ifa_scope != RT_SCOPE_HOST) {
+					VLOG(2) << "Address on link " << info->ifa_index << ((msg->nlmsg_type == RTM_NEWADDR) ? " added" : " removed");
+
+					changes |= kChangeAddress;
+				}
+				break;
+			}
+
+			case NLMSG_OVERRUN: {
+				changes |= (kChangeLink | kChangeAddress);
+				break;
+			}
+
+			// ignore everything else
+			default:
+				break;
+		}
+	}
+#endif
+
+	return changes;
+}
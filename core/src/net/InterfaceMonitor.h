@@ -0,0 +1,58 @@
+/**
+ * Watches the network interfaces for changes through an rtnetlink socket,
+ * subscribed to link and IPv4 address notifications.
+ *
+ * The monitor has no thread of its own: its descriptor is registered with the
+ * control shard's reactor, which calls readChanges() whenever the kernel sent
+ * notifications. Those are drained and folded into a mask of what changed, so
+ * that a burst of them (such as when a DHCP lease is renewed) is handled once.
+ *
+ * Loopback links and host scoped addresses are ignored, since they never end
+ * up in the node announcement anyways.
+ *
+ * This is only available on Linux. If the socket can't be opened (or on other
+ * platforms) the descriptor is -1, and callers should assume that anything may
+ * have changed at any time.
+ */
+#ifndef INTERFACEMONITOR_H
+#define INTERFACEMONITOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+class InterfaceMonitor {
+	public:
+		/**
+		 * Kinds of changes returned by readChanges().
+		 */
+		enum {
+			kChangeLink					= (1 << 0),
+			kChangeAddress				= (1 << 1),
+		};
+
+	public:
+		InterfaceMonitor();
+		~InterfaceMonitor();
+
+		uint32_t readChanges(void);
+
+		int getDescriptor(void) const {
+			return this->socket;
+		}
+
+	private:
+		uint32_t parseMessages(const void *buffer, size_t length);
+
+	private:
+		// size of the receive buffer; the kernel won't send larger messages
+		static const size_t kBufferSize = 8192;
+
+	private:
+		// rtnetlink socket
+		int socket = -1;
+
+		// buffer notifications are read into
+		char *buffer = nullptr;
+};
+
+#endif
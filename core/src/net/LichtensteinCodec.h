@@ -0,0 +1,487 @@
+/**
+ * Describes the layout of each packet in lichtenstein_proto.h, so that the code
+ * converting packets to and from network byte order is generated at compile
+ * time rather than written (and kept up to date) by hand.
+ *
+ * Each packet struct has a LichtensteinLayout specialization listing all of
+ * its fields after the header in order, including those that aren't swapped
+ * (single bytes, or addresses that are kept in network order), and the array
+ * at the end of the packet, if any. A layout that skips or misplaces a field,
+ * or doesn't reach the end of the struct, fails to compile; so when a packet
+ * gains a field, its layout has to be updated as well.
+ *
+ * From a layout, convert() generates straight-line code swapping each field
+ * at its fixed offset, and a loop for the array; the only runtime checks are
+ * that the packet is long enough to hold its fields and the array's entries.
+ */
+#ifndef LICHTENSTEINCODEC_H
+#define LICHTENSTEINCODEC_H
+
+#include "lichtenstein_proto.h"
+
+#include <utility>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Layout of a packet; specialized for every packet struct below.
+ */
+template<typename T> struct LichtensteinLayout;
+
+class LichtensteinCodec {
+	public:
+		/**
+		 * A field (or a fixed size array of equally sized fields) in a packet.
+		 */
+		struct Field {
+			uint16_t offset;
+			// size of each element, and the number of elements
+			uint8_t size;
+			uint16_t count;
+			// whether the field is byte swapped; false for ones kept as-is
+			bool swap;
+		};
+
+		/**
+		 * Variable length array at the end of a packet. Its number of entries
+		 * is in another field; each entry consists of one or more equally
+		 * sized fields.
+		 */
+		struct Array {
+			bool present;
+
+			// field holding the number of entries
+			Field count;
+			// largest number of entries allowed
+			uint32_t maxCount;
+
+			// offset of the first entry, size of each field, and fields per entry
+			uint16_t offset;
+			uint8_t size;
+			uint8_t fieldsPerEntry;
+		};
+
+		/// a packet without a variable length array
+		static constexpr Array kNoArray = {false, {0, 0, 0, false}, 0, 0, 0, 0};
+
+		/**
+		 * Converts the body of a packet of a given type; its header must have
+		 * been converted already.
+		 */
+		typedef int (*Converter)(uint8_t *packet, size_t length);
+
+		/**
+		 * Converters for one packet type, indexed by whether the packet is in
+		 * network byte order.
+		 */
+		struct Variant {
+			const char *name;
+			Converter convert[2];
+		};
+
+		/**
+		 * How to convert the packets with a particular opcode. Usually only
+		 * the base variant is used; if the packet's length is exactly
+		 * exactLength, the exact variant is, and otherwise if any of the
+		 * bits in flag are set, the flagged variant is.
+		 */
+		struct Entry {
+			Variant base;
+
+			uint16_t flag;
+			Variant flagged;
+
+			size_t exactLength;
+			Variant exact;
+		};
+
+	public:
+		/**
+		 * Gets the variant for the given packet type.
+		 */
+		template<typename T>
+		static constexpr Variant variant(const char *name) {
+			return {name, {&convert<T, false>, &convert<T, true>}};
+		}
+
+		/**
+		 * Gets an entry for an opcode that only has a single packet type.
+		 */
+		template<typename T>
+		static constexpr Entry entry(const char *name) {
+			return {variant<T>(name), 0, {}, 0, {}};
+		}
+
+		static inline void convertHeader(uint8_t *packet);
+
+		/**
+		 * Swaps all fields of a packet of the given type, after checking that
+		 * it's long enough to hold them.
+		 *
+		 * @return 0 if the packet was converted, -1 if it's too small.
+		 */
+		template<typename T, bool FromNetwork>
+		static int convert(uint8_t *packet, size_t length) {
+			typedef LichtensteinLayout<T> L;
+
+			static_assert(isComplete<T>(sizeof(lichtenstein_header_t)), "Packet layout is incomplete");
+
+			if(length < sizeof(T)) {
+				return -1;
+			}
+
+			// the array's size must be known before its fields are swapped
+			size_t count = 0;
+
+			if constexpr(L::kArray.present) {
+				count = load<L::kArray.count.size>(packet + L::kArray.count.offset);
+
+				if(FromNetwork) {
+					count = byteSwap<L::kArray.count.size>(count);
+				}
+
+				const size_t entrySize = (L::kArray.size * L::kArray.fieldsPerEntry);
+
+				if(count > L::kArray.maxCount || count > ((length - L::kArray.offset) / entrySize)) {
+					return -1;
+				}
+			}
+
+			swapFields<L>(packet, std::make_index_sequence<countOf(L::kFields)>());
+
+			if constexpr(L::kArray.present && L::kArray.size > 1) {
+				uint8_t *entries = (packet + L::kArray.offset);
+				const size_t numFields = (count * L::kArray.fieldsPerEntry);
+
+				for(size_t i = 0; i < numFields; i++) {
+					swapAt<L::kArray.size>(entries + (i * L::kArray.size));
+				}
+			}
+
+			(void) count;
+			return 0;
+		}
+
+	private:
+		/**
+		 * Checks that the fields in the layout follow each other without gaps,
+		 * starting at the given offset, and end with the struct; and that the
+		 * array, if any, follows them.
+		 */
+		template<typename T>
+		static constexpr bool isComplete(size_t start) {
+			typedef LichtensteinLayout<T> L;
+
+			size_t next = start;
+
+			for(const Field &field : L::kFields) {
+				if(field.offset != next) {
+					return false;
+				}
+
+				next += (field.size * field.count);
+			}
+
+			if(next != sizeof(T)) {
+				return false;
+			}
+
+			return (!L::kArray.present || L::kArray.offset == sizeof(T));
+		}
+
+		/**
+		 * Swaps all fields in the layout; this expands to one swap per field.
+		 */
+		template<typename L, size_t... I>
+		static inline void swapFields(uint8_t *packet, std::index_sequence<I...>) {
+			(swapField<L::kFields[I].offset, L::kFields[I].size, L::kFields[I].count, L::kFields[I].swap>(packet), ...);
+		}
+
+		template<size_t Offset, size_t Size, size_t Count, bool Swap>
+		static inline void swapField(uint8_t *packet) {
+			if constexpr(Swap && Size > 1) {
+				for(size_t i = 0; i < Count; i++) {
+					swapAt<Size>(packet + Offset + (i * Size));
+				}
+			}
+		}
+
+		/**
+		 * Swaps a single field in place; it need not be aligned.
+		 */
+		template<size_t Size>
+		static inline void swapAt(uint8_t *ptr) {
+			uint64_t value = load<Size>(ptr);
+			value = byteSwap<Size>(value);
+			store<Size>(ptr, value);
+		}
+
+		template<size_t Size>
+		static inline uint64_t load(const uint8_t *ptr) {
+			static_assert(Size == 2 || Size == 4 || Size == 8, "Unsupported field size");
+
+			if constexpr(Size == 2) {
+				uint16_t value;
+				memcpy(&value, ptr, sizeof(value));
+				return value;
+			} else if constexpr(Size == 4) {
+				uint32_t value;
+				memcpy(&value, ptr, sizeof(value));
+				return value;
+			} else {
+				uint64_t value;
+				memcpy(&value, ptr, sizeof(value));
+				return value;
+			}
+		}
+
+		template<size_t Size>
+		static inline void store(uint8_t *ptr, uint64_t value) {
+			if constexpr(Size == 2) {
+				const uint16_t narrow = value;
+				memcpy(ptr, &narrow, sizeof(narrow));
+			} else if constexpr(Size == 4) {
+				const uint32_t narrow = value;
+				memcpy(ptr, &narrow, sizeof(narrow));
+			} else {
+				memcpy(ptr, &value, sizeof(value));
+			}
+		}
+
+		template<size_t Size>
+		static inline uint64_t byteSwap(uint64_t value) {
+			if constexpr(Size == 2) {
+				return __builtin_bswap16(value);
+			} else if constexpr(Size == 4) {
+				return __builtin_bswap32(value);
+			} else {
+				return __builtin_bswap64(value);
+			}
+		}
+
+		template<typename A, size_t N>
+		static constexpr size_t countOf(const A (&)[N]) {
+			return N;
+		}
+};
+
+
+
+/// a multibyte field, or a fixed size array of them
+#define LICHTENSTEIN_FIELD(type, member) \
+	{offsetof(type, member), sizeof(((type *) nullptr)->member), 1, true}
+#define LICHTENSTEIN_FIELDS(type, member) \
+	{offsetof(type, member), sizeof(((type *) nullptr)->member[0]), \
+	 (sizeof(((type *) nullptr)->member) / sizeof(((type *) nullptr)->member[0])), true}
+/// a field that's never swapped (bytes, or values kept in network byte order)
+#define LICHTENSTEIN_RAW(type, member) \
+	{offsetof(type, member), sizeof(((type *) nullptr)->member), 1, false}
+
+/// array at the end of a packet, whose entries are made up of fields of fieldType
+#define LICHTENSTEIN_ARRAY(type, countMember, member, fieldType, maxCount) \
+	{true, LICHTENSTEIN_FIELD(type, countMember), (maxCount), offsetof(type, member), \
+	 sizeof(fieldType), (sizeof(((type *) nullptr)->member[0]) / sizeof(fieldType))}
+
+template<> struct LichtensteinLayout<lichtenstein_header_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, magic),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, version),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, checksum),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, opcode),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, flags),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, sequenceIndex),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, sequenceNumPackets),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, txn),
+		LICHTENSTEIN_FIELD(lichtenstein_header_t, payloadLength),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_announcement_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, swVersion),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, hwVersion),
+		LICHTENSTEIN_RAW(lichtenstein_node_announcement_t, macAddr),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, port),
+		LICHTENSTEIN_RAW(lichtenstein_node_announcement_t, ip),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, fbSize),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, channels),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, numGpioDigitalIn),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, numGpioDigitalOut),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, numGpioAnalogIn),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, numGpioAnalogOut),
+		LICHTENSTEIN_FIELD(lichtenstein_node_announcement_t, hostnameLen),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_node_announcement_t, hostnameLen, hostname, char, UINT16_MAX);
+};
+
+template<> struct LichtensteinLayout<lichtenstein_server_announcement_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_server_announcement_t, swVersion),
+		LICHTENSTEIN_FIELD(lichtenstein_server_announcement_t, capabilities),
+		LICHTENSTEIN_RAW(lichtenstein_server_announcement_t, ip),
+		LICHTENSTEIN_FIELD(lichtenstein_server_announcement_t, port),
+		LICHTENSTEIN_FIELD(lichtenstein_server_announcement_t, status),
+		LICHTENSTEIN_FIELD(lichtenstein_server_announcement_t, hostnameLen),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_server_announcement_t, hostnameLen, hostname, char, UINT16_MAX);
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_adoption_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_RAW(lichtenstein_node_adoption_t, ip),
+		LICHTENSTEIN_FIELD(lichtenstein_node_adoption_t, port),
+		LICHTENSTEIN_FIELD(lichtenstein_node_adoption_t, flags),
+		LICHTENSTEIN_FIELD(lichtenstein_node_adoption_t, numChannels),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_node_adoption_t, numChannels, pixelsPerChannel, uint32_t, kLichtensteinMaxChannels);
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_adoption_ack_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_node_adoption_ack_t, flags),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_status_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, uptime),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, totalMem),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, freeMem),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, rxPackets),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, txPackets),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, packetsWithInvalidCRC),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, framesOutput),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, outputState),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, cpuUsagePercent),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, avgConversionTimeUs),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, rxBytes),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, txBytes),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, rxSymbolErrors),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, mediumSpeed),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_t, mediumDuplex),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_status_sub_req_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_sub_req_t, subOpcode),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_sub_req_t, flags),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_node_status_histograms_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_histograms_t, subOpcode),
+		LICHTENSTEIN_FIELD(lichtenstein_node_status_histograms_t, numHistograms),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_node_status_histograms_t, numHistograms, histograms, uint32_t, UINT32_MAX);
+
+	static_assert((sizeof(lichtenstein_node_status_histogram_t) % sizeof(uint32_t)) == 0,
+				  "Histogram summaries must consist only of 32-bit fields");
+};
+
+template<> struct LichtensteinLayout<lichtenstein_framebuffer_data_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_data_t, destChannel),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_data_t, dataFormat),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_data_t, dataElements),
+	};
+	// the pixel data is bytes, and is sized by the format; it's checked separately
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_framebuffer_fragment_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_t, destChannel),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_t, dataFormat),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_t, totalElements),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_t, elementOffset),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_t, dataElements),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_framebuffer_fragment_nack_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_nack_t, destChannel),
+		LICHTENSTEIN_FIELD(lichtenstein_framebuffer_fragment_nack_t, numMissing),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_framebuffer_fragment_nack_t, numMissing, missing, uint16_t, kLichtensteinMaxFragments);
+};
+
+template<> struct LichtensteinLayout<lichtenstein_sync_output_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_sync_output_t, channels),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_sync_output_timed_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_sync_output_timed_t, channels),
+		LICHTENSTEIN_FIELD(lichtenstein_sync_output_timed_t, presentationTime),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_time_sync_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_time_sync_t, originateTime),
+		LICHTENSTEIN_FIELD(lichtenstein_time_sync_t, receiveTime),
+		LICHTENSTEIN_FIELD(lichtenstein_time_sync_t, transmitTime),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_cumulative_ack_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELDS(lichtenstein_cumulative_ack_t, acceptedChannels),
+		LICHTENSTEIN_FIELDS(lichtenstein_cumulative_ack_t, nackedChannels),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_color_correction_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELDS(lichtenstein_color_correction_t, channels),
+		LICHTENSTEIN_FIELD(lichtenstein_color_correction_t, gamma),
+		LICHTENSTEIN_RAW(lichtenstein_color_correction_t, brightness),
+		LICHTENSTEIN_RAW(lichtenstein_color_correction_t, whiteBalance),
+	};
+	static constexpr LichtensteinCodec::Array kArray = LichtensteinCodec::kNoArray;
+};
+
+template<> struct LichtensteinLayout<lichtenstein_reconfig_t> {
+	static constexpr LichtensteinCodec::Field kFields[] = {
+		LICHTENSTEIN_FIELD(lichtenstein_reconfig_t, hostnameLen),
+	};
+	static constexpr LichtensteinCodec::Array kArray =
+		LICHTENSTEIN_ARRAY(lichtenstein_reconfig_t, hostnameLen, hostname, char, UINT16_MAX);
+};
+
+
+
+
+/**
+ * Swaps all fields of the packet header.
+ */
+inline void LichtensteinCodec::convertHeader(uint8_t *packet) {
+	typedef LichtensteinLayout<lichtenstein_header_t> L;
+
+	static_assert(isComplete<lichtenstein_header_t>(0), "Header layout is incomplete");
+
+	swapFields<L>(packet, std::make_index_sequence<countOf(L::kFields)>());
+}
+
+#endif
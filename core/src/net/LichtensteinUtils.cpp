@@ -1,10 +1,15 @@
 #include "LichtensteinUtils.h"
 
+#include <array>
 #include <iostream>
+#include <utility>
+
+#include <cstring>
 
 #include <glog/logging.h>
 
 #include "lichtenstein_proto.h"
+#include "LichtensteinCodec.h"
 #include "crc32/crc32.h"
 
 // for htons and friends
@@ -55,255 +60,394 @@ LichtensteinUtils::PacketErrors LichtensteinUtils::validatePacket(void *data, si
 }
 
 /**
- * Adds a checksum to the packet.
+ * Validates a packet right off the wire and converts it to host byte order,
+ * touching each byte of it only once where possible.
+ *
+ * For framebuffer data and fragments, only the header and fixed fields are
+ * byte swapped, as the payload consists of single bytes anyway; the checksum
+ * is computed over them while they're still in network order, and then over
+ * the payload, rather than in a separate pass before the conversion.
  *
- * TODO: The CRC code is somehow broken, in that the table is wrong, because the
- * embedded code (with the 1 byte table) gets a different result than the code
- * we use that uses the whole table.
+ * If a partial checksum is specified, checksumming the payload of a fragment
+ * is deferred: the caller must use copyPayload() to copy it into place, which
+ * verifies the checksum as it goes, so the payload is only read once.
+ *
+ * Any other packets are validated and converted as usual.
  */
-LichtensteinUtils::PacketErrors LichtensteinUtils::applyChecksum(void *data, size_t length) {
+LichtensteinUtils::PacketErrors LichtensteinUtils::ingestPacket(void *data, size_t length, PartialChecksum *partial) {
 	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
 
-	// validate packet length
+	// validate packet length and magic before anything else
 	if(length < sizeof(lichtenstein_header_t)) {
 		LOG(WARNING) << "attempted to convert a packet smaller than the header";
 		return kPacketTooSmall;
 	}
 
-	// get CRC offset into the packet
-	size_t offset = offsetof(lichtenstein_header_t, opcode);
-	void *ptr = ((uint8_t *) header) + offset;
-	size_t len = (length - offset);
-
-	uint32_t crc = crc32_fast(ptr, len);
+	if(header->magic != htonl(kLichtensteinMagic)) {
+		LOG(WARNING) << "invalid magic value, got 0x" << hex << ntohl(header->magic);
+		return kInvalidMagic;
+	}
 
-	header->checksum = __builtin_bswap32(crc);
+	// figure out how much of the packet has to be byte swapped
+	const uint16_t opcode = ntohs(header->opcode);
+	const uint16_t flags = ntohs(header->flags);
 
-	return kNoError;
-}
+	size_t fixedLength = 0;
 
-/**
- * Swaps all multibyte fields in a packet.
- *
- * TODO: Add error checking
- *
- * @param _packet Packet
- * @param fromNetworkorder Set if the packet is in network order
- * @param length Total number of bytes in packet
- *
- * @return 0 if the conversion was a success, error code otherwise.
- */
-int LichtensteinUtils::convertPacketByteOrder(void *_packet, bool fromNetworkOrder, size_t length) {
-	lichtenstein_header_opcode_t opcode;
+	if(opcode == kOpcodeFramebufferData) {
+		fixedLength = sizeof(lichtenstein_framebuffer_data_t);
+	} else if(opcode == kOpcodeFramebufferFragment && !(flags & kFlagNAck)) {
+		fixedLength = sizeof(lichtenstein_framebuffer_fragment_t);
+	}
 
-	// first, process the header
-	lichtenstein_header_t *header = (lichtenstein_header_t *) _packet;
+	// anything else (or a packet too small to hold its fixed fields) takes the
+	// slow path; if any field can't be converted, none of the packet can be trusted
+	if(fixedLength == 0 || length < fixedLength) {
+		PacketErrors err = validatePacket(data, length);
 
-	header->magic = __builtin_bswap32(header->magic);
-	header->version = __builtin_bswap32(header->version);
-	header->checksum = __builtin_bswap32(header->checksum);
+		if(err == kNoError && convertToHostByteOrder(data, length) != 0) {
+			err = kMalformedPacket;
+		}
 
-	if(fromNetworkOrder) {
-		header->opcode = __builtin_bswap16(header->opcode);
-		opcode = (lichtenstein_header_opcode_t) header->opcode;
-	} else {
-		opcode = (lichtenstein_header_opcode_t) header->opcode;
-		header->opcode = __builtin_bswap16(header->opcode);
+		return err;
 	}
 
-	header->flags = __builtin_bswap16(header->flags);
+	// checksum the header and fixed fields, then swap them
+	const bool checksummed = (flags & kFlagChecksummed);
 
-	header->sequenceIndex = __builtin_bswap16(header->sequenceIndex);
-	header->sequenceNumPackets = __builtin_bswap16(header->sequenceNumPackets);
+	const size_t checksummedDataStart = offsetof(lichtenstein_header_t, opcode);
+	uint8_t *bytes = static_cast<uint8_t *>(data);
 
-	header->txn = __builtin_bswap32(header->txn);
-	header->payloadLength = __builtin_bswap32(header->payloadLength);
+	uint32_t crc = 0;
 
-	// return immediately if payload length is zero (its a request)
-	if(header->payloadLength == 0) {
-		return 0;
+	if(checksummed) {
+		crc = crc32_fast(bytes + checksummedDataStart, (fixedLength - checksummedDataStart));
 	}
 
-	// handle each packet type individually
-	switch(opcode) {
-		// node announcement
-		case kOpcodeNodeAnnouncement: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_node_announcement_t)) {
-				LOG(WARNING) << "Node announcement packet too small!";
-				return -1;
-			}
+	convertToHostByteOrder(data, fixedLength);
 
-			lichtenstein_node_announcement_t *announce;
-			announce = (lichtenstein_node_announcement_t *) _packet;
+	if(!checksummed) {
+		return kNoError;
+	}
 
-			// byteswap all fields
-			announce->swVersion = __builtin_bswap32(announce->swVersion);
-			announce->hwVersion = __builtin_bswap32(announce->hwVersion);
+	// defer checksumming the payload of fragments, if the caller will copy it
+	if(partial && opcode == kOpcodeFramebufferFragment) {
+		partial->pending = true;
+		partial->valid = true;
+		partial->crc = crc;
+		partial->expected = header->checksum;
 
-			announce->port = __builtin_bswap16(announce->port);
-			// don't byteswap IP, it's already in network byte order
+		return kNoError;
+	}
 
-			announce->fbSize = __builtin_bswap32(announce->fbSize);
-			announce->channels = __builtin_bswap16(announce->channels);
+	// otherwise, checksum it now
+	crc = crc32_fast(bytes + fixedLength, (length - fixedLength), crc);
 
-			announce->numGpioDigitalIn = __builtin_bswap16(announce->numGpioDigitalIn);
-			announce->numGpioDigitalOut = __builtin_bswap16(announce->numGpioDigitalOut);
-			announce->numGpioAnalogIn = __builtin_bswap16(announce->numGpioAnalogIn);
-			announce->numGpioAnalogOut = __builtin_bswap16(announce->numGpioAnalogOut);
+	LOG_IF(WARNING, crc != header->checksum) << "CRC mismatch on packet 0x" << data
+											 << "! Got " << hex << header->checksum
+											 << ", expected " << hex << crc;
 
-			announce->hostnameLen = __builtin_bswap16(announce->hostnameLen);
-			break;
-		}
-		// server announcement
-		case kOpcodeServerAnnouncement: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_server_announcement_t)) {
-				LOG(WARNING) << "Server announcement packet too small!";
-				return -1;
-			}
+	if(crc != header->checksum) {
+		return kInvalidChecksum;
+	}
 
-			lichtenstein_server_announcement_t *announce;
-			announce = (lichtenstein_server_announcement_t *) _packet;
+	return kNoError;
+}
 
-			// byteswap all fields
-			announce->swVersion = __builtin_bswap32(announce->swVersion);
-			announce->capabilities = __builtin_bswap32(announce->capabilities);
+/**
+ * Copies the payload of a packet ingested with a deferred checksum, and
+ * computes the checksum over it while doing so. Bytes of the payload past
+ * those copied are still checksummed.
+ *
+ * If the checksum doesn't match, the copied data must be discarded. If there
+ * is no checksum to verify, the data is just copied.
+ *
+ * @param partial Checksum state filled in by ingestPacket; may be nullptr
+ * @param copyLength Number of bytes to copy to dest
+ * @param payloadLength Total number of bytes from payload to the end of the
+ * packet
+ */
+LichtensteinUtils::PacketErrors LichtensteinUtils::copyPayload(PartialChecksum *partial, void *dest, const void *payload, size_t copyLength, size_t payloadLength) {
+	if(!partial || !partial->pending) {
+		memcpy(dest, payload, copyLength);
+		return kNoError;
+	}
 
-			announce->port = __builtin_bswap16(announce->port);
-			announce->hostnameLen = __builtin_bswap16(announce->hostnameLen);
+	uint32_t crc = crc32_copy(dest, payload, copyLength, partial->crc);
 
-			break;
-		}
+	if(payloadLength > copyLength) {
+		crc = crc32_fast(static_cast<const uint8_t *>(payload) + copyLength,
+						 (payloadLength - copyLength), crc);
+	}
 
-		// node status
-		case kOpcodeNodeStatusReq: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_node_status_t)) {
-				LOG(WARNING) << "Status request packet too small!";
-				return -1;
-			}
+	return finishChecksum(partial, crc);
+}
 
-			lichtenstein_node_status_t *status;
-			status = (lichtenstein_node_status_t *) _packet;
+/**
+ * Verifies a deferred checksum without copying the payload. This is used when
+ * the packet's header has to be trusted before its payload is needed.
+ */
+LichtensteinUtils::PacketErrors LichtensteinUtils::verifyPayload(PartialChecksum *partial, const void *payload, size_t payloadLength) {
+	if(!partial || !partial->pending) {
+		return partial && !partial->valid ? kInvalidChecksum : kNoError;
+	}
 
-			// byteswap all fields
-			status->uptime = __builtin_bswap32(status->uptime);
+	uint32_t crc = crc32_fast(payload, payloadLength, partial->crc);
 
-			status->totalMem = __builtin_bswap32(status->totalMem);
-			status->freeMem = __builtin_bswap32(status->freeMem);
+	return finishChecksum(partial, crc);
+}
 
-			status->rxPackets = __builtin_bswap32(status->rxPackets);
-			status->txPackets = __builtin_bswap32(status->txPackets);
-			status->packetsWithInvalidCRC = __builtin_bswap32(status->packetsWithInvalidCRC);
+/**
+ * Compares the final CRC of a deferred checksum against the packet's.
+ */
+LichtensteinUtils::PacketErrors LichtensteinUtils::finishChecksum(PartialChecksum *partial, uint32_t crc) {
+	partial->pending = false;
+	partial->crc = crc;
 
-			status->framesOutput = __builtin_bswap32(status->framesOutput);
+	if(crc != partial->expected) {
+		LOG(WARNING) << "CRC mismatch on packet payload! Got " << hex
+					 << partial->expected << ", expected " << hex << crc;
 
-			status->outputState = __builtin_bswap16(status->outputState);
-			status->cpuUsagePercent = __builtin_bswap16(status->cpuUsagePercent);
+		partial->valid = false;
+		return kInvalidChecksum;
+	}
+
+	return kNoError;
+}
 
-			status->avgConversionTimeUs = __builtin_bswap32(status->avgConversionTimeUs);
+/**
+ * Checks whether a framebuffer data packet (in host byte order) actually
+ * contains as many elements as its header claims.
+ */
+bool LichtensteinUtils::framebufferDataFits(void *data, size_t length) {
+	lichtenstein_framebuffer_data_t *fb = static_cast<lichtenstein_framebuffer_data_t *>(data);
 
-			status->rxBytes = __builtin_bswap32(status->rxBytes);
-			status->txBytes = __builtin_bswap32(status->txBytes);
+	if(length < sizeof(lichtenstein_framebuffer_data_t)) {
+		return false;
+	}
 
-			status->rxSymbolErrors = __builtin_bswap32(status->rxSymbolErrors);
+	// figure out the size of each element
+	size_t bytesPerElement;
 
-			status->mediumSpeed = __builtin_bswap32(status->mediumSpeed);
-			status->mediumDuplex = __builtin_bswap32(status->mediumDuplex);
+	switch(fb->dataFormat) {
+		case kDataFormatRGB:
+			bytesPerElement = 3;
+			break;
 
+		case kDataFormatRGBW:
+			bytesPerElement = 4;
 			break;
-		}
 
+		default:
+			return false;
+	}
 
-		// framebuffer data
-		case kOpcodeFramebufferData: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_framebuffer_data_t)) {
-				LOG(WARNING) << "Framebuffer data packet too small!";
-				return -1;
-			}
+	size_t available = (length - sizeof(lichtenstein_framebuffer_data_t));
+	return (fb->dataElements <= (available / bytesPerElement));
+}
+
+/**
+ * Adds a checksum to the packet.
+ */
+LichtensteinUtils::PacketErrors LichtensteinUtils::applyChecksum(void *data, size_t length) {
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
 
-			lichtenstein_framebuffer_data_t *fb;
-			fb = (lichtenstein_framebuffer_data_t *) _packet;
+	// validate packet length
+	if(length < sizeof(lichtenstein_header_t)) {
+		LOG(WARNING) << "attempted to convert a packet smaller than the header";
+		return kPacketTooSmall;
+	}
 
-			fb->destChannel = __builtin_bswap32(fb->destChannel);
+	// get CRC offset into the packet
+	size_t offset = offsetof(lichtenstein_header_t, opcode);
+	void *ptr = ((uint8_t *) header) + offset;
+	size_t len = (length - offset);
 
-			fb->dataFormat = __builtin_bswap32(fb->dataFormat);
-			fb->dataElements = __builtin_bswap32(fb->dataElements);
-			break;
-		}
-		// output command
-		case kOpcodeSyncOutput: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_sync_output_t)) {
-				LOG(WARNING) << "Sync output packet too small!";
-				return -1;
-			}
+	uint32_t crc = crc32_fast(ptr, len);
 
-			lichtenstein_sync_output_t *out;
-			out = (lichtenstein_sync_output_t *) _packet;
+	header->checksum = __builtin_bswap32(crc);
 
-			out->channels = __builtin_bswap32(out->channels);
-			break;
-		}
+	return kNoError;
+}
 
-		// node adoption
-		case kOpcodeNodeAdoption: {
-			size_t numChannels = 0;
+/**
+ * How to convert the packets for each opcode, indexed by opcode. Opcodes that
+ * have no packet defined have no converters.
+ */
+static constexpr LichtensteinCodec::Entry kCodecEntries[] = {
+	// kOpcodeNodeAnnouncement
+	LichtensteinCodec::entry<lichtenstein_node_announcement_t>("Node announcement"),
+	// kOpcodeServerAnnouncement
+	LichtensteinCodec::entry<lichtenstein_server_announcement_t>("Server announcement"),
+	// kOpcodeNodeAdoption: the acknowledgement we send has the ack flag set
+	{
+		LichtensteinCodec::variant<lichtenstein_node_adoption_t>("Node adoption"),
+		kFlagAck, LichtensteinCodec::variant<lichtenstein_node_adoption_ack_t>("Node adoption ack"),
+		0, {}
+	},
+	// kOpcodeNodeStatusReq: anything but the general status response is a
+	// sub-request, or the response to one
+	{
+		LichtensteinCodec::variant<lichtenstein_node_status_sub_req_t>("Status sub-request"),
+		kFlagResponse, LichtensteinCodec::variant<lichtenstein_node_status_histograms_t>("Status sub-response"),
+		sizeof(lichtenstein_node_status_t), LichtensteinCodec::variant<lichtenstein_node_status_t>("Node status")
+	},
+	// kOpcodeFramebufferData
+	LichtensteinCodec::entry<lichtenstein_framebuffer_data_t>("Framebuffer data"),
+	// kOpcodeNodeConfig
+	{},
+	// kOpcodeSyncOutput
+	LichtensteinCodec::entry<lichtenstein_sync_output_t>("Sync output"),
+	// kOpcodeReadGPIO, kOpcodeWriteGPIO, kOpcodeSystemReset, kOpcodeSystemSleep, kOpcodeKeepalive
+	{}, {}, {}, {}, {},
+	// kOpcodeNodeReconfig
+	LichtensteinCodec::entry<lichtenstein_reconfig_t>("Node reconfig"),
+	// kOpcodeFramebufferFragment: or the NACK we send for it
+	{
+		LichtensteinCodec::variant<lichtenstein_framebuffer_fragment_t>("Framebuffer fragment"),
+		kFlagNAck, LichtensteinCodec::variant<lichtenstein_framebuffer_fragment_nack_t>("Framebuffer fragment NACK"),
+		0, {}
+	},
+	// kOpcodeCumulativeAck
+	LichtensteinCodec::entry<lichtenstein_cumulative_ack_t>("Cumulative ack"),
+	// kOpcodeTimeSync
+	LichtensteinCodec::entry<lichtenstein_time_sync_t>("Time sync"),
+	// kOpcodeSyncOutputTimed
+	LichtensteinCodec::entry<lichtenstein_sync_output_timed_t>("Timed sync output"),
+	// kOpcodeColorCorrection
+	LichtensteinCodec::entry<lichtenstein_color_correction_t>("Color correction"),
+};
+
+static const size_t kNumCodecEntries = (sizeof(kCodecEntries) / sizeof(kCodecEntries[0]));
+
+static_assert(kNumCodecEntries == (kOpcodeColorCorrection + 1),
+			  "Every opcode needs an entry in the codec table");
 
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_node_adoption_t)) {
-				LOG(WARNING) << "Node adoption packet too small!";
-				return -1;
-			}
+/**
+ * Logs why a packet couldn't be converted. This is kept out of line so that
+ * the conversion itself doesn't need to set up for logging.
+ *
+ * @param name Name of the packet type that was too small, or nullptr if the
+ * opcode is unknown
+ *
+ * @return The error code to return from the conversion.
+ */
+__attribute__((noinline, cold))
+static int conversionFailed(const char *name, uint16_t opcode) {
+	if(name) {
+		LOG(WARNING) << name << " packet too small!";
+	} else {
+		LOG(ERROR) << "Unknown packet type " << opcode;
+	}
 
-			lichtenstein_node_adoption_t *adopt;
-			adopt = (lichtenstein_node_adoption_t *) _packet;
+	return -1;
+}
 
-			// byteswap regular fields
-			adopt->port = __builtin_bswap16(adopt->port);
-			adopt->flags = __builtin_bswap16(adopt->flags);
+/**
+ * Converts the body of a packet with the given opcode. Which packet types the
+ * opcode has is known at compile time, so their converters are inlined and
+ * only the checks that select between them remain.
+ */
+template<bool FromNetwork, size_t Opcode>
+static int convertBody(uint8_t *packet, size_t length, uint16_t flags) {
+	constexpr const LichtensteinCodec::Entry &entry = kCodecEntries[Opcode];
 
-			if(fromNetworkOrder) {
-				adopt->numChannels = __builtin_bswap32(adopt->numChannels);
-				numChannels = adopt->numChannels;
+	if constexpr(entry.base.convert[FromNetwork] == nullptr) {
+		return conversionFailed(nullptr, Opcode);
+	} else {
+		const char *name = entry.base.name;
+		int err;
+
+		if constexpr(entry.exactLength != 0 && entry.flag != 0) {
+			if(length == entry.exactLength) {
+				name = entry.exact.name;
+				err = entry.exact.convert[FromNetwork](packet, length);
+			} else if(flags & entry.flag) {
+				name = entry.flagged.name;
+				err = entry.flagged.convert[FromNetwork](packet, length);
 			} else {
-				numChannels = adopt->numChannels;
-				adopt->numChannels = __builtin_bswap32(adopt->numChannels);
+				err = entry.base.convert[FromNetwork](packet, length);
 			}
-
-			// byteswap the pixels per channel array
-			for(size_t i = 0; i < numChannels; i++) {
-				adopt->pixelsPerChannel[i] = __builtin_bswap32(adopt->pixelsPerChannel[i]);
+		} else if constexpr(entry.flag != 0) {
+			if(flags & entry.flag) {
+				name = entry.flagged.name;
+				err = entry.flagged.convert[FromNetwork](packet, length);
+			} else {
+				err = entry.base.convert[FromNetwork](packet, length);
 			}
+		} else {
+			static_assert(entry.exactLength == 0, "Entries selecting by length must also select by flag");
+			err = entry.base.convert[FromNetwork](packet, length);
+		}
 
-			break;
+		if(err != 0) {
+			return conversionFailed(name, Opcode);
 		}
 
-		// reconfig
-		case kOpcodeNodeReconfig: {
-			// ensure the length is correct
-			if(length < sizeof(lichtenstein_node_adoption_t)) {
-				LOG(WARNING) << "Node reconfig packet too small!";
-				return -1;
-			}
+		return 0;
+	}
+}
 
-			lichtenstein_reconfig_t *adopt;
-			adopt = (lichtenstein_reconfig_t *) _packet;
+typedef int (*BodyConverter)(uint8_t *, size_t, uint16_t);
 
-			break;
-		}
+/**
+ * Builds the table of body converters, indexed by opcode.
+ */
+template<bool FromNetwork, size_t... Opcode>
+static constexpr std::array<BodyConverter, sizeof...(Opcode)> makeBodyConverters(std::index_sequence<Opcode...>) {
+	return {{&convertBody<FromNetwork, Opcode>...}};
+}
 
-		// should never get here
-		default: {
-			LOG(ERROR) << "Unknown packet type " << opcode;
-			return -1;
-		}
+/// converters to network byte order, and from it
+static constexpr std::array<BodyConverter, kNumCodecEntries> kBodyConverters[2] = {
+	makeBodyConverters<false>(std::make_index_sequence<kNumCodecEntries>()),
+	makeBodyConverters<true>(std::make_index_sequence<kNumCodecEntries>()),
+};
+
+/**
+ * Swaps all multibyte fields in a packet. The code for each packet type is
+ * generated from its layout (see LichtensteinCodec.h); this only looks up
+ * the converter for the opcode.
+ *
+ * @param _packet Packet
+ * @param fromNetworkorder Set if the packet is in network order
+ * @param length Total number of bytes in packet
+ *
+ * @return 0 if the conversion was a success, error code otherwise.
+ */
+int LichtensteinUtils::convertPacketByteOrder(void *_packet, bool fromNetworkOrder, size_t length) {
+	uint8_t *packet = static_cast<uint8_t *>(_packet);
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(_packet);
+
+	if(length < sizeof(lichtenstein_header_t)) {
+		return conversionFailed("Header", 0);
+	}
+
+	// get the fields that select the packet type in host byte order
+	uint16_t opcode = header->opcode;
+	uint16_t flags = header->flags;
+	uint32_t payloadLength = header->payloadLength;
+
+	if(fromNetworkOrder) {
+		opcode = __builtin_bswap16(opcode);
+		flags = __builtin_bswap16(flags);
+		payloadLength = __builtin_bswap32(payloadLength);
+	}
+
+	// first, process the header
+	LichtensteinCodec::convertHeader(packet);
+
+	// return immediately if payload length is zero (its a request)
+	if(payloadLength == 0) {
+		return 0;
+	}
+
+	// then, the body
+	if(opcode >= kNumCodecEntries) {
+		return conversionFailed(nullptr, opcode);
 	}
 
-	// if we get down here, conversion was a success
-	return 0;
+	return kBodyConverters[fromNetworkOrder][opcode](packet, length, flags);
 }
 
 /**
@@ -322,7 +466,7 @@ void LichtensteinUtils::populateHeader(void *data, uint16_t opcode) {
 
 	header->opcode = opcode;
 
-	// we don't really care about sequences
+	// packets we send are never split into sequences
 	header->sequenceIndex = 0;
 	header->sequenceNumPackets = 0;
 
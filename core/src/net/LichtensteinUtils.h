@@ -15,7 +15,24 @@ class LichtensteinUtils {
 
 			kInvalidChecksum = 0x100,
 			kPacketTooSmall,
-			kInvalidMagic
+			kInvalidMagic,
+			// couldn't be converted to host byte order (truncated or unknown)
+			kMalformedPacket
+		};
+
+		/**
+		 * State of a checksum whose verification was deferred by ingestPacket
+		 * until the packet's payload is copied to where it's needed.
+		 */
+		struct PartialChecksum {
+			// whether the payload still needs to be checksummed
+			bool pending = false;
+			// cleared if the checksum turned out to be wrong
+			bool valid = true;
+
+			// CRC over the header and fixed fields, and the one in the packet
+			uint32_t crc = 0;
+			uint32_t expected = 0;
 		};
 
 	public:
@@ -23,6 +40,10 @@ class LichtensteinUtils {
 
 		static PacketErrors validatePacket(void *data, size_t length);
 
+		static PacketErrors ingestPacket(void *data, size_t length, PartialChecksum *partial = nullptr);
+		static PacketErrors copyPayload(PartialChecksum *partial, void *dest, const void *payload, size_t copyLength, size_t payloadLength);
+		static PacketErrors verifyPayload(PartialChecksum *partial, const void *payload, size_t payloadLength);
+
 		static PacketErrors applyChecksum(void *data, size_t length);
 
 		static int convertToHostByteOrder(void *data, size_t length) {
@@ -37,9 +58,13 @@ class LichtensteinUtils {
 			return (validatePacket(data, length) == kNoError);
 		}
 
+		static bool framebufferDataFits(void *data, size_t length);
+
 	private:
 		static int convertPacketByteOrder(void *_packet, bool fromNetworkOrder, size_t length);
 
+		static PacketErrors finishChecksum(PartialChecksum *partial, uint32_t crc);
+
 	private:
 		static void _convertToHostNodeAnnouncement(void *data, size_t length);
 };
@@ -0,0 +1,216 @@
+#include "PacketCapture.h"
+
+#include <glog/logging.h>
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Creates (or truncates) the capture file, and writes its header.
+ */
+PacketCapture::PacketCapture(const std::string &_path) : path(_path) {
+	this->fd = open(this->path.c_str(), (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC), 0644);
+	PLOG_IF(FATAL, this->fd < 0) << "Couldn't open capture file " << this->path;
+
+	this->grow(sizeof(FileHeader));
+
+	// write the header
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	FileHeader *header = reinterpret_cast<FileHeader *>(this->map);
+
+	header->magic = kMagic;
+	header->version = kVersion;
+	header->startTime = (static_cast<uint64_t>(now.tv_sec) * 1000000000ULL) + now.tv_nsec;
+
+	this->used = sizeof(FileHeader);
+
+	LOG(INFO) << "Capturing received packets to " << this->path;
+}
+
+/**
+ * Unmaps the file and truncates it to the data actually written.
+ */
+PacketCapture::~PacketCapture() {
+	int err;
+
+	if(this->map) {
+		err = munmap(this->map, this->mapSize);
+		PLOG_IF(ERROR, err != 0) << "Couldn't unmap capture file";
+	}
+
+	if(this->fd >= 0) {
+		err = ftruncate(this->fd, this->used);
+		PLOG_IF(ERROR, err != 0) << "Couldn't truncate capture file";
+
+		err = close(this->fd);
+		PLOG_IF(ERROR, err != 0) << "Couldn't close capture file";
+	}
+
+	LOG(INFO) << "Captured " << this->numPackets << " packets (" << this->used
+		<< " bytes) to " << this->path;
+}
+
+
+
+/**
+ * Appends a datagram to the capture. This may be called from any thread.
+ */
+void PacketCapture::write(const void *data, size_t length, const struct timespec &rxTimestamp, const struct in_addr &dest) {
+	std::lock_guard<std::mutex> lck(this->lock);
+
+	const size_t recordSize = getRecordSize(length);
+
+	if((this->used + recordSize) > this->mapSize) {
+		this->grow(this->used + recordSize);
+	}
+
+	// write the record header, followed by the data
+	RecordHeader *header = reinterpret_cast<RecordHeader *>(this->map + this->used);
+
+	header->timestamp = (static_cast<uint64_t>(rxTimestamp.tv_sec) * 1000000000ULL) + rxTimestamp.tv_nsec;
+	header->length = length;
+	header->dest = dest.s_addr;
+
+	memcpy(this->map + this->used + sizeof(RecordHeader), data, length);
+
+	this->used += recordSize;
+	this->numPackets++;
+}
+
+/**
+ * Grows the file (and the mapping) so it can hold at least the given number of
+ * bytes; it's grown in steps of kGrowSize.
+ */
+void PacketCapture::grow(size_t required) {
+	int err;
+
+	const size_t newSize = ((required + kGrowSize - 1) / kGrowSize) * kGrowSize;
+
+	if(this->map) {
+		err = munmap(this->map, this->mapSize);
+		PLOG_IF(ERROR, err != 0) << "Couldn't unmap capture file";
+	}
+
+	err = ftruncate(this->fd, newSize);
+	PLOG_IF(FATAL, err != 0) << "Couldn't grow capture file to " << newSize << " bytes";
+
+	void *map = mmap(nullptr, newSize, (PROT_READ | PROT_WRITE), MAP_SHARED, this->fd, 0);
+	PLOG_IF(FATAL, map == MAP_FAILED) << "Couldn't map capture file";
+
+	this->map = static_cast<char *>(map);
+	this->mapSize = newSize;
+}
+
+
+
+/**
+ * Maps the capture file and checks its header. If the file can't be read, or
+ * isn't a capture file, isValid() returns false.
+ */
+PacketCaptureReader::PacketCaptureReader(const std::string &path) {
+	int err;
+	struct stat info;
+
+	this->fd = open(path.c_str(), (O_RDONLY | O_CLOEXEC));
+
+	if(this->fd < 0) {
+		PLOG(ERROR) << "Couldn't open capture file " << path;
+		return;
+	}
+
+	err = fstat(this->fd, &info);
+
+	if(err != 0) {
+		PLOG(ERROR) << "Couldn't get size of capture file " << path;
+		return;
+	} else if(static_cast<size_t>(info.st_size) < sizeof(PacketCapture::FileHeader)) {
+		LOG(ERROR) << "Capture file " << path << " is too small";
+		return;
+	}
+
+	void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+
+	if(map == MAP_FAILED) {
+		PLOG(ERROR) << "Couldn't map capture file " << path;
+		return;
+	}
+
+	// validate the header
+	const PacketCapture::FileHeader *header = static_cast<const PacketCapture::FileHeader *>(map);
+
+	if(header->magic != PacketCapture::kMagic || header->version != PacketCapture::kVersion) {
+		LOG(ERROR) << "Capture file " << path << " has invalid magic or version ("
+			<< header->magic << ", " << header->version << ")";
+
+		munmap(map, info.st_size);
+		return;
+	}
+
+	// we read the file front to back
+	madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+	this->map = static_cast<const char *>(map);
+	this->mapSize = info.st_size;
+	this->startTime = header->startTime;
+
+	this->rewind();
+}
+
+/**
+ * Unmaps the file.
+ */
+PacketCaptureReader::~PacketCaptureReader() {
+	if(this->map) {
+		munmap(const_cast<char *>(this->map), this->mapSize);
+	}
+
+	if(this->fd >= 0) {
+		close(this->fd);
+	}
+}
+
+
+
+/**
+ * Gets the next record in the file. The header and data point into the
+ * mapping, and remain valid until the reader is deallocated.
+ *
+ * @return Whether there was another record; false at the end of the file, or
+ * if the record is truncated.
+ */
+bool PacketCaptureReader::next(const PacketCapture::RecordHeader **header, const void **data) {
+	// is there a full record header?
+	if((this->offset + sizeof(PacketCapture::RecordHeader)) > this->mapSize) {
+		return false;
+	}
+
+	const PacketCapture::RecordHeader *record = reinterpret_cast<const PacketCapture::RecordHeader *>(this->map + this->offset);
+
+	// and all of its data?
+	if((this->mapSize - this->offset - sizeof(PacketCapture::RecordHeader)) < record->length) {
+		LOG(WARNING) << "Capture file is truncated at offset " << this->offset;
+		return false;
+	}
+
+	*header = record;
+	*data = (this->map + this->offset + sizeof(PacketCapture::RecordHeader));
+
+	this->offset += PacketCapture::getRecordSize(record->length);
+
+	return true;
+}
+
+/**
+ * Goes back to the first record.
+ */
+void PacketCaptureReader::rewind(void) {
+	this->offset = sizeof(PacketCapture::FileHeader);
+}
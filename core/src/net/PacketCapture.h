@@ -0,0 +1,126 @@
+/**
+ * Capture files record the datagrams the client receives, exactly as they
+ * arrived, along with when they arrived; they can then be replayed into the
+ * protocol handler to benchmark the client with a real server's traffic.
+ *
+ * A capture file starts with a file header, followed by one record per
+ * datagram: a record header, then the datagram itself, padded to a multiple of
+ * 8 bytes. All fields are in the byte order of the machine that captured it.
+ *
+ * Files are written and read through a memory mapping; while capturing, the
+ * file grows in large steps, and it's truncated to its actual length once the
+ * capture is closed.
+ */
+#ifndef PACKETCAPTURE_H
+#define PACKETCAPTURE_H
+
+#include <mutex>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// for struct in_addr
+#include <netinet/in.h>
+
+class PacketCapture {
+	public:
+		PacketCapture(const std::string &path);
+		~PacketCapture();
+
+		void write(const void *data, size_t length, const struct timespec &rxTimestamp, const struct in_addr &dest);
+
+		size_t getNumPackets(void) const {
+			return this->numPackets;
+		}
+
+	public:
+		/// magic value at the start of the file ('LCAP')
+		static const uint32_t kMagic = 0x5041434c;
+		/// current version of the file format
+		static const uint32_t kVersion = 1;
+
+	#pragma pack(push, 1)
+		struct FileHeader {
+			uint32_t magic;
+			uint32_t version;
+
+			// time at which the capture started (ns since the epoch)
+			uint64_t startTime;
+		};
+
+		struct RecordHeader {
+			// time at which the kernel received the datagram (ns since the epoch)
+			uint64_t timestamp;
+
+			// length of the datagram, in bytes
+			uint32_t length;
+			// address the datagram was sent to (IP_PKTINFO; network byte order)
+			uint32_t dest;
+		};
+	#pragma pack(pop)
+
+		/**
+		 * Returns the number of bytes a record of the given length takes up.
+		 */
+		static size_t getRecordSize(size_t length) {
+			return ((sizeof(RecordHeader) + length + 7) & ~static_cast<size_t>(7));
+		}
+
+	private:
+		void grow(size_t required);
+
+	private:
+		// amount by which the file is grown at a time
+		static const size_t kGrowSize = (4 * 1024 * 1024);
+
+		std::string path;
+		int fd = -1;
+
+		// the mapping, its size, and how much of it is used
+		char *map = nullptr;
+		size_t mapSize = 0;
+		size_t used = 0;
+
+		size_t numPackets = 0;
+
+		// packets may be received by several shards at once
+		std::mutex lock;
+};
+
+/**
+ * Reads the records of a capture file in order.
+ */
+class PacketCaptureReader {
+	public:
+		PacketCaptureReader(const std::string &path);
+		~PacketCaptureReader();
+
+		bool isValid(void) const {
+			return (this->map != nullptr);
+		}
+
+		bool next(const PacketCapture::RecordHeader **header, const void **data);
+		void rewind(void);
+
+		/**
+		 * Returns the time at which the capture started.
+		 */
+		uint64_t getStartTime(void) const {
+			return this->startTime;
+		}
+
+	private:
+		int fd = -1;
+
+		const char *map = nullptr;
+		size_t mapSize = 0;
+
+		// offset of the next record
+		size_t offset = 0;
+
+		uint64_t startTime = 0;
+};
+
+#endif
@@ -1,20 +1,38 @@
 #include "ProtocolHandler.h"
 
 #include "LichtensteinUtils.h"
+#include "FrameReassembler.h"
+#include "ClockSync.h"
+#include "PacketCapture.h"
+#include "InterfaceMonitor.h"
 #include "lichtenstein_proto.h"
 
 #include "../output/OutputFrame.h"
+#include "../output/FramebufferArena.h"
 
 #include "../status/StatusHandler.h"
 
+#include "../event/PlatformReactor.h"
+
+#include "../util/BufferPool.h"
+#include "../util/SpscRing.h"
+#include "../util/ThreadUtils.h"
+
+#include "../config/Config.h"
+#include "../metrics/MetricsRegistry.h"
+
 #include <glog/logging.h>
-#include <INIReader.h>
 #include <cpptime.h>
 
 #include <chrono>
 #include <bitset>
+#include <algorithm>
 
 #include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -22,10 +40,11 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/utsname.h>
 #include <fcntl.h>
 
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 
@@ -41,15 +60,35 @@
 #include <sys/sysinfo.h>
 #endif
 
-// for some platforms (macOS) HOST_NAME_MAX is not defined
-#ifndef HOST_NAME_MAX
-	#define HOST_NAME_MAX 255
+// classic BPF, to steer packets among sockets with SO_REUSEPORT
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+// timerfd, to output timed syncs at their presentation time
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+// scheduling policy and thread ids, to prioritize the data plane
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #endif
 
 /// packet buffer size
 static const size_t kClientBufferSz = (1024 * 8);
 /// control buffer size for recvfrom
 static const size_t kControlBufSz = (1024);
+/// maximum number of acknowledgements sent with a single sendmmsg call
+static const size_t kMaxAckBatchSize = 64;
+/// timed syncs further in the future than this (in seconds) are output right away
+static const time_t kMaxPresentationDelay = 10;
+/// interval at which metrics (and thus status responses) are refreshed, in ms
+static const unsigned long kMetricsSnapshotInterval = 1000;
+/// packets replayed before yielding to other events, when replaying as fast as possible
+static const size_t kMaxReplayBatch = 64;
 
 // current software version
 extern const uint32_t kLichtensteinSWVersion;
@@ -57,10 +96,43 @@ extern const uint32_t kLichtensteinSWVersion;
 
 
 /**
- * Trampoline to get into the worker thread
+ * Acknowledgement template: the destination address, and a header in network
+ * byte order that has all fields but the opcode, flags, transaction and
+ * checksum filled in.
+ */
+struct ProtocolHandler::AckTemplate {
+	struct sockaddr_in addr;
+	lichtenstein_header_t header;
+};
+
+
+
+/**
+ * Returns the CPU time (user and system) used by the process so far, in µs.
  */
-void ProtocolHandlerThreadEntry(void *ctx) {
-	(static_cast<ProtocolHandler *>(ctx))->workerEntry();
+static uint64_t getProcessCpuTimeUs(void) {
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+
+	return (static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL) +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * Trampoline to get into a shard's worker thread
+ */
+void ProtocolHandlerThreadEntry(void *ctx, void *shard) {
+	(static_cast<ProtocolHandler *>(ctx))->workerEntry(static_cast<ProtocolHandler::Shard *>(shard));
+}
+
+/**
+ * Trampoline to get into a shard's receive thread
+ */
+void ProtocolHandlerReceiverEntry(void *ctx, void *shard) {
+	(static_cast<ProtocolHandler *>(ctx))->receiverEntry(static_cast<ProtocolHandler::Shard *>(shard));
 }
 
 
@@ -68,27 +140,128 @@ void ProtocolHandlerThreadEntry(void *ctx) {
 /**
  * Initializes the protocol handler
  */
-ProtocolHandler::ProtocolHandler(INIReader *_config) : config(_config) {
-	int err = 0;
-	int fd[2];
+ProtocolHandler::ProtocolHandler(const Config *_config) : config(_config) {
+	static_assert((ProtocolHandler::kChannelBitmapWords * 32) == kLichtensteinMaxChannels,
+				  "Channel bitmap size doesn't match maximum number of channels");
+
+	// cache the port
+	this->port = this->config->getClient().port;
+
+	// reset state shared between shards
+	this->isAdopted = false;
+	this->lastServerMessageOn = 0;
+
+	// register counters
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
+
+	this->rxPackets = metrics->registerCounter("net.rxPackets");
+	this->rxBytes = metrics->registerCounter("net.rxBytes");
+	this->txPackets = metrics->registerCounter("net.txPackets");
+	this->txBytes = metrics->registerCounter("net.txBytes");
+	this->packetsWithInvalidCRC = metrics->registerCounter("net.invalidCrc");
+	this->pipelineOverruns = metrics->registerCounter("net.pipelineOverruns");
+
+	this->framebufferPacketsDiscarded = metrics->registerCounter("net.framebufferDiscarded");
+	this->outputPacketsDiscarded = metrics->registerCounter("net.outputDiscarded");
+	this->framesOutput = metrics->registerCounter("output.frames");
+	this->framesOverwritten = metrics->registerCounter("output.framesOverwritten");
+	this->outputState = metrics->registerGauge("output.state");
+
+	// and the latency histograms
+	static_assert(ProtocolHandler::kNumStages == kNumPipelineStages,
+				  "Number of latency histograms doesn't match pipeline stages");
+
+	this->stageLatency[kStageReceive] = metrics->registerHistogram("latency.receive");
+	this->stageLatency[kStageValidate] = metrics->registerHistogram("latency.validate");
+	this->stageLatency[kStageFrame] = metrics->registerHistogram("latency.frame");
+	this->stageLatency[kStagePluginQueue] = metrics->registerHistogram("latency.pluginQueue");
+	this->stageLatency[kStageHardwareSubmit] = metrics->registerHistogram("latency.hardwareSubmit");
+	this->stageLatency[kStageAckSend] = metrics->registerHistogram("latency.ackSend");
+
+	// frames are acknowledged individually until the server asks otherwise
+	this->cumulativeAcks = false;
+
+	for(size_t i = 0; i < kChannelBitmapWords; i++) {
+		this->acceptedChannels[i] = 0;
+		this->nackedChannels[i] = 0;
+	}
+
+	for(ChannelLatency &channel : this->latency) {
+		channel.totalUs = 0;
+		channel.frames = 0;
+		channel.maxUs = 0;
+	}
 
-	// create the threada communicating pipe
-	err = pipe(fd);
-	PLOG_IF(FATAL, err != 0) << "Couldn't create pipe, fcntl is fucked";
+	// framebuffers are allocated on adoption, but may never exceed what we announce
+	this->framebuffers = new FramebufferArena(this->config->getOutput().fbSize);
 
-	this->workerPipeRead = fd[0];
-	this->workerPipeWrite = fd[1];
+	// set up clock synchronization
+	this->clockSync = new ClockSync(this->config->getClient().clockSyncTestOffset * 1000LL);
 
-	// enable non-blocking IO on the read end of the pipe
-	int flags = fcntl(this->workerPipeRead, F_GETFL);
-	PCHECK(flags != -1) << "Couldn't get flags, fcntl is fucked";
+	// allocate buffers for sending acknowledgements
+	this->ackPackets = new lichtenstein_header_t[kMaxAckBatchSize];
+	this->ackIov = new struct iovec[kMaxAckBatchSize];
 
-	flags |= O_NONBLOCK;
+#ifdef __linux__
+	this->ackMsgs = new struct mmsghdr[kMaxAckBatchSize];
+#endif
+
+	this->pendingAcks.reserve(kMaxAckBatchSize);
+	this->flushingAcks.reserve(kMaxAckBatchSize);
+
+	// get the batch size (the config makes sure it's in range)
+	long batch = this->config->getClient().rxBatchSize;
+
+#ifndef __linux__
+	// recvmmsg is linux only; everyone else reads one datagram per syscall
+	batch = 1;
+#endif
+
+	this->rxBatchSize = static_cast<unsigned int>(batch);
+
+	LOG(INFO) << "Receiving up to " << this->rxBatchSize << " packets per syscall";
+
+	// get the number of extra buffers
+	this->rxExtraBuffers = static_cast<unsigned int>(this->config->getClient().rxBuffers);
+
+	// receive on separate threads, if requested; a replay has nothing to receive
+	if(this->config->getClient().pipeline) {
+#ifdef __linux__
+		if(this->config->getCapture().replayFile.empty()) {
+			this->pipeline = true;
+			this->pipelineDepth = static_cast<size_t>(this->config->getClient().pipelineDepth);
+
+			LOG(INFO) << "Receiving on separate threads, up to " << this->pipelineDepth
+				<< " packets waiting per shard";
+		} else {
+			LOG(INFO) << "Not using the pipeline while replaying";
+		}
+#else
+		LOG(WARNING) << "The pipeline requires Linux; packets are handled on the receiving thread";
+#endif
+	}
+
+	// set up capturing received packets, or replaying a previous capture
+	const Config::Capture &capture = this->config->getCapture();
+
+	if(!capture.file.empty()) {
+		this->capture = new PacketCapture(capture.file);
+	}
+
+	if(!capture.replayFile.empty()) {
+		this->replay = new PacketCaptureReader(capture.replayFile);
+		CHECK(this->replay->isValid()) << "Couldn't read replay file " << capture.replayFile;
+
+		this->replaySpeed = capture.replaySpeed;
+
+		LOG(INFO) << "Replaying packets from " << capture.replayFile << " at "
+			<< ((this->replaySpeed > 0) ? std::to_string(this->replaySpeed) + "x speed" : "full speed");
+	}
 
-	err = fcntl(this->workerPipeRead, F_SETFL, flags);
-	PCHECK(err != -1) << "Couldn't set flags, fcntl is fucked";
+	// open the sockets; this creates the shards
+	this->setUpSockets();
 
-	// start the thread
+	// start the threads
 	this->start();
 }
 
@@ -96,36 +269,74 @@ ProtocolHandler::ProtocolHandler(INIReader *_config) : config(_config) {
  * Cleans up all resources, and stops the handler if it hasn't been already.
  */
 ProtocolHandler::~ProtocolHandler() {
-	int err = 0;
-
-	// is the thread still running?
-	if(this->run || this->worker != nullptr) {
+	// are the threads still running?
+	if(this->run || this->shards[kControlShard]->worker != nullptr) {
 		this->stop();
 	}
 
-	// close the thread communicating pipe
-	close(this->workerPipeRead);
-	close(this->workerPipeWrite);
+	// close sockets and release the shards' event loops
+	this->cleanUpSockets();
+
+	for(Shard *shard : this->shards) {
+		delete shard->rxRing;
+		delete shard->rxReactor;
+		delete shard->reactor;
+		delete shard;
+	}
+
+	this->shards.clear();
+
+	// release ack templates and buffers
+	for(auto it : this->ackTemplates) {
+		delete it.second;
+	}
+
+#ifdef __linux__
+	delete[] this->ackMsgs;
+#endif
+
+	delete[] this->ackIov;
+	delete[] this->ackPackets;
+
+	delete[] this->announcement;
+
+	delete this->clockSync;
+
+	delete this->framebuffers;
+
+	// close the capture files
+	delete this->capture;
+	delete this->replay;
 }
 
 
 
 /**
- * Starts the protocol handler thread.
+ * Starts the worker thread of each shard.
  */
 void ProtocolHandler::start(void) {
 	// make sure there's no existing thread
-	CHECK(this->worker == nullptr) << "Trying to start thread when it's already running, fuck off";
+	CHECK(this->shards[kControlShard]->worker == nullptr) << "Trying to start thread when it's already running, fuck off";
 
 	// run
 	this->run = true;
 
-	// create a thread
-	this->worker = new std::thread(ProtocolHandlerThreadEntry, this);
+	// create a thread for each shard
+	for(Shard *shard : this->shards) {
+		shard->worker = new std::thread(ProtocolHandlerThreadEntry, this, shard);
+	}
+
+	// and one to receive its packets, if they're pipelined
+	if(this->pipeline) {
+		for(Shard *shard : this->shards) {
+			shard->receiverJoined = false;
+			shard->receiver = new std::thread(ProtocolHandlerReceiverEntry, this, shard);
+		}
+	}
 }
 
 /**
- * Stops the protocol handler thread.
+ * Stops the worker threads of all shards.
  */
 void ProtocolHandler::stop(void) {
 	int err = 0;
@@ -133,437 +344,2069 @@ void ProtocolHandler::stop(void) {
 	// clear the running flag
 	this->run = false;
 
-	// write to the pipe to unblock the thread
-	int blah = kWorkerShutdown;
-	err = write(this->workerPipeWrite, &blah, sizeof(blah));
+	// stop receiving first, so no more packets are passed to the workers
+	for(Shard *shard : this->shards) {
+		if(!shard->receiver) {
+			continue;
+		}
 
-	if(err < 0) {
-		PLOG(ERROR) << "Couldn't write to pipe, shit's fucked";
+		err = shard->rxReactor->postCommand(kWorkerShutdown);
+		LOG_IF(ERROR, err != 0) << "Couldn't post shutdown command to receive thread of shard "
+			<< shard->index << ": " << err;
 
-		// if we can't write to the pipe we're fucked, just kill the socket
-		close(this->socket);
-		this->socket = -1;
-	}
+		shard->receiver->join();
 
-	// wait for thread to end
-	this->worker->join();
+		delete shard->receiver;
+		shard->receiver = nullptr;
 
-	delete this->worker;
-	this->worker = nullptr;
-}
+		shard->receiverJoined = true;
+	}
 
+	// wake up the threads so they notice
+	for(Shard *shard : this->shards) {
+		err = shard->reactor->postCommand(kWorkerShutdown);
+		LOG_IF(ERROR, err != 0) << "Couldn't post shutdown command to shard "
+			<< shard->index << ": " << err;
+	}
+
+	// wait for threads to end
+	for(Shard *shard : this->shards) {
+		shard->worker->join();
 
+		delete shard->worker;
+		shard->worker = nullptr;
+	}
+}
 
 /**
- * Thread entry point
+ * Starts replaying the configured capture file on the control shard. If no
+ * replay was configured, this does nothing.
  */
-void ProtocolHandler::workerEntry(void) {
-	int err = 0, rsz;
-	fd_set readfds;
-
-	// set up sockets
-	this->setUpSocket();
+void ProtocolHandler::startReplay(void) {
+	if(!this->replay) {
+		return;
+	}
 
-	// allocate the read buffer
-	char *buffer = new char[kClientBufferSz];
+	int err = this->shards[kControlShard]->reactor->postCommand(kWorkerReplay);
+	LOG_IF(ERROR, err != 0) << "Couldn't post replay command: " << err;
+}
 
-	// used for recvmsg
-	struct msghdr msg;
-	struct sockaddr_storage srcAddr;
 
-	struct iovec iov[1];
-	iov[0].iov_base = buffer;
-	iov[0].iov_len = kClientBufferSz;
 
-	char *controlBuf = new char[kControlBufSz];
+/**
+ * Thread entry point for a shard. Besides receiving packets, the control shard
+ * also sends announcements, and the sync shard outputs timed syncs, keeps the
+ * clock synchronized and sends acknowledgements.
+ */
+void ProtocolHandler::workerEntry(Shard *shard) {
+	int err = 0;
+	const bool isControl = (shard->index == kControlShard);
+	const bool isSync = (shard->index == this->syncShard);
 
-	// send an announcement when the thread becomes alive and alloc timer
-	double initial = this->config->GetReal("client", "announcementIntervalInitial", 10);
-	const unsigned long initialLong = static_cast<unsigned long>(initial * 1000);
+	this->applyThreadPriority(shard);
 
-	double subsequent = this->config->GetReal("client", "announcementInterval", 10);
-	const unsigned long subsequentLong = static_cast<unsigned long>(subsequent * 1000);
+	// allocate the receive buffers, unless the receive thread does the receiving
+	if(this->pipeline) {
+		ThreadUtils::pinToCpu(ThreadUtils::cpuForThread(this->config->getClient().decodeCpus, shard->index));
+	} else {
+		this->allocReceiveRing(shard);
+	}
 
-	this->announcementTimer = this->timer.add(std::chrono::milliseconds(initialLong),
-	[this](CppTime::timer_id) {
-		// send the command
-		int blah = kWorkerAnnounce;
-		int err = write(this->workerPipeWrite, &blah, sizeof(blah));
+	shard->reassembler = new FrameReassembler(this->config, this, this->shards.size());
 
-		PLOG_IF(ERROR, err < 0) << "Couldn't write announcement command";
+	// wait on the socket (unless packets are replayed or received by another
+	// thread instead) and for commands
+	if(!this->replay && !this->pipeline) {
+		err = shard->reactor->addDescriptor(shard->socket, Reactor::kEventReadable,
+		[this, shard](uint32_t) {
+			this->receivePackets(shard);
+		});
+		CHECK(err == 0) << "Couldn't register socket with reactor: " << err;
+	}
 
-		// this->sendAnnouncement();
-	}, std::chrono::milliseconds(subsequentLong));
+	shard->reactor->setCommandHandler([this, shard](unsigned int command) {
+		this->handleCommand(shard, command);
+	});
+
+	// send an announcement when the thread becomes alive and alloc timer; a
+	// replay has no use for them
+	if(isControl && !this->replay) {
+		double initial = this->config->getClient().announcementIntervalInitial;
+		const unsigned long initialLong = static_cast<unsigned long>(initial * 1000);
+
+		double subsequent = this->config->getClient().announcementInterval;
+		const unsigned long subsequentLong = static_cast<unsigned long>(subsequent * 1000);
+
+		this->announcementTimer = this->timer.add(std::chrono::milliseconds(initialLong),
+		[shard](CppTime::timer_id) {
+			// send the command
+			int err = shard->reactor->postCommand(kWorkerAnnounce);
+			LOG_IF(ERROR, err != 0) << "Couldn't post announcement command: " << err;
+		}, std::chrono::milliseconds(subsequentLong));
+	}
 
-	// main loop; wait on socket and pipe
-	while(this->run) {
-		// set up the read descriptors we wait on
-		int max = this->socket;
+	// keep the announcement up to date, and announce as soon as addresses change
+	if(isControl && !this->replay) {
+		this->interfaceMonitor = new InterfaceMonitor();
 
-		if(this->workerPipeRead > max) {
-			max = this->workerPipeRead;
+		if(this->interfaceMonitor->getDescriptor() >= 0) {
+			err = shard->reactor->addDescriptor(this->interfaceMonitor->getDescriptor(),
+				Reactor::kEventReadable, [this, shard](uint32_t) {
+				this->handleInterfaceChanges(shard);
+			});
+			CHECK(err == 0) << "Couldn't register interface monitor with reactor: " << err;
+		} else {
+			delete this->interfaceMonitor;
+			this->interfaceMonitor = nullptr;
 		}
+	}
 
-		FD_ZERO(&readfds);
-		FD_SET(this->socket, &readfds);
-		FD_SET(this->workerPipeRead, &readfds);
-
-		// block on the file descriptors
-		err = select((max + 1), &readfds, nullptr, nullptr, nullptr);
+	// synchronize our clock with the server's, and set up the timer for timed syncs
+	if(isSync) {
+		double interval = this->config->getClient().clockSyncInterval;
+		const auto intervalMs = std::chrono::milliseconds(static_cast<unsigned long>(interval * 1000));
 
-		if(err < 0) {
-			PLOG(INFO) << "select failed";
-			continue;
+		if(interval > 0) {
+			this->clockSyncTimer = this->timer.add(intervalMs, [shard](CppTime::timer_id) {
+				int err = shard->reactor->postCommand(kWorkerClockSync);
+				LOG_IF(ERROR, err != 0) << "Couldn't post clock sync command: " << err;
+			}, intervalMs);
 		}
 
-		// did we receive anything on the socket?
-		if(FD_ISSET(this->socket, &readfds)) {
-			// populate the message buffer
-			memset(&msg, 0, sizeof(msg));
+#ifdef __linux__
+		this->outputTimer = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+		PLOG_IF(FATAL, this->outputTimer < 0) << "Couldn't create output timer";
+
+		err = shard->reactor->addDescriptor(this->outputTimer, Reactor::kEventReadable,
+		[this](uint32_t) {
+			this->handleOutputTimer();
+		});
+		CHECK(err == 0) << "Couldn't register output timer with reactor: " << err;
+#endif
+	}
 
-			msg.msg_name = &srcAddr;
-			msg.msg_namelen = sizeof(srcAddr);
-			msg.msg_iov = iov;
-			msg.msg_iovlen = 1;
-			msg.msg_control = controlBuf;
-			msg.msg_controllen = kControlBufSz;
+	// refresh the metrics that status responses are built from
+	if(isControl) {
+		const auto snapshotInterval = std::chrono::milliseconds(kMetricsSnapshotInterval);
 
-			// clear the buffer, then read from the socket
-			memset(buffer, 0, kClientBufferSz);
-			rsz = recvmsg(this->socket, &msg, 0);
+		this->metricsTimer = this->timer.add(snapshotInterval, [shard](CppTime::timer_id) {
+			int err = shard->reactor->postCommand(kWorkerSnapshotMetrics);
+			LOG_IF(ERROR, err != 0) << "Couldn't post metrics snapshot command: " << err;
+		}, snapshotInterval);
+	}
 
-			// if the read size was zero, the connection was closed
-			if(rsz == 0) {
-				LOG(WARNING) << "Connection " << this->socket << " closed by host";
-				break;
-			}
-			// handle error conditions
-			else if(rsz == -1) {
-				PLOG(WARNING) << "Couldn't read from socket: ";
-				continue;
-			}
-			// otherwise, try to parse the packet
-			else {
-				VLOG(3) << "Received " << rsz << " bytes";
-				this->handlePacket(buffer, rsz, &msg);
-			}
-		}
+	// periodically check for incomplete frames
+	const auto expiryInterval = std::chrono::milliseconds(std::max(1U, shard->reassembler->getTimeoutMs() / 2));
 
-		// did we receive something on the pipe?
-		if(FD_ISSET(this->workerPipeRead, &readfds)) {
-			// read an int from the pipe
-			int command = kWorkerNOP;
-			rsz = read(this->workerPipeRead, &command, sizeof(command));
+	shard->reassemblyTimer = this->timer.add(expiryInterval, [shard](CppTime::timer_id) {
+		int err = shard->reactor->postCommand(kWorkerExpireFragments);
+		LOG_IF(ERROR, err != 0) << "Couldn't post fragment expiry command: " << err;
+	}, expiryInterval);
 
-			if(rsz <= 0) {
-				PLOG(WARNING) << "Couldn't read from worker pipe:";
-			} else {
-				// process the command
-				switch(command) {
-					// No-op, do nothing
-					case kWorkerNOP: {
-						break;
-					}
-
-					// Shut down the thread
-					case kWorkerShutdown: {
-						LOG(INFO) << "Shutting down worker thread";
-						break;
-					}
-
-					// send an announcement packet
-					case kWorkerAnnounce: {
-						this->sendAnnouncement();
-						break;
-					}
-
-					// shouldn't get here
-					default: {
-						LOG(WARNING) << "Unknown command " << command;
-						break;
-					}
-				}
+#ifdef __linux__
+	// replayed packets are paced with a timer
+	if(isControl && this->replay) {
+		this->replayTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		PLOG_IF(FATAL, this->replayTimer < 0) << "Couldn't create replay timer";
+
+		err = shard->reactor->addDescriptor(this->replayTimer, Reactor::kEventReadable,
+		[this, shard](uint32_t) {
+			uint64_t expirations;
+
+			if(read(this->replayTimer, &expirations, sizeof(expirations)) < 0) {
+				return;
 			}
-		}
+
+			this->replayPackets(shard);
+		});
+		CHECK(err == 0) << "Couldn't register replay timer with reactor: " << err;
 	}
+#endif
 
-	// clear the timer
-	this->timer.remove(this->announcementTimer);
+	// main loop; handle events until we're told to stop. with the pipeline,
+	// the receive thread must have been joined as well, since it may still be
+	// filling the ring when the running flag is cleared.
+	while(this->run || (this->pipeline && !shard->receiverJoined)) {
+		shard->reactor->runOnce();
+	}
 
-	// clean up
-	this->cleanUpSocket();
-}
+	// clear the timers
+	if(isControl) {
+		if(!this->replay) {
+			this->timer.remove(this->announcementTimer);
+		}
 
-/**
- * Handles a received packet.
- */
-void ProtocolHandler::handlePacket(void *packet, size_t length, struct msghdr *msg) {
-	int err;
-	struct cmsghdr *cmhdr;
+		if(this->interfaceMonitor) {
+			shard->reactor->removeDescriptor(this->interfaceMonitor->getDescriptor());
 
-	static const socklen_t srcAddrSz = 128;
-	char srcAddr[srcAddrSz];
-	struct in_addr srcAddrStruct;
+			delete this->interfaceMonitor;
+			this->interfaceMonitor = nullptr;
+		}
 
-	bool isMulticast = false;
+		this->timer.remove(this->metricsTimer);
 
-	// go through the buffer and find IP_PKTINFO (TODO: IPv6 support)
-	for(cmhdr = CMSG_FIRSTHDR(msg); cmhdr != nullptr; cmhdr = CMSG_NXTHDR(msg, cmhdr)) {
-		// check if it's the right type
-		if(cmhdr->cmsg_level == IPPROTO_IP && cmhdr->cmsg_type == IP_PKTINFO) {
-			void *data = CMSG_DATA(cmhdr);
-			struct in_pktinfo *info = static_cast<struct in_pktinfo *>(data);
+#ifdef __linux__
+		if(this->replayTimer >= 0) {
+			shard->reactor->removeDescriptor(this->replayTimer);
 
-			// check if it's multicast (they're class D, i.e. 1110 MSB)
-			unsigned int addr = ntohl(info->ipi_addr.s_addr);
-			isMulticast = ((addr >> 28) == 0x0E);
+			err = close(this->replayTimer);
+			PLOG_IF(ERROR, err != 0) << "Couldn't close replay timer";
 
-			// convert the destination address
-			const char *ptr = inet_ntop(AF_INET, &info->ipi_addr, srcAddr, srcAddrSz);
-			CHECK(ptr != nullptr) << "Couldn't convert source address";
+			this->replayTimer = -1;
+		}
+#endif
+	}
 
-			// copy the address
-			memcpy(&srcAddrStruct, &info->ipi_addr, sizeof(srcAddrStruct));
+	if(isSync) {
+		if(this->config->getClient().clockSyncInterval > 0) {
+			this->timer.remove(this->clockSyncTimer);
 		}
-  }
 
-	// validate the packet
-	LichtensteinUtils::PacketErrors pErr;
+#ifdef __linux__
+		shard->reactor->removeDescriptor(this->outputTimer);
 
-	// check validity
-	pErr = LichtensteinUtils::validatePacket(packet, length);
+		err = close(this->outputTimer);
+		PLOG_IF(ERROR, err != 0) << "Couldn't close output timer";
 
-	if(err != LichtensteinUtils::kNoError) {
-		// is it a checksum error?
-		if(err == LichtensteinUtils::kInvalidChecksum) {
-			// if so, increment that counter
-			this->packetsWithInvalidCRC++;
-		}
+		this->outputTimer = -1;
+#endif
 
-		LOG(ERROR) << "Couldn't verify packet: " << err
-			<< "(multicast: " << isMulticast << ")";
-		return;
+		LOG_IF(WARNING, !this->scheduledOutputs.empty()) << "Dropping "
+			<< this->scheduledOutputs.size() << " scheduled outputs";
+		this->scheduledOutputs.clear();
 	}
 
-	// reset the timer
-	this->lastServerMessageOn = time(nullptr);
+	this->timer.remove(shard->reassemblyTimer);
 
-	// check to see what type of packet it is
-	LichtensteinUtils::convertToHostByteOrder(packet, length);
-	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(packet);
+	// send any acknowledgements that are still queued, then clean up
+	if(isSync) {
+		this->flushAcks();
+	}
 
-	// apply the multicast and request masks
-	unsigned int type = header->opcode;
+	if(!this->replay && !this->pipeline) {
+		shard->reactor->removeDescriptor(shard->socket);
+	}
 
-	const unsigned int kMulticastMask = 0x100;
-	const unsigned int kRequestMask = 0x200;
-	const unsigned int kAckMask = 0x400;
+	delete shard->reassembler;
+	shard->reassembler = nullptr;
 
-	if(isMulticast) type |= kMulticastMask;
-	if(header->payloadLength == 0) type |= kRequestMask;
-	if((header->flags & kFlagAck)) type |= kAckMask;
+	// the receive thread has been joined by now, and freed its receive ring
+	if(this->pipeline) {
+		CHECK(shard->receiverJoined) << "Receive thread of shard " << shard->index
+			<< " is still running";
 
-	VLOG(3) << "Received packet with opcode " << header->opcode
-		<< "(multicast " << isMulticast << ")";
+		this->discardPipeline(shard);
+	} else {
+		this->freeReceiveRing(shard);
+	}
+}
 
-	// handle the packet
-	switch(type) {
-		// status request?
-		case (kOpcodeNodeStatusReq | kRequestMask):
-			this->sendStatusResponse(header, &srcAddrStruct);
-			break;
+/**
+ * Thread entry point for a shard's receive thread, if packets are pipelined:
+ * it drains the socket into the shard's ring, from which the worker takes the
+ * packets to validate and decode them.
+ */
+void ProtocolHandler::receiverEntry(Shard *shard) {
+	int err = 0;
 
-		// node adoption?
-		case kOpcodeNodeAdoption:
-			if(this->isAdopted == false) {
-  			this->handleAdoption(header, &srcAddrStruct);
-			} else {
-				LOG(WARNING) << "Attempted adoption by " << srcAddr << ", but we're already adopted.";
-			}
+	this->applyThreadPriority(shard);
+	ThreadUtils::pinToCpu(ThreadUtils::cpuForThread(this->config->getClient().receiveCpus, shard->index));
 
-			break;
+	// allocate the receive buffers
+	this->allocReceiveRing(shard);
 
-		// received framebuffer data?
-		case kOpcodeFramebufferData:
-			if(this->isAdopted) {
-				// create an output frame…
-				lichtenstein_framebuffer_data_t *packet = reinterpret_cast<lichtenstein_framebuffer_data_t *>(header);
-				OutputFrame *fr = new OutputFrame(packet, this, &srcAddrStruct);
+	err = shard->rxReactor->addDescriptor(shard->socket, Reactor::kEventReadable,
+	[this, shard](uint32_t) {
+		this->receivePackets(shard);
+	});
+	CHECK(err == 0) << "Couldn't register socket with reactor: " << err;
 
-				// …and run the callback.
-				err = this->frameReceiveCallback(fr);
+	// the only command is to shut down, which the loop below notices
+	shard->rxReactor->setCommandHandler([shard](unsigned int) {
+		VLOG(1) << "Shutting down receive thread for shard " << shard->index;
+	});
 
-				if(err != 0) {
-					// increment counter
-					this->framebufferPacketsDiscarded++;
+	// main loop; receive packets until we're told to stop
+	while(this->run) {
+		shard->rxReactor->runOnce();
+	}
 
-					// log
-					LOG(WARNING) << "Couldn't process framebuffer data: " << err;
+	shard->rxReactor->removeDescriptor(shard->socket);
 
-					// create a negative ack
-					lichtenstein_header_t *hdr = fr->getAckPacket();
+	this->freeReceiveRing(shard);
+}
 
-					hdr->flags &= ~kFlagAck;
-					hdr->flags |= ~kFlagNAck;
+/**
+ * Handles a command posted to a shard's reactor.
+ */
+void ProtocolHandler::handleCommand(Shard *shard, unsigned int command) {
+	switch(command) {
+		// No-op, do nothing
+		case kWorkerNOP: {
+			break;
+		}
 
-					// send it
-					this->ackOutputFrame(fr);
+		// Shut down the thread
+		case kWorkerShutdown: {
+			LOG(INFO) << "Shutting down worker thread for shard " << shard->index;
+			break;
+		}
 
-					// delete frame
-					delete fr;
-				}
-			} else {
-				LOG(WARNING) << "Received framebuffer data from " << srcAddr << ", but node isn't adopted, that server needs to fuck off";
-			}
+		// send an announcement packet
+		case kWorkerAnnounce: {
+			this->sendAnnouncement();
 			break;
+		}
 
-		// received sync output? (this _should_ be multicast but handle unicast too)
-		case kOpcodeSyncOutput:
-		case (kOpcodeSyncOutput | kMulticastMask):
-			if(this->isAdopted) {
-				lichtenstein_sync_output_t *packet = reinterpret_cast<lichtenstein_sync_output_t *>(header);
+		// check for incomplete frames that timed out
+		case kWorkerExpireFragments: {
+			shard->reassembler->expireSlots();
+			break;
+		}
 
-				// make it a bitfield
-				std::bitset<32> channels(packet->channels);
+		// send all queued acknowledgements
+		case kWorkerFlushAcks: {
+			this->flushAcks();
+			break;
+		}
 
-				// call into the plugin handler
-				err = this->channelOutputCallback(channels);
+		// refresh the metrics snapshot
+		case kWorkerSnapshotMetrics: {
+			MetricsRegistry::sharedInstance()->takeSnapshot();
+			break;
+		}
 
-				if(err != 0) {
-					// increment counter
-					this->outputPacketsDiscarded++;
+		// exchange timestamps with the server
+		case kWorkerClockSync: {
+			this->sendTimeSyncRequest();
+			break;
+		}
 
-					// log
-					LOG(WARNING) << "Couldn't process channel output: " << err;
+		// replay packets from the capture file
+		case kWorkerReplay: {
+			this->replayPackets(shard);
+			break;
+		}
 
-					// nack
-					this->ackUnicast(header, &srcAddrStruct, true);
-				}
-			} else {
-				LOG(WARNING) << "Received output request from " << srcAddr << ", but node isn't adopted";
+		// forget the previous server's clock, and synchronize to the new one
+		case kWorkerResetClockSync: {
+			this->clockSync->reset();
+
+			if(this->config->getClient().clockSyncInterval > 0) {
+				this->sendTimeSyncRequest();
 			}
 			break;
+		}
 
-		// keepalive; just ack it and reset the adoption timer
-		case kOpcodeKeepalive:
-			// TODO: reset adoption timer
-			this->ackUnicast(header, &srcAddrStruct);
+		// handle packets passed on by the receive thread
+		case kWorkerDrainPipeline: {
+			this->drainPipeline(shard);
 			break;
+		}
 
-		// unhandled packet type
-		default:
-			LOG(INFO) << "Request for unimplemented opcode " << header->opcode
-				<< " (flags 0x" << std::hex << type << ")";
+		// shouldn't get here
+		default: {
+			LOG(WARNING) << "Unknown command " << command;
 			break;
+		}
+	}
+}
+
+
+
+/**
+ * Allocates a shard's receive ring: a packet buffer, a control buffer and a
+ * source address for each datagram we can read in a single syscall. The
+ * message headers pointing into these buffers are set up once here, so the
+ * receive path only has to reset the lengths the kernel overwrites.
+ *
+ * Packet buffers come from a pool; besides one buffer per slot, it holds some
+ * extra buffers to replace those that output frames hold on to until they are
+ * output, and, with the pipeline, those waiting for the worker.
+ */
+void ProtocolHandler::allocReceiveRing(Shard *shard) {
+	const size_t waiting = (shard->rxRing ? shard->rxRing->getCapacity() : 0);
+	shard->rxPool = new BufferPool(kClientBufferSz, this->rxBatchSize + this->rxExtraBuffers + waiting);
+
+	// allocate the buffers
+	shard->rxSlots = new PacketBuffer*[this->rxBatchSize];
+	shard->rxControlBuffers = new char[this->rxBatchSize * kControlBufSz];
+	shard->rxAddrs = new struct sockaddr_storage[this->rxBatchSize];
+	shard->rxIov = new struct iovec[this->rxBatchSize];
+
+	for(unsigned int i = 0; i < this->rxBatchSize; i++) {
+		shard->rxSlots[i] = shard->rxPool->acquire();
+
+		shard->rxIov[i].iov_base = shard->rxSlots[i]->getData();
+		shard->rxIov[i].iov_len = kClientBufferSz;
+	}
+
+#ifdef __linux__
+	shard->rxMsgs = new struct mmsghdr[this->rxBatchSize];
+	memset(shard->rxMsgs, 0, sizeof(struct mmsghdr) * this->rxBatchSize);
+
+	for(unsigned int i = 0; i < this->rxBatchSize; i++) {
+		struct msghdr *msg = &shard->rxMsgs[i].msg_hdr;
+
+		msg->msg_name = &shard->rxAddrs[i];
+		msg->msg_iov = &shard->rxIov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = shard->rxControlBuffers + (i * kControlBufSz);
 	}
+#endif
 }
 
+/**
+ * Releases the buffers allocated for a shard's receive ring.
+ *
+ * Output frames may still hold on to packet buffers at this point, so the pool
+ * only goes away once they have all been released.
+ */
+void ProtocolHandler::freeReceiveRing(Shard *shard) {
+#ifdef __linux__
+	delete[] shard->rxMsgs;
+	shard->rxMsgs = nullptr;
+#endif
+
+	// give the slots' buffers back to the pool
+	for(unsigned int i = 0; i < this->rxBatchSize; i++) {
+		shard->rxSlots[i]->release();
+	}
+
+	delete[] shard->rxIov;
+	delete[] shard->rxAddrs;
+	delete[] shard->rxControlBuffers;
+	delete[] shard->rxSlots;
+
+	shard->rxIov = nullptr;
+	shard->rxAddrs = nullptr;
+	shard->rxControlBuffers = nullptr;
+	shard->rxSlots = nullptr;
+
+	shard->rxPool->destroy();
+	shard->rxPool = nullptr;
+}
+
+/**
+ * Ensures the buffer in the given slot of the receive ring can be reused: if
+ * an output frame still references it, it's swapped out for a fresh buffer
+ * from the pool, and the old buffer goes back to the pool once the frame is
+ * done with it.
+ */
+void ProtocolHandler::refreshReceiveSlot(Shard *shard, unsigned int slot) {
+	PacketBuffer *buffer = shard->rxSlots[slot];
+
+	if(!buffer->isShared()) {
+		return;
+	}
+
+	// drop our reference and get a new buffer
+	buffer->release();
+
+	shard->rxSlots[slot] = shard->rxPool->acquire();
+	shard->rxIov[slot].iov_base = shard->rxSlots[slot]->getData();
+
+	shard->rxSlotsReplaced++;
+}
+
+/**
+ * Drains a shard's socket after it became readable. With batching enabled,
+ * this reads up to rxBatchSize datagrams per recvmmsg call, and keeps going
+ * until the socket is empty; each packet in the batch is then handled in order.
+ *
+ * The number of packets received per wakeup is recorded, so it's possible to
+ * tell whether batching actually kicks in on a loaded node.
+ */
+void ProtocolHandler::receivePackets(Shard *shard) {
+	size_t received = 0;
+
+#ifdef __linux__
+	if(this->rxBatchSize > 1) {
+		int num;
+
+		do {
+			// reset the fields the kernel overwrites on each call
+			for(unsigned int i = 0; i < this->rxBatchSize; i++) {
+				struct msghdr *msg = &shard->rxMsgs[i].msg_hdr;
+
+				msg->msg_namelen = sizeof(struct sockaddr_storage);
+				msg->msg_controllen = kControlBufSz;
+				msg->msg_flags = 0;
+			}
+
+			// read as many packets as are available, up to the batch size
+			num = recvmmsg(shard->socket, shard->rxMsgs, this->rxBatchSize,
+						   MSG_DONTWAIT, nullptr);
+
+			if(num == -1) {
+				// socket is drained
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					break;
+				}
+
+				PLOG(WARNING) << "Couldn't read from socket: ";
+				break;
+			}
+
+			// handle each of the packets in the batch, or pass them on
+			for(int i = 0; i < num; i++) {
+				size_t rsz = shard->rxMsgs[i].msg_len;
+
+				VLOG(3) << "Received " << rsz << " bytes";
+
+				if(shard->rxRing) {
+					this->enqueuePacket(shard, i, rsz, &shard->rxMsgs[i].msg_hdr);
+				} else {
+					this->handlePacket(shard, shard->rxSlots[i], rsz,
+									   &shard->rxMsgs[i].msg_hdr);
+
+					this->refreshReceiveSlot(shard, i);
+				}
+			}
+
+			// get the worker going on this batch while we read the next
+			if(shard->rxRing && num > 0) {
+				int err = shard->reactor->postCommand(kWorkerDrainPipeline);
+				LOG_IF(ERROR, err != 0) << "Couldn't post drain command: " << err;
+			}
+
+			received += num;
+		} while(num == static_cast<int>(this->rxBatchSize));
+	} else {
+		this->receiveSinglePacket(shard);
+		received = 1;
+	}
+#else
+	this->receiveSinglePacket(shard);
+	received = 1;
+#endif
+
+	// update statistics
+	shard->rxWakeups++;
+	shard->rxWakeupPackets += received;
+
+	shard->queueDepth->record(received);
+
+	if(received > shard->rxWakeupPacketsMax) {
+		shard->rxWakeupPacketsMax = received;
+	}
+
+	VLOG(3) << "Received " << received << " packets in this wakeup";
+
+	if((shard->rxWakeups % 1000) == 0) {
+		VLOG(1) << "Receive batching (shard " << shard->index << "): "
+			<< shard->rxWakeupPackets << " packets in "
+			<< shard->rxWakeups << " wakeups ("
+			<< (double(shard->rxWakeupPackets) / double(shard->rxWakeups))
+			<< " packets/wakeup, max " << shard->rxWakeupPacketsMax << "), "
+			<< shard->rxSlotsReplaced << " buffers held by frames, "
+			<< shard->multicastDropped << " multicast packets dropped";
+	}
+}
+
+/**
+ * Reads a single datagram from a shard's socket with recvmsg, into the first
+ * slot of the receive ring.
+ */
+void ProtocolHandler::receiveSinglePacket(Shard *shard) {
+	int rsz;
+	struct msghdr msg;
+
+	// populate the message buffer
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_name = &shard->rxAddrs[0];
+	msg.msg_namelen = sizeof(struct sockaddr_storage);
+	msg.msg_iov = &shard->rxIov[0];
+	msg.msg_iovlen = 1;
+	msg.msg_control = shard->rxControlBuffers;
+	msg.msg_controllen = kControlBufSz;
+
+	rsz = recvmsg(shard->socket, &msg, 0);
+
+	// handle error conditions
+	if(rsz == -1) {
+		PLOG(WARNING) << "Couldn't read from socket: ";
+	}
+	// pass it on to the worker, if pipelined
+	else if(shard->rxRing) {
+		VLOG(3) << "Received " << rsz << " bytes";
+		this->enqueuePacket(shard, 0, rsz, &msg);
+
+		int err = shard->reactor->postCommand(kWorkerDrainPipeline);
+		LOG_IF(ERROR, err != 0) << "Couldn't post drain command: " << err;
+	}
+	// otherwise, try to parse the packet
+	else {
+		VLOG(3) << "Received " << rsz << " bytes";
+		this->handlePacket(shard, shard->rxSlots[0], rsz, &msg);
+
+		this->refreshReceiveSlot(shard, 0);
+	}
+}
+
+/**
+ * Passes the packet in the given slot of the receive ring on to the shard's
+ * worker, and gives the slot a fresh buffer; the worker releases the packet's
+ * buffer once it's handled. If the worker has fallen so far behind that its
+ * ring is full, the packet is dropped instead, and the slot keeps its buffer.
+ */
+void ProtocolHandler::enqueuePacket(Shard *shard, unsigned int slot, size_t length, struct msghdr *msg) {
+	ReceivedPacket *packet = shard->rxRing->claim();
+
+	if(!packet) {
+		this->pipelineOverruns->increment();
+
+		VLOG(2) << "Dropping packet on shard " << shard->index << "; "
+			<< shard->rxRing->getCapacity() << " packets waiting";
+		return;
+	}
+
+	packet->buffer = shard->rxSlots[slot];
+	packet->length = length;
+
+	// copy the sender and control messages, as the slot is reused right away
+	packet->addrLen = std::min(msg->msg_namelen, static_cast<socklen_t>(sizeof(packet->addr)));
+	memcpy(&packet->addr, msg->msg_name, packet->addrLen);
+
+	packet->controlLen = std::min(static_cast<size_t>(msg->msg_controllen), sizeof(packet->control));
+	memcpy(packet->control, msg->msg_control, packet->controlLen);
+
+	shard->rxRing->publish();
+
+	// the buffer now belongs to the worker
+	shard->rxSlots[slot] = shard->rxPool->acquire();
+	shard->rxIov[slot].iov_base = shard->rxSlots[slot]->getData();
+}
+
+/**
+ * Handles all packets the receive thread has passed to a shard's worker.
+ */
+void ProtocolHandler::drainPipeline(Shard *shard) {
+	ReceivedPacket *packet;
+	struct msghdr msg;
+
+	while((packet = shard->rxRing->front()) != nullptr) {
+		// rebuild the parts of the message header that handlePacket looks at
+		memset(&msg, 0, sizeof(msg));
+
+		msg.msg_name = &packet->addr;
+		msg.msg_namelen = packet->addrLen;
+		msg.msg_control = packet->control;
+		msg.msg_controllen = packet->controlLen;
+
+		this->handlePacket(shard, packet->buffer, packet->length, &msg);
+
+		// frames built from the packet have retained its buffer
+		packet->buffer->release();
+		shard->rxRing->pop();
+	}
+}
+
+/**
+ * Releases the buffers of packets the worker didn't get to before it was
+ * stopped. The receive thread must no longer be running.
+ */
+void ProtocolHandler::discardPipeline(Shard *shard) {
+	ReceivedPacket *packet;
+	size_t discarded = 0;
+
+	while((packet = shard->rxRing->front()) != nullptr) {
+		packet->buffer->release();
+		shard->rxRing->pop();
+
+		discarded++;
+	}
+
+	LOG_IF(INFO, discarded != 0) << "Discarded " << discarded << " received packets on shard "
+		<< shard->index;
+}
+
+/**
+ * Handles a received packet. Framebuffer data is not copied out of the packet
+ * buffer; the output frame created for it retains the buffer instead.
+ *
+ * Data shards only handle framebuffer data; the sync shard also handles syncs
+ * and clock sync responses.
+ */
+void ProtocolHandler::handlePacket(Shard *shard, PacketBuffer *buffer, size_t length, struct msghdr *msg) {
+	int err;
+	void *packet = buffer->getData();
+	struct cmsghdr *cmhdr;
+
+	static const socklen_t srcAddrSz = 128;
+	char srcAddr[srcAddrSz] = "";
+	struct in_addr srcAddrStruct, destAddrStruct;
+	srcAddrStruct.s_addr = INADDR_ANY;
+	destAddrStruct.s_addr = INADDR_ANY;
+
+	bool isMulticast = false;
+
+	struct timespec rxTimestamp = {0, 0};
+
+	// when we got around to handling the packet, and when it was validated
+	struct timespec handledTimestamp, validatedTimestamp;
+	clock_gettime(CLOCK_REALTIME, &handledTimestamp);
+
+	// go through the buffer and find IP_PKTINFO (TODO: IPv6 support) and the timestamp
+	for(cmhdr = CMSG_FIRSTHDR(msg); cmhdr != nullptr; cmhdr = CMSG_NXTHDR(msg, cmhdr)) {
+#ifdef SO_TIMESTAMPNS
+		// time at which the kernel received the packet
+		if(cmhdr->cmsg_level == SOL_SOCKET && cmhdr->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&rxTimestamp, CMSG_DATA(cmhdr), sizeof(rxTimestamp));
+			continue;
+		}
+#endif
+
+		// check if it's the right type
+		if(cmhdr->cmsg_level == IPPROTO_IP && cmhdr->cmsg_type == IP_PKTINFO) {
+			void *data = CMSG_DATA(cmhdr);
+			struct in_pktinfo *info = static_cast<struct in_pktinfo *>(data);
+
+			// check if it's multicast (they're class D, i.e. 1110 MSB)
+			unsigned int addr = ntohl(info->ipi_addr.s_addr);
+			isMulticast = ((addr >> 28) == 0x0E);
+
+			// copy the destination address
+			memcpy(&destAddrStruct, &info->ipi_addr, sizeof(destAddrStruct));
+		}
+  }
+
+	// replies go to whoever sent the packet
+	const struct sockaddr_in *sender = static_cast<const struct sockaddr_in *>(msg->msg_name);
+
+	if(sender && msg->msg_namelen >= sizeof(*sender) && sender->sin_family == AF_INET) {
+		srcAddrStruct = sender->sin_addr;
+	} else {
+		srcAddrStruct = destAddrStruct;
+	}
+
+	const char *ptr = inet_ntop(AF_INET, &srcAddrStruct, srcAddr, srcAddrSz);
+	CHECK(ptr != nullptr) << "Couldn't convert source address";
+
+	// without a kernel timestamp, the time we got around to the packet will have to do
+	if(rxTimestamp.tv_sec == 0 && rxTimestamp.tv_nsec == 0) {
+		rxTimestamp = handledTimestamp;
+	} else {
+		this->stageLatency[kStageReceive]->recordInterval(rxTimestamp, handledTimestamp);
+	}
+
+	// multicast is delivered to every socket, but only one shard handles it
+	if(isMulticast && !this->handlesMulticast(shard, packet, length)) {
+		shard->multicastDropped++;
+		return;
+	}
+
+	this->rxPackets->increment();
+	this->rxBytes->add(length);
+
+	// capture the packet as received, before it's validated and byte swapped
+	if(this->capture) {
+		this->capture->write(packet, length, rxTimestamp, destAddrStruct);
+	}
+
+	// validate the packet and convert it to host byte order in one go; checking
+	// the payload of fragments is deferred until it's copied into the frame
+	LichtensteinUtils::PacketErrors pErr;
+	LichtensteinUtils::PartialChecksum checksum;
+
+	// check validity
+	pErr = LichtensteinUtils::ingestPacket(packet, length, &checksum);
+
+	if(pErr != LichtensteinUtils::kNoError) {
+		// is it a checksum error?
+		if(pErr == LichtensteinUtils::kInvalidChecksum) {
+			// if so, increment that counter
+			this->packetsWithInvalidCRC->increment();
+		}
+
+		LOG(ERROR) << "Couldn't verify packet: " << pErr
+			<< "(multicast: " << isMulticast << ")";
+		return;
+	}
+
+	// reset the timer
+	this->lastServerMessageOn = time(nullptr);
+
+	clock_gettime(CLOCK_REALTIME, &validatedTimestamp);
+	this->stageLatency[kStageValidate]->recordInterval(handledTimestamp, validatedTimestamp);
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(packet);
+
+	// apply the multicast and request masks
+	unsigned int type = header->opcode;
+
+	const unsigned int kMulticastMask = 0x100;
+	const unsigned int kRequestMask = 0x200;
+	const unsigned int kAckMask = 0x400;
+
+	if(isMulticast) type |= kMulticastMask;
+	if(header->payloadLength == 0) type |= kRequestMask;
+	if((header->flags & kFlagAck)) type |= kAckMask;
+
+	// the steering program should never send anything else to a data shard
+	const bool isControl = (shard->index == kControlShard);
+	const bool isSync = (shard->index == this->syncShard);
+
+	const bool isData = (header->opcode == kOpcodeFramebufferData ||
+						 header->opcode == kOpcodeFramebufferFragment);
+	const bool isTiming = (header->opcode == kOpcodeSyncOutput ||
+						   header->opcode == kOpcodeSyncOutputTimed ||
+						   header->opcode == kOpcodeTimeSync);
+
+	if(!isControl && !isData && !(isSync && isTiming)) {
+		LOG(WARNING) << "Shard " << shard->index << " received opcode "
+			<< header->opcode << ", ignoring";
+		return;
+	}
+
+	VLOG(3) << "Received packet with opcode " << header->opcode
+		<< "(multicast " << isMulticast << ")";
+
+	// handle the packet
+	switch(type) {
+		// status request?
+		case (kOpcodeNodeStatusReq | kRequestMask):
+			this->sendStatusResponse(header, &srcAddrStruct);
+			break;
+
+		// status request with a sub-opcode?
+		case kOpcodeNodeStatusReq:
+			this->handleStatusSubRequest(header, &srcAddrStruct);
+			break;
+
+		// node adoption?
+		// the server that adopted us may do so again, e.g. once our address changed
+		case kOpcodeNodeAdoption:
+			if(this->isAdopted == false || srcAddrStruct.s_addr == this->serverAddr.s_addr) {
+  			this->handleAdoption(header, length, &srcAddrStruct);
+			} else {
+				LOG(WARNING) << "Attempted adoption by " << srcAddr << ", but we're already adopted.";
+			}
+
+			break;
+
+		// received framebuffer data?
+		case kOpcodeFramebufferData:
+			if(this->isAdopted) {
+				lichtenstein_framebuffer_data_t *packet = reinterpret_cast<lichtenstein_framebuffer_data_t *>(header);
+
+				// the frame references the data in place, so it must actually be there
+				if(!LichtensteinUtils::framebufferDataFits(packet, length)) {
+					this->framebufferPacketsDiscarded->increment();
+
+					LOG(WARNING) << "Framebuffer data from " << srcAddr
+						<< " is truncated (" << length << " bytes)";
+
+					this->ackUnicast(header, &srcAddrStruct, true);
+					break;
+				}
+
+				// copy it into the channel's back buffer until the next sync
+				if(this->framebuffers->isConfigured()) {
+					const size_t bytesPerElement = ((packet->dataFormat == kDataFormatRGBW) ? 4 : 3);
+
+					this->storeFrame(packet->destChannel, &packet->data,
+						(packet->dataElements * bytesPerElement), bytesPerElement, header->opcode,
+						header->txn, &srcAddrStruct, rxTimestamp, &validatedTimestamp);
+					break;
+				}
+
+				// otherwise, create an output frame and hand it off
+				OutputFrame *fr = new OutputFrame(packet, buffer, this, &srcAddrStruct);
+				fr->setRxTimestamp(rxTimestamp);
+
+				this->submitOutputFrame(fr, &validatedTimestamp);
+			} else {
+				LOG(WARNING) << "Received framebuffer data from " << srcAddr << ", but node isn't adopted, that server needs to fuck off";
+			}
+			break;
+
+		// received part of framebuffer data?
+		case kOpcodeFramebufferFragment:
+			if(this->isAdopted) {
+				lichtenstein_framebuffer_fragment_t *packet = reinterpret_cast<lichtenstein_framebuffer_fragment_t *>(header);
+
+				// hand off the frame, if this fragment completed it
+				OutputFrame *fr = shard->reassembler->addFragment(packet, length, &srcAddrStruct, &rxTimestamp, &checksum);
+
+				if(!checksum.valid) {
+					this->packetsWithInvalidCRC->increment();
+				}
+
+				if(fr && this->framebuffers->isConfigured()) {
+					// copy the reassembled frame into the channel's back buffer
+					this->storeFrame(fr->getChannel(), fr->getData(), fr->getDataLen(),
+						fr->getBytesPerPixel(), fr->getAckOpcode(), fr->getAckTxn(), fr->getAckDest(),
+						fr->getRxTimestamp(), &validatedTimestamp);
+
+					delete fr;
+				} else if(fr) {
+					this->submitOutputFrame(fr, &validatedTimestamp);
+				}
+			} else {
+				LOG(WARNING) << "Received framebuffer fragment from " << srcAddr << ", but node isn't adopted";
+			}
+			break;
+
+		// received sync output? (this _should_ be multicast but handle unicast too)
+		case kOpcodeSyncOutput:
+		case (kOpcodeSyncOutput | kMulticastMask):
+			if(this->isAdopted) {
+				lichtenstein_sync_output_t *packet = reinterpret_cast<lichtenstein_sync_output_t *>(header);
+
+				// output right away
+				this->outputChannels(packet->channels, header->opcode, header->txn, &srcAddrStruct);
+
+				// acknowledge all frames received since the last sync
+				if(this->cumulativeAcks) {
+					this->sendCumulativeAck(header->txn);
+				}
+			} else {
+				LOG(WARNING) << "Received output request from " << srcAddr << ", but node isn't adopted";
+			}
+			break;
+
+		// received timed sync output? (likewise, usually multicast)
+		case kOpcodeSyncOutputTimed:
+		case (kOpcodeSyncOutputTimed | kMulticastMask):
+			if(this->isAdopted) {
+				// output once the presentation time comes around
+				this->scheduleOutput(header, &srcAddrStruct);
+
+				// frames were received, even if they weren't output yet
+				if(this->cumulativeAcks) {
+					this->sendCumulativeAck(header->txn);
+				}
+			} else {
+				LOG(WARNING) << "Received timed output request from " << srcAddr << ", but node isn't adopted";
+			}
+			break;
+
+		// change of the color correction of some channels
+		case kOpcodeColorCorrection:
+			if(this->isAdopted && srcAddrStruct.s_addr == this->serverAddr.s_addr) {
+				this->handleColorCorrection(header, &srcAddrStruct);
+			} else {
+				LOG(WARNING) << "Received color correction from " << srcAddr << ", which didn't adopt us";
+			}
+			break;
+
+		// response to a time sync request
+		case (kOpcodeTimeSync | kAckMask):
+			if(this->isAdopted && srcAddrStruct.s_addr == this->serverAddr.s_addr) {
+				this->handleTimeSync(header, &rxTimestamp);
+			} else {
+				LOG(WARNING) << "Received time sync response from " << srcAddr << ", which didn't adopt us";
+			}
+			break;
+
+		// keepalive; just ack it and reset the adoption timer
+		case kOpcodeKeepalive:
+			// TODO: reset adoption timer
+			this->ackUnicast(header, &srcAddrStruct);
+			break;
+
+		// unhandled packet type
+		default:
+			LOG(INFO) << "Request for unimplemented opcode " << header->opcode
+				<< " (flags 0x" << std::hex << type << ")";
+			break;
+	}
+}
+
+
+
+/**
+ * Decides whether a shard handles a multicast packet, which the kernel delivers
+ * to all of them. Syncs are handled by the sync shard, everything else by the
+ * control shard. The packet hasn't been validated yet, so only its opcode (in
+ * network byte order) is looked at.
+ */
+bool ProtocolHandler::handlesMulticast(Shard *shard, const void *packet, size_t length) {
+	unsigned int handler = kControlShard;
+
+	if(length >= sizeof(lichtenstein_header_t)) {
+		const lichtenstein_header_t *header = static_cast<const lichtenstein_header_t *>(packet);
+		const uint16_t opcode = ntohs(header->opcode);
+
+		if(opcode == kOpcodeSyncOutput || opcode == kOpcodeSyncOutputTimed) {
+			handler = this->syncShard;
+		}
+	}
+
+	return (shard->index == handler);
+}
+
+
+
+/**
+ * Runs the frame received callback for an output frame. If the frame can't be
+ * processed, it's NACKed and deallocated.
+ *
+ * The time since the packet that completed the frame was validated is recorded
+ * as the frame stage's latency, unless no timestamp is given; frames presented
+ * from the framebuffer arena had theirs recorded when they were stored.
+ */
+void ProtocolHandler::submitOutputFrame(OutputFrame *frame, const struct timespec *validatedTimestamp) {
+	int err;
+
+	// the frame is built; it's now up to the plugin
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if(validatedTimestamp) {
+		this->stageLatency[kStageFrame]->recordInterval(*validatedTimestamp, now);
+	}
+
+	frame->setQueueTimestamp(now);
+
+	err = this->frameReceiveCallback(frame);
+
+	if(err != 0) {
+		// increment counter
+		this->framebufferPacketsDiscarded->increment();
+
+		// log
+		LOG(WARNING) << "Couldn't process framebuffer data: " << err;
+
+		// send a negative ack
+		this->ackOutputFrame(frame, true);
+
+		if(this->cumulativeAcks) {
+			this->recordFrameResult(frame->getChannel(), true);
+		}
+
+		// delete frame
+		delete frame;
+	}
+}
+
+
+
+/**
+ * Copies a frame's data into the back buffer of its channel in the framebuffer
+ * arena, where it stays until the next sync output presents it. A frame that
+ * was still in the back buffer (and thus never output) is NACKed, as is this
+ * frame if the channel has no framebuffer or it doesn't fit.
+ *
+ * This may be called from any data shard.
+ */
+void ProtocolHandler::storeFrame(size_t channel, const void *data, size_t length, unsigned int bytesPerPixel, uint16_t opcode, uint32_t txn, struct in_addr *source, const struct timespec &rxTimestamp, const struct timespec *validatedTimestamp) {
+	FramebufferArena::FrameInfo info;
+	info.opcode = opcode;
+	info.txn = txn;
+	info.source = *source;
+	info.rxTimestamp = rxTimestamp;
+	info.bytesPerPixel = bytesPerPixel;
+
+	FramebufferArena::FrameInfo superseded;
+	int result = this->framebuffers->store(channel, data, length, info, &superseded);
+
+	// the frame is built, even though it won't be output until the next sync
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	this->stageLatency[kStageFrame]->recordInterval(*validatedTimestamp, now);
+
+	// NACK the frame that was overwritten, or this one if it wasn't stored
+	lichtenstein_header_t header;
+	memset(&header, 0, sizeof(header));
+
+	switch(result) {
+		case FramebufferArena::kStored:
+			return;
+
+		case FramebufferArena::kStoredSuperseding:
+			this->framesOverwritten->increment();
+
+			VLOG(2) << "Frame for channel " << channel << " (txn " << superseded.txn
+				<< ") overwritten by txn " << txn << " before it was output";
+
+			header.opcode = superseded.opcode;
+			header.txn = superseded.txn;
+
+			this->ackUnicast(&header, &superseded.source, true);
+			break;
+
+		case FramebufferArena::kNoChannel:
+		case FramebufferArena::kTooLarge:
+			this->framebufferPacketsDiscarded->increment();
+
+			LOG(WARNING) << "Couldn't store " << length << " bytes of framebuffer data for channel "
+				<< channel << ((result == FramebufferArena::kNoChannel) ? ": channel wasn't adopted" : ": too large");
+
+			header.opcode = opcode;
+			header.txn = txn;
+
+			this->ackUnicast(&header, source, true);
+			break;
+	}
+
+	if(this->cumulativeAcks) {
+		this->recordFrameResult(channel, true);
+	}
+}
+
+
+
+/**
+ * Handles a node adoption. The framebuffers are reallocated for the channels
+ * in the packet, so a server that adopted us before can do so again, such as
+ * after our address changed and it saw the new announcement.
+ *
+ * @note This assumes all preconditions are satisfied: e.g. that the node isn't
+ * already adopted by a different server.
+ */
+void ProtocolHandler::handleAdoption(lichtenstein_header_t *header, size_t length, struct in_addr *source) {
+  int err;
+  lichtenstein_node_adoption_t *packet = reinterpret_cast<lichtenstein_node_adoption_t *>(header);
+
+  // acknowledge request (to the IP in the packet)
+  LOG(INFO) << "Acknowledge packet IP: " << std::hex << packet->ip;
+
+  // figure out which of the requested flags we support
+  uint16_t acceptedFlags = 0;
+
+  if(packet->flags & kAdoptionFlagCumulativeAck) {
+    if(this->config->getClient().cumulativeAck) {
+      acceptedFlags |= kAdoptionFlagCumulativeAck;
+    } else {
+      LOG(INFO) << "Server requested cumulative acks, but they're disabled";
+    }
+  }
+
+  // allocate framebuffers for the pixels on each channel; if the server wants
+  // more than we told it we have, refuse to be adopted
+  if(packet->numChannels != 0) {
+    // the packet must actually carry a pixel count for each channel
+    const size_t entries = (length >= sizeof(*packet)) ?
+                           ((length - sizeof(*packet)) / sizeof(uint32_t)) : 0;
+
+    if(packet->numChannels > entries) {
+      LOG(ERROR) << "Adoption for " << packet->numChannels << " channels only has "
+        << entries << " pixel counts; rejecting it";
+
+      this->ackUnicast(header, source, true);
+      return;
+    }
+
+    const size_t numChannels = std::min(static_cast<size_t>(packet->numChannels),
+                                        static_cast<size_t>(kLichtensteinMaxChannels));
+
+    err = this->framebuffers->configure(packet->pixelsPerChannel, numChannels);
+
+    if(err != 0) {
+      LOG(ERROR) << "Couldn't set up framebuffers for adoption (limit "
+        << this->config->getOutput().fbSize << " bytes); rejecting it";
+
+      this->ackUnicast(header, source, true);
+      return;
+    }
+  }
+
+  // send the ack, indicating the flags we accepted
+  lichtenstein_node_adoption_ack_t ack;
+  memset(&ack, 0, sizeof(ack));
+
+  LichtensteinUtils::populateHeader(&ack, kOpcodeNodeAdoption);
+
+  ack.header.flags |= kFlagAck;
+  ack.header.txn = header->txn;
+  ack.header.payloadLength = (sizeof(ack) - sizeof(lichtenstein_header_t));
+
+  ack.flags = acceptedFlags;
+
+  LichtensteinUtils::convertToNetworkByteOrder(&ack, sizeof(ack));
+  LichtensteinUtils::applyChecksum(&ack, sizeof(ack));
+
+  err = this->sendPacketToHost(&ack, sizeof(ack), source);
+  LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+
+  // set flag
+  this->isAdopted = true;
+
+  this->serverAddr = *source;
+  this->cumulativeAcks = (acceptedFlags & kAdoptionFlagCumulativeAck);
+
+  LOG_IF(INFO, this->cumulativeAcks) << "Acknowledging frames cumulatively";
+
+  // synchronize to the new server's clock; the sync shard owns the clock
+  err = this->shards[this->syncShard]->reactor->postCommand(kWorkerResetClockSync);
+  LOG_IF(ERROR, err != 0) << "Couldn't post clock sync reset command: " << err;
+
+  // set status
+  StatusHandler::sharedInstance()->setAdoptionState(true);
+
+  // cancel the timer
+	this->timer.remove(this->announcementTimer);
+
+  // success!
+  static const socklen_t srcAddrSz = 128;
+  char srcAddr[srcAddrSz];
+  const char *ptr = inet_ntop(AF_INET, source, srcAddr, srcAddrSz);
+  CHECK(ptr != nullptr) << "Couldn't convert destination address";
+
+  LOG(INFO) << "Adopted by " << srcAddr;
+}
+
+
+/**
+ * Changes the color correction of the channels in the packet, then acknowledges
+ * it. If the parameters are invalid for any of the channels, none of them are
+ * changed, and the packet is NACKed instead.
+ */
+void ProtocolHandler::handleColorCorrection(lichtenstein_header_t *header, struct in_addr *source) {
+	int err;
+	lichtenstein_color_correction_t *packet = reinterpret_cast<lichtenstein_color_correction_t *>(header);
+
+	// a gamma of zero would turn every pixel on
+	bool failed = (packet->gamma == 0 || !this->colorCorrectionCallback);
+
+	ColorCorrection::Parameters params;
+	params.gamma = (packet->gamma / 1000.);
+	params.brightness = packet->brightness;
+	memcpy(params.whiteBalance, packet->whiteBalance, sizeof(params.whiteBalance));
+
+	// collect the channels to change
+	std::vector<size_t> channels;
+
+	for(size_t i = 0; i < kLichtensteinMaxChannels; i++) {
+		if(packet->channels[i / 32] & (1U << (i % 32))) {
+			channels.push_back(i);
+		}
+	}
+
+	// then, change all of them at once
+	if(!failed) {
+		err = this->colorCorrectionCallback(channels, params);
+
+		if(err != 0) {
+			LOG(WARNING) << "Couldn't change color correction of " << channels.size()
+				<< " channels: " << err;
+			failed = true;
+		}
+	}
+
+	LOG_IF(INFO, !failed) << "Changed color correction of " << channels.size() << " channels: gamma "
+		<< params.gamma << ", brightness " << static_cast<unsigned int>(params.brightness);
+
+	this->ackUnicast(header, source, failed);
+}
+
+/**
+ * Acknowledges an unicast packet without sending any additional data back to
+ * the server.
+ */
+void ProtocolHandler::ackUnicast(lichtenstein_header_t *header, struct in_addr *source, bool nack) {
+	int err;
+
+	// build the packet
+	AckTemplate *tmpl = this->getAckTemplate(source);
+
+	lichtenstein_header_t packet;
+	this->fillAck(&packet, tmpl, header->opcode, header->txn, nack);
+
+	// send
+	err = this->sendPacket(&packet, sizeof(packet), &tmpl->addr);
+	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+}
+
+/**
+ * Returns the acknowledgement template for the given destination, creating it
+ * if needed.
+ *
+ * @note This may only be called from the worker thread.
+ */
+ProtocolHandler::AckTemplate *ProtocolHandler::getAckTemplate(struct in_addr *dest) {
+	// data shards NACK frames they couldn't store
+	std::lock_guard<std::mutex> lck(this->ackTemplatesMutex);
+
+	// is there a template already?
+	auto it = this->ackTemplates.find(dest->s_addr);
+
+	if(it != this->ackTemplates.end()) {
+		return it->second;
+	}
+
+	// if not, create one
+	AckTemplate *tmpl = new AckTemplate;
+
+	memset(&tmpl->addr, 0, sizeof(tmpl->addr));
+	tmpl->addr.sin_family = AF_INET;
+	tmpl->addr.sin_port = htons(this->port);
+	memcpy(&tmpl->addr.sin_addr, dest, sizeof(tmpl->addr.sin_addr));
+
+	memset(&tmpl->header, 0, sizeof(tmpl->header));
+	LichtensteinUtils::populateHeader(&tmpl->header, 0);
+	tmpl->header.txn = 0;
+
+	LichtensteinUtils::convertToNetworkByteOrder(&tmpl->header, sizeof(tmpl->header));
+
+	this->ackTemplates[dest->s_addr] = tmpl;
+	return tmpl;
+}
+
+/**
+ * Builds an acknowledgement packet for the given opcode and transaction in
+ * the provided header by copying the template, then filling in the fields
+ * that differ between acks.
+ */
+void ProtocolHandler::fillAck(lichtenstein_header_t *packet, AckTemplate *tmpl, uint16_t opcode, uint32_t txn, bool nack) {
+	memcpy(packet, &tmpl->header, sizeof(lichtenstein_header_t));
+
+	packet->opcode = htons(opcode);
+	packet->flags = htons(nack ? kFlagNAck : kFlagAck);
+	packet->txn = htonl(txn);
+
+	LichtensteinUtils::applyChecksum(packet, sizeof(lichtenstein_header_t));
+}
+
+/**
+ * Acknowledges an output frame immediately.
+ *
+ * @note This may only be called from the worker thread; plugins should use
+ * queueAck() instead.
+ */
+void ProtocolHandler::ackOutputFrame(OutputFrame *frame, bool nack) {
+	int err;
+
+	// build the packet
+	AckTemplate *tmpl = this->getAckTemplate(frame->getAckDest());
+
+	lichtenstein_header_t packet;
+	this->fillAck(&packet, tmpl, frame->getAckOpcode(), frame->getAckTxn(), nack);
+
+	// send
+	err = this->sendPacket(&packet, sizeof(packet), &tmpl->addr);
+	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+}
+
+/**
+ * Queues the acknowledgement for an output frame; it's sent the next time the
+ * queue is flushed. The frame may be deallocated once this returns.
+ *
+ * This may be called from any thread. If the queue fills up to the size of a
+ * batch, a flush is requested.
+ */
+void ProtocolHandler::queueAck(OutputFrame *frame, bool nack) {
+	bool flush;
+
+	if(!nack) {
+		this->framesOutput->increment();
+		this->recordFrameLatency(frame);
+	}
+
+	// in cumulative mode, only NACKs are sent for individual frames
+	if(this->cumulativeAcks) {
+		this->recordFrameResult(frame->getChannel(), nack);
+
+		if(!nack) {
+			return;
+		}
+	}
+
+	PendingAck ack;
+
+	ack.dest = *frame->getAckDest();
+	ack.opcode = frame->getAckOpcode();
+	ack.txn = frame->getAckTxn();
+	ack.nack = nack;
+
+	clock_gettime(CLOCK_REALTIME, &ack.queuedAt);
+
+	{
+		std::lock_guard<std::mutex> lck(this->pendingAcksMutex);
+
+		this->pendingAcks.push_back(ack);
+		flush = (this->pendingAcks.size() >= kMaxAckBatchSize);
+	}
+
+	// NACKs go out right away
+	if(nack) {
+		flush = true;
+	}
+
+	if(flush) {
+		this->requestAckFlush();
+	}
+}
+
+/**
+ * Asks the sync shard's worker to send all queued acknowledgements. Requests made
+ * before the worker gets around to it are coalesced into a single flush.
+ */
+void ProtocolHandler::requestAckFlush(void) {
+	int err = this->shards[this->syncShard]->reactor->postCommand(kWorkerFlushAcks);
+	LOG_IF(ERROR, err != 0) << "Couldn't post ack flush command: " << err;
+}
+
+/**
+ * Sends all queued acknowledgements. On Linux, they are sent in batches with
+ * sendmmsg; elsewhere, one at a time.
+ */
+void ProtocolHandler::flushAcks(void) {
+	int err;
+
+	// grab the queued acks
+	{
+		std::lock_guard<std::mutex> lck(this->pendingAcksMutex);
+		this->flushingAcks.swap(this->pendingAcks);
+	}
+
+	const size_t numAcks = this->flushingAcks.size();
+
+	// send them in batches
+	for(size_t start = 0; start < numAcks; start += kMaxAckBatchSize) {
+		const size_t batch = std::min(kMaxAckBatchSize, (numAcks - start));
+
+		for(size_t i = 0; i < batch; i++) {
+			PendingAck &ack = this->flushingAcks[start + i];
+			AckTemplate *tmpl = this->getAckTemplate(&ack.dest);
+
+			this->fillAck(&this->ackPackets[i], tmpl, ack.opcode, ack.txn, ack.nack);
+
+			this->ackIov[i].iov_base = &this->ackPackets[i];
+			this->ackIov[i].iov_len = sizeof(lichtenstein_header_t);
+
+#ifdef __linux__
+			struct msghdr *msg = &this->ackMsgs[i].msg_hdr;
+			memset(msg, 0, sizeof(struct msghdr));
+
+			msg->msg_name = &tmpl->addr;
+			msg->msg_namelen = sizeof(tmpl->addr);
+			msg->msg_iov = &this->ackIov[i];
+			msg->msg_iovlen = 1;
+#else
+			err = this->sendPacket(&this->ackPackets[i], sizeof(lichtenstein_header_t), &tmpl->addr);
+			LOG_IF(ERROR, err != 0) << "Couldn't send ack: " << err;
+
+			this->ackFlushSyscalls++;
+#endif
+		}
+
+#ifdef __linux__
+		// send the batch; sendmmsg may send only part of it
+		size_t sent = 0;
+
+		while(sent < batch) {
+			err = sendmmsg(this->announcementSocket, this->ackMsgs + sent, (batch - sent), 0);
+			this->ackFlushSyscalls++;
+
+			if(err == -1) {
+				if(errno == EINTR) {
+					continue;
+				}
+
+				PLOG(ERROR) << "Couldn't send " << (batch - sent) << " acks";
+				break;
+			}
+
+			sent += err;
+
+			this->txPackets->add(err);
+			this->txBytes->add(err * sizeof(lichtenstein_header_t));
+		}
+#endif
+
+		// record how long the acks waited in the queue
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+
+		for(size_t i = 0; i < batch; i++) {
+			this->stageLatency[kStageAckSend]->recordInterval(this->flushingAcks[start + i].queuedAt, now);
+		}
+	}
+
+	this->acksFlushed += numAcks;
+	this->flushingAcks.clear();
+
+	VLOG_IF(1, numAcks > 0 && (this->ackFlushSyscalls % 1000) == 0) << "Sent "
+		<< this->acksFlushed << " queued acks with " << this->ackFlushSyscalls << " syscalls";
+}
+
+
+
+/**
+ * Records that a frame for the given channel was accepted or rejected, for the
+ * next cumulative ack. This may be called from any thread.
+ */
+void ProtocolHandler::recordFrameResult(size_t channel, bool nack) {
+	if(channel >= (kChannelBitmapWords * 32)) {
+		LOG(WARNING) << "Can't record result for invalid channel " << channel;
+		return;
+	}
+
+	const uint32_t bit = (1U << (channel % 32));
+
+	if(nack) {
+		this->nackedChannels[channel / 32].fetch_or(bit, std::memory_order_relaxed);
+	} else {
+		this->acceptedChannels[channel / 32].fetch_or(bit, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Records how long it took from the kernel receiving a frame until an output
+ * plugin submitted it to the hardware, as well as the time spent in the plugin's
+ * queue and submitting it. Frames that weren't stamped by their plugin are
+ * ignored. This may be called from any thread.
+ */
+void ProtocolHandler::recordFrameLatency(OutputFrame *frame) {
+	const struct timespec &rx = frame->getRxTimestamp();
+	const struct timespec &queued = frame->getQueueTimestamp();
+	const struct timespec &dequeued = frame->getDequeueTimestamp();
+	const struct timespec &out = frame->getOutputTimestamp();
+
+	const size_t channel = frame->getChannel();
+
+	if(out.tv_sec == 0 && out.tv_nsec == 0) {
+		return;
+	} else if(channel >= (kChannelBitmapWords * 32)) {
+		return;
+	}
+
+	// per stage latency, if the plugin marked when it dequeued the frame
+	if(dequeued.tv_sec != 0 || dequeued.tv_nsec != 0) {
+		this->stageLatency[kStagePluginQueue]->recordInterval(queued, dequeued);
+		this->stageLatency[kStageHardwareSubmit]->recordInterval(dequeued, out);
+	}
+
+	const int64_t latencyNs = ((static_cast<int64_t>(out.tv_sec) - rx.tv_sec) * 1000000000LL) +
+		(static_cast<int64_t>(out.tv_nsec) - rx.tv_nsec);
+
+	// the clock may have been stepped in the meantime
+	if(latencyNs < 0) {
+		return;
+	}
+
+	const uint32_t latencyUs = static_cast<uint32_t>(std::min(latencyNs / 1000, static_cast<int64_t>(UINT32_MAX)));
+
+	ChannelLatency &stats = this->latency[channel];
+
+	stats.totalUs.fetch_add(latencyUs, std::memory_order_relaxed);
+	stats.frames.fetch_add(1, std::memory_order_relaxed);
+
+	uint32_t max = stats.maxUs.load(std::memory_order_relaxed);
+
+	while(latencyUs > max && !stats.maxUs.compare_exchange_weak(max, latencyUs, std::memory_order_relaxed)) {
+		// retry; max was updated with the current value
+	}
+}
+
+/**
+ * Collects the latency of the frames output since the last call, logging it
+ * for each channel, and resets the statistics.
+ *
+ * @return Average latency over all channels in µs, or -1 if no frames were
+ * output in the meantime.
+ */
+int32_t ProtocolHandler::collectFrameLatency(void) {
+	uint64_t totalUs = 0;
+	uint64_t frames = 0;
+
+	for(size_t i = 0; i < (kChannelBitmapWords * 32); i++) {
+		ChannelLatency &stats = this->latency[i];
+
+		const uint64_t channelTotal = stats.totalUs.exchange(0, std::memory_order_relaxed);
+		const uint32_t channelFrames = stats.frames.exchange(0, std::memory_order_relaxed);
+		const uint32_t channelMax = stats.maxUs.exchange(0, std::memory_order_relaxed);
+
+		if(channelFrames == 0) {
+			continue;
+		}
+
+		VLOG(1) << "Channel " << i << ": " << channelFrames << " frames, latency avg "
+			<< (channelTotal / channelFrames) << " µs, max " << channelMax << " µs";
+
+		totalUs += channelTotal;
+		frames += channelFrames;
+	}
+
+	if(frames == 0) {
+		return -1;
+	}
+
+	return static_cast<int32_t>(std::min(totalUs / frames, static_cast<uint64_t>(INT32_MAX)));
+}
+
+/**
+ * Sends a cumulative ack for all frames processed since the last one to the
+ * server, then starts a new generation.
+ */
+void ProtocolHandler::sendCumulativeAck(uint32_t txn) {
+	int err;
+
+	lichtenstein_cumulative_ack_t ack;
+	memset(&ack, 0, sizeof(ack));
+
+	LichtensteinUtils::populateHeader(&ack, kOpcodeCumulativeAck);
+
+	ack.header.flags |= kFlagAck;
+	ack.header.txn = txn;
+	ack.header.payloadLength = (sizeof(ack) - sizeof(lichtenstein_header_t));
+
+	// grab the bitmaps and clear them
+	for(size_t i = 0; i < kChannelBitmapWords; i++) {
+		ack.acceptedChannels[i] = this->acceptedChannels[i].exchange(0);
+		ack.nackedChannels[i] = this->nackedChannels[i].exchange(0);
+	}
+
+	LichtensteinUtils::convertToNetworkByteOrder(&ack, sizeof(ack));
+	LichtensteinUtils::applyChecksum(&ack, sizeof(ack));
+
+	// send
+	err = this->sendPacketToHost(&ack, sizeof(ack), &this->serverAddr);
+	LOG_IF(ERROR, err != 0) << "Couldn't send cumulative ack: " << err;
+}
+
+/**
+ * Sends a NACK for a fragmented frame, listing the fragments that are missing.
+ */
+void ProtocolHandler::sendFragmentNack(uint32_t txn, uint32_t channel, const uint16_t *missing, size_t numMissing, struct in_addr *dest) {
+	int err;
+
+	// build the packet on the stack; it's at most a few hundred bytes
+	char buffer[sizeof(lichtenstein_framebuffer_fragment_nack_t) + (kLichtensteinMaxFragments * sizeof(uint16_t))];
+	CHECK(numMissing <= kLichtensteinMaxFragments) << "Too many missing fragments: " << numMissing;
+
+	size_t totalPacketLen = sizeof(lichtenstein_framebuffer_fragment_nack_t) + (numMissing * sizeof(uint16_t));
+	memset(buffer, 0, totalPacketLen);
+
+	lichtenstein_framebuffer_fragment_nack_t *nack = reinterpret_cast<lichtenstein_framebuffer_fragment_nack_t *>(buffer);
+
+	LichtensteinUtils::populateHeader(nack, kOpcodeFramebufferFragment);
+
+	nack->header.flags |= kFlagNAck;
+	nack->header.txn = txn;
+	nack->header.payloadLength = (totalPacketLen - sizeof(lichtenstein_header_t));
+
+	nack->destChannel = channel;
+	nack->numMissing = numMissing;
+
+	memcpy(nack->missing, missing, (numMissing * sizeof(uint16_t)));
+
+	LichtensteinUtils::convertToNetworkByteOrder(nack, totalPacketLen);
+	LichtensteinUtils::applyChecksum(nack, totalPacketLen);
+
+	// send
+	err = this->sendPacketToHost(nack, totalPacketLen, dest);
+	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+}
+
+
+
+/**
+ * Starts a time sync exchange with the server that adopted us. The server
+ * responds with the times at which it received the request and sent its
+ * response, which are then used to estimate the offset between our clocks.
+ */
+void ProtocolHandler::sendTimeSyncRequest(void) {
+	int err;
+
+	if(!this->isAdopted) {
+		return;
+	}
+
+	// build the packet
+	lichtenstein_time_sync_t request;
+	memset(&request, 0, sizeof(request));
+
+	LichtensteinUtils::populateHeader(&request, kOpcodeTimeSync);
+	request.header.payloadLength = (sizeof(request) - sizeof(lichtenstein_header_t));
+
+	// get the timestamp as late as possible
+	request.originateTime = this->clockSync->startRequest();
+
+	LichtensteinUtils::convertToNetworkByteOrder(&request, sizeof(request));
+	LichtensteinUtils::applyChecksum(&request, sizeof(request));
+
+	// send
+	err = this->sendPacketToHost(&request, sizeof(request), &this->serverAddr);
+	LOG_IF(ERROR, err != 0) << "Couldn't send time sync request: " << err;
+}
+
+/**
+ * Handles the server's response to a time sync request.
+ */
+void ProtocolHandler::handleTimeSync(lichtenstein_header_t *header, const struct timespec *rxTimestamp) {
+	lichtenstein_time_sync_t *packet = reinterpret_cast<lichtenstein_time_sync_t *>(header);
+
+	// the receive timestamp is the closest we have to the arrival on the wire
+	const uint64_t t4 = this->clockSync->getLocalTime(*rxTimestamp);
+
+	const bool wasSynchronized = this->clockSync->isSynchronized();
+
+	if(!this->clockSync->addSample(packet->originateTime, packet->receiveTime, packet->transmitTime, t4)) {
+		return;
+	}
+
+	LOG_IF(INFO, !wasSynchronized) << "Synchronized to server clock: offset "
+		<< this->clockSync->getOffset() << " ns, delay "
+		<< this->clockSync->getDelay() << " ns";
+}
+
+
+
+/**
+ * Outputs the given channels; if that fails, the sync output request is NACKed.
+ */
+void ProtocolHandler::outputChannels(uint32_t channelMask, uint16_t opcode, uint32_t txn, struct in_addr *source) {
+	int err;
+
+	// make it a bitfield
+	std::bitset<32> channels(channelMask);
+
+	// swap the framebuffers of those channels, and hand the plugin the front buffers
+	if(this->framebuffers->isConfigured()) {
+		for(size_t i = 0; i < channels.size(); i++) {
+			if(!channels[i]) {
+				continue;
+			}
+
+			OutputFrame *frame = this->framebuffers->present(i, this);
+
+			if(frame) {
+				this->submitOutputFrame(frame, nullptr);
+			}
+		}
+	}
+
+	// call into the plugin handler
+	err = this->channelOutputCallback(channels);
+
+	if(err != 0) {
+		// increment counter
+		this->outputPacketsDiscarded->increment();
+
+		// log
+		LOG(WARNING) << "Couldn't process channel output: " << err;
+
+		// nack
+		lichtenstein_header_t header;
+		memset(&header, 0, sizeof(header));
+
+		header.opcode = opcode;
+		header.txn = txn;
+
+		this->ackUnicast(&header, source, true);
+	}
+}
+
+/**
+ * Schedules the output requested by a timed sync output packet for its
+ * presentation time. If the presentation time can't be converted to our clock
+ * or is unreasonable, the channels are output right away instead.
+ */
+void ProtocolHandler::scheduleOutput(lichtenstein_header_t *header, struct in_addr *source) {
+	lichtenstein_sync_output_timed_t *packet = reinterpret_cast<lichtenstein_sync_output_timed_t *>(header);
+
+	ScheduledOutput output;
+
+	output.channels = packet->channels;
+	output.opcode = header->opcode;
+	output.txn = header->txn;
+	output.source = *source;
+
+#ifdef __linux__
+	// convert the presentation time to our clock
+	if(!this->clockSync->toRealtime(packet->presentationTime, output.deadline)) {
+		LOG(WARNING) << "Clock isn't synchronized, outputting txn " << header->txn << " immediately";
+
+		this->outputChannels(output.channels, output.opcode, output.txn, &output.source);
+		return;
+	}
+
+	// output late or implausibly far off requests right away
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if(output.deadline.tv_sec < now.tv_sec ||
+	   (output.deadline.tv_sec == now.tv_sec && output.deadline.tv_nsec <= now.tv_nsec)) {
+		VLOG(1) << "Presentation time for txn " << header->txn << " already passed";
+
+		this->outputChannels(output.channels, output.opcode, output.txn, &output.source);
+		return;
+	} else if((output.deadline.tv_sec - now.tv_sec) > kMaxPresentationDelay) {
+		LOG(WARNING) << "Presentation time for txn " << header->txn << " is more than "
+			<< kMaxPresentationDelay << " seconds away, outputting immediately";
+
+		this->outputChannels(output.channels, output.opcode, output.txn, &output.source);
+		return;
+	}
+
+	// insert it in order of deadline
+	auto it = std::upper_bound(this->scheduledOutputs.begin(), this->scheduledOutputs.end(), output,
+	[](const ScheduledOutput &a, const ScheduledOutput &b) {
+		if(a.deadline.tv_sec != b.deadline.tv_sec) {
+			return (a.deadline.tv_sec < b.deadline.tv_sec);
+		}
+
+		return (a.deadline.tv_nsec < b.deadline.tv_nsec);
+	});
+
+	this->scheduledOutputs.insert(it, output);
+
+	this->armOutputTimer();
+#else
+	// without timerfd, there's no way to wait precisely
+	this->outputChannels(output.channels, output.opcode, output.txn, &output.source);
+#endif
+}
+
+/**
+ * Arms the output timer for the earliest scheduled output, or disarms it if
+ * there are none.
+ */
+void ProtocolHandler::armOutputTimer(void) {
+#ifdef __linux__
+	int err;
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	if(!this->scheduledOutputs.empty()) {
+		spec.it_value = this->scheduledOutputs.front().deadline;
+	}
+
+	err = timerfd_settime(this->outputTimer, TFD_TIMER_ABSTIME, &spec, nullptr);
+	PLOG_IF(ERROR, err != 0) << "Couldn't arm output timer";
+#endif
+}
+
+/**
+ * Handles the output timer expiring: all outputs whose presentation time has
+ * come are performed, and the timer is armed for the next one.
+ */
+void ProtocolHandler::handleOutputTimer(void) {
+#ifdef __linux__
+	int err;
+
+	// read the expiration count to clear the descriptor's readable state
+	uint64_t expirations;
+
+	err = read(this->outputTimer, &expirations, sizeof(expirations));
+
+	if(err < 0 && errno != EAGAIN) {
+		PLOG(ERROR) << "Couldn't read output timer";
+	}
+
+	// perform all outputs that are due
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	auto it = this->scheduledOutputs.begin();
+
+	for(; it != this->scheduledOutputs.end(); it++) {
+		if(it->deadline.tv_sec > now.tv_sec ||
+		   (it->deadline.tv_sec == now.tv_sec && it->deadline.tv_nsec > now.tv_nsec)) {
+			break;
+		}
+
+		VLOG(2) << "Outputting txn " << it->txn << " "
+			<< (((now.tv_sec - it->deadline.tv_sec) * 1000000000LL) + (now.tv_nsec - it->deadline.tv_nsec))
+			<< " ns after its presentation time";
+
+		this->outputChannels(it->channels, it->opcode, it->txn, &it->source);
+	}
+
+	this->scheduledOutputs.erase(this->scheduledOutputs.begin(), it);
+
+	// wait for the next one
+	this->armOutputTimer();
+#endif
+}
+
+
+
+/**
+ * Replays packets from the capture file into the given shard. With a replay
+ * speed, packets are injected at the same relative times they were captured
+ * (scaled by the speed), and the replay timer is armed when the next one isn't
+ * due yet; otherwise, they're injected as fast as possible.
+ *
+ * At most kMaxReplayBatch packets are injected per call, so that acks, timers
+ * and other commands are still handled while replaying.
+ */
+void ProtocolHandler::replayPackets(Shard *shard) {
+	const PacketCapture::RecordHeader *record;
+	const void *data;
+	size_t injected = 0;
+
+	// note when (and in what state) the replay started, to calculate throughput
+	if(!this->replayStarted) {
+		this->replayStarted = true;
+
+		clock_gettime(CLOCK_MONOTONIC, &this->replayStartTime);
+		this->replayStartCpuUs = getProcessCpuTimeUs();
+		this->replayStartFrames = this->framesOutput->read();
+
+		// times are relative to the first packet
+		if(this->replay->next(&record, &data)) {
+			this->replayFirstTimestamp = record->timestamp;
+
+			this->replayRecord = record;
+			this->replayData = data;
+		}
+	}
+
+	while(this->run) {
+		// get the next record, unless the last one we read wasn't due yet
+		if(this->replayRecord) {
+			record = static_cast<const PacketCapture::RecordHeader *>(this->replayRecord);
+			data = this->replayData;
+
+			this->replayRecord = nullptr;
+		} else if(!this->replay->next(&record, &data)) {
+			this->finishReplay();
+			return;
+		}
+
+#ifdef __linux__
+		// wait until the packet is due
+		if(this->replaySpeed > 0) {
+			uint64_t offset = 0;
 
+			if(record->timestamp > this->replayFirstTimestamp) {
+				offset = static_cast<uint64_t>((record->timestamp - this->replayFirstTimestamp) / this->replaySpeed);
+			}
 
-/**
- * Handles a node adoption.
- *
- * @note This assumes all preconditions are satisfied: e.g. that the node isn't
- * already adopted.
- */
-void ProtocolHandler::handleAdoption(lichtenstein_header_t *header, struct in_addr *source) {
-  lichtenstein_node_adoption_t *packet = reinterpret_cast<lichtenstein_node_adoption_t *>(header);
+			const uint64_t start = (static_cast<uint64_t>(this->replayStartTime.tv_sec) * 1000000000ULL) +
+				this->replayStartTime.tv_nsec;
+			const uint64_t due = start + offset;
 
-  // acknowledge request (to the IP in the packet)
-  LOG(INFO) << "Acknowledge packet IP: " << std::hex << packet->ip;
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
 
-  this->ackUnicast(header, source, false);
+			if(due > ((static_cast<uint64_t>(now.tv_sec) * 1000000000ULL) + now.tv_nsec)) {
+				this->replayRecord = record;
+				this->replayData = data;
 
-  // set flag
-  this->isAdopted = true;
+				struct itimerspec spec;
+				memset(&spec, 0, sizeof(spec));
 
-  // set status
-  StatusHandler::sharedInstance()->setAdoptionState(true);
+				spec.it_value.tv_sec = (due / 1000000000ULL);
+				spec.it_value.tv_nsec = (due % 1000000000ULL);
 
-  // cancel the timer
-	this->timer.remove(this->announcementTimer);
+				int err = timerfd_settime(this->replayTimer, TFD_TIMER_ABSTIME, &spec, nullptr);
+				PLOG_IF(ERROR, err != 0) << "Couldn't arm replay timer";
 
-  // success!
-  static const socklen_t srcAddrSz = 128;
-  char srcAddr[srcAddrSz];
-  const char *ptr = inet_ntop(AF_INET, source, srcAddr, srcAddrSz);
-  CHECK(ptr != nullptr) << "Couldn't convert destination address";
+				return;
+			}
+		}
+#endif
 
-  LOG(INFO) << "Adopted by " << srcAddr;
-}
+		this->injectPacket(shard, data, record->length, record->dest);
+
+		// yield to the event loop every so often
+		if(++injected == kMaxReplayBatch) {
+			int err = shard->reactor->postCommand(kWorkerReplay);
+			LOG_IF(ERROR, err != 0) << "Couldn't post replay command: " << err;
 
+			return;
+		}
+	}
+}
 
 /**
- * Acknowledges an unicast packet without sending any additional data back to
- * the server.
+ * Injects a replayed packet into the shard, as if it had been received on its
+ * socket just now. Packets that were multicast keep their destination, so they
+ * are handled as such; all of them appear to come from the loopback address,
+ * so any replies go there rather than to the server in the capture.
  */
-void ProtocolHandler::ackUnicast(lichtenstein_header_t *header, struct in_addr *source, bool nack) {
-	int err;
+void ProtocolHandler::injectPacket(Shard *shard, const void *data, size_t length, uint32_t dest) {
+	if(length > kClientBufferSz) {
+		LOG(WARNING) << "Skipping replayed packet of " << length << " bytes";
+		return;
+	}
 
-	// get the packet
-	void *packet = this->createUnicastAck(header, nack);
+	// copy the packet into a buffer, as frames may hold on to it
+	PacketBuffer *buffer = shard->rxPool->acquire();
+	memcpy(buffer->getData(), data, length);
 
-	// send
-	err = this->sendPacketToHost(packet, sizeof(lichtenstein_header_t), source);
-	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+	// fill in the control messages the socket would provide
+	alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct in_pktinfo)) +
+										 CMSG_SPACE(sizeof(struct timespec))];
+	memset(control, 0, sizeof(control));
 
-	// clean up
-	free(packet);
-}
+	// all packets appear to be sent from loopback
+	struct sockaddr_in sender;
+	memset(&sender, 0, sizeof(sender));
 
-/**
- * Generates an acknowledgement packet.
- */
-lichtenstein_header_t *ProtocolHandler::createUnicastAck(lichtenstein_header_t *header, bool nack) {
-	// allocate the packet
-	size_t totalPacketLen = sizeof(lichtenstein_header_t);
+	sender.sin_family = AF_INET;
+	sender.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sender.sin_port = htons(this->port);
 
-	lichtenstein_header_t *packet = static_cast<lichtenstein_header_t *>(malloc(totalPacketLen));
-	CHECK(packet != nullptr) << "Couldn't allocate packet!";
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
 
-	memset(packet, 0, totalPacketLen);
+	msg.msg_name = &sender;
+	msg.msg_namelen = sizeof(sender);
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
 
-	// prepare the packet
-	LichtensteinUtils::populateHeader(packet, header->opcode);
+	struct cmsghdr *cmhdr = CMSG_FIRSTHDR(&msg);
 
-	// set the nack/ack flags
-	if(!nack) {
-		packet->flags |= kFlagAck;
-	} else {
-		packet->flags |= kFlagNAck;
-	}
+	struct in_pktinfo info;
+	memset(&info, 0, sizeof(info));
 
-	packet->txn = header->txn;
+	const bool isMulticast = ((ntohl(dest) >> 28) == 0x0E);
+	info.ipi_addr.s_addr = isMulticast ? dest : htonl(INADDR_LOOPBACK);
 
-	LichtensteinUtils::convertToNetworkByteOrder(packet, totalPacketLen);
-	LichtensteinUtils::applyChecksum(packet, totalPacketLen);
+	cmhdr->cmsg_level = IPPROTO_IP;
+	cmhdr->cmsg_type = IP_PKTINFO;
+	cmhdr->cmsg_len = CMSG_LEN(sizeof(info));
+	memcpy(CMSG_DATA(cmhdr), &info, sizeof(info));
 
-	// done
-	return packet;
+#ifdef SO_TIMESTAMPNS
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	cmhdr = CMSG_NXTHDR(&msg, cmhdr);
+
+	cmhdr->cmsg_level = SOL_SOCKET;
+	cmhdr->cmsg_type = SCM_TIMESTAMPNS;
+	cmhdr->cmsg_len = CMSG_LEN(sizeof(now));
+	memcpy(CMSG_DATA(cmhdr), &now, sizeof(now));
+#else
+	msg.msg_controllen = CMSG_SPACE(sizeof(struct in_pktinfo));
+#endif
+
+	this->handlePacket(shard, buffer, length, &msg);
+
+	this->replayedPackets++;
+	this->replayedBytes += length;
+
+	// drop our reference; frames keep theirs
+	buffer->release();
 }
 
 /**
- * Acknowledges an output frame.
+ * Logs the throughput of the replay once all packets have been injected, then
+ * invokes the replay done callback.
+ *
+ * Frames that are still queued in the output plugin when the replay finishes
+ * aren't counted.
  */
-void ProtocolHandler::ackOutputFrame(OutputFrame *frame, bool nack) {
-	int err;
+void ProtocolHandler::finishReplay(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	// get the packet
-	void *packet = frame->getAckPacket();
-	struct in_addr *dest = frame->getAckDest();
+	const double elapsed = (now.tv_sec - this->replayStartTime.tv_sec) +
+		((now.tv_nsec - this->replayStartTime.tv_nsec) / 1000000000.0);
 
-	// modify the packet if nack is true
-	if(nack) {
-		lichtenstein_header_t *hdr = static_cast<lichtenstein_header_t *>(packet);
+	const uint64_t frames = this->framesOutput->read() - this->replayStartFrames;
+	const uint64_t cpuUs = getProcessCpuTimeUs() - this->replayStartCpuUs;
 
-		// clear ACK flag, set NACK
-		hdr->flags &= ~kFlagAck;
-		hdr->flags |= kFlagNAck;
-	}
+	LOG(INFO) << "Replayed " << this->replayedPackets << " packets ("
+		<< this->replayedBytes << " bytes) in " << elapsed << " s: "
+		<< (this->replayedPackets / std::max(elapsed, 1e-9)) << " packets/s, "
+		<< frames << " frames output (" << (frames / std::max(elapsed, 1e-9))
+		<< " frames/s, " << (frames ? (double(cpuUs) / frames) : 0)
+		<< " µs CPU per frame)";
 
-	// send
-	err = this->sendPacketToHost(packet, sizeof(lichtenstein_header_t), dest);
-	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+	if(this->replayDoneCallback) {
+		this->replayDoneCallback();
+	}
 }
 
 
@@ -583,27 +2426,30 @@ void ProtocolHandler::sendStatusResponse(lichtenstein_header_t *header, struct i
 	// get uptime
 	status->uptime = this->getUptime();
 
-	// get total and free memory (this only works on linux)
-#ifdef __linux__
-	struct sysinfo info;
+	// everything else comes from the last metrics snapshot; the protocol's
+	// counters are 32 bits, so they simply wrap around
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
 
-	// get the struct info
-	err = sysinfo(&info);
-	PLOG_IF(ERROR, err != 0) << "sysinfo failed";
+	status->totalMem = metrics->getTotalMemory()->getSnapshot();
+	status->freeMem = metrics->getFreeMemory()->getSnapshot();
 
-	unsigned int unitSz = info.mem_unit;
+	status->rxPackets = this->rxPackets->getSnapshot();
+	status->txPackets = this->txPackets->getSnapshot();
+	status->packetsWithInvalidCRC = this->packetsWithInvalidCRC->getSnapshot();
 
-	status->totalMem = (info.totalram * unitSz);
-	status->freeMem = (info.freeram * unitSz);
-#endif
+	status->framesOutput = this->framesOutput->getSnapshot();
 
-	// packets with invalid CRC
-	status->packetsWithInvalidCRC = this->packetsWithInvalidCRC;
+	status->outputState = this->outputState->getSnapshot();
+	status->cpuUsagePercent = std::min(metrics->getCpuUsage()->getSnapshot(), static_cast<int64_t>(UINT16_MAX));
 
-	// get CPU load (in percent)
-#ifdef __linux__
-	status->cpuUsagePercent = (info.loads[0] * 100);
-#endif
+	status->rxBytes = this->rxBytes->getSnapshot();
+	status->txBytes = this->txBytes->getSnapshot();
+
+	status->mediumSpeed = metrics->getLinkSpeed()->getSnapshot();
+	status->mediumDuplex = (metrics->getLinkDuplex()->getSnapshot() ? kDuplexFull : kDuplexHalf);
+
+	// average time from receiving a frame to outputting it
+	status->avgConversionTimeUs = this->collectFrameLatency();
 
 	// prepare to send
 	LichtensteinUtils::populateHeader(status, kOpcodeNodeStatusReq);
@@ -612,6 +2458,7 @@ void ProtocolHandler::sendStatusResponse(lichtenstein_header_t *header, struct i
 	status->header.flags |= kFlagResponse;
 
 	status->header.txn = header->txn;
+	status->header.payloadLength = (totalPacketLen - sizeof(lichtenstein_header_t));
 
 	LichtensteinUtils::convertToNetworkByteOrder(status, totalPacketLen);
 	LichtensteinUtils::applyChecksum(status, totalPacketLen);
@@ -625,33 +2472,116 @@ void ProtocolHandler::sendStatusResponse(lichtenstein_header_t *header, struct i
 }
 
 /**
- * Sends the specified data packet to the host whose address is specified.
+ * Handles a status request that carries a sub-opcode.
  */
-int ProtocolHandler::sendPacketToHost(void *data, size_t length, struct in_addr *dest) {
+void ProtocolHandler::handleStatusSubRequest(lichtenstein_header_t *header, struct in_addr *source) {
+	lichtenstein_node_status_sub_req_t *req = reinterpret_cast<lichtenstein_node_status_sub_req_t *>(header);
+
+	switch(req->subOpcode) {
+		// latency histograms
+		case kStatusSubHistograms:
+			this->sendHistogramResponse(header, (req->flags & kStatusSubFlagReset), source);
+			break;
+
+		default:
+			LOG(WARNING) << "Unknown status sub-opcode " << req->subOpcode;
+			this->ackUnicast(header, source, true);
+			break;
+	}
+}
+
+/**
+ * Sends a summary of each pipeline stage's latency histogram, optionally
+ * resetting the histograms afterwards.
+ */
+void ProtocolHandler::sendHistogramResponse(lichtenstein_header_t *header, bool reset, struct in_addr *source) {
 	int err;
 
+	// build the packet on the stack; it's a couple hundred bytes
+	const size_t totalPacketLen = sizeof(lichtenstein_node_status_histograms_t) +
+		(kNumStages * sizeof(lichtenstein_node_status_histogram_t));
+
+	char buffer[totalPacketLen];
+	memset(buffer, 0, totalPacketLen);
+
+	lichtenstein_node_status_histograms_t *response = reinterpret_cast<lichtenstein_node_status_histograms_t *>(buffer);
+
+	response->subOpcode = kStatusSubHistograms;
+	response->numHistograms = kNumStages;
+
+	for(size_t i = 0; i < kNumStages; i++) {
+		MetricsHistogram::Summary summary;
+		this->stageLatency[i]->summarize(summary);
+
+		if(reset) {
+			this->stageLatency[i]->reset();
+		}
+
+		lichtenstein_node_status_histogram_t *out = &response->histograms[i];
+
+		out->stage = i;
+		out->count = std::min(summary.count, static_cast<uint64_t>(UINT32_MAX));
+
+		out->p50 = std::min(summary.p50, static_cast<uint64_t>(UINT32_MAX));
+		out->p90 = std::min(summary.p90, static_cast<uint64_t>(UINT32_MAX));
+		out->p99 = std::min(summary.p99, static_cast<uint64_t>(UINT32_MAX));
+		out->p999 = std::min(summary.p999, static_cast<uint64_t>(UINT32_MAX));
+		out->max = std::min(summary.max, static_cast<uint64_t>(UINT32_MAX));
+	}
+
+	// prepare to send
+	LichtensteinUtils::populateHeader(response, kOpcodeNodeStatusReq);
+
+	response->header.flags |= kFlagAck;
+	response->header.flags |= kFlagResponse;
+
+	response->header.txn = header->txn;
+	response->header.payloadLength = (totalPacketLen - sizeof(lichtenstein_header_t));
+
+	LichtensteinUtils::convertToNetworkByteOrder(response, totalPacketLen);
+	LichtensteinUtils::applyChecksum(response, totalPacketLen);
+
+	// send
+	err = this->sendPacketToHost(response, totalPacketLen, source);
+	LOG_IF(ERROR, err != 0) << "Couldn't send packet: " << err;
+}
+
+/**
+ * Sends the specified data packet to the host whose address is specified.
+ */
+int ProtocolHandler::sendPacketToHost(void *data, size_t length, struct in_addr *dest) {
 	// prepare address
 	struct sockaddr_in addr;
 
-	// prefill it with the port
-	int port = this->config->GetInteger("client", "port", 7420);
-
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(port);
+	addr.sin_port = htons(this->port);
 
 	// copy in the IP address
 	memcpy(&addr.sin_addr, dest, sizeof(addr.sin_addr));
 
+	// send the packet
+	return this->sendPacket(data, length, &addr);
+}
+
+/**
+ * Sends the given packet to the specified address.
+ */
+int ProtocolHandler::sendPacket(void *data, size_t length, const struct sockaddr_in *addr) {
+	int err;
+
 	// send the packet
 	err = sendto(this->announcementSocket, data, length,
-				 0, (struct sockaddr *) &addr, sizeof(addr));
+				 0, (const struct sockaddr *) addr, sizeof(*addr));
 
 	// handle errors
 	if(err == -1) {
 		return errno;
 	}
 
+	this->txPackets->increment();
+	this->txBytes->add(length);
+
 	// no errors, yay
 	return 0;
 }
@@ -660,68 +2590,100 @@ int ProtocolHandler::sendPacketToHost(void *data, size_t length, struct in_addr
 
 /**
  * Sends a node announcement packet.
+ *
+ * The packet is built once, and sent as-is until the interface monitor reports
+ * that links or addresses changed, or the hostname changes. There's no
+ * notification for the latter, so the hostname is compared on every send;
+ * that's a single uname call. Without a monitor, the packet is rebuilt every
+ * time.
  */
 void ProtocolHandler::sendAnnouncement(void) {
 	int err = 0;
-	struct in_addr addr;
+	const Config::Client &client = this->config->getClient();
 
 	// set up the destination address of the multicast group
-	string address = this->config->Get("client", "multicastGroup", "239.42.0.69");
+	struct in_addr addr = client.multicastGroup;
 
-	err = inet_pton(AF_INET, address.c_str(), &addr);
-	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address";
+	struct utsname names;
 
-	// get MAC address and hostname
-	uint8_t macAddr[6] = {0xd8, 0xde, 0xad, 0xbe, 0xef, 0x00};
-	this->getMacAddress(reinterpret_cast<uint8_t *>(&macAddr));
+	err = uname(&names);
+	PLOG_IF(FATAL, err != 0) << "Couldn't get hostname";
 
-	char hostname[HOST_NAME_MAX];
-	memset(hostname, 0, sizeof(hostname));
+	if(this->announcedHostname != names.nodename) {
+		this->announcementStale = true;
+	}
 
-	err = gethostname(hostname, sizeof(hostname));
-	PLOG_IF(FATAL, err != 0) << "Couldn't get hostname";
+	// rebuild the packet if needed
+	if(this->announcementStale || !this->interfaceMonitor) {
+		err = this->buildAnnouncement(names.nodename);
 
-	size_t hostnameLen = strlen(hostname) + 1;
+		if(err != 0) {
+			LOG(WARNING) << "Not sending announcement; no address to announce";
+			return;
+		}
+	}
 
-	// allocate the packet
-	size_t totalPacketLen = sizeof(lichtenstein_node_announcement_t) + hostnameLen;
+	// send it
+	err = this->sendPacketToHost(this->announcement, this->announcementLength, &addr);
+	LOG_IF(ERROR, err != 0) << "Couldn't send announcement: " << err;
+}
 
-	lichtenstein_node_announcement_t *announce = static_cast<lichtenstein_node_announcement_t *>(malloc(totalPacketLen + 16));
-	memset(announce, 0, (totalPacketLen + 16));
+/**
+ * Builds the node announcement packet, in network byte order and with its
+ * checksum applied, replacing the previous one.
+ *
+ * @return 0 on success, -1 if we don't have an address to announce.
+ */
+int ProtocolHandler::buildAnnouncement(const char *hostname) {
+	int err = 0;
+	const Config::Client &client = this->config->getClient();
 
-	// versions
-	announce->swVersion = kLichtensteinSWVersion;
-	announce->hwVersion = 0x00001000; // TODO: figure this out properly
+	// get MAC address
+	uint8_t macAddr[6] = {0xd8, 0xde, 0xad, 0xbe, 0xef, 0x00};
+	this->getMacAddress(reinterpret_cast<uint8_t *>(&macAddr));
 
-	// get the port, then figure out how to get the IP address
-	announce->port = this->config->GetInteger("client", "port", 7420);;
+	size_t hostnameLen = strlen(hostname) + 1;
 
 	// figure out if we need to get the IP address from the config
-	std::string advertiseAddress = this->config->Get("client", "advertiseAddress", "0.0.0.0");
+	uint32_t ip;
 
-	if(advertiseAddress != "0.0.0.0") {
-		err = inet_pton(AF_INET, advertiseAddress.c_str(), &announce->ip);
-
-		PLOG_IF(FATAL, err != 1) << "Couldn't convert address '" << advertiseAddress << "'";
+	if(client.advertiseAddress.s_addr != htonl(INADDR_ANY)) {
+		memcpy(&ip, &client.advertiseAddress, sizeof(ip));
 	} else {
-		std::string listenAddress = this->config->Get("client", "listen", "0.0.0.0");
-
 		// is the listen address non-null?
-		if(listenAddress != "0.0.0.0") {
+		if(client.listen.s_addr != htonl(INADDR_ANY)) {
 			// use the listen address instead.
-			err = inet_pton(AF_INET, listenAddress.c_str(), &announce->ip);
-
-			PLOG_IF(FATAL, err != 1) << "Couldn't convert address '" << listenAddress << "'";
+			memcpy(&ip, &client.listen, sizeof(ip));
 		} else {
 			// automatically detect the address
 			char addrBuffer[32];
-			this->getIpAddress(reinterpret_cast<char *>(&addrBuffer), sizeof(addrBuffer));
 
-			err = inet_pton(AF_INET, addrBuffer, &announce->ip);
+			if(this->getIpAddress(reinterpret_cast<char *>(&addrBuffer), sizeof(addrBuffer)) != 0) {
+				return -1;
+			}
+
+			err = inet_pton(AF_INET, addrBuffer, &ip);
 			PLOG_IF(FATAL, err != 1) << "Couldn't convert address '" << addrBuffer << "'";
 		}
 	}
 
+	// allocate the packet
+	size_t totalPacketLen = sizeof(lichtenstein_node_announcement_t) + hostnameLen;
+
+	delete[] this->announcement;
+	this->announcement = new char[totalPacketLen + 16];
+	memset(this->announcement, 0, (totalPacketLen + 16));
+
+	lichtenstein_node_announcement_t *announce = reinterpret_cast<lichtenstein_node_announcement_t *>(this->announcement);
+
+	// versions
+	announce->swVersion = kLichtensteinSWVersion;
+	announce->hwVersion = 0x00001000; // TODO: figure this out properly
+
+	// port and IP address
+	announce->port = this->port;
+	memcpy(&announce->ip, &ip, sizeof(announce->ip));
+
 	// copy hostname and MAC address
 	announce->hostnameLen = hostnameLen;
 	strncpy(static_cast<char *>(announce->hostname), hostname, (hostnameLen - 1));
@@ -729,8 +2691,8 @@ void ProtocolHandler::sendAnnouncement(void) {
 	memcpy(announce->macAddr, macAddr, 6);
 
 	// populate number of channels and framebuffer size
-	announce->fbSize = this->config->GetInteger("output", "fbsize", 1048576);
-	announce->channels = this->config->GetInteger("output", "channels", 1);
+	announce->fbSize = this->config->getOutput().fbSize;
+	announce->channels = this->config->getOutput().channels;
 
 
 	// prepare it for sending
@@ -740,16 +2702,39 @@ void ProtocolHandler::sendAnnouncement(void) {
 	LichtensteinUtils::convertToNetworkByteOrder(announce, totalPacketLen);
 	LichtensteinUtils::applyChecksum(announce, totalPacketLen);
 
-	// send it
-	err = this->sendPacketToHost(announce, totalPacketLen, &addr);
-	LOG_IF(FATAL, err == -1) << "Couldn't send announcement: " << err;
+	this->announcementLength = totalPacketLen;
+	this->announcedHostname = hostname;
+	this->announcementStale = false;
 
-/*	err = sendto(this->announcementSocket, announce, totalPacketLen,
-				 0, (struct sockaddr *) &addr, sizeof(addr));
-	PLOG_IF(FATAL, err == -1) << "Couldn't send announcement";*/
+	char addrStr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &ip, addrStr, sizeof(addrStr));
 
-	// clean up
-	free(announce);
+	VLOG(1) << "Built announcement for " << hostname << " (" << addrStr << ")";
+
+	return 0;
+}
+
+/**
+ * Handles notifications from the interface monitor. The announcement is
+ * rebuilt the next time it's sent; if an address changed, that happens right
+ * away, so the server learns of our new address without waiting for the
+ * announcement timer.
+ */
+void ProtocolHandler::handleInterfaceChanges(Shard *shard) {
+	const uint32_t changes = this->interfaceMonitor->readChanges();
+
+	if(!changes) {
+		return;
+	}
+
+	this->announcementStale = true;
+
+	if(changes & InterfaceMonitor::kChangeAddress) {
+		LOG(INFO) << "Interface addresses changed; announcing again";
+
+		int err = shard->reactor->postCommand(kWorkerAnnounce);
+		LOG_IF(ERROR, err != 0) << "Couldn't post announcement command: " << err;
+	}
 }
 
 
@@ -834,8 +2819,10 @@ done: ;
  *
  * This is a really dumb approach because it just picks the first interface with
  * an IPv4 address.
+ *
+ * @return 0 if an address was found, -1 otherwise.
  */
-void ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
+int ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
 	struct ifaddrs *interfaces;
 	struct ifaddrs *current;
 	int err;
@@ -845,9 +2832,11 @@ void ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
 
 	if(err != 0) {
 		PLOG(ERROR) << "Couldn't get address info";
-		return;
+		return -1;
 	}
 
+	err = -1;
+
 	// iterate through it
 	current = interfaces;
 
@@ -855,7 +2844,7 @@ void ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
 		// ignore loopback interfaces
 		if(!(current->ifa_flags & IFF_LOOPBACK)) {
 			// get its address (if IPv4 address present)
-			if(current->ifa_addr->sa_family == AF_INET) {
+			if(current->ifa_addr && current->ifa_addr->sa_family == AF_INET) {
 				char ipStr[INET_ADDRSTRLEN];
 
 				// convert address
@@ -867,6 +2856,7 @@ void ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
 				VLOG(3) << "Interface name: " << current->ifa_name << " addr " << ipStr;
 
 				strncpy(addrOut, ipStr, addrOutLen);
+				err = 0;
 				goto done;
 			}
 		}
@@ -878,79 +2868,287 @@ void ProtocolHandler::getIpAddress(char *addrOut, size_t addrOutLen) {
 	// clean up
 done: ;
 	freeifaddrs(interfaces);
+
+	return err;
 }
 
 
 
 /**
- * Sets up the UDP listening socket, and a socket to send node announcements
- * with.
+ * Sets up the UDP listening sockets, one per receive shard, and a socket to
+ * send node announcements with.
+ *
+ * With more than one shard, all listening sockets are bound to the same port
+ * with SO_REUSEPORT, and a classic BPF program steers each packet to a socket:
+ * framebuffer data by its channel, syncs to the sync shard, and everything else
+ * to the control shard. If the control plane is separate, the control shard is
+ * in addition to the configured number of shards, and receives no framebuffer
+ * data. If the program can't be attached, we fall back to a single shard.
+ */
+void ProtocolHandler::setUpSockets(void) {
+	int err = 0;
+
+	// get the number of shards that receive framebuffer data
+	long numShards = this->config->getClient().receiveShards;
+
+	bool separateControl = this->config->getClient().separateControl;
+
+#if !defined(__linux__) || !defined(SO_ATTACH_REUSEPORT_CBPF)
+	// steering packets to sockets requires SO_ATTACH_REUSEPORT_CBPF
+	numShards = 1;
+	separateControl = false;
+#endif
+
+	// replayed packets are all injected into the control shard
+	if(this->replay) {
+		numShards = 1;
+		separateControl = false;
+	}
+
+	const long numSockets = (numShards + (separateControl ? 1 : 0));
+
+	// open a socket for each shard; the order determines its index in the group
+	std::vector<int> sockets;
+
+	for(long i = 0; i < numSockets; i++) {
+		sockets.push_back(this->openReceiveSocket(numSockets > 1));
+	}
+
+	// attach the steering program
+	if(numSockets > 1) {
+		err = this->attachSteeringProgram(sockets[0], (separateControl ? 1 : 0), numShards);
+
+		if(err != 0) {
+			LOG(WARNING) << "Couldn't attach steering program (" << err
+				<< "), using a single receive shard";
+
+			for(size_t i = 1; i < sockets.size(); i++) {
+				close(sockets[i]);
+			}
+
+			sockets.resize(1);
+			separateControl = false;
+		}
+	}
+
+	this->syncShard = (separateControl ? (kControlShard + 1) : kControlShard);
+
+	// the control shard's queue is only measured separately if it's separate
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
+
+	MetricsHistogram *controlDepth = metrics->registerHistogram("net.control.queueDepth");
+	MetricsHistogram *dataDepth = metrics->registerHistogram("net.data.queueDepth");
+
+	// create the shards
+	for(size_t i = 0; i < sockets.size(); i++) {
+		Shard *shard = new Shard;
+
+		shard->index = i;
+		shard->socket = sockets[i];
+		shard->reactor = new PlatformReactor();
+		shard->queueDepth = (i < this->syncShard) ? controlDepth : dataDepth;
+
+		if(this->pipeline) {
+			shard->rxReactor = new PlatformReactor();
+			shard->rxRing = new SpscRing<ReceivedPacket>(this->pipelineDepth);
+		}
+
+		this->shards.push_back(shard);
+	}
+
+	LOG(INFO) << "Receiving with " << this->shards.size() << " shard(s) on port " << this->port
+		<< (separateControl ? " (control packets separately)" : "");
+
+	// set up the announcement socket
+	this->announcementSocket = ::socket(AF_INET, SOCK_DGRAM, 0);
+	PLOG_IF(FATAL, this->announcementSocket < 0) << "Couldn't create announcement socket";
+}
+
+/**
+ * Opens a non-blocking UDP socket bound to the client port.
+ *
+ * @param reusePort Whether the socket is part of a SO_REUSEPORT group.
  */
-void ProtocolHandler::setUpSocket(void) {
+int ProtocolHandler::openReceiveSocket(bool reusePort) {
 	int err = 0;
 	struct sockaddr_in addr;
-	int nbytes, addrlen;
-	struct ip_mreq mreq;
+	int sock;
 
 	unsigned int yes = 1;
 
 	// clear the address
 	memset(&addr, 0, sizeof(addr));
 
-	// get the port and IP address to listen on
-	int port = this->config->GetInteger("client", "port", 7420);
-	string address = this->config->Get("client", "listen", "0.0.0.0");
-
-	err = inet_pton(AF_INET, address.c_str(), &addr.sin_addr.s_addr);
-	PLOG_IF(FATAL, err != 1) << "Couldn't convert IP address: ";
+	// get the IP address to listen on
+	int port = this->port;
+	addr.sin_addr = this->config->getClient().listen;
 
 	// create the socket
-	this->socket = ::socket(AF_INET, SOCK_DGRAM, 0);
-	PLOG_IF(FATAL, this->socket < 0) << "Couldn't create listening socket";
+	sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+	PLOG_IF(FATAL, sock < 0) << "Couldn't create listening socket";
 
 	// allow re-use of the address
-	err = setsockopt(this->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	err = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
 
+	// allow several sockets to share the port
+	if(reusePort) {
+		err = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+		PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEPORT";
+	}
+
 	// enable the socket info struct
-	err = setsockopt(this->socket, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
+	err = setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes));
 	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
 
+#ifdef SO_TIMESTAMPNS
+	// have the kernel timestamp received packets, to measure frame latency
+	err = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes));
+	PLOG_IF(WARNING, err < 0) << "Couldn't set SO_TIMESTAMPNS; latency will exclude time spent in the kernel";
+#endif
+
 	// set up the destination address
 	addr.sin_family = AF_INET;
 	// addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	addr.sin_port = htons(port);
 
 	// bind to this address
-	err = ::bind(this->socket, (struct sockaddr *) &addr, sizeof(addr));
+	err = ::bind(sock, (struct sockaddr *) &addr, sizeof(addr));
 	PLOG_IF(FATAL, err < 0) << "Couldn't bind listening socket on port " << port;
 
-	LOG(INFO) << "Opened listening socket on port " << port;
+	VLOG(1) << "Opened listening socket on port " << port;
 
 	// enable non-blocking IO on the socket
-	int flags = fcntl(this->socket, F_GETFL);
+	int flags = fcntl(sock, F_GETFL);
 	PCHECK(flags != -1) << "Couldn't get flags";
 
 	flags |= O_NONBLOCK;
 
-	err = fcntl(this->socket, F_SETFL, flags);
+	err = fcntl(sock, F_SETFL, flags);
 	PCHECK(err != -1) << "Couldn't set flags";
 
+	return sock;
+}
 
-	// set up the announcement socket
-	this->announcementSocket = ::socket(AF_INET, SOCK_DGRAM, 0);
-	PLOG_IF(FATAL, this->announcementSocket < 0) << "Couldn't create announcement socket";
+/**
+ * Attaches the classic BPF program that steers packets among the sockets in
+ * the SO_REUSEPORT group of the given socket. The program runs on the UDP
+ * payload: framebuffer data and fragments are steered by destination channel,
+ * modulo the number of data shards (which start at firstData), and syncs to
+ * the first data shard; all other packets go to the control shard.
+ *
+ * Syncs stay in the same queue as the framebuffer data of the first shard, so
+ * that with a single data shard, they can't overtake the frames they output.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int ProtocolHandler::attachSteeringProgram(int sock, unsigned int firstData, unsigned int numShards) {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+	int err;
+
+	static_assert(offsetof(lichtenstein_framebuffer_data_t, destChannel) ==
+				  offsetof(lichtenstein_framebuffer_fragment_t, destChannel),
+				  "Channel must be at the same offset in all framebuffer packets");
+
+	struct sock_filter code[] = {
+		// A = opcode
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, offsetof(lichtenstein_header_t, opcode)),
+		// framebuffer data or fragment?
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kOpcodeFramebufferData, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kOpcodeFramebufferFragment, 0, 4),
+		// A = (destination channel % shards) + first data shard
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(lichtenstein_framebuffer_data_t, destChannel)),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, numShards),
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, firstData),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		// syncs, and the clock sync responses their timing depends on
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kOpcodeSyncOutput, 2, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kOpcodeSyncOutputTimed, 1, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, kOpcodeTimeSync, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, firstData),
+		// everything else goes to the control shard
+		BPF_STMT(BPF_RET | BPF_K, kControlShard),
+	};
+
+	struct sock_fprog prog;
+	prog.len = (sizeof(code) / sizeof(code[0]));
+	prog.filter = code;
+
+	err = setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+
+	if(err != 0) {
+		err = errno;
+		PLOG(ERROR) << "Couldn't set SO_ATTACH_REUSEPORT_CBPF";
+
+		return err;
+	}
+
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+/**
+ * Adjusts the priority of the calling shard's thread: data shards may run with
+ * a realtime priority, and a separate control shard with a higher nice value.
+ * Failing to do so isn't fatal; the thread keeps its current priority.
+ */
+void ProtocolHandler::applyThreadPriority(Shard *shard) {
+#ifdef __linux__
+	int err;
+	const Config::Client &client = this->config->getClient();
+
+	// framebuffer data and syncs
+	if(shard->index >= this->syncShard) {
+		if(client.dataThreadPriority <= 0) {
+			return;
+		}
+
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+
+		param.sched_priority = static_cast<int>(client.dataThreadPriority);
+
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+		if(err != 0) {
+			LOG(WARNING) << "Couldn't set realtime priority " << param.sched_priority
+				<< " for shard " << shard->index << ": " << strerror(err);
+		} else {
+			VLOG(1) << "Shard " << shard->index << " runs with realtime priority "
+				<< param.sched_priority;
+		}
+	}
+	// a control shard that doesn't receive data
+	else {
+		const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+
+		err = setpriority(PRIO_PROCESS, tid, static_cast<int>(client.controlThreadNice));
+
+		if(err != 0) {
+			PLOG(WARNING) << "Couldn't set nice value " << client.controlThreadNice
+				<< " for control shard";
+		} else {
+			VLOG(1) << "Control shard runs with nice value " << client.controlThreadNice;
+		}
+	}
+#endif
 }
 
 /**
- * Closes the UDP socket used to receive data.
+ * Closes the UDP sockets used to receive data, and the announcement socket.
  */
-void ProtocolHandler::cleanUpSocket(void) {
+void ProtocolHandler::cleanUpSockets(void) {
 	int err = 0;
 
-	// all we're doing is closing the socket
-	err = close(this->socket);
-	PLOG_IF(ERROR, err != 0) << "Couldn't close socket";
+	// all we're doing is closing the sockets
+	for(Shard *shard : this->shards) {
+		err = close(shard->socket);
+		PLOG_IF(ERROR, err != 0) << "Couldn't close socket";
+
+		shard->socket = -1;
+	}
 
 	// close the announcement socket
 	err = close(this->announcementSocket);
@@ -3,9 +3,14 @@
 
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <unordered_map>
 
 #include <cstddef>
 #include <cstdint>
+#include <ctime>
 
 #include <functional>
 #include <bitset>
@@ -15,20 +20,38 @@
 // for struct msghdr
 #include <sys/socket.h>
 
-#include <INIReader.h>
 #include <cpptime.h>
 
+#include "../color/ColorCorrection.h"
+
 #ifndef LICHTENSTEINPROTO_H
 	// Forward declare header type
 	struct lichtenstein_header;
 	typedef struct lichtenstein_header lichtenstein_header_t;
 #endif
 
+class Config;
+class ClockSync;
 class OutputFrame;
+class Reactor;
+class FrameReassembler;
+class BufferPool;
+class PacketBuffer;
+class MetricsCounter;
+class MetricsGauge;
+class MetricsHistogram;
+class PacketCapture;
+class PacketCaptureReader;
+class InterfaceMonitor;
+class FramebufferArena;
+
+template <typename T> class SpscRing;
 
 class ProtocolHandler {
 	// OutputFrame can generate ack packets
 	friend class OutputFrame;
+	// reassembler can request missing fragments
+	friend class FrameReassembler;
 	// plugin handler may acknowledge packets
 	friend class LichtensteinPluginHandler;
 
@@ -36,81 +59,372 @@ class ProtocolHandler {
 	friend int main(int, const char *[]);
 
 	public:
-		ProtocolHandler(INIReader *config);
+		ProtocolHandler(const Config *config);
 		~ProtocolHandler();
 
 		void start(void);
 		void stop(void);
 
+		void startReplay(void);
+
 	private:
 		enum {
 			kWorkerNOP,
 			kWorkerShutdown,
-			kWorkerAnnounce
+			kWorkerAnnounce,
+			kWorkerExpireFragments,
+			kWorkerFlushAcks,
+			kWorkerClockSync,
+			kWorkerSnapshotMetrics,
+			kWorkerReplay,
+			kWorkerResetClockSync,
+			kWorkerDrainPipeline
+		};
+
+		// an acknowledgement waiting to be sent
+		struct PendingAck {
+			struct in_addr dest;
+
+			uint16_t opcode;
+			uint32_t txn;
+			bool nack;
+
+			// when the ack was queued (CLOCK_REALTIME)
+			struct timespec queuedAt;
+		};
+
+		// prebuilt acknowledgement for a particular destination
+		struct AckTemplate;
+
+		// a timed sync output waiting for its presentation time
+		struct ScheduledOutput {
+			// when to output (CLOCK_REALTIME)
+			struct timespec deadline;
+			uint32_t channels;
+
+			// the packet to NACK if output fails, and where it came from
+			uint16_t opcode;
+			uint32_t txn;
+			struct in_addr source;
+		};
+
+		/**
+		 * A packet handed from a shard's receive thread to its decode thread,
+		 * along with what recvmmsg reported about it. The buffer's reference
+		 * passes to the decode thread.
+		 */
+		struct ReceivedPacket {
+			PacketBuffer *buffer;
+			size_t length;
+
+			struct sockaddr_storage addr;
+			socklen_t addrLen;
+
+			// control messages (the sockets ask for IP_PKTINFO and a timestamp)
+			alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(struct in_pktinfo)) +
+												 CMSG_SPACE(sizeof(struct timespec))];
+			size_t controlLen;
 		};
 
+		/**
+		 * A receive shard: each shard has its own socket (all sharing the
+		 * port), worker thread and event loop, as well as its own receive
+		 * buffers and frame reassembler. Framebuffer data is steered to a
+		 * data shard by channel, and output syncs to the sync shard (the first
+		 * data shard); everything else goes to the control shard. Unless the
+		 * control plane is separate, the control shard is a data shard too.
+		 *
+		 * With the pipeline enabled, a second thread per shard receives the
+		 * packets and passes them to the worker through a ring; the worker
+		 * then only validates and decodes them.
+		 */
+		struct Shard {
+			unsigned int index = 0;
+
+			int socket = -1;
+
+			// event loop of the worker; commands are posted to it
+			Reactor *reactor = nullptr;
+			std::thread *worker = nullptr;
+
+			// receive thread and its event loop, and the packets it passes on
+			// to the worker; only used with the pipeline
+			Reactor *rxReactor = nullptr;
+			std::thread *receiver = nullptr;
+			SpscRing<ReceivedPacket> *rxRing = nullptr;
+			// set once the receive thread was joined; the worker keeps running
+			// until then, so it can discard what's left in the ring
+			std::atomic_bool receiverJoined{false};
+
+			// pool from which packet buffers are allocated
+			BufferPool *rxPool = nullptr;
+
+			// receive ring: one buffer, control buffer and address per slot
+			PacketBuffer **rxSlots = nullptr;
+			char *rxControlBuffers = nullptr;
+			struct sockaddr_storage *rxAddrs = nullptr;
+			struct iovec *rxIov = nullptr;
+#ifdef __linux__
+			struct mmsghdr *rxMsgs = nullptr;
+#endif
+
+			// reassembles framebuffer data split across several packets
+			FrameReassembler *reassembler = nullptr;
+			CppTime::timer_id reassemblyTimer;
+
+			// number of times the socket became readable, and packets read then
+			size_t rxWakeups = 0;
+			size_t rxWakeupPackets = 0;
+			// largest number of packets read in a single wakeup
+			size_t rxWakeupPacketsMax = 0;
+
+			// number of receive slots that were replaced since a frame held on to them
+			size_t rxSlotsReplaced = 0;
+			// multicast packets dropped because another shard handles them
+			size_t multicastDropped = 0;
+
+			// packets waiting each time the socket became readable
+			MetricsHistogram *queueDepth = nullptr;
+		};
+
+		// shard that handles everything but framebuffer data and syncs
+		static const unsigned int kControlShard = 0;
+
 	private:
-		friend void ProtocolHandlerThreadEntry(void *);
+		friend void ProtocolHandlerThreadEntry(void *, void *);
+		friend void ProtocolHandlerReceiverEntry(void *, void *);
+
+		void workerEntry(Shard *);
+		void receiverEntry(Shard *);
+		void handleCommand(Shard *, unsigned int);
+
+		void allocReceiveRing(Shard *);
+		void freeReceiveRing(Shard *);
+		void receivePackets(Shard *);
+		void receiveSinglePacket(Shard *);
+
+		void refreshReceiveSlot(Shard *, unsigned int);
 
-		void workerEntry(void);
+		void enqueuePacket(Shard *, unsigned int, size_t, struct msghdr *);
+		void drainPipeline(Shard *);
+		void discardPipeline(Shard *);
 
-		void handlePacket(void *, size_t, struct msghdr *);
+		void handlePacket(Shard *, PacketBuffer *, size_t, struct msghdr *);
+		bool handlesMulticast(Shard *, const void *, size_t);
+		void submitOutputFrame(OutputFrame *, const struct timespec *);
+		void storeFrame(size_t, const void *, size_t, unsigned int, uint16_t, uint32_t, struct in_addr *, const struct timespec &, const struct timespec *);
 		void sendAnnouncement(void);
+		int buildAnnouncement(const char *);
+		void handleInterfaceChanges(Shard *);
 		void getMacAddress(uint8_t *);
-		void getIpAddress(char *, size_t);
+		int getIpAddress(char *, size_t);
 
-		void setUpSocket(void);
-		void cleanUpSocket(void);
+		void setUpSockets(void);
+		int openReceiveSocket(bool);
+		int attachSteeringProgram(int, unsigned int, unsigned int);
+		void applyThreadPriority(Shard *);
+		void cleanUpSockets(void);
 
     void sendStatusResponse(lichtenstein_header_t *, struct in_addr *);
-		void handleAdoption(lichtenstein_header_t *, struct in_addr *);
+		void handleStatusSubRequest(lichtenstein_header_t *, struct in_addr *);
+		void sendHistogramResponse(lichtenstein_header_t *, bool, struct in_addr *);
+		void handleAdoption(lichtenstein_header_t *, size_t, struct in_addr *);
+		void handleColorCorrection(lichtenstein_header_t *, struct in_addr *);
 
 		int sendPacketToHost(void *, size_t, struct in_addr *);
 
-		lichtenstein_header_t *createUnicastAck(lichtenstein_header_t *, bool = false);
+		int sendPacket(void *, size_t, const struct sockaddr_in *);
+
+		AckTemplate *getAckTemplate(struct in_addr *);
+		void fillAck(lichtenstein_header_t *, AckTemplate *, uint16_t, uint32_t, bool = false);
 		void ackUnicast(lichtenstein_header_t *, struct in_addr *, bool = false);
 
 		void ackOutputFrame(OutputFrame *, bool = false);
 
+		void queueAck(OutputFrame *, bool = false);
+		void requestAckFlush(void);
+		void flushAcks(void);
+
+		void recordFrameResult(size_t, bool);
+		void recordFrameLatency(OutputFrame *);
+		int32_t collectFrameLatency(void);
+		void sendCumulativeAck(uint32_t);
+
+		void sendFragmentNack(uint32_t, uint32_t, const uint16_t *, size_t, struct in_addr *);
+
+		void sendTimeSyncRequest(void);
+		void handleTimeSync(lichtenstein_header_t *, const struct timespec *);
+
+		void outputChannels(uint32_t, uint16_t, uint32_t, struct in_addr *);
+		void scheduleOutput(lichtenstein_header_t *, struct in_addr *);
+		void armOutputTimer(void);
+		void handleOutputTimer(void);
+
+		void replayPackets(Shard *);
+		void injectPacket(Shard *, const void *, size_t, uint32_t);
+		void finishReplay(void);
+
 	private:
 		static unsigned int getUptime(void);
 
 	private:
-		// config reader
-		INIReader *config = nullptr;
+		// configuration
+		const Config *config = nullptr;
+
+		// port on which we (and the server) communicate
+		int port = 7420;
 
-		// sockets used for receiving and announcements
-		int socket = -1;
+		// socket used for sending announcements and acks
 		int announcementSocket = -1;
 
-		// pipe for communicating with worker
-		int workerPipeRead = -1;
-		int workerPipeWrite = -1;
+		// receive shards; the first one is the control shard
+		std::vector<Shard *> shards;
+
+		// shard that handles syncs, the output timer, clock sync and acks; this
+		// is the first one that receives framebuffer data
+		unsigned int syncShard = kControlShard;
+
+		// maximum number of datagrams to pull off the socket per syscall
+		unsigned int rxBatchSize = 1;
+		// packet buffers allocated per shard beyond those in the receive ring
+		unsigned int rxExtraBuffers = 0;
+
+		// whether each shard receives on a thread of its own, and how many
+		// packets may be waiting for its worker
+		bool pipeline = false;
+		size_t pipelineDepth = 0;
+
+		// acknowledgements queued by plugins, and the lock protecting them
+		std::vector<PendingAck> pendingAcks;
+		std::mutex pendingAcksMutex;
+		// acknowledgements being sent by the worker
+		std::vector<PendingAck> flushingAcks;
+
+		// ack templates, keyed by destination address, and the lock protecting them
+		std::unordered_map<uint32_t, AckTemplate *> ackTemplates;
+		std::mutex ackTemplatesMutex;
+
+		// buffers for sending a batch of acknowledgements
+		lichtenstein_header_t *ackPackets = nullptr;
+		struct iovec *ackIov = nullptr;
+#ifdef __linux__
+		struct mmsghdr *ackMsgs = nullptr;
+#endif
 
-		// worker thread
+		// whether the worker threads should keep running
 		std::atomic_bool run;
-		std::thread *worker = nullptr;
 
 		// timer used for announcements/adoption
 		CppTime::Timer timer;
     CppTime::timer_id announcementTimer;
 
+		// prebuilt announcement (in network byte order) and its length
+		char *announcement = nullptr;
+		size_t announcementLength = 0;
+		// hostname the announcement was built with
+		std::string announcedHostname;
+		// set when the announcement needs to be rebuilt before it's sent again
+		bool announcementStale = true;
+
+		// notifies us of interface changes, so the announcement is kept fresh
+		InterfaceMonitor *interfaceMonitor = nullptr;
+		// timer used to refresh metrics
+		CppTime::timer_id metricsTimer;
+
 		// callback to notify plugins of received frames
 		std::function<int(OutputFrame *)> frameReceiveCallback;
+		// callback to change the color correction of channels; all or none are changed
+		std::function<int(const std::vector<size_t> &, const ColorCorrection::Parameters &)> colorCorrectionCallback;
 		// callback to notify plugins of output requests
 		std::function<int(std::bitset<32> &)> channelOutputCallback;
+		// callback invoked once a replay has finished
+		std::function<void(void)> replayDoneCallback;
 
 	private:
-		bool isAdopted = false;
+		std::atomic_bool isAdopted;
 
-		time_t lastServerMessageOn = 0;
+		// server that adopted us
+		struct in_addr serverAddr;
 
-	// counters
-	private:
-		size_t packetsWithInvalidCRC = 0;
+		// whether frames are acknowledged cumulatively, once per sync
+		std::atomic_bool cumulativeAcks;
 
-		size_t framebufferPacketsDiscarded = 0;
-		size_t outputPacketsDiscarded = 0;
+		// front and back buffers of each channel, allocated on adoption
+		FramebufferArena *framebuffers = nullptr;
+
+		// number of 32-bit words in a channel bitmap
+		static const size_t kChannelBitmapWords = 4;
+
+		// channels for which frames were accepted/rejected since the last sync
+		std::atomic<uint32_t> acceptedChannels[kChannelBitmapWords];
+		std::atomic<uint32_t> nackedChannels[kChannelBitmapWords];
+
+		std::atomic<time_t> lastServerMessageOn;
+
+		// offset between the server's clock and ours
+		ClockSync *clockSync = nullptr;
+		CppTime::timer_id clockSyncTimer;
+
+		// timed sync outputs, ordered by deadline, and the timer that fires for the first
+		std::vector<ScheduledOutput> scheduledOutputs;
+		int outputTimer = -1;
+
+		// receive to output latency of a channel's frames since the last status report
+		struct ChannelLatency {
+			std::atomic<uint64_t> totalUs;
+			std::atomic<uint32_t> frames;
+			std::atomic<uint32_t> maxUs;
+		};
+
+		ChannelLatency latency[kChannelBitmapWords * 32];
+
+	// counters (updated by all shards; owned by the metrics registry)
+	private:
+		MetricsCounter *rxPackets = nullptr;
+		MetricsCounter *rxBytes = nullptr;
+		MetricsCounter *txPackets = nullptr;
+		MetricsCounter *txBytes = nullptr;
+		MetricsCounter *packetsWithInvalidCRC = nullptr;
+		// packets dropped because a shard's decode thread fell behind
+		MetricsCounter *pipelineOverruns = nullptr;
+
+		MetricsCounter *framebufferPacketsDiscarded = nullptr;
+		MetricsCounter *outputPacketsDiscarded = nullptr;
+
+		MetricsCounter *framesOutput = nullptr;
+		MetricsCounter *framesOverwritten = nullptr;
+		MetricsGauge *outputState = nullptr;
+
+		// latency of each stage of the frame pipeline (see lichtenstein_pipeline_stage_t)
+		static const size_t kNumStages = 6;
+		MetricsHistogram *stageLatency[kNumStages];
+
+		// number of acks sent from the queue, and the syscalls that took
+		size_t acksFlushed = 0;
+		size_t ackFlushSyscalls = 0;
+
+	// capture and replay
+	private:
+		// received packets are written to this capture, if set
+		PacketCapture *capture = nullptr;
+
+		// when replaying, packets are read from this capture instead of the socket
+		PacketCaptureReader *replay = nullptr;
+		double replaySpeed = 1;
+		int replayTimer = -1;
+
+		// next record to replay (header and data), if it was read but isn't due yet
+		const void *replayRecord = nullptr;
+		const void *replayData = nullptr;
+
+		// when (CLOCK_MONOTONIC) and with what state the replay started
+		bool replayStarted = false;
+		struct timespec replayStartTime;
+		uint64_t replayFirstTimestamp = 0;
+		uint64_t replayStartCpuUs = 0;
+		uint64_t replayStartFrames = 0;
+		size_t replayedPackets = 0;
+		size_t replayedBytes = 0;
 };
 
 #endif
@@ -23,6 +23,11 @@ const uint32_t kLichtensteinMagic		= 0x4c494348;
  */
 const uint32_t kLichtensteinMaxChannels	= 128;
 
+/**
+ * Maximum number of packets a single fragmented framebuffer may be split into.
+ */
+const uint32_t kLichtensteinMaxFragments	= 256;
+
 /**
  * Defined flags. The "flags" field in the packet header may only contain a
  * bitwise-OR of these flags, except Ack and NAck; they are exclusive and only
@@ -55,6 +60,11 @@ typedef enum {
 	kOpcodeSystemSleep			= 10,
 	kOpcodeKeepalive			= 11,
 	kOpcodeNodeReconfig			= 12,
+	kOpcodeFramebufferFragment	= 13,
+	kOpcodeCumulativeAck		= 14,
+	kOpcodeTimeSync				= 15,
+	kOpcodeSyncOutputTimed		= 16,
+	kOpcodeColorCorrection		= 17,
 } lichtenstein_header_opcode_t;
 
 /**
@@ -124,6 +134,14 @@ typedef struct {
 } lichtenstein_server_announcement_t;
 
 
+/**
+ * Flags in the node adoption packet, requesting optional behavior of the node.
+ */
+typedef enum {
+	/// acknowledge frames with one cumulative ack per output sync
+	kAdoptionFlagCumulativeAck	= (1 << 0),
+} lichtenstein_node_adoption_flags_t;
+
 /**
  * Node adoption packet: when adopting a node, the server sends this packet to
  * the node. This packet also indicates to the node how many pixels are
@@ -142,6 +160,16 @@ typedef struct {
 	uint32_t pixelsPerChannel[];
 } lichtenstein_node_adoption_t;
 
+/**
+ * Node adoption acknowledgement: the node acknowledges an adoption with this
+ * packet, which indicates which of the requested adoption flags it accepted.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint16_t flags;
+} lichtenstein_node_adoption_ack_t;
+
 
 /**
  * Values possible for the "output state" field in the node status packet
@@ -193,6 +221,79 @@ typedef struct {
 	uint32_t mediumDuplex;
 } lichtenstein_node_status_t;
 
+/**
+ * Status sub-opcodes: a status request that has a payload asks for a specific
+ * kind of status, rather than the general status above. Both the request and
+ * the response start with the sub-opcode.
+ */
+typedef enum {
+	kStatusSubHistograms		= 1,
+} lichtenstein_node_status_sub_opcode_t;
+
+/**
+ * Flags for status sub-requests.
+ */
+typedef enum {
+	// reset the histograms after reading them
+	kStatusSubFlagReset			= (1 << 0),
+} lichtenstein_node_status_sub_flags_t;
+
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t subOpcode;
+	uint32_t flags;
+} lichtenstein_node_status_sub_req_t;
+
+/**
+ * Stages of the frame pipeline for which the node records latency.
+ */
+typedef enum {
+	// kernel receive timestamp until the packet is handled
+	kStageReceive				= 0,
+	// validating the packet (including the CRC) and byte swapping
+	kStageValidate				= 1,
+	// building the output frame (reassembling fragments)
+	kStageFrame					= 2,
+	// waiting in the output plugin's queue
+	kStagePluginQueue			= 3,
+	// the output plugin handing the frame to the hardware
+	kStageHardwareSubmit		= 4,
+	// queueing an acknowledgement until it's sent
+	kStageAckSend				= 5,
+
+	kNumPipelineStages
+} lichtenstein_pipeline_stage_t;
+
+/**
+ * Latency histogram summary for a single pipeline stage. All times are in
+ * nanoseconds, and are the upper bounds of the histogram buckets into which
+ * the percentiles fell; they saturate at about 4.29 seconds.
+ */
+typedef struct {
+	uint32_t stage;
+	uint32_t count;
+
+	uint32_t p50;
+	uint32_t p90;
+	uint32_t p99;
+	uint32_t p999;
+	uint32_t max;
+} lichtenstein_node_status_histogram_t;
+
+/**
+ * Response to the histograms status sub-request: one summary per stage, since
+ * the histograms were last reset.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t subOpcode;
+	uint32_t numHistograms;
+
+	lichtenstein_node_status_histogram_t histograms[];
+} lichtenstein_node_status_histograms_t;
+
 
 /**
  * Possible values for the "data format" field of the framebuffer data packet.
@@ -223,6 +324,45 @@ typedef struct {
 } lichtenstein_framebuffer_data_t;
 
 
+/**
+ * Framebuffer fragment packet: channels whose data doesn't fit in a single
+ * datagram are split into several of these. The sequenceIndex and
+ * sequenceNumPackets fields of the header identify the fragment, and all
+ * fragments of a frame share the same transaction number.
+ *
+ * Each fragment carries dataElements elements, which are placed at offset
+ * elementOffset of a frame that is totalElements long in total. Once all
+ * fragments arrived, the frame is acknowledged like regular framebuffer data.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t destChannel;
+
+	uint32_t dataFormat;
+	uint32_t totalElements;
+
+	uint32_t elementOffset;
+	uint32_t dataElements;
+
+	char data[];
+} lichtenstein_framebuffer_fragment_t;
+
+/**
+ * Framebuffer fragment NACK: if not all fragments of a frame arrive in time, the
+ * node replies with this packet (with the NAck flag set) to request that only
+ * the fragments listed be retransmitted.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t destChannel;
+
+	uint16_t numMissing;
+	uint16_t missing[];
+} lichtenstein_framebuffer_fragment_nack_t;
+
+
 /**
  * Sync output packet: When a node receives this packet, it will begin the
  * output of the previously received data. This is used to synchronize output
@@ -237,6 +377,82 @@ typedef struct {
 	uint32_t channels;
 } lichtenstein_sync_output_t;
 
+/**
+ * Timed sync output packet: like the sync output packet, but rather than as
+ * soon as it's received, the node begins output when its clock (synchronized
+ * to the server's with time sync packets) reaches the presentation time.
+ *
+ * The presentation time is in nanoseconds since the Unix epoch, according to
+ * the server's clock.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t channels;
+	uint64_t presentationTime;
+} lichtenstein_sync_output_timed_t;
+
+
+/**
+ * Time sync packet: used to determine the offset between the clocks of a node
+ * and the server that adopted it, as in NTP. The node sends a request with the
+ * originate time set; the server echoes it in its response (with the ack flag
+ * set) and fills in when it received the request and sent the response. The
+ * node notes when it received the response.
+ *
+ * All times are nanoseconds since the Unix epoch.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	// node's clock when it sent the request
+	uint64_t originateTime;
+	// server's clock when it received the request
+	uint64_t receiveTime;
+	// server's clock when it sent the response
+	uint64_t transmitTime;
+} lichtenstein_time_sync_t;
+
+
+/**
+ * Cumulative acknowledgement: if negotiated during adoption, the node doesn't
+ * acknowledge each frame. Instead, when it receives a sync output packet, it
+ * sends one of these (with the sync packet's transaction number) indicating for
+ * which channels frames were accepted and rejected since the previous sync.
+ *
+ * Bit n of word m in each bitmap corresponds to channel (m * 32) + n. NACKs are
+ * still sent for individual frames as soon as they are rejected.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t acceptedChannels[kLichtensteinMaxChannels / 32];
+	uint32_t nackedChannels[kLichtensteinMaxChannels / 32];
+} lichtenstein_cumulative_ack_t;
+
+
+/**
+ * Color correction: sets the gamma, brightness and white balance the node
+ * applies to the framebuffer data of the given channels before outputting it.
+ * This takes effect for frames received afterwards, so the server can dim a
+ * node without changing the frames it sends.
+ *
+ * Bit n of word m in the channel bitmap corresponds to channel (m * 32) + n.
+ * Gamma is the exponent times 1000, so 1000 is linear; brightness and each
+ * white balance component (red, green, blue, white) range from 0 (off) to 255
+ * (unchanged.) The node acknowledges the packet, or NACKs it if the values are
+ * invalid.
+ */
+typedef struct {
+	lichtenstein_header_t header;
+
+	uint32_t channels[kLichtensteinMaxChannels / 32];
+
+	uint16_t gamma;
+	uint8_t brightness;
+	uint8_t whiteBalance[4];
+} lichtenstein_color_correction_t;
+
 
 /**
  * Node reconfiguration: Sends a new configuration to the node. The values in
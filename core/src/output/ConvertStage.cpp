@@ -0,0 +1,263 @@
+#include "../net/lichtenstein_proto.h"
+
+#include "ConvertStage.h"
+
+#include "OutputFrame.h"
+#include "OutputHandler.h"
+#include "../plugin/LichtensteinPluginHandler.h"
+
+#include "../event/PlatformReactor.h"
+#include "../util/SpscRing.h"
+#include "../util/ThreadUtils.h"
+
+#include "../metrics/MetricsRegistry.h"
+
+#include <glog/logging.h>
+
+#include <cerrno>
+
+/**
+ * Trampoline to get into the stage's thread
+ */
+void ConvertStageThreadEntry(void *ctx) {
+	(static_cast<ConvertStage *>(ctx))->threadEntry();
+}
+
+
+
+/**
+ * Generation of the next stage that's created; starts at 1, so it never matches
+ * a thread that hasn't cached a ring yet.
+ */
+std::atomic<uint64_t> ConvertStage::nextGeneration{1};
+
+
+
+/**
+ * Sets up the stage and starts its thread. Each producer's ring holds up to
+ * the given number of items; the thread is pinned to the given CPU, unless
+ * it's negative.
+ */
+ConvertStage::ConvertStage(OutputHandler *_handler, size_t _depth, int _cpu) :
+	handler(_handler), depth(_depth), cpu(_cpu) {
+	this->generation = nextGeneration.fetch_add(1, std::memory_order_relaxed);
+
+	// register counters
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
+
+	this->overruns = metrics->registerCounter("output.convertOverruns");
+	this->errors = metrics->registerCounter("output.convertErrors");
+
+	this->numRings = 0;
+
+	// create the event loop, then the thread
+	this->reactor = new PlatformReactor();
+
+	this->reactor->setCommandHandler([this](unsigned int command) {
+		if(command == kCommandDrain) {
+			this->drain();
+		}
+	});
+
+	this->run = true;
+	this->worker = new std::thread(ConvertStageThreadEntry, this);
+
+	LOG(INFO) << "Converting frames on a separate thread, up to " << this->depth
+		<< " waiting per producer";
+}
+
+/**
+ * Stops the thread, and deletes frames that were never converted. Nothing may
+ * submit frames anymore at this point.
+ */
+ConvertStage::~ConvertStage() {
+	int err;
+
+	// clear the running flag and wake up the thread so it notices
+	this->run = false;
+
+	err = this->reactor->postCommand(kCommandShutdown);
+	LOG_IF(ERROR, err != 0) << "Couldn't post shutdown command to convert stage: " << err;
+
+	this->worker->join();
+	delete this->worker;
+
+	delete this->reactor;
+
+	// get rid of anything still in the rings
+	this->discard();
+
+	for(Ring *ring : this->rings) {
+		delete ring;
+	}
+}
+
+
+
+/**
+ * Entry point for the stage's thread.
+ */
+void ConvertStage::threadEntry(void) {
+	ThreadUtils::pinToCpu(this->cpu);
+
+	// main loop; handle frames until we're told to stop
+	while(this->run) {
+		this->reactor->runOnce();
+	}
+}
+
+
+
+/**
+ * Queues a frame to be color corrected and admitted to the plugin's queue.
+ *
+ * @return 0 if the frame was queued, an error code otherwise; in that case,
+ * the caller still owns the frame.
+ */
+int ConvertStage::submitFrame(OutputFrame *frame) {
+	Item item;
+
+	item.frame = frame;
+	item.channels = 0;
+
+	return this->submit(item);
+}
+
+/**
+ * Queues a request to output the given channels, once all frames queued by the
+ * calling thread before it have been admitted.
+ */
+int ConvertStage::submitOutput(std::bitset<32> &channels) {
+	Item item;
+
+	item.frame = nullptr;
+	item.channels = static_cast<uint32_t>(channels.to_ulong());
+
+	return this->submit(item);
+}
+
+/**
+ * Puts an item into the calling thread's ring, and wakes up the stage.
+ */
+int ConvertStage::submit(const Item &item) {
+	int err;
+
+	if(!this->getRing()->push(item)) {
+		this->overruns->increment();
+		return ENOBUFS;
+	}
+
+	// the item is queued either way, so failing to wake the thread isn't the caller's problem
+	err = this->reactor->postCommand(kCommandDrain);
+	LOG_IF(ERROR, err != 0) << "Couldn't post drain command to convert stage: " << err;
+
+	return 0;
+}
+
+/**
+ * Returns the calling thread's ring, creating it the first time the thread
+ * submits anything.
+ *
+ * The cached ring is keyed on the stage's generation rather than its address:
+ * a stage created after this one was deleted may get the same address, but
+ * the ring belonged to (and was deleted with) the old one.
+ */
+ConvertStage::Ring *ConvertStage::getRing(void) {
+	// generation of the stage the ring was created for
+	static thread_local uint64_t owner = 0;
+	static thread_local Ring *ring = nullptr;
+
+	if(owner != this->generation) {
+		ring = new Ring(this->depth);
+		owner = this->generation;
+
+		std::lock_guard<std::mutex> lck(this->ringsLock);
+
+		this->rings.push_back(ring);
+		this->numRings.store(this->rings.size(), std::memory_order_release);
+	}
+
+	return ring;
+}
+
+
+
+/**
+ * Handles everything waiting in the rings. Frames at the front of all rings are
+ * admitted before any output request is handled, so frames that other threads
+ * submitted before the request are output with it.
+ */
+void ConvertStage::drain(void) {
+	int err;
+	Item *item;
+	bool progress;
+
+	// pick up the rings of threads that submitted for the first time
+	if(this->numRings.load(std::memory_order_acquire) != this->consumerRings.size()) {
+		std::lock_guard<std::mutex> lck(this->ringsLock);
+		this->consumerRings = this->rings;
+	}
+
+	do {
+		progress = false;
+
+		// color correct and admit frames, up to the next output request
+		for(Ring *ring : this->consumerRings) {
+			while((item = ring->front()) != nullptr && item->frame != nullptr) {
+				OutputFrame *frame = item->frame;
+				ring->pop();
+
+				err = this->handler->admitFrame(frame);
+
+				if(err != 0) {
+					this->errors->increment();
+
+					LOG(WARNING) << "Couldn't queue frame for channel " << frame->getChannel()
+						<< ": " << err;
+
+					this->handler->pluginHandler->nackFrame(frame);
+					delete frame;
+				}
+
+				progress = true;
+			}
+		}
+
+		// then, output; the sync can't be NACKed anymore if that fails
+		for(Ring *ring : this->consumerRings) {
+			if((item = ring->front()) != nullptr && item->frame == nullptr) {
+				std::bitset<32> channels(item->channels);
+				ring->pop();
+
+				err = this->handler->outputNow(channels);
+
+				if(err != 0) {
+					this->errors->increment();
+					LOG(WARNING) << "Couldn't process channel output: " << err;
+				}
+
+				progress = true;
+			}
+		}
+	} while(progress);
+}
+
+/**
+ * Deletes all frames still waiting in the rings. The thread must not be
+ * running anymore.
+ */
+void ConvertStage::discard(void) {
+	Item item;
+	size_t discarded = 0;
+
+	for(Ring *ring : this->rings) {
+		while(ring->pop(item)) {
+			if(item.frame) {
+				delete item.frame;
+				discarded++;
+			}
+		}
+	}
+
+	LOG_IF(INFO, discarded != 0) << "Discarded " << discarded << " frames waiting for conversion";
+}
@@ -0,0 +1,96 @@
+/**
+ * Last stage of the pipeline, between the receive shards and the output
+ * plugin: frames are color corrected and admitted to the plugin's queue on a
+ * thread of its own, rather than on the shard that decoded them, so the shard
+ * can go on to validate the next packet in the meantime.
+ *
+ * Each thread that submits frames gets its own ring, so every ring has a
+ * single producer. Output requests go through the same rings: whenever the
+ * stage wakes up, it first admits the frames waiting in all rings, and only
+ * then outputs, so frames decoded by other shards before the sync was
+ * received go out with it.
+ */
+#ifndef CONVERTSTAGE_H
+#define CONVERTSTAGE_H
+
+#include <atomic>
+#include <bitset>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+class OutputHandler;
+class OutputFrame;
+class Reactor;
+class MetricsCounter;
+
+template <typename T> class SpscRing;
+
+class ConvertStage {
+	friend void ConvertStageThreadEntry(void *);
+
+	public:
+		ConvertStage(OutputHandler *handler, size_t depth, int cpu);
+		~ConvertStage();
+
+		int submitFrame(OutputFrame *frame);
+		int submitOutput(std::bitset<32> &channels);
+
+	private:
+		/**
+		 * A frame to convert and admit, or if there's no frame, channels to
+		 * output.
+		 */
+		struct Item {
+			OutputFrame *frame;
+			uint32_t channels;
+		};
+
+		typedef SpscRing<Item> Ring;
+
+		enum {
+			kCommandShutdown,
+			kCommandDrain,
+		};
+
+	private:
+		void threadEntry(void);
+
+		Ring *getRing(void);
+		int submit(const Item &item);
+
+		void drain(void);
+		void discard(void);
+
+	private:
+		OutputHandler *handler = nullptr;
+
+		// identifies this stage to the threads' cached rings; never reused
+		uint64_t generation = 0;
+		static std::atomic<uint64_t> nextGeneration;
+
+		// number of items each ring holds, and the CPU the thread is pinned to
+		size_t depth = 0;
+		int cpu = -1;
+
+		std::thread *worker = nullptr;
+		Reactor *reactor = nullptr;
+		std::atomic_bool run;
+
+		// one ring per producer thread, and the lock protecting the list
+		std::vector<Ring *> rings;
+		std::mutex ringsLock;
+		// number of rings in the list, and the copy the stage's thread reads
+		std::atomic<size_t> numRings;
+		std::vector<Ring *> consumerRings;
+
+	// counters (owned by the metrics registry)
+	private:
+		MetricsCounter *overruns = nullptr;
+		MetricsCounter *errors = nullptr;
+};
+
+#endif
@@ -0,0 +1,217 @@
+#include "FramebufferArena.h"
+
+#include "OutputFrame.h"
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * Creates an empty arena; buffers are allocated once the number of pixels on
+ * each channel is known.
+ *
+ * @param limit Maximum size of the arena, in bytes.
+ */
+FramebufferArena::FramebufferArena(size_t _limit) : limit(_limit) {
+
+}
+
+/**
+ * Releases the arena.
+ *
+ * @note No output frames for any of the front buffers may still exist.
+ */
+FramebufferArena::~FramebufferArena() {
+	delete[] this->channels;
+	free(this->arena);
+}
+
+
+
+/**
+ * Allocates the framebuffers for the given number of pixels on each channel.
+ * Channels without pixels get no buffers. Any previous buffers are released,
+ * along with frames waiting in back buffers.
+ *
+ * This may be called from any thread.
+ *
+ * @return 0 on success, -1 if the buffers would exceed the arena's limit, or
+ * the plugin still holds one of the previous front buffers.
+ */
+int FramebufferArena::configure(const uint32_t *pixelsPerChannel, size_t numChannels) {
+	int err;
+
+	// figure out the size of each channel's buffers
+	size_t total = 0;
+
+	for(size_t i = 0; i < numChannels; i++) {
+		const size_t bytes = (static_cast<size_t>(pixelsPerChannel[i]) * kMaxBytesPerPixel);
+		const size_t capacity = (((bytes + kAlignment - 1) / kAlignment) * kAlignment);
+
+		total += (2 * capacity);
+
+		if(total > this->limit) {
+			LOG(ERROR) << "Framebuffers for " << numChannels << " channels exceed "
+				<< this->limit << " bytes";
+			return -1;
+		}
+	}
+
+	// nothing may use the previous buffers while they're released
+	std::unique_lock<std::shared_mutex> lck(this->lock);
+
+	for(size_t i = 0; i < this->numChannels; i++) {
+		if(this->channels[i].frontBusy) {
+			LOG(WARNING) << "Can't reallocate framebuffers; channel " << i
+				<< " is still being output";
+			return -1;
+		}
+	}
+
+	// release the previous buffers
+	delete[] this->channels;
+	this->channels = nullptr;
+	this->numChannels = 0;
+
+	free(this->arena);
+	this->arena = nullptr;
+	this->arenaSize = 0;
+
+	if(total == 0) {
+		return 0;
+	}
+
+	// allocate the arena, and fault it in so outputting never has to
+	void *memory = nullptr;
+
+	err = posix_memalign(&memory, kAlignment, total);
+	CHECK(err == 0) << "Couldn't allocate " << total << " bytes of framebuffers: " << err;
+
+	memset(memory, 0, total);
+
+	this->arena = static_cast<char *>(memory);
+	this->arenaSize = total;
+
+	// carve out each channel's buffers
+	this->channels = new Channel[numChannels];
+	this->numChannels = numChannels;
+
+	char *next = this->arena;
+
+	for(size_t i = 0; i < numChannels; i++) {
+		Channel &channel = this->channels[i];
+
+		const size_t bytes = (static_cast<size_t>(pixelsPerChannel[i]) * kMaxBytesPerPixel);
+		channel.capacity = (((bytes + kAlignment - 1) / kAlignment) * kAlignment);
+
+		channel.buffers[0] = next;
+		channel.buffers[1] = (next + channel.capacity);
+
+		next += (2 * channel.capacity);
+	}
+
+	LOG(INFO) << "Allocated " << total << " bytes of framebuffers for "
+		<< numChannels << " channels";
+
+	return 0;
+}
+
+
+
+/**
+ * Copies a frame into a channel's back buffer. If the back buffer held a frame
+ * that was never output, it's replaced; its info is returned so the caller can
+ * NACK it.
+ *
+ * This may be called from any thread.
+ *
+ * @return One of the kStored constants.
+ */
+int FramebufferArena::store(size_t index, const void *data, size_t length, const FrameInfo &info, FrameInfo *superseded) {
+	std::shared_lock<std::shared_mutex> arenaLck(this->lock);
+
+	if(index >= this->numChannels || this->channels[index].capacity == 0) {
+		return kNoChannel;
+	}
+
+	Channel &channel = this->channels[index];
+
+	if(length > channel.capacity) {
+		return kTooLarge;
+	}
+
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	const bool replaced = channel.backValid;
+
+	if(replaced && superseded) {
+		*superseded = channel.back;
+	}
+
+	memcpy(channel.buffers[channel.front ^ 1], data, length);
+
+	channel.backValid = true;
+	channel.backLength = length;
+	channel.back = info;
+
+	return (replaced ? kStoredSuperseding : kStored);
+}
+
+/**
+ * Swaps a channel's buffers, if the back buffer holds a frame, and returns an
+ * output frame for the new front buffer.
+ *
+ * If the plugin still holds the front buffer, the buffers aren't swapped; the
+ * frame in the back buffer is presented with the next sync instead.
+ *
+ * @return The output frame, or nullptr if there's nothing to present.
+ */
+OutputFrame *FramebufferArena::present(size_t index, ProtocolHandler *handler) {
+	std::shared_lock<std::shared_mutex> arenaLck(this->lock);
+
+	if(index >= this->numChannels) {
+		return nullptr;
+	}
+
+	Channel &channel = this->channels[index];
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	if(!channel.backValid) {
+		return nullptr;
+	} else if(channel.frontBusy) {
+		VLOG(2) << "Front buffer of channel " << index << " still in use; deferring txn "
+			<< channel.back.txn;
+		return nullptr;
+	}
+
+	// swap the buffers
+	channel.front ^= 1;
+	channel.frontBusy = true;
+	channel.backValid = false;
+
+	OutputFrame *frame = new OutputFrame(index, channel.buffers[channel.front],
+		channel.backLength, channel.capacity, this, channel.back.opcode, channel.back.txn, handler,
+		&channel.back.source);
+	frame->setRxTimestamp(channel.back.rxTimestamp);
+	frame->setBytesPerPixel(channel.back.bytesPerPixel);
+
+	return frame;
+}
+
+/**
+ * Marks a channel's front buffer as no longer in use; called when the output
+ * frame referencing it is deallocated.
+ */
+void FramebufferArena::release(size_t index) {
+	std::shared_lock<std::shared_mutex> arenaLck(this->lock);
+
+	if(index >= this->numChannels) {
+		return;
+	}
+
+	Channel &channel = this->channels[index];
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	channel.frontBusy = false;
+}
@@ -0,0 +1,131 @@
+/**
+ * Holds the framebuffers of all output channels in a single contiguous block
+ * of memory, allocated when the node is adopted and sized according to the
+ * number of pixels the server says are connected to each channel.
+ *
+ * Each channel has a front and a back buffer, both aligned to a cache line.
+ * Framebuffer data is copied into the back buffer as it arrives; a newer frame
+ * simply overwrites it, and the frame it replaces is returned so it can be
+ * NACKed. When an output sync comes in, the buffers are swapped, and the front
+ * buffer is handed to the output plugin as an output frame. The front buffer
+ * stays with the plugin until that frame is deallocated; until then, the back
+ * buffer isn't swapped in, so the plugin never sees its data change.
+ *
+ * The whole arena must fit into the framebuffer size we announce to the server,
+ * so memory use is bounded by what the server was told.
+ *
+ * The arena is reconfigured when the node is adopted again. Storing and
+ * presenting frames hold the arena's lock shared, and reconfiguring holds it
+ * exclusively; it's refused while the plugin holds any front buffer.
+ */
+#ifndef FRAMEBUFFERARENA_H
+#define FRAMEBUFFERARENA_H
+
+#include <mutex>
+#include <shared_mutex>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+// for struct in_addr
+#include <netinet/in.h>
+
+class OutputFrame;
+class ProtocolHandler;
+
+class FramebufferArena {
+	public:
+		/**
+		 * Everything needed to acknowledge a frame held in a buffer.
+		 */
+		struct FrameInfo {
+			// opcode and transaction of the packet to acknowledge, and its source
+			uint16_t opcode;
+			uint32_t txn;
+			struct in_addr source;
+
+			// when the frame's data was received (CLOCK_REALTIME)
+			struct timespec rxTimestamp;
+
+			// size of a pixel in the frame's data
+			unsigned int bytesPerPixel;
+		};
+
+		/**
+		 * Outcomes of storing a frame in a channel's back buffer.
+		 */
+		enum {
+			// the frame was stored
+			kStored,
+			// the frame was stored, replacing one that was never output
+			kStoredSuperseding,
+			// the channel has no framebuffer
+			kNoChannel,
+			// the frame is larger than the channel's framebuffer
+			kTooLarge,
+		};
+
+	public:
+		FramebufferArena(size_t limit);
+		~FramebufferArena();
+
+		int configure(const uint32_t *pixelsPerChannel, size_t numChannels);
+
+		int store(size_t channel, const void *data, size_t length, const FrameInfo &info, FrameInfo *superseded);
+		OutputFrame *present(size_t channel, ProtocolHandler *handler);
+		void release(size_t channel);
+
+		bool isConfigured(void) const {
+			std::shared_lock<std::shared_mutex> lck(this->lock);
+			return (this->arena != nullptr);
+		}
+		size_t getSize(void) const {
+			std::shared_lock<std::shared_mutex> lck(this->lock);
+			return this->arenaSize;
+		}
+
+	private:
+		struct Channel {
+			// front and back buffer, and the size of each
+			char *buffers[2] = {nullptr, nullptr};
+			size_t capacity = 0;
+
+			// index of the front buffer; the other one is the back buffer
+			unsigned int front = 0;
+			// whether the front buffer was handed to the plugin and is in use
+			bool frontBusy = false;
+
+			// whether the back buffer holds a frame, its length and origin
+			bool backValid = false;
+			size_t backLength = 0;
+			FrameInfo back;
+
+			// protects all of the above
+			std::mutex lock;
+		};
+
+		// buffers are aligned to (and padded to a multiple of) a cache line
+		static const size_t kAlignment = 64;
+		// largest pixel size (RGBW) that buffers must fit; RGB frames for RGBW
+		// strips are expanded in place, so this applies to them too
+		static const size_t kMaxBytesPerPixel = 4;
+
+	private:
+		// maximum size of the arena, in bytes
+		size_t limit = 0;
+
+		// the block of memory holding all buffers, and its size
+		char *arena = nullptr;
+		size_t arenaSize = 0;
+
+		// state of each channel
+		Channel *channels = nullptr;
+		size_t numChannels = 0;
+
+		// protects the arena and the channel list, but not the channels' state:
+		// held shared while a channel is used, exclusively while reconfiguring
+		mutable std::shared_mutex lock;
+};
+
+#endif
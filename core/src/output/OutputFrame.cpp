@@ -2,6 +2,8 @@
 
 #include "OutputFrame.h"
 #include "../net/ProtocolHandler.h"
+#include "../util/BufferPool.h"
+#include "FramebufferArena.h"
 
 #include <glog/logging.h>
 
@@ -20,9 +22,15 @@ OutputFrame::OutputFrame(size_t _channel, void *_data, size_t _dataLen) : channe
 }
 
 /**
- * Given a Lichtenstein packet, allocate an output frame from it.
+ * Given a Lichtenstein packet, allocate an output frame from it. The frame
+ * references the pixel data in place: the buffer the packet was received into
+ * is retained until the frame is deallocated. The data may grow into the rest
+ * of the buffer, past the end of the packet.
+ *
+ * @note The caller must ensure the packet contains the number of elements it
+ * claims to.
  */
-OutputFrame::OutputFrame(lichtenstein_framebuffer_data_t *packet, ProtocolHandler *_handler, struct in_addr *_source) : protoHandler(_handler), ackDest(*_source) {
+OutputFrame::OutputFrame(lichtenstein_framebuffer_data_t *packet, PacketBuffer *_buffer, ProtocolHandler *_handler, struct in_addr *_source) : protoHandler(_handler), ackDest(*_source) {
 	// copy the destination channel
 	this->channel = packet->destChannel;
 
@@ -38,6 +46,7 @@ OutputFrame::OutputFrame(lichtenstein_framebuffer_data_t *packet, ProtocolHandle
 		// 4 bytes per element
 		case kDataFormatRGBW:
 			numBytes *= 4;
+			this->bytesPerPixel = 4;
 			break;
 
 		// shouldn't happen
@@ -46,29 +55,57 @@ OutputFrame::OutputFrame(lichtenstein_framebuffer_data_t *packet, ProtocolHandle
 			return;
 	}
 
-	// allocate buffer and copy
+	// reference the data in the buffer
 	this->dataLen = numBytes;
+	this->data = &packet->data;
 
-	this->data = malloc(this->dataLen);
-	CHECK(this->data != nullptr) << "Couldn't allocate buffer!";
+	this->buffer = _buffer;
+	this->buffer->retain();
 
-	memcpy(this->data, &packet->data, this->dataLen);
+	const size_t offset = (static_cast<char *>(this->data) - static_cast<char *>(_buffer->getData()));
+	this->dataCapacity = (_buffer->getCapacity() - offset);
+
+	// store what we need to generate the ack packet later
+	this->ackOpcode = packet->header.opcode;
+	this->ackTxn = packet->header.txn;
+}
+
+/**
+ * Allocates an output frame for data that was assembled in the given buffer,
+ * starting at its beginning; the buffer is retained until the frame is
+ * deallocated, and the data may grow to fill it. The opcode and transaction
+ * are those to acknowledge once the frame has been output.
+ */
+OutputFrame::OutputFrame(size_t _channel, PacketBuffer *_buffer, size_t _dataLen, uint16_t opcode, uint32_t txn, ProtocolHandler *_handler, struct in_addr *_source) : channel(_channel), dataLen(_dataLen), protoHandler(_handler), ackOpcode(opcode), ackTxn(txn), ackDest(*_source) {
+	this->data = _buffer->getData();
+	this->dataCapacity = _buffer->getCapacity();
+
+	this->buffer = _buffer;
+	this->buffer->retain();
+}
+
+/**
+ * Creates an output frame for the front buffer of a channel in the framebuffer
+ * arena. The arena won't swap that channel's buffers again until the frame is
+ * deallocated.
+ *
+ * @param _dataCapacity Size of the front buffer, which the data may grow to.
+ */
+OutputFrame::OutputFrame(size_t _channel, void *_data, size_t _dataLen, size_t _dataCapacity, FramebufferArena *_arena, uint16_t opcode, uint32_t txn, ProtocolHandler *_handler, struct in_addr *_source) : channel(_channel), data(_data), dataLen(_dataLen), protoHandler(_handler), ackOpcode(opcode), ackTxn(txn), ackDest(*_source), arena(_arena), dataCapacity(_dataCapacity) {
 
-	// generate the ack packet
-	this->ackPacket = this->protoHandler->createUnicastAck(&packet->header);
 }
 
 /**
  * Releases the memory held by the output frame.
  */
 OutputFrame::~OutputFrame() {
-	// deallocate data
-	if(this->data) {
+	// hand back the front buffer, release the receive buffer, or deallocate our
+	// copy of the data
+	if(this->arena) {
+		this->arena->release(this->channel);
+	} else if(this->buffer) {
+		this->buffer->release();
+	} else if(this->data) {
 		free(this->data);
 	}
-
-	// deallocate the acknowledgement packet, if we allocated it earlier
-	if(this->ackPacket) {
-		free(this->ackPacket);
-	}
 }
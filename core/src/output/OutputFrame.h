@@ -15,22 +15,30 @@
 #endif
 
 #include <cstddef>
+#include <cstdint>
+#include <ctime>
 
 // for struct in_addr
 #include <netinet/in.h>
 
 class ProtocolHandler;
+class PacketBuffer;
+class FramebufferArena;
 
 class OutputFrame {
 	// allow the handler to access the packet
 	// friend class ProtocolHandler;
+	// admission keeps track of whether the frame was superseded
+	friend class OutputHandler;
 
 	public:
 		OutputFrame() = delete;
 		~OutputFrame();
 
 		OutputFrame(size_t channel, void *data, size_t dataLen);
-		OutputFrame(lichtenstein_framebuffer_data_t *packet, ProtocolHandler *handler, struct in_addr *source);
+		OutputFrame(lichtenstein_framebuffer_data_t *packet, PacketBuffer *buffer, ProtocolHandler *handler, struct in_addr *source);
+		OutputFrame(size_t channel, PacketBuffer *buffer, size_t dataLen, uint16_t opcode, uint32_t txn, ProtocolHandler *handler, struct in_addr *source);
+		OutputFrame(size_t channel, void *data, size_t dataLen, size_t dataCapacity, FramebufferArena *arena, uint16_t opcode, uint32_t txn, ProtocolHandler *handler, struct in_addr *source);
 
 	public:
 		size_t getChannel(void) const {
@@ -43,25 +51,126 @@ class OutputFrame {
 		size_t getDataLen(void) const {
 			return this->dataLen;
 		}
+		void setDataLen(size_t length) {
+			this->dataLen = length;
+		}
+
+		/**
+		 * Number of bytes data has room for; the data may grow up to this size
+		 * in place. Frames that reference a buffer may use all of it; copied
+		 * frames have no extra room.
+		 */
+		size_t getDataCapacity(void) const {
+			return (this->dataCapacity > this->dataLen) ? this->dataCapacity : this->dataLen;
+		}
 
-		lichtenstein_header_t *getAckPacket(void) const {
-			return this->ackPacket;
+		/**
+		 * Number of bytes making up each pixel: 3 for RGB, or 4 for RGBW.
+		 */
+		unsigned int getBytesPerPixel(void) const {
+			return this->bytesPerPixel;
+		}
+		void setBytesPerPixel(unsigned int bytes) {
+			this->bytesPerPixel = bytes;
+		}
+
+		uint16_t getAckOpcode(void) const {
+			return this->ackOpcode;
+		}
+		uint32_t getAckTxn(void) const {
+			return this->ackTxn;
 		}
 		struct in_addr *getAckDest(void) const {
 			return const_cast<struct in_addr *>(&this->ackDest);
 		}
 
+		/**
+		 * Time at which the kernel received the packet (or the first fragment)
+		 * carrying this frame's data. (CLOCK_REALTIME)
+		 */
+		const struct timespec &getRxTimestamp(void) const {
+			return this->rxTimestamp;
+		}
+		void setRxTimestamp(const struct timespec &timestamp) {
+			this->rxTimestamp = timestamp;
+		}
+
+		/**
+		 * Time at which the frame was handed to the output plugin.
+		 */
+		const struct timespec &getQueueTimestamp(void) const {
+			return this->queueTimestamp;
+		}
+		void setQueueTimestamp(const struct timespec &timestamp) {
+			this->queueTimestamp = timestamp;
+		}
+
+		/**
+		 * Time at which the output plugin took the frame off its queue; zero
+		 * until it calls stampDequeueTime().
+		 */
+		const struct timespec &getDequeueTimestamp(void) const {
+			return this->dequeueTimestamp;
+		}
+		/**
+		 * Called when the output plugin takes the frame off its queue to start
+		 * processing it; PluginHandler::claimFrame() does this.
+		 */
+		void stampDequeueTime(void) {
+			clock_gettime(CLOCK_REALTIME, &this->dequeueTimestamp);
+		}
+
+		/**
+		 * Time at which the frame was submitted to the hardware; zero until an
+		 * output plugin calls stampOutputTime().
+		 */
+		const struct timespec &getOutputTimestamp(void) const {
+			return this->outputTimestamp;
+		}
+		/**
+		 * Output plugins should call this right after handing the frame's data
+		 * to the hardware, so the client can keep track of frame latency.
+		 */
+		void stampOutputTime(void) {
+			clock_gettime(CLOCK_REALTIME, &this->outputTimestamp);
+		}
+
 	private:
 		size_t channel = 0;
 
 		void *data = nullptr;
 		size_t dataLen = 0;
 
+		// when set, data points into this (retained) receive buffer
+		PacketBuffer *buffer = nullptr;
+
 	private:
 		ProtocolHandler *protoHandler = nullptr;
 
-		lichtenstein_header_t *ackPacket = nullptr;
+		// opcode and transaction of the packet to acknowledge
+		uint16_t ackOpcode = 0;
+		uint32_t ackTxn = 0;
 		struct in_addr ackDest;
+
+		// when the data was received, queued for and dequeued by the plugin, and output
+		struct timespec rxTimestamp = {0, 0};
+		struct timespec queueTimestamp = {0, 0};
+		struct timespec dequeueTimestamp = {0, 0};
+		struct timespec outputTimestamp = {0, 0};
+
+	private:
+		// set once a newer frame replaced this one while it was queued; it's
+		// been NACKed, and must not be output (protected by the channel's lock)
+		bool superseded = false;
+
+		// when set, data is the channel's front buffer in this arena
+		FramebufferArena *arena = nullptr;
+
+		// size of a pixel in data
+		unsigned int bytesPerPixel = 3;
+
+		// bytes available at data, if more than dataLen
+		size_t dataCapacity = 0;
 };
 
 #endif
@@ -1,28 +1,62 @@
+#include "../net/lichtenstein_proto.h"
+
 #include "OutputHandler.h"
 
 #include "OutputFrame.h"
+#include "ConvertStage.h"
+#include "../color/ColorCorrection.h"
 #include "../plugin/LichtensteinPluginHandler.h"
 
 #include "../status/StatusHandler.h"
+#include "../metrics/MetricsRegistry.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include "../config/Config.h"
+
+#include <algorithm>
 
 /**
  * Attempts to load the output plugin specified in the configuration file, then
  * sets up the plugin for outputting.
  */
-OutputHandler::OutputHandler(INIReader *_config, LichtensteinPluginHandler *_pluginHandler) :
+OutputHandler::OutputHandler(const Config *_config, LichtensteinPluginHandler *_pluginHandler) :
  	config(_config), pluginHandler(_pluginHandler) {
+	static_assert(OutputHandler::kMaxChannels == kLichtensteinMaxChannels,
+				  "Number of admission channels doesn't match maximum number of channels");
+
+	// register counters
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
+
+	this->framesSuperseded = metrics->registerCounter("output.framesSuperseded");
+	this->framesRejected = metrics->registerCounter("output.framesRejected");
+	this->framesWaiting = metrics->registerGauge("output.framesWaiting");
+
+	this->readAdmissionConfig();
+
+	this->color = new ColorCorrection(this->config);
+
 	// TODO: actually read the option ROM
 	this->loadPlugin(nullptr, 0);
+
+	// correct and admit frames on a thread of their own, if pipelined
+	const Config::Client &client = this->config->getClient();
+
+	if(client.pipeline) {
+		this->convert = new ConvertStage(this, static_cast<size_t>(client.pipelineDepth),
+										 static_cast<int>(client.convertCpu));
+	}
 }
 
 /**
  * De-allocates the output plugin.
  */
 OutputHandler::~OutputHandler() {
+	// stop converting before the plugin goes away
+	delete this->convert;
+
 	delete this->plugin;
+
+	delete this->color;
 }
 
 
@@ -32,7 +66,7 @@ OutputHandler::~OutputHandler() {
  */
 void OutputHandler::loadPlugin(void *rom, size_t romLen) {
 	// get the factory function
-	std::string uuid = this->config->Get("output", "module", "");
+	std::string uuid = this->config->getOutput().module;
 
 	try {
 		this->plugin = this->pluginHandler->initOutputPluginByUUID(uuid, rom, romLen);
@@ -44,16 +78,232 @@ void OutputHandler::loadPlugin(void *rom, size_t romLen) {
 
 
 /**
- * Queues frames for output.
+ * Reads the queue depth and admission policy from the config.
+ */
+void OutputHandler::readAdmissionConfig(void) {
+	const Config::Output &output = this->config->getOutput();
+
+	this->queueDepth = static_cast<size_t>(output.queueDepth);
+
+	if(output.admissionPolicy == "latest") {
+		this->policy = kAdmitLatest;
+	} else if(output.admissionPolicy == "drop_oldest") {
+		this->policy = kAdmitDropOldest;
+	} else if(output.admissionPolicy == "nack_new") {
+		this->policy = kAdmitNackNew;
+	} else {
+		LOG(WARNING) << "Unknown admission policy '" << output.admissionPolicy
+			<< "'; using 'latest'";
+		this->policy = kAdmitLatest;
+	}
+
+	if(this->policy == kAdmitLatest) {
+		LOG_IF(INFO, this->queueDepth > 1) << "queue_depth is ignored with latest wins; "
+			<< "only the newest frame per channel waits for the plugin";
+	} else {
+		LOG(INFO) << "Admitting up to " << this->queueDepth << " frames per channel ("
+			<< output.admissionPolicy << ")";
+	}
+}
+
+
+
+/**
+ * Color corrects frames, then queues them for output; with the pipeline, this
+ * happens on the convert stage's thread.
+ *
+ * @return 0 if the frame was queued or dropped, an error code if the plugin
+ * (or the convert stage) couldn't take it; in that case, the caller still owns
+ * the frame.
  */
 int OutputHandler::queueOutputFrame(OutputFrame *frame) {
-	return this->plugin->queueFrame(frame);
+	if(this->convert) {
+		return this->convert->submitFrame(frame);
+	}
+
+	return this->admitFrame(frame);
 }
 
 /**
- * Actually outputs the given channels.
+ * Color corrects a frame, and queues it for output. With latest wins, any
+ * frames still waiting for the plugin on the channel are dropped and NACKed.
+ * Otherwise, if the channel already has as many frames waiting as allowed,
+ * one of them (or the new one) is dropped and NACKed, according to the
+ * admission policy. Frames that can't be corrected for their channel are
+ * dropped and NACKed as well.
+ *
+ * @return 0 if the frame was queued or dropped, an error code if the plugin
+ * couldn't take it; in that case, the caller still owns the frame.
+ */
+int OutputHandler::admitFrame(OutputFrame *frame) {
+	int err;
+	const size_t index = frame->getChannel();
+
+	// without the pipeline, this runs on the receiving shard, so it's spread
+	// over all of them
+	err = this->color->apply(frame);
+
+	if(err != 0) {
+		this->framesRejected->increment();
+
+		this->pluginHandler->nackFrame(frame);
+		delete frame;
+
+		return 0;
+	}
+
+	// frames for channels out of range go straight to the plugin
+	if(index >= kMaxChannels) {
+		return this->plugin->queueFrame(frame);
+	}
+
+	Channel &channel = this->channels[index];
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	// with latest wins, the new frame replaces all waiting frames
+	if(this->policy == kAdmitLatest) {
+		while(!channel.waiting.empty()) {
+			OutputFrame *waiting = channel.waiting.front();
+			channel.waiting.pop_front();
+
+			this->supersede(waiting);
+		}
+	}
+	// otherwise, make room for the frame, if needed
+	else if(channel.waiting.size() >= this->queueDepth) {
+		switch(this->policy) {
+			// waiting frames were already replaced above
+			case kAdmitLatest: {
+				break;
+			}
+
+			case kAdmitDropOldest: {
+				OutputFrame *oldest = channel.waiting.front();
+				channel.waiting.pop_front();
+
+				this->supersede(oldest);
+				break;
+			}
+
+			case kAdmitNackNew: {
+				this->framesRejected->increment();
+
+				VLOG(2) << "Rejecting frame for channel " << index << "; "
+					<< channel.waiting.size() << " frames waiting";
+
+				this->pluginHandler->nackFrame(frame);
+				delete frame;
+
+				return 0;
+			}
+		}
+	}
+
+	// hand it to the plugin; it can't claim the frame until we release the lock
+	err = this->plugin->queueFrame(frame);
+
+	if(err != 0) {
+		return err;
+	}
+
+	channel.waiting.push_back(frame);
+	this->framesWaiting->add(1);
+
+	return 0;
+}
+
+/**
+ * Drops a frame that's waiting for the plugin, and NACKs it. If it's still in
+ * the plugin's queue, it's taken out and deallocated right away, so dropped
+ * frames don't pile up behind a slow output. Otherwise, the plugin is about to
+ * claim it; it's marked as superseded, and the plugin releases it instead.
+ *
+ * @note The channel's lock must be held; the frame must already be removed
+ * from its waiting list.
+ */
+void OutputHandler::supersede(OutputFrame *frame) {
+	this->framesSuperseded->increment();
+	this->framesWaiting->add(-1);
+
+	VLOG(2) << "Frame for channel " << frame->getChannel() << " (txn "
+		<< frame->getAckTxn() << ") was superseded";
+
+	this->pluginHandler->nackFrame(frame);
+
+	if(this->plugin->removeFrame(frame)) {
+		delete frame;
+	} else {
+		frame->superseded = true;
+	}
+}
+
+/**
+ * Called when the plugin takes a frame off its queue.
+ *
+ * @return Whether the frame should be output; if not, it was superseded.
+ */
+bool OutputHandler::claimFrame(OutputFrame *frame) {
+	const size_t index = frame->getChannel();
+
+	if(index >= kMaxChannels) {
+		return true;
+	}
+
+	Channel &channel = this->channels[index];
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	if(frame->superseded) {
+		return false;
+	}
+
+	auto it = std::find(channel.waiting.begin(), channel.waiting.end(), frame);
+
+	if(it != channel.waiting.end()) {
+		channel.waiting.erase(it);
+		this->framesWaiting->add(-1);
+	}
+
+	return true;
+}
+
+/**
+ * Removes a frame that's about to be deallocated from its channel's waiting
+ * list, in case the plugin never claimed it.
+ */
+void OutputHandler::forgetFrame(OutputFrame *frame) {
+	const size_t index = frame->getChannel();
+
+	if(index >= kMaxChannels) {
+		return;
+	}
+
+	Channel &channel = this->channels[index];
+	std::lock_guard<std::mutex> lck(channel.lock);
+
+	auto it = std::find(channel.waiting.begin(), channel.waiting.end(), frame);
+
+	if(it != channel.waiting.end()) {
+		channel.waiting.erase(it);
+		this->framesWaiting->add(-1);
+	}
+}
+
+/**
+ * Outputs the given channels; with the pipeline, once the frames queued before
+ * have been admitted.
  */
 int OutputHandler::outputChannels(std::bitset<32> &channels) {
+	if(this->convert) {
+		return this->convert->submitOutput(channels);
+	}
+
+	return this->outputNow(channels);
+}
+
+/**
+ * Actually outputs the given channels.
+ */
+int OutputHandler::outputNow(std::bitset<32> &channels) {
 	// set the output state
 	// TODO: disable it later
 	StatusHandler::sharedInstance()->setOutputState(true);
@@ -2,31 +2,112 @@
 #define OUTPUTHANDLER_H
 
 #include <bitset>
+#include <deque>
+#include <mutex>
 #include <cstddef>
 
-class INIReader;
+class Config;
 class OutputPlugin;
 class LichtensteinPluginHandler;
+class MetricsCounter;
+class MetricsGauge;
 
 class OutputFrame;
+class ColorCorrection;
+class ConvertStage;
 
+/**
+ * Hands frames to the output plugin, and outputs channels when requested.
+ *
+ * Before being queued, frames are color corrected in place.
+ *
+ * Frames pass through an admission layer on their way to the plugin: each
+ * channel may have a limited number of frames waiting for the plugin to take
+ * them off its queue. Beyond that, the admission policy decides which frame is
+ * dropped; with latest wins, only the newest frame waits. Dropped frames are
+ * NACKed right away, and taken out of the plugin's queue. Frames the plugin
+ * already took off its queue are marked as superseded instead, and released
+ * by the plugin when it tries to claim them.
+ *
+ * With the pipeline enabled, frames are corrected and admitted (and channels
+ * output) on the convert stage's thread instead of the calling thread.
+ */
 class OutputHandler {
+	// plugin handler claims and releases frames for the plugins
+	friend class LichtensteinPluginHandler;
+	// convert stage admits frames and outputs channels on its thread
+	friend class ConvertStage;
+
 	public:
-		OutputHandler(INIReader *config, LichtensteinPluginHandler *pluginHandler);
+		OutputHandler(const Config *config, LichtensteinPluginHandler *pluginHandler);
 		~OutputHandler();
 
 	public:
 		int queueOutputFrame(OutputFrame *frame);
 		int outputChannels(std::bitset<32> &channels);
 
+		ColorCorrection *getColorCorrection(void) const {
+			return this->color;
+		}
+
+	public:
+		/**
+		 * What to do with a frame for a channel whose queue is full.
+		 */
+		enum AdmissionPolicy {
+			// replace all waiting frames; the queue depth doesn't apply
+			kAdmitLatest,
+			// drop the oldest waiting frame
+			kAdmitDropOldest,
+			// reject the new frame
+			kAdmitNackNew,
+		};
+
 	private:
 		void loadPlugin(void *rom, size_t romLen);
+		void readAdmissionConfig(void);
+
+		int admitFrame(OutputFrame *frame);
+		int outputNow(std::bitset<32> &channels);
+
+		bool claimFrame(OutputFrame *frame);
+		void forgetFrame(OutputFrame *frame);
+
+		void supersede(OutputFrame *frame);
+
+	private:
+		// frames waiting for the plugin on a channel, and the lock protecting them
+		struct Channel {
+			std::deque<OutputFrame *> waiting;
+			std::mutex lock;
+		};
+
+		// number of channels frames are admitted for; see kLichtensteinMaxChannels
+		static const size_t kMaxChannels = 128;
 
 	private:
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
 
 		LichtensteinPluginHandler *pluginHandler = nullptr;
 		OutputPlugin *plugin = nullptr;
+
+		// maximum number of frames waiting per channel, and the admission policy
+		size_t queueDepth = 2;
+		AdmissionPolicy policy = kAdmitLatest;
+
+		Channel channels[kMaxChannels];
+
+		// applied to frames before they're handed to the plugin
+		ColorCorrection *color = nullptr;
+
+		// thread frames are corrected and admitted on, if pipelined
+		ConvertStage *convert = nullptr;
+
+	// counters (owned by the metrics registry)
+	private:
+		MetricsCounter *framesSuperseded = nullptr;
+		MetricsCounter *framesRejected = nullptr;
+		MetricsGauge *framesWaiting = nullptr;
 };
 
 #endif
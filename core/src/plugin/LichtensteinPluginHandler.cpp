@@ -1,7 +1,9 @@
 #include "LichtensteinPluginHandler.h"
 
 #include "../output/OutputFrame.h"
+#include "../output/OutputHandler.h"
 #include "../net/ProtocolHandler.h"
+#include "../event/PlatformReactor.h"
 
 #include "GPIOHelper.h"
 #include "PluginDiscovery.h"
@@ -19,7 +21,7 @@
 /**
  * Sets up the plugin handler and loads the plugins.
  */
-LichtensteinPluginHandler::LichtensteinPluginHandler(INIReader *_cfg) : config(_cfg) {
+LichtensteinPluginHandler::LichtensteinPluginHandler(const Config *_cfg) : config(_cfg) {
   int err;
 
 	// create GPIO helper and discovery controller
@@ -79,13 +81,21 @@ int LichtensteinPluginHandler::registerInputPlugin(const uuid_t &uuid, input_plu
 
 
 
+/**
+ * Creates a reactor for a plugin's worker thread.
+ */
+Reactor *LichtensteinPluginHandler::createReactor(void) {
+	return new PlatformReactor();
+}
+
+
+
 /**
  * Loads input plugins.
  */
 void LichtensteinPluginHandler::loadInputPlugins(void) {
-	// read from the INI
-	std::string path = this->config->Get("input", "module_dir", "unknown");
-	CHECK(path != "unknown") << "input module_dir was not set in config, aborting";
+	std::string path = this->config->getInput().moduleDir;
+	CHECK(!path.empty()) << "input module_dir was not set in config, aborting";
 
 	this->loadPluginsInDirectory(path);
 }
@@ -94,9 +104,8 @@ void LichtensteinPluginHandler::loadInputPlugins(void) {
  * Loads output plugins.
  */
 void LichtensteinPluginHandler::loadOutputPlugins(void) {
-	// read from the INI
-	std::string path = this->config->Get("output", "module_dir", "unknown");
-	CHECK(path != "unknown") << "output module_dir was not set in config, fix your shit, what the fuck";
+	std::string path = this->config->getOutput().moduleDir;
+	CHECK(!path.empty()) << "output module_dir was not set in config, fix your shit, what the fuck";
 
 	this->loadPluginsInDirectory(path);
 }
@@ -274,16 +283,63 @@ void LichtensteinPluginHandler::callPluginDestructors(void) {
 
 
 /**
- * Acknowledges a frame as having been processed. This will notify the
- * server that the frame is ready.
- *
- * TODO: Should this somehow ensure that the packet is sent from the worker
- * thread?
+ * Acknowledges a frame as having been processed. The acknowledgement is queued,
+ * and sent to the server from the protocol worker thread when the queue is
+ * next flushed.
  */
 void LichtensteinPluginHandler::acknowledgeFrame(OutputFrame *frame, bool nack) {
-	// acknowledge frame
-	this->protocolHandler->ackOutputFrame(frame, nack);
+	// queue the acknowledgement
+	this->protocolHandler->queueAck(frame, nack);
 
 	// delete the frame
+	this->releaseFrame(frame);
+}
+
+/**
+ * Claims a frame the plugin took off its queue. Frames superseded while they
+ * were queued must be released without being output.
+ */
+bool LichtensteinPluginHandler::claimFrame(OutputFrame *frame) {
+	frame->stampDequeueTime();
+
+	if(!this->outputHandler) {
+		return true;
+	}
+
+	return this->outputHandler->claimFrame(frame);
+}
+
+/**
+ * Deallocates a frame without acknowledging it.
+ */
+void LichtensteinPluginHandler::releaseFrame(OutputFrame *frame) {
+	// in case the plugin never claimed it
+	if(this->outputHandler) {
+		this->outputHandler->forgetFrame(frame);
+	}
+
 	delete frame;
 }
+
+/**
+ * Queues a NACK for a frame, without deallocating it. NACKs are sent right
+ * away.
+ */
+void LichtensteinPluginHandler::nackFrame(OutputFrame *frame) {
+	this->protocolHandler->queueAck(frame, true);
+}
+
+/**
+ * Sends all queued acknowledgements to the server.
+ */
+void LichtensteinPluginHandler::flushAcknowledgements(void) {
+	this->protocolHandler->requestAckFlush();
+}
+
+/**
+ * Marks the keys a plugin reads as known, so they're not reported once all
+ * plugins have been initialized.
+ */
+void LichtensteinPluginHandler::declareConfigKeys(const std::string &section, const std::vector<std::string> &keys) {
+	this->config->declareKeys(section, keys);
+}
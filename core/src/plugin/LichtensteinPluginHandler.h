@@ -15,9 +15,11 @@
 
 #include <uuid/uuid.h>
 
-#include <INIReader.h>
+#include "../config/Config.h"
+#include "../metrics/MetricsRegistry.h"
 
 class ProtocolHandler;
+class OutputHandler;
 class OutputFrame;
 
 class GPIOHelper;
@@ -26,16 +28,17 @@ class PluginDiscovery;
 class LichtensteinPluginHandler : public PluginHandler {
 	friend class InputHandler;
 	friend class OutputHandler;
+	friend class ConvertStage;
 
 	friend int main(int, const char *[]);
 
 	public:
-		LichtensteinPluginHandler(INIReader *config);
+		LichtensteinPluginHandler(const Config *config);
 		~LichtensteinPluginHandler();
 
 	// plugin API
 	public:
-		virtual INIReader *getConfig(void) {
+		virtual const Config *getConfig(void) {
 			return this->config;
 		}
 
@@ -43,10 +46,21 @@ class LichtensteinPluginHandler : public PluginHandler {
 			return this->gpioHelper;
 		}
 
+		virtual MetricsRegistry *getMetricsRegistry(void) {
+			return MetricsRegistry::sharedInstance();
+		}
+
 		virtual int registerOutputPlugin(const uuid_t &uuid, output_plugin_factory_t factory);
 		virtual int registerInputPlugin(const uuid_t &uuid, input_plugin_factory_t factory);
 
+		virtual Reactor *createReactor(void);
+
 		virtual void acknowledgeFrame(OutputFrame *frame, bool nack = false);
+		virtual bool claimFrame(OutputFrame *frame);
+		virtual void releaseFrame(OutputFrame *frame);
+		virtual void flushAcknowledgements(void);
+
+		virtual void declareConfigKeys(const std::string &section, const std::vector<std::string> &keys);
 
 	// API used by the rest of the server
 	protected:
@@ -68,6 +82,8 @@ class LichtensteinPluginHandler : public PluginHandler {
 			return factory(this);
 		}
 
+		void nackFrame(OutputFrame *frame);
+
 	private:
 		enum {
 			PLUGIN_LOADED			= 0,
@@ -97,8 +113,9 @@ class LichtensteinPluginHandler : public PluginHandler {
 		std::map<std::string, input_plugin_factory_t> inFactories;
 
 		ProtocolHandler *protocolHandler = nullptr;
+		OutputHandler *outputHandler = nullptr;
 
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
 		GPIOHelper *gpioHelper = nullptr;
 
     PluginDiscovery *discovery = nullptr;
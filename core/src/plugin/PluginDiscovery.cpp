@@ -44,7 +44,7 @@ int PluginDiscovery::discover(void) {
   int err = 0, numAddresses = 0;
 
   // get a vector of all addresses
-	std::string addrStr = this->config->Get("discovery", "eeprom_addresses", "0x50,0x51,0x52,0x53");
+	std::string addrStr = this->config->getDiscovery().eepromAddresses;
 
   std::vector<int> addr;
   numAddresses = StringUtils::parseCsvList(addrStr, addr, 16);
@@ -115,7 +115,7 @@ int PluginDiscovery::readConfigRom(int addr, void **data, size_t *len) {
   CHECK(addr < 0x80) << "I2C address may not be more than 0x7F";
 
   // get bus number from config
-  int busNr = this->config->GetInteger("discovery", "eeprom_bus", 0);
+  int busNr = this->config->getDiscovery().eepromBus;
 
   CHECK(busNr >= 0) << "Address is negative, wtf (got " << busNr << ", check discovery.eeprom_bus)";
 
@@ -7,7 +7,7 @@
 #ifndef PLUGIN_DISCOVERY_H
 #define PLUGIN_DISCOVERY_H
 
-#include <INIReader.h>
+#include "../config/Config.h"
 
 class LichtensteinPluginHandler;
 
@@ -35,7 +35,7 @@ class PluginDiscovery {
     };
 
   private:
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
     LichtensteinPluginHandler *handler = nullptr;
 };
 
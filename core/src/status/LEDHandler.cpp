@@ -1,7 +1,7 @@
 #include "LEDHandler.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include "../config/Config.h"
 #include <cpptime.h>
 
 #include <string>
@@ -18,7 +18,7 @@
  * from the config, and disables output functionality for that LED if they were
  * omitted from the config.
  */
-LEDHandler::LEDHandler(INIReader *_config) : config(_config) {
+LEDHandler::LEDHandler(const Config *_config) : config(_config) {
 	// read LED configuration
 	this->configureLeds();
 
@@ -73,7 +73,7 @@ LEDHandler::~LEDHandler() {
  */
 void LEDHandler::configureLeds(void) {
 	// configure error LED
-	this->errorLedPath = this->config->Get("statusled", "errorled", "none");
+	this->errorLedPath = this->config->getStatusLed().errorLed;
 
 	if(this->errorLedPath != "none") {
 		bool exists = this->checkIfFileExists(this->errorLedPath);
@@ -81,7 +81,7 @@ void LEDHandler::configureLeds(void) {
 	}
 
 	// configure output active LED
-	this->outputActiveLedPath = this->config->Get("statusled", "outputled", "none");
+	this->outputActiveLedPath = this->config->getStatusLed().outputLed;
 
 	if(this->outputActiveLedPath != "none") {
 		bool exists = this->checkIfFileExists(this->outputActiveLedPath);
@@ -89,7 +89,7 @@ void LEDHandler::configureLeds(void) {
 	}
 
 	// configure error LED
-	this->adoptedLedPath = this->config->Get("statusled", "adoptionled", "none");
+	this->adoptedLedPath = this->config->getStatusLed().adoptionLed;
 
 	if(this->adoptedLedPath != "none") {
 		bool exists = this->checkIfFileExists(this->adoptedLedPath);
@@ -97,7 +97,7 @@ void LEDHandler::configureLeds(void) {
 	}
 
 	// configure error LED
-	this->heartbeatLedPath = this->config->Get("statusled", "heartbeatled", "none");
+	this->heartbeatLedPath = this->config->getStatusLed().heartbeatLed;
 
 	if(this->heartbeatLedPath != "none") {
 		bool exists = this->checkIfFileExists(this->heartbeatLedPath);
@@ -10,7 +10,7 @@
 
 #include <string>
 
-class INIReader;
+class Config;
 
 namespace CppTime {
 	class Timer;
@@ -18,7 +18,7 @@ namespace CppTime {
 
 class LEDHandler {
 	public:
-		LEDHandler(INIReader *config);
+		LEDHandler(const Config *config);
 		~LEDHandler();
 
 		void setErrorState(bool state) {
@@ -45,7 +45,7 @@ class LEDHandler {
 		int setLedState(std::string &, bool);
 
 	private:
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
 
 		CppTime::Timer *heartbeatTimer;
 
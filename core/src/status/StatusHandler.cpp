@@ -2,8 +2,11 @@
 
 #include "LEDHandler.h"
 
+#include "../metrics/MetricsRegistry.h"
+#include "../net/lichtenstein_proto.h"
+
 #include <glog/logging.h>
-#include <INIReader.h>
+#include "../config/Config.h"
 
 // static instance (singleton)
 static StatusHandler *sharedHandler = nullptr;
@@ -15,10 +18,13 @@ static StatusHandler *sharedHandler = nullptr;
  * from the config, and disables output functionality for that LED if they were
  * omitted from the config.
  */
-StatusHandler::StatusHandler(INIReader *_config) : config(_config) {
+StatusHandler::StatusHandler(const Config *_config) : config(_config) {
 	// allocate LED handler
 	this->led = new LEDHandler(this->config);
 	CHECK(this->led != nullptr) << "Couldn't allocate LED handler";
+
+	// register the output state
+	this->outputState = MetricsRegistry::sharedInstance()->registerGauge("output.state");
 }
 
 /**
@@ -37,7 +43,7 @@ StatusHandler::~StatusHandler() {
  * Initializes the status handler, passing the given config reader to it. This
  * should be called early on from the main routine.
  */
-void StatusHandler::initSingleton(INIReader *config) {
+void StatusHandler::initSingleton(const Config *config) {
 	sharedHandler = new StatusHandler(config);
 }
 
@@ -76,6 +82,8 @@ void StatusHandler::assertErrorState() {
  * Sets the state of the output indicator.
  */
 void StatusHandler::setOutputState(bool isActive) {
+	this->outputState->set(isActive ? kOutputStateActive : kOutputStateIdle);
+
 	if(this->led) {
 		this->led->setOutputState(isActive);
 	}
@@ -5,9 +5,10 @@
 #ifndef STATUSHANDLER_H
 #define STATUSHANDLER_H
 
-class INIReader;
+class Config;
 
 class LEDHandler;
+class MetricsGauge;
 
 class StatusHandler {
 	friend int main(int, const char *[]);
@@ -21,19 +22,21 @@ class StatusHandler {
 		void setAdoptionState(bool isAdopted);
 
 	private:
-		StatusHandler(INIReader *config);
+		StatusHandler(const Config *config);
 		~StatusHandler();
 
-		static void initSingleton(INIReader *config);
+		static void initSingleton(const Config *config);
 		static void deallocSingleton(void);
 
 	private:
 
 	private:
-		INIReader *config = nullptr;
+		const Config *config = nullptr;
 
 		LEDHandler *led = nullptr;
 
+		// output state reported in status responses
+		MetricsGauge *outputState = nullptr;
 };
 
 #endif
@@ -0,0 +1,140 @@
+#include "BufferPool.h"
+
+#include <glog/logging.h>
+
+#include <cstdlib>
+
+/**
+ * Allocates a buffer of the given capacity. The buffer starts out with a single
+ * reference, held by whoever acquired it from the pool.
+ */
+PacketBuffer::PacketBuffer(BufferPool *_pool, size_t _capacity) : pool(_pool),
+	capacity(_capacity) {
+	this->refCount = 1;
+
+	this->data = static_cast<char *>(malloc(this->capacity));
+	CHECK(this->data != nullptr) << "Couldn't allocate buffer!";
+}
+
+/**
+ * Releases the buffer's memory.
+ */
+PacketBuffer::~PacketBuffer() {
+	free(this->data);
+}
+
+/**
+ * Drops a reference to the buffer; when the last reference goes away, the
+ * buffer goes back to its pool.
+ */
+void PacketBuffer::release(void) {
+	int previous = this->refCount.fetch_sub(1, std::memory_order_acq_rel);
+	CHECK(previous > 0) << "Over-released buffer " << this;
+
+	if(previous == 1) {
+		this->pool->recycle(this);
+	}
+}
+
+
+
+/**
+ * Sets up the pool, preallocating the given number of buffers.
+ */
+BufferPool::BufferPool(size_t _bufferSize, size_t count) : bufferSize(_bufferSize) {
+	this->allBuffers.reserve(count);
+	this->freeBuffers.reserve(count);
+
+	for(size_t i = 0; i < count; i++) {
+		PacketBuffer *buffer = new PacketBuffer(this, this->bufferSize);
+
+		this->allBuffers.push_back(buffer);
+		this->freeBuffers.push_back(buffer);
+	}
+}
+
+/**
+ * Releases all buffers. This is only invoked once the pool has been destroyed,
+ * and all buffers have been returned to it.
+ */
+BufferPool::~BufferPool() {
+	LOG_IF(INFO, this->timesGrown > 0) << "Buffer pool grew " << this->timesGrown
+		<< " times, to " << this->allBuffers.size() << " buffers";
+
+	for(PacketBuffer *buffer : this->allBuffers) {
+		delete buffer;
+	}
+}
+
+/**
+ * Gives up the owner's reference to the pool. If buffers are still in use, the
+ * pool is deallocated once the last of them is returned.
+ */
+void BufferPool::destroy(void) {
+	bool deallocate;
+
+	{
+		std::lock_guard<std::mutex> lck(this->freeBuffersMutex);
+
+		this->destroyed = true;
+		deallocate = (this->buffersInUse == 0);
+
+		VLOG_IF(1, !deallocate) << "Destroying pool with " << this->buffersInUse
+			<< " buffers in use";
+	}
+
+	if(deallocate) {
+		delete this;
+	}
+}
+
+/**
+ * Takes a buffer out of the pool. If no buffers are available, a new one is
+ * allocated: so the pool grows to whatever the peak number of buffers in
+ * flight is, after which no further allocations take place.
+ */
+PacketBuffer *BufferPool::acquire(void) {
+	std::lock_guard<std::mutex> lck(this->freeBuffersMutex);
+
+	// is there a free buffer?
+	if(!this->freeBuffers.empty()) {
+		PacketBuffer *buffer = this->freeBuffers.back();
+		this->freeBuffers.pop_back();
+
+		buffer->refCount.store(1, std::memory_order_relaxed);
+		this->buffersInUse++;
+
+		return buffer;
+	}
+
+	// if not, allocate a new one
+	PacketBuffer *buffer = new PacketBuffer(this, this->bufferSize);
+	this->allBuffers.push_back(buffer);
+	this->buffersInUse++;
+
+	this->timesGrown++;
+	VLOG(1) << "Buffer pool ran dry, grew to " << this->allBuffers.size() << " buffers";
+
+	return buffer;
+}
+
+/**
+ * Returns a buffer to the free list. If the pool was destroyed while this
+ * buffer was in use and it's the last one, the pool is deallocated.
+ */
+void BufferPool::recycle(PacketBuffer *buffer) {
+	bool deallocate;
+
+	{
+		std::lock_guard<std::mutex> lck(this->freeBuffersMutex);
+
+		this->freeBuffers.push_back(buffer);
+		this->buffersInUse--;
+
+		deallocate = (this->destroyed && this->buffersInUse == 0);
+	}
+
+	if(deallocate) {
+		delete this;
+	}
+}
@@ -0,0 +1,97 @@
+/**
+ * A pool of fixed-size, reference counted buffers. Packets are received
+ * directly into buffers from the pool; anything that wants to hold on to data
+ * in the buffer beyond the receive path (such as an output frame referencing
+ * the pixel data of a packet) retains the buffer, and it's returned to the pool
+ * once the last reference is released.
+ *
+ * Since buffers may outlive whatever owns the pool, the pool isn't deleted
+ * directly: its owner calls destroy(), and the pool goes away as soon as the
+ * last buffer has been returned to it.
+ */
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <cstddef>
+
+class BufferPool;
+
+class PacketBuffer {
+	friend class BufferPool;
+
+	public:
+		void *getData(void) const {
+			return this->data;
+		}
+		size_t getCapacity(void) const {
+			return this->capacity;
+		}
+
+		/**
+		 * Returns whether anyone besides the caller holds a reference.
+		 */
+		bool isShared(void) const {
+			return (this->refCount.load(std::memory_order_acquire) > 1);
+		}
+
+		void retain(void) {
+			this->refCount.fetch_add(1, std::memory_order_relaxed);
+		}
+		void release(void);
+
+	private:
+		PacketBuffer(BufferPool *pool, size_t capacity);
+		~PacketBuffer();
+
+	private:
+		BufferPool *pool = nullptr;
+		std::atomic_int refCount;
+
+		char *data = nullptr;
+		size_t capacity = 0;
+};
+
+class BufferPool {
+	friend class PacketBuffer;
+
+	public:
+		BufferPool(size_t bufferSize, size_t count);
+
+		void destroy(void);
+
+		PacketBuffer *acquire(void);
+
+		size_t getBufferSize(void) const {
+			return this->bufferSize;
+		}
+
+	private:
+		~BufferPool();
+
+		void recycle(PacketBuffer *buffer);
+
+	private:
+		size_t bufferSize = 0;
+
+		// buffers that are available for use
+		std::vector<PacketBuffer *> freeBuffers;
+		// lock protecting the free list and the fields below
+		std::mutex freeBuffersMutex;
+
+		// number of buffers currently handed out
+		size_t buffersInUse = 0;
+		// set once the owner has given up the pool
+		bool destroyed = false;
+
+		// every buffer ever allocated by the pool
+		std::vector<PacketBuffer *> allBuffers;
+
+		// number of times the pool ran dry and had to allocate
+		size_t timesGrown = 0;
+};
+
+#endif
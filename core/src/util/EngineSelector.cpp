@@ -0,0 +1,28 @@
+#include "EngineSelector.h"
+
+#include <ctime>
+
+/**
+ * Fills the buffer with reproducible pseudo-random data (xorshift32.)
+ */
+void EngineBenchmark::fillTestData(std::vector<uint8_t> &buffer) {
+	uint32_t state = 0x2545F491;
+
+	for(size_t i = 0; i < buffer.size(); i++) {
+		state ^= (state << 13);
+		state ^= (state >> 17);
+		state ^= (state << 5);
+
+		buffer[i] = (state & 0xFF);
+	}
+}
+
+/**
+ * Returns the current monotonic time, in nanoseconds.
+ */
+uint64_t EngineBenchmark::getMonotonicTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
@@ -0,0 +1,194 @@
+/**
+ * Picks one of several implementations of the same algorithm when the client
+ * starts, like the CRC32 algorithm or the color correction kernel.
+ *
+ * A specific candidate may be requested by name; it's used as long as the CPU
+ * supports it and it passes the cross check against the reference. Otherwise
+ * (or for "auto"), every candidate the CPU supports is checked and timed, and
+ * the best one wins; by default, that's simply the fastest.
+ *
+ * The cross check and benchmark are up to the caller. A few helpers for them,
+ * such as reproducible test data and timing the fastest of several rounds, are
+ * provided as well.
+ */
+#ifndef ENGINESELECTOR_H
+#define ENGINESELECTOR_H
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Helpers for checking and timing candidates.
+ */
+class EngineBenchmark {
+	private:
+		EngineBenchmark() {}
+		~EngineBenchmark() {}
+
+	public:
+		static void fillTestData(std::vector<uint8_t> &buffer);
+		static uint64_t getMonotonicTime(void);
+
+		/**
+		 * Invokes the function the given number of times per round, and
+		 * returns the time per call in the fastest round, in nanoseconds.
+		 */
+		template <typename Function>
+		static uint64_t timeFastestRound(size_t rounds, size_t calls, Function function) {
+			uint64_t fastest = UINT64_MAX;
+
+			for(size_t round = 0; round < rounds; round++) {
+				const uint64_t start = EngineBenchmark::getMonotonicTime();
+
+				for(size_t call = 0; call < calls; call++) {
+					function();
+				}
+
+				fastest = std::min(fastest, (EngineBenchmark::getMonotonicTime() - start));
+			}
+
+			return (fastest / calls);
+		}
+};
+
+/**
+ * Selects one of the given candidates. Candidates must have a name, and an
+ * isAvailable function, which is nullptr if the candidate can always run.
+ */
+template <typename Candidate>
+class EngineSelector {
+	public:
+		// checks the candidate against the reference
+		typedef std::function<bool(const Candidate &)> check_t;
+		// times the candidate, in nanoseconds per call
+		typedef std::function<uint64_t(const Candidate &)> benchmark_t;
+		// whether a candidate that took the given time beats the best one so far
+		typedef std::function<bool(const Candidate &, uint64_t, const Candidate &, uint64_t)> compare_t;
+
+	public:
+		/**
+		 * Sets up the selector. The kind of candidate and the unit of the
+		 * benchmark (such as "per 512 pixels") are only used for logging.
+		 */
+		EngineSelector(const char *_kind, const std::string &_unit, check_t _check,
+					   benchmark_t _benchmark) : kind(_kind), unit(_unit),
+					   check(_check), benchmark(_benchmark) {
+
+		}
+
+		/**
+		 * Changes how candidates are compared; by default, the fastest wins.
+		 */
+		void setComparator(compare_t compare) {
+			this->compare = compare;
+		}
+
+		/**
+		 * Picks one of the candidates. Those before the first automatic one
+		 * (such as a slow reference) are only used if requested by name.
+		 *
+		 * @return The candidate to use, or nullptr if none passed the check.
+		 */
+		const Candidate *select(const Candidate *candidates, size_t numCandidates,
+								size_t firstAutomatic, const std::string &preferred) {
+			this->usedPreferred = false;
+
+			const bool automatic = (preferred.empty() || preferred == "auto");
+
+			// use the requested one if possible
+			if(!automatic) {
+				for(size_t i = 0; i < numCandidates; i++) {
+					const Candidate &candidate = candidates[i];
+
+					if(preferred != candidate.name) {
+						continue;
+					}
+
+					if(candidate.isAvailable && !candidate.isAvailable()) {
+						LOG(WARNING) << "Can't use " << this->kind << " " << candidate.name
+							<< "; it isn't supported on this CPU";
+						break;
+					} else if(!this->check(candidate)) {
+						break;
+					}
+
+					LOG(INFO) << "Using " << this->kind << " " << candidate.name << " (from config)";
+
+					this->usedPreferred = true;
+					return &candidate;
+				}
+
+				LOG(WARNING) << "Can't use " << this->kind << " '" << preferred
+					<< "'; selecting one automatically";
+			}
+
+			// time all candidates that pass the check
+			const Candidate *best = nullptr;
+			uint64_t bestTime = 0;
+
+			for(size_t i = firstAutomatic; i < numCandidates; i++) {
+				const Candidate &candidate = candidates[i];
+
+				if(candidate.isAvailable && !candidate.isAvailable()) {
+					VLOG(1) << "Skipping " << this->kind << " " << candidate.name << "; it isn't supported";
+					continue;
+				} else if(!this->check(candidate)) {
+					continue;
+				}
+
+				const uint64_t time = this->benchmark(candidate);
+
+				VLOG(1) << "Timed " << this->kind << " " << candidate.name << ": " << time
+					<< " ns " << this->unit;
+
+				if(best && !this->isBetter(candidate, time, *best, bestTime)) {
+					continue;
+				}
+
+				best = &candidate;
+				bestTime = time;
+			}
+
+			LOG_IF(INFO, best) << "Using " << this->kind << " " << best->name << " ("
+				<< bestTime << " ns " << this->unit << ")";
+
+			this->usedPreferred = automatic;
+			return best;
+		}
+
+		/**
+		 * Whether the last selection got what was asked for: the requested
+		 * candidate, or any candidate if none was requested.
+		 */
+		bool gotPreferred(void) const {
+			return this->usedPreferred;
+		}
+
+	private:
+		bool isBetter(const Candidate &candidate, uint64_t time, const Candidate &best, uint64_t bestTime) const {
+			if(this->compare) {
+				return this->compare(candidate, time, best, bestTime);
+			}
+
+			return (time < bestTime);
+		}
+
+	private:
+		const char *kind;
+		std::string unit;
+
+		check_t check;
+		benchmark_t benchmark;
+		compare_t compare;
+
+		bool usedPreferred = false;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * A bounded, lock-free queue between exactly one producer and one consumer
+ * thread; the stages of the receive pipeline are connected with these.
+ *
+ * The capacity is rounded up to a power of two, so the indices only ever
+ * increase and are masked on access. The producer's and consumer's index live
+ * on separate cache lines, and each side keeps a cached copy of the other's,
+ * so the shared lines only bounce when the ring looks full (or empty).
+ *
+ * Items are constructed in place: the producer claims the next free slot, fills
+ * it, and publishes it; the consumer looks at the oldest item with front(), and
+ * hands the slot back with pop() once it's done with it. push() and pop() that
+ * copy an item are provided for small items.
+ */
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+
+#include <cstddef>
+
+template <typename T>
+class SpscRing {
+	public:
+		SpscRing(size_t capacity) {
+			size_t size = 1;
+
+			while(size < capacity) {
+				size <<= 1;
+			}
+
+			this->mask = (size - 1);
+			this->slots = new T[size];
+		}
+
+		~SpscRing() {
+			delete[] this->slots;
+		}
+
+		SpscRing(const SpscRing &) = delete;
+		SpscRing &operator=(const SpscRing &) = delete;
+
+		size_t getCapacity(void) const {
+			return (this->mask + 1);
+		}
+
+	// producer side
+	public:
+		/**
+		 * Returns the slot the next item goes into, or nullptr if the ring is
+		 * full. The item isn't visible to the consumer until it's published.
+		 */
+		T *claim(void) {
+			const size_t tail = this->tail.load(std::memory_order_relaxed);
+
+			if((tail - this->cachedHead) > this->mask) {
+				this->cachedHead = this->head.load(std::memory_order_acquire);
+
+				if((tail - this->cachedHead) > this->mask) {
+					return nullptr;
+				}
+			}
+
+			return &this->slots[tail & this->mask];
+		}
+
+		/**
+		 * Makes the item in the slot returned by the last claim() available to
+		 * the consumer.
+		 */
+		void publish(void) {
+			this->tail.store(this->tail.load(std::memory_order_relaxed) + 1,
+							 std::memory_order_release);
+		}
+
+		/**
+		 * Copies an item into the ring.
+		 *
+		 * @return Whether the item was queued; it isn't if the ring is full.
+		 */
+		bool push(const T &item) {
+			T *slot = this->claim();
+
+			if(!slot) {
+				return false;
+			}
+
+			*slot = item;
+			this->publish();
+
+			return true;
+		}
+
+	// consumer side
+	public:
+		/**
+		 * Returns the oldest item in the ring, or nullptr if it's empty. The
+		 * slot remains valid until pop() is called.
+		 */
+		T *front(void) {
+			const size_t head = this->head.load(std::memory_order_relaxed);
+
+			if(head == this->cachedTail) {
+				this->cachedTail = this->tail.load(std::memory_order_acquire);
+
+				if(head == this->cachedTail) {
+					return nullptr;
+				}
+			}
+
+			return &this->slots[head & this->mask];
+		}
+
+		/**
+		 * Hands the slot of the oldest item back to the producer.
+		 */
+		void pop(void) {
+			this->head.store(this->head.load(std::memory_order_relaxed) + 1,
+							 std::memory_order_release);
+		}
+
+		/**
+		 * Copies the oldest item out of the ring, and removes it.
+		 *
+		 * @return Whether there was an item.
+		 */
+		bool pop(T &item) {
+			T *slot = this->front();
+
+			if(!slot) {
+				return false;
+			}
+
+			item = *slot;
+			this->pop();
+
+			return true;
+		}
+
+	private:
+		T *slots = nullptr;
+		size_t mask = 0;
+
+		// index of the next item to read; written by the consumer
+		alignas(64) std::atomic<size_t> head{0};
+		// consumer's copy of the tail
+		size_t cachedTail = 0;
+
+		// index of the next slot to write; written by the producer
+		alignas(64) std::atomic<size_t> tail{0};
+		// producer's copy of the head
+		size_t cachedHead = 0;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "ThreadUtils.h"
+#include "StringUtils.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <glog/logging.h>
+
+// thread affinity is linux only
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * Restricts the calling thread to run on the given CPU only; a negative CPU
+ * leaves it unpinned.
+ *
+ * @return 0 on success, an error code otherwise.
+ */
+int ThreadUtils::pinToCpu(int cpu) {
+	if(cpu < 0) {
+		return 0;
+	}
+
+#ifdef __linux__
+	int err;
+
+	if(cpu >= CPU_SETSIZE) {
+		LOG(WARNING) << "Can't pin thread to CPU " << cpu;
+		return EINVAL;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+	if(err != 0) {
+		LOG(WARNING) << "Couldn't pin thread to CPU " << cpu << ": " << strerror(err);
+		return err;
+	}
+
+	return 0;
+#else
+	LOG(WARNING) << "Pinning threads to CPUs isn't supported on this platform";
+	return ENOTSUP;
+#endif
+}
+
+/**
+ * Parses a comma-separated list of CPUs, one for each of several threads; the
+ * last one applies to any threads beyond the end of the list.
+ *
+ * @return CPU for the thread with the given index, or -1 if it shouldn't be
+ * pinned.
+ */
+int ThreadUtils::cpuForThread(const std::string &list, size_t index) {
+	std::vector<int> cpus;
+
+	if(list.empty() || StringUtils::parseCsvList(list, cpus) == 0) {
+		return -1;
+	}
+
+	return cpus[std::min(index, cpus.size() - 1)];
+}
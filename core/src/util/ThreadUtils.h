@@ -0,0 +1,31 @@
+/**
+ * A few functions useful for dealing with threads.
+ */
+#ifndef THREADUTILS_H
+#define THREADUTILS_H
+
+#include <string>
+
+#include <cstddef>
+
+class ThreadUtils {
+	private:
+		ThreadUtils() {}
+		~ThreadUtils() {}
+
+	public:
+		/**
+		 * Restricts the calling thread to run on the given CPU only; a negative
+		 * CPU leaves it unpinned.
+		 */
+		static int pinToCpu(int cpu);
+
+		/**
+		 * Parses a comma-separated list of CPUs, one for each of several
+		 * threads; the last one applies to any threads beyond the end of the
+		 * list. Returns -1 (don't pin) for any thread if the list is empty.
+		 */
+		static int cpuForThread(const std::string &list, size_t index);
+};
+
+#endif
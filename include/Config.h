@@ -0,0 +1 @@
+../core/src/config/Config.h
\ No newline at end of file
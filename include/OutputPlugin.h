@@ -31,6 +31,14 @@ class OutputPlugin {
 		virtual int queueFrame(OutputFrame *frame) = 0;
 		virtual int outputChannels(std::bitset<32> &channels) = 0;
 
+		/**
+		 * Takes a frame that was superseded out of the plugin's queue. If it
+		 * was still queued, it's removed and true is returned; the caller then
+		 * owns the frame again. Otherwise, the plugin already took it off the
+		 * queue, and releases it when claimFrame() fails.
+		 */
+		virtual bool removeFrame(OutputFrame *frame) = 0;
+
 	// shared variables
 	protected:
 		void *romData = nullptr;
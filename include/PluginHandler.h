@@ -1,15 +1,21 @@
 #ifndef PLUGINHANDLER_H
 #define PLUGINHANDLER_H
 
+#include <string>
+#include <vector>
+
 #include <cstddef>
 #include <uuid/uuid.h>
 
-#include <INIReader.h>
+#include <Config.h>
 #include <GPIOHelper.h>
+#include <MetricsRegistry.h>
 
 class OutputPlugin;
 class InputPlugin;
 
+class Reactor;
+
 class PluginHandler;
 
 class OutputFrame;
@@ -30,17 +36,54 @@ class PluginHandler {
 
 	// functions plugins can call
 	public:
-		virtual INIReader *getConfig(void) = 0;
+		virtual const Config *getConfig(void) = 0;
 		virtual GPIOHelper *getGPIOHelper(void) = 0;
+		/**
+		 * Returns the registry into which plugins can register their own
+		 * counters and gauges. These are reported along with the client's.
+		 */
+		virtual MetricsRegistry *getMetricsRegistry(void) = 0;
 
 		virtual int registerOutputPlugin(const uuid_t &uuid, output_plugin_factory_t factory) = 0;
 		virtual int registerInputPlugin(const uuid_t &uuid, input_plugin_factory_t factory) = 0;
 
+		/**
+		 * Creates a new reactor (event loop) for a worker thread. The caller
+		 * owns the reactor and must delete it when it's no longer needed.
+		 */
+		virtual Reactor *createReactor(void) = 0;
+
 		/**
 		 * Acknowledges a frame as having been processed. This will notify the
-		 * server that the frame is ready.
+		 * server that the frame is ready once acknowledgements are flushed; the
+		 * frame is deallocated.
 		 */
 		virtual void acknowledgeFrame(OutputFrame *frame, bool nack = false) = 0;
+		/**
+		 * Output plugins must call this for each frame they take off their
+		 * queue, before processing it. If it returns false, a newer frame for
+		 * the same channel superseded it while it was queued, and it has been
+		 * NACKed already: the plugin must not output or acknowledge it, but
+		 * release it with releaseFrame() instead.
+		 */
+		virtual bool claimFrame(OutputFrame *frame) = 0;
+		/**
+		 * Deallocates a frame without acknowledging it.
+		 */
+		virtual void releaseFrame(OutputFrame *frame) = 0;
+		/**
+		 * Sends all acknowledgements queued so far to the server, in as few
+		 * syscalls as possible. Plugins should call this once they're done
+		 * processing a batch of frames.
+		 */
+		virtual void flushAcknowledgements(void) = 0;
+
+		/**
+		 * Declares the keys the plugin reads from the given section of the
+		 * config file, so they're not reported as unknown. Plugins should call
+		 * this from their init function.
+		 */
+		virtual void declareConfigKeys(const std::string &section, const std::vector<std::string> &keys) = 0;
 };
 
 #endif
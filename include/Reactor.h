@@ -0,0 +1,76 @@
+/**
+ * Defines the interface to the event loop used by the worker threads of the
+ * client and its plugins.
+ *
+ * Each worker owns one reactor, and blocks in runOnce() until one of its
+ * registered descriptors becomes ready, or another thread posts a command to
+ * it. Commands are coalesced: posting the same command several times before
+ * the worker gets around to handling it results in the handler being invoked
+ * only once, and only the first post after the worker has caught up costs a
+ * syscall.
+ */
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstdint>
+#include <functional>
+
+class Reactor {
+	public:
+		/**
+		 * Events a descriptor may be waited on for; these are passed to the
+		 * descriptor's handler as well.
+		 */
+		enum {
+			kEventReadable				= (1 << 0),
+			kEventWritable				= (1 << 1),
+			kEventPriority				= (1 << 2),
+			kEventError					= (1 << 3),
+		};
+
+		/**
+		 * Maximum number of distinct commands; commands are numbered from 0 to
+		 * kMaxCommands - 1.
+		 */
+		static const unsigned int kMaxCommands = 32;
+
+		// invoked with the events that occurred on the descriptor
+		typedef std::function<void(uint32_t)> descriptor_handler_t;
+		// invoked once for each command that was posted
+		typedef std::function<void(unsigned int)> command_handler_t;
+
+	public:
+		virtual ~Reactor() {
+
+		}
+
+	public:
+		/**
+		 * Registers a descriptor with the reactor; the handler is invoked from
+		 * runOnce() whenever one of the given events occurs.
+		 */
+		virtual int addDescriptor(int fd, uint32_t events, descriptor_handler_t handler) = 0;
+		/**
+		 * Removes a previously registered descriptor. This does not close it.
+		 */
+		virtual int removeDescriptor(int fd) = 0;
+
+		/**
+		 * Sets the function invoked for each posted command.
+		 */
+		virtual void setCommandHandler(command_handler_t handler) = 0;
+		/**
+		 * Posts a command to the reactor. This may be called from any thread.
+		 */
+		virtual int postCommand(unsigned int command) = 0;
+
+		/**
+		 * Waits for events for up to the given number of milliseconds (or
+		 * forever, if negative) and dispatches them.
+		 *
+		 * @return Number of events handled, or a negative error code.
+		 */
+		virtual int runOnce(int timeoutMs = -1) = 0;
+};
+
+#endif
@@ -23,7 +23,7 @@
  * will not be loaded. This should _only_ be changed in case the binary API to
  * the client is broken.
  */
-#define PLUGIN_CLIENT_VERSION		0x00001000
+#define PLUGIN_CLIENT_VERSION		0x0000100A
 
 /**
  * Plugin type
@@ -0,0 +1,815 @@
+#include "LoadGenerator.h"
+
+#include "net/LichtensteinUtils.h"
+#include "net/lichtenstein_proto.h"
+#include "metrics/MetricsRegistry.h"
+
+#include <glog/logging.h>
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <algorithm>
+
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/// largest datagram we can receive
+static const size_t kReceiveBufferSz = (1024 * 9);
+/// how long the receive thread waits for packets before checking for lost frames, in ms
+static const int kPollTimeout = 100;
+/// number of times an adoption is sent before giving up on the node
+static const unsigned int kAdoptionAttempts = 5;
+/// time to wait for adoption acks after each attempt, in ms
+static const unsigned int kAdoptionTimeout = 500;
+
+
+
+/**
+ * Registers the metrics, opens a socket for each node and builds the packets
+ * that make up a frame; then starts the receive thread.
+ */
+LoadGenerator::LoadGenerator(const Options &_options) : options(_options) {
+	// validate the options
+	CHECK(this->options.numNodes >= 1) << "Need at least one node";
+	CHECK(this->options.channels >= 1 && this->options.channels <= 32)
+		<< "Channels must be between 1 and 32 (syncs address at most 32 channels)";
+	CHECK(this->options.fps > 0) << "Frame rate must be positive";
+	CHECK((this->options.basePort + this->options.numNodes - 1) <= 65535) << "Too many nodes for base port";
+	CHECK(this->options.bindAddress.s_addr != this->options.nodeAddress.s_addr)
+		<< "Bind address must differ from the nodes' address, or their replies go to themselves";
+
+	// register metrics
+	MetricsRegistry *metrics = MetricsRegistry::sharedInstance();
+
+	this->framesSent = metrics->registerCounter("loadgen.framesSent");
+	this->syncsSent = metrics->registerCounter("loadgen.syncsSent");
+	this->packetsSent = metrics->registerCounter("loadgen.packetsSent");
+	this->bytesSent = metrics->registerCounter("loadgen.bytesSent");
+	this->sendErrors = metrics->registerCounter("loadgen.sendErrors");
+	this->missedTicks = metrics->registerCounter("loadgen.missedTicks");
+
+	this->framesAcked = metrics->registerCounter("loadgen.framesAcked");
+	this->framesNacked = metrics->registerCounter("loadgen.framesNacked");
+	this->fragmentNacks = metrics->registerCounter("loadgen.fragmentNacks");
+	this->framesLost = metrics->registerCounter("loadgen.framesLost");
+
+	this->ackRtt = metrics->registerHistogram("loadgen.ackRtt");
+
+	// set up the nodes
+	for(unsigned int i = 0; i < this->options.numNodes; i++) {
+		Node *node = new Node;
+		node->index = i;
+
+		this->openSocket(node);
+		this->nodes.push_back(node);
+	}
+
+	this->buildFramePackets();
+
+	// start receiving
+	this->receiver = new std::thread(&LoadGenerator::receiveEntry, this);
+}
+
+/**
+ * Stops the receive thread and closes all sockets.
+ */
+LoadGenerator::~LoadGenerator() {
+	this->receiving = false;
+
+	if(this->receiver) {
+		this->receiver->join();
+		delete this->receiver;
+	}
+
+	for(Node *node : this->nodes) {
+		close(node->socket);
+		delete node;
+	}
+
+	this->nodes.clear();
+}
+
+/**
+ * Opens the socket for a node: it's bound to our address on the node's port,
+ * since that's where the node sends its replies. Syncs are multicast from it
+ * as well, so it joins the multicast group; otherwise, multicast sent over
+ * loopback isn't delivered locally.
+ */
+void LoadGenerator::openSocket(Node *node) {
+	int err;
+	int yes = 1;
+
+	const uint16_t port = (this->options.basePort + node->index);
+
+	node->socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+	PLOG_IF(FATAL, node->socket < 0) << "Couldn't create socket";
+
+	// the node's socket on the same port has SO_REUSEADDR set as well
+	err = setsockopt(node->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	PLOG_IF(FATAL, err < 0) << "Couldn't set SO_REUSEADDR";
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr = this->options.bindAddress;
+	addr.sin_port = htons(port);
+
+	err = ::bind(node->socket, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+	PLOG_IF(FATAL, err < 0) << "Couldn't bind socket to port " << port;
+
+	// multicast from the interface of our address, and join the group there
+	err = setsockopt(node->socket, IPPROTO_IP, IP_MULTICAST_IF, &this->options.bindAddress,
+					 sizeof(this->options.bindAddress));
+	PLOG_IF(FATAL, err < 0) << "Couldn't set multicast interface";
+
+	err = setsockopt(node->socket, IPPROTO_IP, IP_MULTICAST_LOOP, &yes, sizeof(yes));
+	PLOG_IF(FATAL, err < 0) << "Couldn't enable multicast loopback";
+
+	struct ip_mreq membership;
+	membership.imr_multiaddr = this->options.multicastGroup;
+	membership.imr_interface = this->options.bindAddress;
+
+	err = setsockopt(node->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+	PLOG_IF(WARNING, err < 0) << "Couldn't join multicast group; syncs may not be delivered";
+
+	// the receive thread drains the socket without blocking
+	int flags = fcntl(node->socket, F_GETFL);
+	PCHECK(flags != -1) << "Couldn't get flags";
+
+	err = fcntl(node->socket, F_SETFL, flags | O_NONBLOCK);
+	PCHECK(err != -1) << "Couldn't set flags";
+
+	// build the node's addresses
+	memset(&node->addr, 0, sizeof(node->addr));
+	node->addr.sin_family = AF_INET;
+	node->addr.sin_addr = this->options.nodeAddress;
+	node->addr.sin_port = htons(port);
+
+	node->syncAddr = node->addr;
+	node->syncAddr.sin_addr = this->options.multicastGroup;
+}
+
+/**
+ * Builds the packets for one frame of each channel, in network byte order.
+ * Channels whose data doesn't fit into a single datagram are split into
+ * fragments. Only the transaction number (and thus the checksum) changes from
+ * frame to frame.
+ */
+void LoadGenerator::buildFramePackets(void) {
+	const size_t bytesPerElement = this->options.rgbw ? 4 : 3;
+	const uint32_t format = this->options.rgbw ? kDataFormatRGBW : kDataFormatRGB;
+	const size_t pixels = this->options.pixels;
+
+	for(unsigned int channel = 0; channel < this->options.channels; channel++) {
+		std::vector<FramePacket> packets;
+
+		if((sizeof(lichtenstein_framebuffer_data_t) + (pixels * bytesPerElement)) <= this->options.maxPacketSize) {
+			// it fits in a single framebuffer data packet
+			FramePacket packet;
+			packet.data.resize(sizeof(lichtenstein_framebuffer_data_t) + (pixels * bytesPerElement));
+
+			lichtenstein_framebuffer_data_t *fb = reinterpret_cast<lichtenstein_framebuffer_data_t *>(packet.data.data());
+
+			LichtensteinUtils::populateHeader(fb, kOpcodeFramebufferData);
+			fb->header.payloadLength = (packet.data.size() - sizeof(lichtenstein_header_t));
+
+			fb->destChannel = channel;
+			fb->dataFormat = format;
+			fb->dataElements = pixels;
+
+			for(size_t i = 0; i < (pixels * bytesPerElement); i++) {
+				fb->data[i] = static_cast<char>(i + channel);
+			}
+
+			packets.push_back(std::move(packet));
+		} else {
+			// split it into fragments
+			CHECK(this->options.maxPacketSize > (sizeof(lichtenstein_framebuffer_fragment_t) + bytesPerElement))
+				<< "Maximum packet size is too small to fit a fragment";
+
+			const size_t perFragment = ((this->options.maxPacketSize - sizeof(lichtenstein_framebuffer_fragment_t)) / bytesPerElement);
+			const size_t numFragments = ((pixels + perFragment - 1) / perFragment);
+
+			CHECK(numFragments <= kLichtensteinMaxFragments) << "Frame needs " << numFragments
+				<< " fragments, but at most " << kLichtensteinMaxFragments << " are supported";
+
+			for(size_t i = 0; i < numFragments; i++) {
+				const size_t offset = (i * perFragment);
+				const size_t elements = std::min(perFragment, (pixels - offset));
+
+				FramePacket packet;
+				packet.data.resize(sizeof(lichtenstein_framebuffer_fragment_t) + (elements * bytesPerElement));
+
+				lichtenstein_framebuffer_fragment_t *frag = reinterpret_cast<lichtenstein_framebuffer_fragment_t *>(packet.data.data());
+
+				LichtensteinUtils::populateHeader(frag, kOpcodeFramebufferFragment);
+				frag->header.payloadLength = (packet.data.size() - sizeof(lichtenstein_header_t));
+				frag->header.sequenceIndex = i;
+				frag->header.sequenceNumPackets = numFragments;
+
+				frag->destChannel = channel;
+				frag->dataFormat = format;
+				frag->totalElements = pixels;
+				frag->elementOffset = offset;
+				frag->dataElements = elements;
+
+				for(size_t j = 0; j < (elements * bytesPerElement); j++) {
+					frag->data[j] = static_cast<char>(((offset * bytesPerElement) + j) + channel);
+				}
+
+				packets.push_back(std::move(packet));
+			}
+		}
+
+		// finish each packet
+		for(FramePacket &packet : packets) {
+			lichtenstein_header_t *header = reinterpret_cast<lichtenstein_header_t *>(packet.data.data());
+
+			if(!this->options.checksum) {
+				header->flags &= ~kFlagChecksummed;
+			}
+
+			LichtensteinUtils::convertToNetworkByteOrder(packet.data.data(), packet.data.size());
+		}
+
+		LOG_IF(INFO, channel == 0) << "Each channel is sent as " << packets.size()
+			<< " packet(s) per frame";
+
+		this->framePackets.push_back(std::move(packets));
+	}
+}
+
+
+
+/**
+ * Adopts all nodes. Adoptions are resent a few times to nodes that don't
+ * acknowledge them.
+ *
+ * @return Whether all nodes acknowledged the adoption; nodes that didn't may
+ * already have been adopted by an earlier run, so frames are sent regardless.
+ */
+bool LoadGenerator::adopt(void) {
+	const size_t length = sizeof(lichtenstein_node_adoption_t) + (this->options.channels * sizeof(uint32_t));
+	std::vector<char> buffer(length);
+
+	for(unsigned int attempt = 0; attempt < kAdoptionAttempts; attempt++) {
+		// send an adoption to every node that hasn't acknowledged one
+		for(Node *node : this->nodes) {
+			if(node->adopted) {
+				continue;
+			}
+
+			std::fill(buffer.begin(), buffer.end(), 0);
+			lichtenstein_node_adoption_t *adoption = reinterpret_cast<lichtenstein_node_adoption_t *>(buffer.data());
+
+			LichtensteinUtils::populateHeader(adoption, kOpcodeNodeAdoption);
+			adoption->header.txn = this->nextTxn++;
+			adoption->header.payloadLength = (length - sizeof(lichtenstein_header_t));
+
+			memcpy(&adoption->ip, &this->options.bindAddress, sizeof(adoption->ip));
+			adoption->port = (this->options.basePort + node->index);
+			adoption->flags = this->options.cumulativeAck ? kAdoptionFlagCumulativeAck : 0;
+
+			adoption->numChannels = this->options.channels;
+
+			for(unsigned int i = 0; i < this->options.channels; i++) {
+				adoption->pixelsPerChannel[i] = this->options.pixels;
+			}
+
+			LichtensteinUtils::convertToNetworkByteOrder(adoption, length);
+			LichtensteinUtils::applyChecksum(adoption, length);
+
+			this->sendPacket(node, &node->addr, adoption, length);
+		}
+
+		// wait for the acks
+		for(unsigned int waited = 0; waited < kAdoptionTimeout; waited += 10) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			bool allAdopted = std::all_of(this->nodes.begin(), this->nodes.end(), [](Node *node) {
+				return node->adopted.load();
+			});
+
+			if(allAdopted) {
+				LOG(INFO) << "Adopted " << this->nodes.size() << " node(s)";
+				return true;
+			}
+		}
+	}
+
+	// complain about the nodes that didn't reply
+	for(Node *node : this->nodes) {
+		if(!node->adopted) {
+			LOG(WARNING) << "Node " << node->index << " (port " << ntohs(node->addr.sin_port)
+				<< ") didn't acknowledge the adoption; it may already be adopted";
+
+			// assume it does what we asked for
+			node->cumulativeAck = this->options.cumulativeAck;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Sends frames to all nodes at the configured frame rate, until the duration
+ * elapsed or stop() is called. If sending all frames takes longer than the
+ * frame period, ticks are skipped rather than sent in a burst, and counted.
+ *
+ * Once done, we wait for the ack timeout, so that all frames are either acked
+ * or counted as lost.
+ */
+void LoadGenerator::run(void) {
+	const uint64_t period = static_cast<uint64_t>(1000000000.0 / this->options.fps);
+	const uint64_t duration = static_cast<uint64_t>(this->options.duration * 1000000000.0);
+
+	LOG(INFO) << "Sending " << this->options.fps << " fps to " << this->nodes.size()
+		<< " node(s) with " << this->options.channels << " channel(s) of "
+		<< this->options.pixels << " pixels each, for " << this->options.duration << " s";
+
+	// measure our own CPU usage over the run
+	MetricsRegistry::sharedInstance()->takeSnapshot();
+
+	this->startTime = getMonotonicTime();
+
+	uint64_t next = this->startTime;
+	uint64_t nextReport = this->startTime + 1000000000ULL;
+	uint64_t now = this->startTime;
+
+	while(this->sending && (now - this->startTime) < duration) {
+		// send a frame and sync to each node
+		for(Node *node : this->nodes) {
+			this->sendFrame(node);
+			this->sendSync(node);
+		}
+
+		// wait for the next tick, unless we're too far behind
+		next += period;
+		now = getMonotonicTime();
+
+		if(now > (next + period)) {
+			this->missedTicks->add((now - next) / period);
+			next = now;
+		} else if(next > now) {
+			struct timespec wakeup;
+			wakeup.tv_sec = (next / 1000000000ULL);
+			wakeup.tv_nsec = (next % 1000000000ULL);
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, nullptr);
+			now = getMonotonicTime();
+		}
+
+		// report progress every second
+		if(now >= nextReport) {
+			this->logProgress(1.0);
+			nextReport += 1000000000ULL;
+		}
+	}
+
+	this->elapsed = ((now - this->startTime) / 1000000000.0);
+
+	MetricsRegistry::sharedInstance()->takeSnapshot();
+
+	// wait for any outstanding acks
+	std::this_thread::sleep_for(std::chrono::milliseconds(this->options.ackTimeout + kPollTimeout));
+}
+
+/**
+ * Stops sending frames. This may be called from a signal handler.
+ */
+void LoadGenerator::stop(void) {
+	this->sending = false;
+}
+
+/**
+ * Prints a summary of the run to stdout.
+ */
+void LoadGenerator::report(void) {
+	const double channels = (this->nodes.size() * this->options.channels);
+	const double elapsed = std::max(this->elapsed, 1e-9);
+
+	const uint64_t sent = this->framesSent->read();
+	const uint64_t acked = this->framesAcked->read();
+	const uint64_t nacked = this->framesNacked->read();
+	const uint64_t lost = this->framesLost->read();
+
+	MetricsHistogram::Summary rtt;
+	this->ackRtt->summarize(rtt);
+
+	std::cout << std::fixed << std::setprecision(2)
+		<< "nodes:         " << this->nodes.size() << " x " << this->options.channels
+			<< " channel(s) x " << this->options.pixels << " pixels" << std::endl
+		<< "duration:      " << elapsed << " s" << std::endl
+		<< "target:        " << this->options.fps << " fps" << std::endl
+		<< "sent:          " << (sent / channels / elapsed) << " fps ("
+			<< sent << " frames, " << this->missedTicks->read() << " ticks missed, "
+			<< this->sendErrors->read() << " send errors)" << std::endl
+		<< "sustained:     " << (acked / channels / elapsed) << " fps ("
+			<< acked << " frames acked)" << std::endl
+		<< "nack rate:     " << ((acked + nacked) ? (100.0 * nacked / (acked + nacked)) : 0)
+			<< " % (" << nacked << " nacked, " << this->fragmentNacks->read()
+			<< " fragment retransmit requests)" << std::endl
+		<< "lost:          " << lost << " frames" << std::endl
+		<< "ack rtt (us):  p50 <= " << (rtt.p50 / 1000.0) << ", p90 <= " << (rtt.p90 / 1000.0)
+			<< ", p99 <= " << (rtt.p99 / 1000.0) << ", p99.9 <= " << (rtt.p999 / 1000.0)
+			<< ", max <= " << (rtt.max / 1000.0) << " (" << rtt.count << " samples)" << std::endl
+		<< "loadgen cpu:   " << MetricsRegistry::sharedInstance()->getCpuUsage()->getSnapshot()
+			<< " %" << std::endl;
+}
+
+
+
+/**
+ * Sends one frame for every channel to the node. Each channel's frame gets its
+ * own transaction number, which its ack carries.
+ */
+void LoadGenerator::sendFrame(Node *node) {
+	const uint64_t now = getMonotonicTime();
+
+	for(std::vector<FramePacket> &packets : this->framePackets) {
+		const uint32_t txn = this->nextTxn++;
+
+		// note the frame before sending it, as the ack may come back right away
+		if(!node->cumulativeAck) {
+			std::lock_guard<std::mutex> lck(node->outstandingLock);
+			node->outstanding[txn] = now;
+		}
+
+		for(FramePacket &packet : packets) {
+			lichtenstein_header_t *header = reinterpret_cast<lichtenstein_header_t *>(packet.data.data());
+			header->txn = htonl(txn);
+
+			if(this->options.checksum) {
+				LichtensteinUtils::applyChecksum(packet.data.data(), packet.data.size());
+			}
+
+			this->sendPacket(node, &node->addr, packet.data.data(), packet.data.size());
+		}
+
+		this->framesSent->increment();
+	}
+}
+
+/**
+ * Multicasts a sync for all channels to the node. With cumulative acks, the
+ * sync's transaction is what's acknowledged.
+ */
+void LoadGenerator::sendSync(Node *node) {
+	lichtenstein_sync_output_t sync;
+	memset(&sync, 0, sizeof(sync));
+
+	LichtensteinUtils::populateHeader(&sync, kOpcodeSyncOutput);
+
+	if(!this->options.checksum) {
+		sync.header.flags &= ~kFlagChecksummed;
+	}
+
+	sync.header.flags |= kFlagMulticast;
+	sync.header.txn = this->nextTxn++;
+	sync.header.payloadLength = (sizeof(sync) - sizeof(lichtenstein_header_t));
+
+	sync.channels = (this->options.channels == 32) ? 0xFFFFFFFF : ((1U << this->options.channels) - 1);
+
+	if(node->cumulativeAck) {
+		std::lock_guard<std::mutex> lck(node->outstandingLock);
+		node->outstanding[sync.header.txn] = getMonotonicTime();
+	}
+
+	LichtensteinUtils::convertToNetworkByteOrder(&sync, sizeof(sync));
+
+	if(this->options.checksum) {
+		LichtensteinUtils::applyChecksum(&sync, sizeof(sync));
+	}
+
+	this->sendPacket(node, &node->syncAddr, &sync, sizeof(sync));
+	this->syncsSent->increment();
+}
+
+/**
+ * Sends a packet from the node's socket.
+ *
+ * @return 0 if successful, an errno value otherwise.
+ */
+int LoadGenerator::sendPacket(Node *node, const struct sockaddr_in *addr, void *data, size_t length) {
+	int err = sendto(node->socket, data, length, 0, reinterpret_cast<const struct sockaddr *>(addr),
+					 sizeof(*addr));
+
+	if(err < 0) {
+		err = errno;
+
+		this->sendErrors->increment();
+		LOG_EVERY_N(WARNING, 1000) << "Couldn't send packet to node " << node->index
+			<< ": " << strerror(err);
+
+		return err;
+	}
+
+	this->packetsSent->increment();
+	this->bytesSent->add(length);
+
+	return 0;
+}
+
+
+
+/**
+ * Receive thread: waits for replies on all sockets, and periodically expires
+ * frames that weren't acknowledged in time.
+ */
+void LoadGenerator::receiveEntry(void) {
+	std::vector<struct pollfd> fds;
+
+	for(Node *node : this->nodes) {
+		struct pollfd fd;
+		fd.fd = node->socket;
+		fd.events = POLLIN;
+
+		fds.push_back(fd);
+	}
+
+	while(this->receiving) {
+		int num = poll(fds.data(), fds.size(), kPollTimeout);
+
+		if(num < 0 && errno != EINTR) {
+			PLOG(ERROR) << "Couldn't poll sockets";
+		}
+
+		if(num > 0) {
+			for(size_t i = 0; i < fds.size(); i++) {
+				if(fds[i].revents & POLLIN) {
+					this->receivePackets(this->nodes[i]);
+				}
+			}
+		}
+
+		this->expireOutstanding(getMonotonicTime());
+	}
+}
+
+/**
+ * Reads all pending packets from the node's socket.
+ */
+void LoadGenerator::receivePackets(Node *node) {
+	char buffer[kReceiveBufferSz];
+
+	while(true) {
+		ssize_t length = recv(node->socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+		if(length < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				PLOG(WARNING) << "Couldn't receive from node " << node->index;
+			}
+
+			return;
+		}
+
+		this->handlePacket(node, buffer, length, getMonotonicTime());
+	}
+}
+
+/**
+ * Handles a packet received from a node.
+ */
+void LoadGenerator::handlePacket(Node *node, void *data, size_t length, uint64_t rxTime) {
+	if(LichtensteinUtils::validatePacket(data, length) != LichtensteinUtils::kNoError) {
+		LOG(WARNING) << "Received invalid packet from node " << node->index;
+		return;
+	}
+
+	LichtensteinUtils::convertToHostByteOrder(data, length);
+
+	lichtenstein_header_t *header = static_cast<lichtenstein_header_t *>(data);
+
+	const bool ack = (header->flags & kFlagAck);
+	const bool nack = (header->flags & kFlagNAck);
+
+	switch(header->opcode) {
+		// the node accepted the adoption, and tells us which flags it accepted
+		case kOpcodeNodeAdoption: {
+			if(ack && length >= sizeof(lichtenstein_node_adoption_ack_t)) {
+				lichtenstein_node_adoption_ack_t *adoptionAck = static_cast<lichtenstein_node_adoption_ack_t *>(data);
+
+				node->cumulativeAck = (adoptionAck->flags & kAdoptionFlagCumulativeAck);
+				node->adopted = true;
+
+				LOG(INFO) << "Node " << node->index << " acknowledged adoption"
+					<< (node->cumulativeAck ? " (cumulative acks)" : "");
+			}
+			break;
+		}
+
+		// frame acknowledgements
+		case kOpcodeFramebufferData:
+		case kOpcodeFramebufferFragment: {
+			// NACKs with a payload are requests to retransmit fragments; we don't
+			if(nack && header->payloadLength != 0) {
+				this->fragmentNacks->increment();
+			} else if(ack || nack) {
+				this->handleAck(node, header->txn, nack, rxTime);
+			}
+			break;
+		}
+
+		case kOpcodeCumulativeAck: {
+			if(length >= sizeof(lichtenstein_cumulative_ack_t)) {
+				this->handleCumulativeAck(node, data, rxTime);
+			}
+			break;
+		}
+
+		// time sync request; answer it like a server would
+		case kOpcodeTimeSync: {
+			if(!ack && length >= sizeof(lichtenstein_time_sync_t)) {
+				this->handleTimeSync(node, data, rxTime);
+			}
+			break;
+		}
+
+		default: {
+			VLOG(1) << "Ignoring opcode " << header->opcode << " from node " << node->index;
+			break;
+		}
+	}
+}
+
+/**
+ * Handles the acknowledgement of a single frame. With cumulative acks, nodes
+ * still NACK individual frames, but those aren't tracked.
+ */
+void LoadGenerator::handleAck(Node *node, uint32_t txn, bool nack, uint64_t rxTime) {
+	if(node->cumulativeAck) {
+		if(nack) {
+			this->framesNacked->increment();
+		}
+
+		return;
+	}
+
+	uint64_t sentAt;
+
+	{
+		std::lock_guard<std::mutex> lck(node->outstandingLock);
+		auto it = node->outstanding.find(txn);
+
+		// it was acked after it was counted as lost (or twice)
+		if(it == node->outstanding.end()) {
+			VLOG(1) << "Ack for unknown txn " << txn << " from node " << node->index;
+			return;
+		}
+
+		sentAt = it->second;
+		node->outstanding.erase(it);
+	}
+
+	if(nack) {
+		this->framesNacked->increment();
+	} else {
+		this->framesAcked->increment();
+		this->ackRtt->record(rxTime - sentAt);
+	}
+}
+
+/**
+ * Handles a cumulative ack: every channel set in the accepted bitmap had its
+ * frame accepted since the last sync. Rejected frames were already counted
+ * when their individual NACKs arrived.
+ */
+void LoadGenerator::handleCumulativeAck(Node *node, void *data, uint64_t rxTime) {
+	lichtenstein_cumulative_ack_t *ack = static_cast<lichtenstein_cumulative_ack_t *>(data);
+
+	uint64_t sentAt = 0;
+
+	{
+		std::lock_guard<std::mutex> lck(node->outstandingLock);
+		auto it = node->outstanding.find(ack->header.txn);
+
+		if(it != node->outstanding.end()) {
+			sentAt = it->second;
+			node->outstanding.erase(it);
+		}
+	}
+
+	if(sentAt == 0) {
+		VLOG(1) << "Cumulative ack for unknown txn " << ack->header.txn << " from node " << node->index;
+		return;
+	}
+
+	size_t accepted = 0;
+
+	for(size_t i = 0; i < (kLichtensteinMaxChannels / 32); i++) {
+		accepted += __builtin_popcount(ack->acceptedChannels[i]);
+	}
+
+	this->framesAcked->add(accepted);
+	this->ackRtt->record(rxTime - sentAt);
+}
+
+/**
+ * Answers a node's time sync request with our clock. The receive time is when
+ * the packet was read off the socket (on the monotonic clock), moved onto the
+ * real time clock, so the time spent handling it isn't counted as network
+ * delay.
+ */
+void LoadGenerator::handleTimeSync(Node *node, void *data, uint64_t rxTime) {
+	lichtenstein_time_sync_t *request = static_cast<lichtenstein_time_sync_t *>(data);
+	const uint64_t receiveTime = (getRealTime() - (getMonotonicTime() - rxTime));
+
+	lichtenstein_time_sync_t response;
+	memset(&response, 0, sizeof(response));
+
+	LichtensteinUtils::populateHeader(&response, kOpcodeTimeSync);
+
+	response.header.flags |= kFlagAck;
+	response.header.txn = request->header.txn;
+	response.header.payloadLength = (sizeof(response) - sizeof(lichtenstein_header_t));
+
+	response.originateTime = request->originateTime;
+	response.receiveTime = receiveTime;
+	response.transmitTime = getRealTime();
+
+	LichtensteinUtils::convertToNetworkByteOrder(&response, sizeof(response));
+	LichtensteinUtils::applyChecksum(&response, sizeof(response));
+
+	this->sendPacket(node, &node->addr, &response, sizeof(response));
+}
+
+/**
+ * Counts frames that weren't acknowledged within the timeout as lost. With
+ * cumulative acks, a lost sync means all of its channels' frames were lost.
+ */
+void LoadGenerator::expireOutstanding(uint64_t now) {
+	const uint64_t timeout = (this->options.ackTimeout * 1000000ULL);
+
+	for(Node *node : this->nodes) {
+		size_t expired = 0;
+
+		{
+			std::lock_guard<std::mutex> lck(node->outstandingLock);
+
+			for(auto it = node->outstanding.begin(); it != node->outstanding.end();) {
+				if(now > it->second && (now - it->second) > timeout) {
+					it = node->outstanding.erase(it);
+					expired++;
+				} else {
+					it++;
+				}
+			}
+		}
+
+		if(expired) {
+			this->framesLost->add(node->cumulativeAck ? (expired * this->options.channels) : expired);
+		}
+	}
+}
+
+/**
+ * Logs the frame rates since the last report.
+ */
+void LoadGenerator::logProgress(double elapsed) {
+	const double channels = (this->nodes.size() * this->options.channels);
+
+	const uint64_t sent = this->framesSent->read();
+	const uint64_t acked = this->framesAcked->read();
+	const uint64_t nacked = this->framesNacked->read();
+
+	LOG(INFO) << "sent " << ((sent - this->lastFramesSent) / channels / elapsed) << " fps, acked "
+		<< ((acked - this->lastFramesAcked) / channels / elapsed) << " fps, "
+		<< (nacked - this->lastFramesNacked) << " nacks, "
+		<< this->missedTicks->read() << " ticks missed in total";
+
+	this->lastFramesSent = sent;
+	this->lastFramesAcked = acked;
+	this->lastFramesNacked = nacked;
+}
+
+
+
+/**
+ * Returns the current CLOCK_MONOTONIC time, in ns.
+ */
+uint64_t LoadGenerator::getMonotonicTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Returns the current CLOCK_REALTIME time, in ns since the epoch.
+ */
+uint64_t LoadGenerator::getRealTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+}
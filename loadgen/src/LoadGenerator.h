@@ -0,0 +1,168 @@
+/**
+ * Stand-in for the Lichtenstein server, which generates load for clients to
+ * find the point at which they saturate.
+ *
+ * Each node is a lichtenstein_client listening on its own port (the base port
+ * plus the node's index.) The generator binds a socket to that port on its
+ * own address, adopts the node through it, then sends framebuffer data for
+ * every channel (fragmented, if it doesn't fit in a datagram) followed by a
+ * multicast sync at a fixed frame rate. Nodes reply to the sender's address
+ * on their port, so replies end up on the same socket.
+ *
+ * Every acknowledgement is matched to the frame (or, with cumulative acks, the
+ * sync) it's for, and the round trip time is recorded in a histogram. Frames
+ * that aren't acknowledged within a timeout are counted as lost.
+ */
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <netinet/in.h>
+
+class MetricsCounter;
+class MetricsHistogram;
+
+class LoadGenerator {
+	public:
+		struct Options {
+			// address the nodes listen on
+			struct in_addr nodeAddress;
+			// address to send from; replies are received on it
+			struct in_addr bindAddress;
+			// group to which syncs are multicast
+			struct in_addr multicastGroup;
+
+			// number of nodes, and the port of the first one
+			unsigned int numNodes;
+			unsigned int basePort;
+
+			// channels per node, and pixels per channel
+			unsigned int channels;
+			unsigned int pixels;
+			bool rgbw;
+
+			// frames per second, and for how long (in seconds) to send them
+			double fps;
+			double duration;
+
+			// largest datagram to send; larger frames are fragmented
+			size_t maxPacketSize;
+
+			// whether to request cumulative acks, and to checksum packets
+			bool cumulativeAck;
+			bool checksum;
+
+			// time after which unacknowledged frames are lost, in ms
+			unsigned int ackTimeout;
+		};
+
+	public:
+		LoadGenerator(const Options &options);
+		~LoadGenerator();
+
+		bool adopt(void);
+		void run(void);
+		void stop(void);
+		void report(void);
+
+	private:
+		struct Node;
+
+		void openSocket(Node *node);
+		void buildFramePackets(void);
+
+		void sendFrame(Node *node);
+		void sendSync(Node *node);
+		int sendPacket(Node *node, const struct sockaddr_in *addr, void *data, size_t length);
+
+		void receiveEntry(void);
+		void receivePackets(Node *node);
+		void handlePacket(Node *node, void *data, size_t length, uint64_t rxTime);
+
+		void handleAck(Node *node, uint32_t txn, bool nack, uint64_t rxTime);
+		void handleCumulativeAck(Node *node, void *data, uint64_t rxTime);
+		void handleTimeSync(Node *node, void *data, uint64_t rxTime);
+
+		void expireOutstanding(uint64_t now);
+		void logProgress(double elapsed);
+
+		static uint64_t getMonotonicTime(void);
+		static uint64_t getRealTime(void);
+
+	private:
+		struct Node {
+			unsigned int index;
+
+			// socket bound to our address on the node's port
+			int socket = -1;
+
+			// unicast address of the node, and where its syncs go
+			struct sockaddr_in addr;
+			struct sockaddr_in syncAddr;
+
+			// set once the node acknowledged the adoption
+			std::atomic_bool adopted{false};
+			std::atomic_bool cumulativeAck{false};
+
+			// frames (or syncs) that weren't acknowledged yet, and when they were sent
+			std::unordered_map<uint32_t, uint64_t> outstanding;
+			std::mutex outstandingLock;
+		};
+
+		// a framebuffer packet, in network byte order (except for the txn)
+		struct FramePacket {
+			std::vector<char> data;
+		};
+
+	private:
+		Options options;
+
+		std::vector<Node *> nodes;
+
+		// packets making up one frame of each channel
+		std::vector<std::vector<FramePacket>> framePackets;
+
+		// transaction number of the next frame or sync
+		uint32_t nextTxn = 1;
+
+		// the receive thread, and whether it should keep going
+		std::thread *receiver = nullptr;
+		std::atomic_bool receiving{true};
+
+		// cleared to stop sending frames early
+		std::atomic_bool sending{true};
+
+		// when the generator started sending, and how long it did
+		uint64_t startTime = 0;
+		double elapsed = 0;
+
+		// totals over the entire run
+		MetricsCounter *framesSent = nullptr;
+		MetricsCounter *syncsSent = nullptr;
+		MetricsCounter *packetsSent = nullptr;
+		MetricsCounter *bytesSent = nullptr;
+		MetricsCounter *sendErrors = nullptr;
+		MetricsCounter *missedTicks = nullptr;
+
+		MetricsCounter *framesAcked = nullptr;
+		MetricsCounter *framesNacked = nullptr;
+		MetricsCounter *fragmentNacks = nullptr;
+		MetricsCounter *framesLost = nullptr;
+
+		MetricsHistogram *ackRtt = nullptr;
+
+		// values at the last progress report
+		uint64_t lastFramesSent = 0;
+		uint64_t lastFramesAcked = 0;
+		uint64_t lastFramesNacked = 0;
+};
+
+#endif
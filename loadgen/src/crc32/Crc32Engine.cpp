@@ -0,0 +1 @@
+../../../core/src/crc32/Crc32Engine.cpp
\ No newline at end of file
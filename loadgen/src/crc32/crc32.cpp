@@ -0,0 +1 @@
+../../../core/src/crc32/crc32.cpp
\ No newline at end of file
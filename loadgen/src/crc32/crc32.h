@@ -0,0 +1 @@
+../../../core/src/crc32/crc32.h
\ No newline at end of file
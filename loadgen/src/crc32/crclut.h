@@ -0,0 +1 @@
+../../../core/src/crc32/crclut.h
\ No newline at end of file
@@ -0,0 +1,141 @@
+/**
+ * Main entrypoint for the Lichtenstein load generator
+ */
+#include "LoadGenerator.h"
+#include "metrics/MetricsRegistry.h"
+#include "crc32/Crc32Engine.h"
+
+#include <glog/logging.h>
+#include <cxxopts.hpp>
+
+#include <iostream>
+#include <string>
+
+#include <cstdint>
+#include <signal.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// the generator; stopped when we receive a signal
+LoadGenerator *generator = nullptr;
+
+/**
+ * Signal handler. This handler is invoked for the following signals to stop
+ * sending frames early; the report is still printed.
+ *
+ * - SIGINT
+ */
+void signalHandler(int) {
+	if(generator) {
+		generator->stop();
+	}
+}
+
+/**
+ * Parses an IPv4 address given on the command line.
+ */
+static struct in_addr parseAddress(const string &name, const string &value) {
+	struct in_addr addr;
+
+	if(inet_pton(AF_INET, value.c_str(), &addr) != 1) {
+		LOG(FATAL) << "Invalid " << name << " address '" << value << "'";
+	}
+
+	return addr;
+}
+
+/**
+ * Main function
+ */
+int main(int argc, const char *argv[]) {
+	// set up logging
+	FLAGS_logtostderr = 1;
+	FLAGS_colorlogtostderr = 1;
+
+	google::InitGoogleLogging(argv[0]);
+	google::InstallFailureSignalHandler();
+
+	LOG(INFO) << "lichtenstein load generator " << GIT_HASH << "/" << GIT_BRANCH
+			  << " compiled on " << COMPILE_TIME;
+
+	// parse command-line options
+	cxxopts::Options options("lichtenstein_loadgen", "Lichtenstein Load Generator");
+
+	options.add_options()
+		("n,nodes", "Number of nodes", cxxopts::value<unsigned int>()->default_value("1"))
+		("p,port", "Port of the first node; each further node listens on the next port", cxxopts::value<unsigned int>()->default_value("7420"))
+		("a,address", "Address the nodes listen on", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+		("b,bind", "Address to send from; must differ from the nodes' address", cxxopts::value<std::string>()->default_value("127.0.0.2"))
+		("g,group", "Multicast group for syncs", cxxopts::value<std::string>()->default_value("239.42.0.69"))
+		("c,channels", "Channels per node (up to 32)", cxxopts::value<unsigned int>()->default_value("1"))
+		("l,pixels", "Pixels per channel", cxxopts::value<unsigned int>()->default_value("300"))
+		("rgbw", "Send RGBW rather than RGB data")
+		("f,fps", "Frames per second", cxxopts::value<double>()->default_value("60"))
+		("d,duration", "Seconds to send frames for", cxxopts::value<double>()->default_value("10"))
+		("mtu", "Largest datagram to send, in bytes; larger frames are fragmented", cxxopts::value<size_t>()->default_value("1472"))
+		("cumulative-ack", "Request cumulative acks")
+		("no-checksum", "Don't checksum packets")
+		("ack-timeout", "Time after which unacknowledged frames are lost, in ms", cxxopts::value<unsigned int>()->default_value("1000"))
+		("crc-engine", "CRC32 algorithm to checksum packets with", cxxopts::value<std::string>()->default_value("auto"))
+		("h,help", "Print usage")
+	;
+
+	auto cmdlineOptions = options.parse(argc, argv);
+
+	if(cmdlineOptions.count("help")) {
+		cout << options.help() << endl;
+		return 0;
+	}
+
+	LoadGenerator::Options genOptions;
+
+	genOptions.nodeAddress = parseAddress("node", cmdlineOptions["address"].as<std::string>());
+	genOptions.bindAddress = parseAddress("bind", cmdlineOptions["bind"].as<std::string>());
+	genOptions.multicastGroup = parseAddress("multicast", cmdlineOptions["group"].as<std::string>());
+
+	genOptions.numNodes = cmdlineOptions["nodes"].as<unsigned int>();
+	genOptions.basePort = cmdlineOptions["port"].as<unsigned int>();
+
+	genOptions.channels = cmdlineOptions["channels"].as<unsigned int>();
+	genOptions.pixels = cmdlineOptions["pixels"].as<unsigned int>();
+	genOptions.rgbw = (cmdlineOptions.count("rgbw") != 0);
+
+	genOptions.fps = cmdlineOptions["fps"].as<double>();
+	genOptions.duration = cmdlineOptions["duration"].as<double>();
+
+	genOptions.maxPacketSize = cmdlineOptions["mtu"].as<size_t>();
+
+	genOptions.cumulativeAck = (cmdlineOptions.count("cumulative-ack") != 0);
+	genOptions.checksum = (cmdlineOptions.count("no-checksum") == 0);
+
+	genOptions.ackTimeout = cmdlineOptions["ack-timeout"].as<unsigned int>();
+
+	// checksumming must not be the bottleneck
+	Crc32Engine::select(cmdlineOptions["crc-engine"].as<std::string>());
+
+	// set up the metrics registry, which holds our counters
+	MetricsRegistry::initSingleton();
+
+	generator = new LoadGenerator(genOptions);
+
+	// stop sending on SIGINT
+	struct sigaction sigIntHandler;
+
+	sigIntHandler.sa_handler = signalHandler;
+	sigemptyset(&sigIntHandler.sa_mask);
+	sigIntHandler.sa_flags = 0;
+
+	sigaction(SIGINT, &sigIntHandler, nullptr);
+
+	// adopt the nodes, send frames, then print the results
+	generator->adopt();
+	generator->run();
+	generator->report();
+
+	// clean up
+	delete generator;
+	generator = nullptr;
+
+	MetricsRegistry::deallocSingleton();
+}
@@ -0,0 +1 @@
+../../../core/src/metrics/MetricsRegistry.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../core/src/metrics/MetricsRegistry.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../core/src/net/LichtensteinCodec.h
\ No newline at end of file
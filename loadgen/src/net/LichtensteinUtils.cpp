@@ -0,0 +1 @@
+../../../core/src/net/LichtensteinUtils.cpp
\ No newline at end of file
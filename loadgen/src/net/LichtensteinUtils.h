@@ -0,0 +1 @@
+../../../core/src/net/LichtensteinUtils.h
\ No newline at end of file
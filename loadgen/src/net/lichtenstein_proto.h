@@ -0,0 +1 @@
+../../../core/src/net/lichtenstein_proto.h
\ No newline at end of file
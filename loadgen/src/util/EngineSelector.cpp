@@ -0,0 +1 @@
+../../../core/src/util/EngineSelector.cpp
\ No newline at end of file
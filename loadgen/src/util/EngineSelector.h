@@ -0,0 +1 @@
+../../../core/src/util/EngineSelector.h
\ No newline at end of file
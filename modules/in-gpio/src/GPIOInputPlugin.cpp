@@ -1,7 +1,7 @@
 #include "GPIOInputPlugin.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include <Config.h>
 
 #include <time.h>
 
@@ -107,10 +107,10 @@ int GPIOInputPlugin::getTestState(std::vector<bool> &outState) {
  */
 void GPIOInputPlugin::workerEntry(void) {
 	int err;
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 
 	// get the interval to wait
-	int msecsToWait = config->GetInteger("input_gpio", "interval", 100);
+	int msecsToWait = config->getInteger("input_gpio", "interval", 100);
 
 	while(this->run) {
 		// read states
@@ -174,10 +174,10 @@ void GPIOInputPlugin::workerEntry(void) {
  * Gets the GPIO numbers of all configured GPIOs.
  */
 void GPIOInputPlugin::getAllGPIOs(std::vector<int> &out) {
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 
 	// first, parse the regular inputs, if they exist
-	std::string inputList = config->Get("input_gpio", "gpios", "");
+	std::string inputList = config->getString("input_gpio", "gpios", "");
 
 	if(inputList != "") {
 		std::vector<std::string> strings;
@@ -198,7 +198,7 @@ void GPIOInputPlugin::getAllGPIOs(std::vector<int> &out) {
 	}
 
 	// then, parse the test inputs, if they exist
-	std::string testInputList = config->Get("input_gpio", "test_gpios", "");
+	std::string testInputList = config->getString("input_gpio", "test_gpios", "");
 
 	if(testInputList != "") {
 		std::vector<std::string> strings;
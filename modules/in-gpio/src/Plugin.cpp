@@ -20,6 +20,9 @@ const static unsigned char input_uuid[16] = {
  * Initialization function: attach an input plugin to the plugin handler.
  */
 PLUGIN_PRIVATE void gpio_init(PluginHandler *handler) {
+	// settings read by the plugin
+	handler->declareConfigKeys("input_gpio", {"interval", "gpios", "test_gpios"});
+
 	// register the plugin
 	handler->registerInputPlugin(input_uuid, GPIOInputPlugin::create);
 }
@@ -1,24 +1,26 @@
 #include "LEDChainOutputPlugin.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include <Config.h>
 
 #include <mutex>
 #include <thread>
 #include <atomic>
 #include <stdexcept>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <sstream>
+#include <cstring>
 
 #include <stdarg.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
 
 #include <OutputFrame.h>
+#include <Reactor.h>
 
 // SPI stuff
 #ifdef __linux__
@@ -26,6 +28,9 @@
 	#include <linux/spi/spidev.h>
 
 	#include <libkmod.h>
+
+	#include <pthread.h>
+	#include <sched.h>
 #endif
 
 // static initializers
@@ -96,32 +101,20 @@ LEDChainOutputPlugin::~LEDChainOutputPlugin() {
 
 
 /**
- * Sets up the worker thread, as well as a pipe with which we communicate with
- * that thread.
+ * Sets up the worker thread, as well as the reactor through which we
+ * communicate with that thread.
  */
 void LEDChainOutputPlugin::setUpThread(void) {
-	int err = 0;
-	int fd[2];
-
 	// make sure there's no existing thread
 	CHECK(this->worker == nullptr) << "Trying to start thread when it's already running";
 
-	// create the thread communicating pipe
-	err = pipe(fd);
-	PLOG_IF(FATAL, err != 0) << "Couldn't create pipe";
-
-	this->workerPipeRead = fd[0];
-	this->workerPipeWrite = fd[1];
-
-	// enable non-blocking IO on the read end of the pipe
-	int flags = fcntl(this->workerPipeRead, F_GETFL);
-	PCHECK(flags != -1) << "Couldn't get flags";
-
-	flags |= O_NONBLOCK;
-
-	err = fcntl(this->workerPipeRead, F_SETFL, flags);
-	PCHECK(err != -1) << "Couldn't set flags";
+	// create the worker's event loop
+	this->reactor = this->handler->createReactor();
+	CHECK(this->reactor != nullptr) << "Couldn't create reactor";
 
+	this->reactor->setCommandHandler([this](unsigned int command) {
+		this->handleCommand(command);
+	});
 
 	// set run flag and create thread
 	this->run = true;
@@ -137,14 +130,13 @@ void LEDChainOutputPlugin::shutDownThread(void) {
 	// clear the running flag
 	this->run = false;
 
-	// write to the pipe to unblock the thread
-	int blah = kWorkerShutdown;
-	err = write(this->workerPipeWrite, &blah, sizeof(blah));
+	// wake up the thread so it notices
+	err = this->reactor->postCommand(kWorkerShutdown);
 
-	if(err < 0) {
-		PLOG(ERROR) << "Couldn't write to pipe, shit's fucked";
+	if(err != 0) {
+		LOG(ERROR) << "Couldn't post shutdown command: " << err;
 
-		// if we can't write to the pipe we're fucked, just kill the thread
+		// if we can't wake the thread we're fucked, just kill the thread
 		delete this->worker;
 	} else {
 		// wait for thread to terminate
@@ -153,16 +145,29 @@ void LEDChainOutputPlugin::shutDownThread(void) {
 		delete this->worker;
 	}
 
-	// clear the pointer
+	// clear the pointer and release the event loop
 	this->worker = nullptr;
+
+	delete this->reactor;
+	this->reactor = nullptr;
 }
 
 /**
  * Entry point for the worker thread.
  */
 void LEDChainOutputPlugin::workerEntry(void) {
-	int err = 0, rsz;
-	fd_set readfds;
+#ifdef __linux__
+	// keep the output off the CPUs the client's pipeline runs on, if asked to
+	if(this->cpu >= 0 && this->cpu < CPU_SETSIZE) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(this->cpu, &set);
+
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		LOG_IF(WARNING, err != 0) << "Couldn't pin worker thread to CPU " << this->cpu
+			<< ": " << strerror(err);
+	}
+#endif
 
 	// open file descriptors
 	this->openDevice();
@@ -173,101 +178,95 @@ void LEDChainOutputPlugin::workerEntry(void) {
 	// perform power-on test
 	this->doOutputTest();
 
-	// main loop
+	// main loop; handle commands until we're told to stop
 	while(this->run) {
-		// set up the read descriptors we wait on
-		int max = this->workerPipeRead;
+		this->reactor->runOnce();
+	}
 
-		FD_ZERO(&readfds);
-		FD_SET(this->workerPipeRead, &readfds);
+	// clean up
+	this->reset();
 
-		// block on the file descriptors
-		err = select((max + 1), &readfds, nullptr, nullptr, nullptr);
+	// close files
+	this->closeDevice();
+}
 
-		if(err < 0) {
-			PLOG(INFO) << "select failed";
-			continue;
+/**
+ * Handles a command posted to the worker's reactor. Commands are coalesced, so
+ * a single kWorkerCheckQueue may stand in for several queued frames.
+ */
+void LEDChainOutputPlugin::handleCommand(unsigned int command) {
+	switch(command) {
+		// No-op, do nothing
+		case kWorkerNOP: {
+			break;
 		}
 
-		// did the worker pipe become ready?
-		if(FD_ISSET(this->workerPipeRead, &readfds)) {
-			// read an int from the pipe
-			int command = kWorkerNOP;
-			rsz = read(this->workerPipeRead, &command, sizeof(command));
-
-			if(rsz <= 0) {
-				PLOG(WARNING) << "Couldn't read from worker pipe:";
-			} else {
-				// process the command
-				switch(command) {
-					// No-op, do nothing
-					case kWorkerNOP: {
-						break;
-					}
-
-					// Shut down the thread
-					case kWorkerShutdown: {
-						LOG(INFO) << "Shutting down worker thread";
-						break;
-					}
-
-					// Pop a frame off the queue and process it
-					case kWorkerCheckQueue: {
-						// loop while there is stuff in the queue
-						bool haveMore = true;
+		// Shut down the thread
+		case kWorkerShutdown: {
+			LOG(INFO) << "Shutting down worker thread";
+			break;
+		}
 
-						while(haveMore) {
-							OutputFrame *frame = nullptr;
+		// Pop frames off the queue and process them
+		case kWorkerCheckQueue: {
+			// loop while there is stuff in the queue
+			bool haveMore = true;
 
-							// pop the frame
-							try {
-								// get a lock on the frame queue
-								std::lock_guard<std::mutex> lck(this->outFramesMutex);
+			while(haveMore) {
+				OutputFrame *frame = nullptr;
 
-								// get the leading element
-								frame = this->outFrames.front();
-								this->outFrames.pop();
+				// pop the frame
+				try {
+					// get a lock on the frame queue
+					std::lock_guard<std::mutex> lck(this->outFramesMutex);
 
-								// are there more?
-								haveMore = !this->outFrames.empty();
-							} catch (std::logic_error &ex) {
-								LOG(FATAL) << "Couldn't get lock: " << ex.what();
+					// the queue may have been drained by an earlier command
+					if(this->outFrames.empty()) {
+						break;
+					}
 
-								// force exit the loop
-								haveMore = false;
-							}
+					// get the leading element
+					frame = this->outFrames.front();
+					this->outFrames.pop_front();
 
-							// process the frame
-							if(frame != nullptr) {
-								this->outputFrame(frame);
-								// TODO: implement
-							}
-						}
+					// are there more?
+					haveMore = !this->outFrames.empty();
+				} catch (std::logic_error &ex) {
+					LOG(FATAL) << "Couldn't get lock: " << ex.what();
 
-						break;
-					}
+					// force exit the loop
+					haveMore = false;
+				}
 
-					// outputs all channels for which we have data
-					case kWorkerOutputChannels: {
-						// TODO: implement
-						break;
+				// process the frame, unless a newer one superseded it
+				if(frame != nullptr) {
+					if(!this->handler->claimFrame(frame)) {
+						this->handler->releaseFrame(frame);
+						continue;
 					}
 
-					// shouldn't get here
-					default: {
-						LOG(WARNING) << "Unknown command " << command;
-						break;
-					}
+					this->outputFrame(frame);
+					// TODO: implement
 				}
 			}
+
+			// send the acknowledgements for all frames processed
+			this->handler->flushAcknowledgements();
+			break;
 		}
-	}
 
-	// clean up
-	this->reset();
+		// outputs all channels for which we have data
+		case kWorkerOutputChannels: {
+			// TODO: implement
+			break;
+		}
 
-	// close files
-	this->closeDevice();
+		// shouldn't get here
+		default: {
+			LOG(WARNING) << "Unknown command " << command;
+			break;
+		}
+	}
 }
 
 
@@ -276,14 +275,14 @@ void LEDChainOutputPlugin::workerEntry(void) {
  * Reads the configuration for the plugin.
  */
 void LEDChainOutputPlugin::readConfig(void) {
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 
 	// clear config structs
 	memset(this->numLeds, 0, sizeof(this->numLeds));
 	memset(this->ledType, 0, sizeof(this->ledType));
 
 	// first, read the number of leds
-	std::string numList = config->Get("output_ledchain", "leds", "");
+	std::string numList = config->getString("output_ledchain", "leds", "");
 
 	if(numList != "") {
 		std::vector<std::string> strings;
@@ -310,7 +309,7 @@ void LEDChainOutputPlugin::readConfig(void) {
 	}
 
 	// now, read the type of LED
-	std::string typeList = config->Get("output_ledchain", "types", "");
+	std::string typeList = config->getString("output_ledchain", "types", "");
 
 	if(typeList != "") {
 		std::vector<std::string> strings;
@@ -334,6 +333,9 @@ void LEDChainOutputPlugin::readConfig(void) {
 	} else {
 		LOG(WARNING) << "LED type was omitted, defaulting to WS2811; check output_ledchain.types";
 	}
+
+	// lastly, the CPU the worker runs on
+	this->cpu = static_cast<int>(config->getInteger("output_ledchain", "cpu", -1));
 }
 
 
@@ -345,9 +347,9 @@ void LEDChainOutputPlugin::loadModule(void) {
 	int err;
 
 	// get path to module
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 
-	std::string path = config->Get("output_ledchain", "module_path", "");
+	std::string path = config->getString("output_ledchain", "module_path", "");
 
 	size_t kmodPathLen = strlen(path.c_str()) + 8;
 
@@ -504,6 +506,8 @@ void LEDChainOutputPlugin::outputFrame(OutputFrame *frame) {
 		goto cleanup;
 	}
 
+	frame->stampOutputTime();
+
 	// push the frames into the ack queue
 	try {
 		std::lock_guard<std::mutex> lck(this->framesToAckMutex);
@@ -559,6 +563,8 @@ void LEDChainOutputPlugin::ackFramesForChannel(int channel) {
 		CHECK(frame != nullptr) << "Got null frame!";
 		this->handler->acknowledgeFrame(frame);
 	}
+
+	this->handler->flushAcknowledgements();
 }
 
 /**
@@ -589,21 +595,37 @@ int LEDChainOutputPlugin::queueFrame(OutputFrame *frame) {
 		std::lock_guard<std::mutex> lck(this->outFramesMutex);
 
 		// just push it into the queue
-		this->outFrames.push(frame);
+		this->outFrames.push_back(frame);
 	} catch (std::logic_error &ex) {
 		LOG(ERROR) << "Couldn't get lock: " << ex.what();
 		return -1;
 	}
 
 	// notify the worker thread
-	int cmd = kWorkerCheckQueue;
-	err = write(this->workerPipeWrite, &cmd, sizeof(cmd));
-	PLOG_IF(ERROR, err < 0) << "Couldn't write to pipe, shit's fucked: " << err;
+	err = this->reactor->postCommand(kWorkerCheckQueue);
+	LOG_IF(ERROR, err != 0) << "Couldn't post command: " << err;
 
 	// done
 	return 0;
 }
 
+/**
+ * Takes a superseded frame out of the queue, if the worker hasn't gotten to it
+ * yet.
+ */
+bool LEDChainOutputPlugin::removeFrame(OutputFrame *frame) {
+	std::lock_guard<std::mutex> lck(this->outFramesMutex);
+
+	auto it = std::find(this->outFrames.begin(), this->outFrames.end(), frame);
+
+	if(it == this->outFrames.end()) {
+		return false;
+	}
+
+	this->outFrames.erase(it);
+	return true;
+}
+
 /**
  * Outputs all channels whose bits are set. This uses channel numbering relative
  * to the first output channel on the output chip.
@@ -615,12 +637,11 @@ int LEDChainOutputPlugin::outputChannels(std::bitset<32> &channels) {
 	this->channelsToOutput = channels;
 
 	// notify worker thread
-	int cmd = kWorkerOutputChannels;
-	err = write(this->workerPipeWrite, &cmd, sizeof(cmd));
+	err = this->reactor->postCommand(kWorkerOutputChannels);
 
-	// was there an error writing to the pipe?
-	if(err < 0) {
-		PLOG(ERROR) << "Couldn't write to pipe, shit's fucked: " << err;
+	// was there an error posting the command?
+	if(err != 0) {
+		LOG(ERROR) << "Couldn't post command: " << err;
 		return err;
 	}
 
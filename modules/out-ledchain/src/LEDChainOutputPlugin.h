@@ -11,6 +11,7 @@
 #include <thread>
 #include <atomic>
 #include <string>
+#include <deque>
 #include <queue>
 #include <bitset>
 
@@ -19,6 +20,7 @@
 #endif
 
 class OutputFrame;
+class Reactor;
 
 class LEDChainOutputPlugin : public OutputPlugin {
 	friend void LEDChainThreadEntry(void *);
@@ -38,11 +40,14 @@ class LEDChainOutputPlugin : public OutputPlugin {
 		virtual int queueFrame(OutputFrame *frame);
 		virtual int outputChannels(std::bitset<32> &channels);
 
+		virtual bool removeFrame(OutputFrame *frame);
+
 	private:
 		void setUpThread(void);
 		void shutDownThread(void);
 
 		void workerEntry(void);
+		void handleCommand(unsigned int);
 
 		void readConfig(void);
 
@@ -61,7 +66,7 @@ class LEDChainOutputPlugin : public OutputPlugin {
 		void doOutputTest(void);
 
 	private:
-		// commands written on pipe
+		// commands posted to the worker's reactor
 		enum {
 			kWorkerNOP,
 			kWorkerShutdown,
@@ -94,12 +99,11 @@ class LEDChainOutputPlugin : public OutputPlugin {
 		std::thread *worker = nullptr;
 		std::atomic_bool run;
 
-		// pipe for communicating with worker
-		int workerPipeRead = -1;
-		int workerPipeWrite = -1;
+		// event loop of the worker; commands are posted to it
+		Reactor *reactor = nullptr;
 
 		// queue of output frames
-		std::queue<OutputFrame *> outFrames;
+		std::deque<OutputFrame *> outFrames;
 		// lock protecting the queue
 		std::mutex outFramesMutex;
 
@@ -117,6 +121,9 @@ class LEDChainOutputPlugin : public OutputPlugin {
 		int numLeds[LEDChainOutputPlugin::numChannels];
 		int ledType[LEDChainOutputPlugin::numChannels];
 
+		// CPU to pin the worker thread to; negative to leave it unpinned
+		int cpu = -1;
+
 		// file descriptors for ledchain devices
 		int ledchainFd[LEDChainOutputPlugin::numChannels];
 };
@@ -20,6 +20,9 @@ const unsigned char rev01_uuid[16] = {
  * Initialization function: attach an output plugin to the plugin handler.
  */
 PLUGIN_PRIVATE void ledchain_init(PluginHandler *handler) {
+	// settings read by the plugin
+	handler->declareConfigKeys("output_ledchain", {"leds", "types", "module_path", "cpu"});
+
 	// register the plugin
 	handler->registerOutputPlugin(rev01_uuid, LEDChainOutputPlugin::create);
 }
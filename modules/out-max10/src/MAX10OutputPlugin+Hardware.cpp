@@ -43,11 +43,11 @@
 void MAX10OutputPlugin::configureHardware(void) {
 	int err;
 
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 	GPIOHelper *gpio = this->handler->getGPIOHelper();
 
 	// Get GPIO for reset pin and set it up
-	this->resetGPIO = config->GetInteger("output_max10", "gpio_reset", -1);
+	this->resetGPIO = config->getInteger("output_max10", "gpio_reset", -1);
 	CHECK(this->resetGPIO > 0) << "Invalid reset GPIO value: " << this->resetGPIO;
 
 	err = gpio->exportGPIO(this->resetGPIO);
@@ -57,7 +57,7 @@ void MAX10OutputPlugin::configureHardware(void) {
 	CHECK(err == 0) << "Couldn't configure reset GPIO: " << err;
 
 	// Get GPIO for enable pin
-	this->enableGPIO = config->GetInteger("output_max10", "gpio_enable", -1);
+	this->enableGPIO = config->getInteger("output_max10", "gpio_enable", -1);
 	CHECK(this->enableGPIO > 0) << "Invalid enable GPIO value: " << this->enableGPIO;
 
 	err = gpio->exportGPIO(this->enableGPIO);
@@ -68,13 +68,13 @@ void MAX10OutputPlugin::configureHardware(void) {
 
 
 	// TODO: read from EEPROM data
-	this->spiBaud = config->GetInteger("output_max10", "baud", 2500000);
+	this->spiBaud = config->getInteger("output_max10", "baud", 2500000);
 
-	this->spiDeviceFile = config->Get("output_max10", "device", "");
+	this->spiDeviceFile = config->getString("output_max10", "device", "");
 	CHECK(this->spiDeviceFile != "") << "Invalid device file: " << this->spiDeviceFile;
 
 	// get EEPROM address
-	this->i2cEeepromAddr = config->GetInteger("output_max10", "eeprom", 0x40);
+	this->i2cEeepromAddr = config->getInteger("output_max10", "eeprom", 0x40);
 	CHECK(this->i2cEeepromAddr >= 0) << "Invalid EEPROM address " << this->i2cEeepromAddr;
 
 	// open SPI device
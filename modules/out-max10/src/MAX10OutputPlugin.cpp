@@ -1,20 +1,21 @@
 #include "MAX10OutputPlugin.h"
 
 #include <glog/logging.h>
-#include <INIReader.h>
+#include <Config.h>
 
 #include <mutex>
 #include <thread>
 #include <atomic>
 #include <stdexcept>
+#include <algorithm>
 
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
 
 #include <OutputFrame.h>
+#include <Reactor.h>
 
 // SPI stuff
 #ifdef __linux__
@@ -64,10 +65,10 @@ MAX10OutputPlugin::MAX10OutputPlugin(PluginHandler *_handler, void *romData, siz
  * "fit" into this buffer and will later be transferred to the chip.
  */
 void MAX10OutputPlugin::allocateFramebuffer(void) {
-	INIReader *config = this->handler->getConfig();
+	const Config *config = this->handler->getConfig();
 
 	// TODO: read from EEPROM data
-	this->framebufferLen = config->GetInteger("output_max10", "fbsize", 131072);
+	this->framebufferLen = config->getInteger("output_max10", "fbsize", 131072);
 
 	if((this->framebufferLen % kFBMapBlockSize) != 0) {
 		LOG(FATAL) << "Framebuffer length must be a multiple of "
@@ -111,32 +112,20 @@ MAX10OutputPlugin::~MAX10OutputPlugin() {
 
 
 /**
- * Sets up the worker thread, as well as a pipe with which we communicate with
- * that thread.
+ * Sets up the worker thread, as well as the reactor through which we
+ * communicate with that thread.
  */
 void MAX10OutputPlugin::setUpThread(void) {
-	int err = 0;
-	int fd[2];
-
 	// make sure there's no existing thread
 	CHECK(this->worker == nullptr) << "Trying to start thread when it's already running";
 
-	// create the thread communicating pipe
-	err = pipe(fd);
-	PLOG_IF(FATAL, err != 0) << "Couldn't create pipe";
-
-	this->workerPipeRead = fd[0];
-	this->workerPipeWrite = fd[1];
-
-	// enable non-blocking IO on the read end of the pipe
-	int flags = fcntl(this->workerPipeRead, F_GETFL);
-	PCHECK(flags != -1) << "Couldn't get flags";
-
-	flags |= O_NONBLOCK;
-
-	err = fcntl(this->workerPipeRead, F_SETFL, flags);
-	PCHECK(err != -1) << "Couldn't set flags";
+	// create the worker's event loop
+	this->reactor = this->handler->createReactor();
+	CHECK(this->reactor != nullptr) << "Couldn't create reactor";
 
+	this->reactor->setCommandHandler([this](unsigned int command) {
+		this->handleCommand(command);
+	});
 
 	// set run flag and create thread
 	this->run = true;
@@ -152,14 +141,13 @@ void MAX10OutputPlugin::shutDownThread(void) {
 	// clear the running flag
 	this->run = false;
 
-	// write to the pipe to unblock the thread
-	int blah = kWorkerShutdown;
-	err = write(this->workerPipeWrite, &blah, sizeof(blah));
+	// wake up the thread so it notices
+	err = this->reactor->postCommand(kWorkerShutdown);
 
-	if(err < 0) {
-		PLOG(ERROR) << "Couldn't write to pipe, shit's fucked";
+	if(err != 0) {
+		LOG(ERROR) << "Couldn't post shutdown command: " << err;
 
-		// if we can't write to the pipe we're fucked, just kill the thread
+		// if we can't wake the thread we're fucked, just kill the thread
 		delete this->worker;
 	} else {
 		// wait for thread to terminate
@@ -168,119 +156,113 @@ void MAX10OutputPlugin::shutDownThread(void) {
 		delete this->worker;
 	}
 
-	// clear the pointer
+	// clear the pointer and release the event loop
 	this->worker = nullptr;
+
+	delete this->reactor;
+	this->reactor = nullptr;
 }
 
 /**
  * Entry point for the worker thread.
  */
 void MAX10OutputPlugin::workerEntry(void) {
-	int err = 0, rsz;
-	fd_set readfds;
-
 	// set up hardware
 	this->reset();
 
 	// perform power-on test
 	this->doOutputTest();
 
-	// main loop
+	// main loop; handle commands until we're told to stop
 	while(this->run) {
-		// set up the read descriptors we wait on
-		int max = this->workerPipeRead;
+		this->reactor->runOnce();
+	}
 
-		FD_ZERO(&readfds);
-		FD_SET(this->workerPipeRead, &readfds);
+	// clean up
+	this->reset();
+}
 
-		// block on the file descriptors
-		err = select((max + 1), &readfds, nullptr, nullptr, nullptr);
+/**
+ * Handles a command posted to the worker's reactor. Commands are coalesced, so
+ * a single kWorkerCheckQueue may stand in for several queued frames.
+ */
+void MAX10OutputPlugin::handleCommand(unsigned int command) {
+	switch(command) {
+		// No-op, do nothing
+		case kWorkerNOP: {
+			break;
+		}
 
-		if(err < 0) {
-			PLOG(INFO) << "select failed";
-			continue;
+		// Shut down the thread
+		case kWorkerShutdown: {
+			LOG(INFO) << "Shutting down worker thread";
+			break;
 		}
 
-		// did the worker pipe become ready?
-		if(FD_ISSET(this->workerPipeRead, &readfds)) {
-			// read an int from the pipe
-			int command = kWorkerNOP;
-			rsz = read(this->workerPipeRead, &command, sizeof(command));
-
-			if(rsz <= 0) {
-				PLOG(WARNING) << "Couldn't read from worker pipe:";
-			} else {
-				// process the command
-				switch(command) {
-					// No-op, do nothing
-					case kWorkerNOP: {
-						break;
-					}
+		// Pop frames off the queue and process them
+		case kWorkerCheckQueue: {
+			// loop while there is stuff in the queue
+			bool haveMore = true;
 
-					// Shut down the thread
-					case kWorkerShutdown: {
-						LOG(INFO) << "Shutting down worker thread";
-						break;
-					}
+			while(haveMore) {
+				OutputFrame *frame = nullptr;
 
-					// Pop a frame off the queue and process it
-					case kWorkerCheckQueue: {
-						// loop while there is stuff in the queue
-						bool haveMore = true;
+				// pop the frame
+				try {
+					// get a lock on the frame queue
+					std::lock_guard<std::mutex> lck(this->outFramesMutex);
 
-						while(haveMore) {
-							OutputFrame *frame = nullptr;
+					// the queue may have been drained by an earlier command
+					if(this->outFrames.empty()) {
+						break;
+					}
 
-							// pop the frame
-							try {
-								// get a lock on the frame queue
-								std::lock_guard<std::mutex> lck(this->outFramesMutex);
+					// get the leading element
+					frame = this->outFrames.front();
+					this->outFrames.pop_front();
 
-								// get the leading element
-								frame = this->outFrames.front();
-								this->outFrames.pop();
+					// are there more?
+					haveMore = !this->outFrames.empty();
+				} catch (std::logic_error &ex) {
+					LOG(FATAL) << "Couldn't get lock: " << ex.what();
 
-								// are there more?
-								haveMore = !this->outFrames.empty();
-							} catch (std::logic_error &ex) {
-								LOG(FATAL) << "Couldn't get lock: " << ex.what();
+					// force exit the loop
+					haveMore = false;
+				}
 
-								// force exit the loop
-								haveMore = false;
-							}
+				// process the frame, unless a newer one superseded it
+				if(frame != nullptr) {
+					if(!this->handler->claimFrame(frame)) {
+						this->handler->releaseFrame(frame);
+						continue;
+					}
 
-							// process the frame
-							if(frame != nullptr) {
-								this->sendFrameToFramebuffer(frame);
-							}
-						}
+					this->sendFrameToFramebuffer(frame);
+				}
+			}
 
-						break;
-					}
+			// send the acknowledgements for all frames processed
+			this->handler->flushAcknowledgements();
+			break;
+		}
 
-					// outputs all channels for which we have data
-					case kWorkerOutputAllChannels: {
-						// check to see which parts of memory we can release
-						// TODO: does this release memory we are outputting with?
-						this->releaseUnusedFramebufferMem();
+		// outputs all channels for which we have data
+		case kWorkerOutputAllChannels: {
+			// check to see which parts of memory we can release
+			// TODO: does this release memory we are outputting with?
+			this->releaseUnusedFramebufferMem();
 
-						// attempt to output data for all channels
-						this->outputChannelsWithData();
-						break;
-					}
+			// attempt to output data for all channels
+			this->outputChannelsWithData();
+			break;
+		}
 
-					// shouldn't get here
-					default: {
-						LOG(WARNING) << "Unknown command " << command;
-						break;
-					}
-				}
-			}
+		// shouldn't get here
+		default: {
+			LOG(WARNING) << "Unknown command " << command;
+			break;
 		}
 	}
-
-	// clean up
-	this->reset();
 }
 
 
@@ -351,6 +333,8 @@ void MAX10OutputPlugin::sendFrameToFramebuffer(OutputFrame *frame) {
 	}
 
 	// if we get down here, nothing went wrong
+	frame->stampOutputTime();
+
 	this->handler->acknowledgeFrame(frame);
 }
 
@@ -553,21 +537,37 @@ int MAX10OutputPlugin::queueFrame(OutputFrame *frame) {
 		std::lock_guard<std::mutex> lck(this->outFramesMutex);
 
 		// just push it into the queue
-		this->outFrames.push(frame);
+		this->outFrames.push_back(frame);
 	} catch (std::logic_error &ex) {
 		LOG(ERROR) << "Couldn't get lock: " << ex.what();
 		return -1;
 	}
 
 	// notify the worker thread
-	int cmd = kWorkerCheckQueue;
-	err = write(this->workerPipeWrite, &cmd, sizeof(cmd));
-	PLOG_IF(ERROR, err < 0) << "Couldn't write to pipe, shit's fucked: " << err;
+	err = this->reactor->postCommand(kWorkerCheckQueue);
+	LOG_IF(ERROR, err != 0) << "Couldn't post command: " << err;
 
 	// done
 	return 0;
 }
 
+/**
+ * Takes a superseded frame out of the queue, if the worker hasn't gotten to it
+ * yet.
+ */
+bool MAX10OutputPlugin::removeFrame(OutputFrame *frame) {
+	std::lock_guard<std::mutex> lck(this->outFramesMutex);
+
+	auto it = std::find(this->outFrames.begin(), this->outFrames.end(), frame);
+
+	if(it == this->outFrames.end()) {
+		return false;
+	}
+
+	this->outFrames.erase(it);
+	return true;
+}
+
 /**
  * Outputs all channels whose bits are set. This uses channel numbering relative
  * to the first output channel on the output chip.
@@ -579,12 +579,11 @@ int MAX10OutputPlugin::outputChannels(std::bitset<32> &channels) {
 	this->channelsToOutput = channels;
 
 	// notify worker thread
-	int cmd = kWorkerOutputAllChannels;
-	err = write(this->workerPipeWrite, &cmd, sizeof(cmd));
+	err = this->reactor->postCommand(kWorkerOutputAllChannels);
 
-	// was there an error writing to the pipe?
-	if(err < 0) {
-		PLOG(ERROR) << "Couldn't write to pipe, shit's fucked: " << err;
+	// was there an error posting the command?
+	if(err != 0) {
+		LOG(ERROR) << "Couldn't post command: " << err;
 		return err;
 	}
 
@@ -11,10 +11,11 @@
 #include <thread>
 #include <atomic>
 #include <string>
-#include <queue>
+#include <deque>
 #include <bitset>
 
 class OutputFrame;
+class Reactor;
 
 class MAX10OutputPlugin : public OutputPlugin {
 	friend void MAX10ThreadEntry(void *);
@@ -34,11 +35,14 @@ class MAX10OutputPlugin : public OutputPlugin {
 		virtual int queueFrame(OutputFrame *frame);
 		virtual int outputChannels(std::bitset<32> &channels);
 
+		virtual bool removeFrame(OutputFrame *frame);
+
 	private:
 		void setUpThread(void);
 		void shutDownThread(void);
 
 		void workerEntry(void);
+		void handleCommand(unsigned int);
 
 		void configureHardware(void);
 		void cleanUpHardware(void);
@@ -77,7 +81,7 @@ class MAX10OutputPlugin : public OutputPlugin {
 			kCommandWriteReg	= 0x02,
 		};
 
-		// commands written on pipe
+		// commands posted to the worker's reactor
 		enum {
 			kWorkerNOP,
 			kWorkerShutdown,
@@ -95,12 +99,11 @@ class MAX10OutputPlugin : public OutputPlugin {
 		std::thread *worker = nullptr;
 		std::atomic_bool run;
 
-		// pipe for communicating with worker
-		int workerPipeRead = -1;
-		int workerPipeWrite = -1;
+		// event loop of the worker; commands are posted to it
+		Reactor *reactor = nullptr;
 
 		// queue of output frames
-		std::queue<OutputFrame *> outFrames;
+		std::deque<OutputFrame *> outFrames;
 		// lock protecting the queue
 		std::mutex outFramesMutex;
 
@@ -20,6 +20,9 @@ const unsigned char rev01_uuid[16] = {
  * Initialization function: attach an output plugin to the plugin handler.
  */
 PLUGIN_PRIVATE void max10_init(PluginHandler *handler) {
+	// settings read by the plugin
+	handler->declareConfigKeys("output_max10", {"baud", "fbsize", "device", "eeprom", "gpio_reset", "gpio_enable"});
+
 	// register the plugin
 	handler->registerOutputPlugin(rev01_uuid, MAX10OutputPlugin::create);
 }